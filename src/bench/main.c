@@ -0,0 +1,411 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * headless benchmark of the image operations: every module is loaded through the
+ * normal module loader, gets its default parameters committed and then has to
+ * process synthetic float buffers of a few sizes. no gui, no opencl, no images.
+ * the numbers are meant to be compared between releases on the same host.
+ * with --raw the given raw files are decoded instead, to measure the loader.
+ */
+
+#include "common/darktable.h"
+#include "common/exif.h"
+#include "common/image.h"
+#include "common/mipmap_cache.h"
+#ifdef HAVE_RAWSPEED
+#include "common/imageio_rawspeed.h"
+#endif
+#include "develop/develop.h"
+#include "develop/imageop.h"
+#include "develop/pixelpipe.h"
+#include "develop/tiling.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <libintl.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+typedef struct dt_bench_size_t
+{
+  int width, height;
+}
+dt_bench_size_t;
+
+static void
+usage(const char* progname)
+{
+  fprintf(stderr, "usage: %s [--iop <op>[,<op>..]] [--sizes <w>x<h>[,<w>x<h>..]] [--runs <n>] [--threads <n>] [--tiling] [--csv] [--raw <file>[,<file>..]] [--core <darktable options>]\n", progname);
+  fprintf(stderr, "       without --iop all modules except the deprecated ones are run.\n");
+  fprintf(stderr, "       --raw times the full raw decode of the given camera samples instead.\n");
+}
+
+static GArray *
+parse_sizes(const char *str)
+{
+  GArray *sizes = g_array_new(FALSE, FALSE, sizeof(dt_bench_size_t));
+  gchar **tokens = g_strsplit(str, ",", -1);
+  for(gchar **t = tokens; *t; t++)
+  {
+    dt_bench_size_t size;
+    if(sscanf(*t, "%dx%d", &size.width, &size.height) == 2 && size.width > 0 && size.height > 0)
+      g_array_append_val(sizes, size);
+    else
+      fprintf(stderr, "[bench] ignoring malformed size `%s'\n", *t);
+  }
+  g_strfreev(tokens);
+  return sizes;
+}
+
+/** smooth gradients, some noise and hard edges, in the value range the module expects. */
+static void
+fill_buffer(float *buf, const int wd, const int ht, const dt_iop_colorspace_type_t cst)
+{
+  unsigned int seed = 42;
+  for(int j=0; j<ht; j++) for(int i=0; i<wd; i++)
+  {
+    const float x = i/(float)wd, y = j/(float)ht;
+    const float edge = (((i>>6)^(j>>6))&1) ? 1.0f : 0.4f;
+    const float noise = 0.02f*(rand_r(&seed)/(float)RAND_MAX - 0.5f);
+    float *px = buf + 4*((size_t)wd*j + i);
+    if(cst == iop_cs_Lab)
+    {
+      px[0] = 100.0f*edge*x + 100.0f*noise;
+      px[1] = 120.0f*(y - 0.5f);
+      px[2] = 120.0f*(0.5f - x*y);
+    }
+    else
+    {
+      px[0] = edge*(0.2f + 0.6f*y) * x + noise;
+      px[1] = edge*(0.8f - 0.6f*y) * x + noise;
+      px[2] = edge*(0.2f + 0.6f*x) * x + noise;
+    }
+    px[3] = 0.0f;
+  }
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  const double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static int
+is_requested(const dt_iop_module_t *module, gchar **ops)
+{
+  if(!ops) return !(module->flags() & IOP_FLAGS_DEPRECATED);
+  for(gchar **op = ops; *op; op++)
+    if(!strcmp(*op, module->op)) return 1;
+  return 0;
+}
+
+/** times the module on one buffer size, returns the median wall time in seconds. */
+static double
+time_module(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in,
+            const dt_iop_roi_t *roi_out, const int runs, const int tiled)
+{
+  const int bpp = 4*sizeof(float);
+  float *in  = (float *)dt_alloc_align(64, (size_t)bpp*roi_in->width*roi_in->height);
+  float *out = (float *)dt_alloc_align(64, (size_t)bpp*roi_out->width*roi_out->height);
+  double *times = (double *)malloc(sizeof(double)*runs);
+  double time = -1.0;
+  if(!in || !out || !times)
+  {
+    fprintf(stderr, "[bench] out of memory running `%s' at %dx%d\n", module->op, roi_out->width, roi_out->height);
+  }
+  else
+  {
+    fill_buffer(in, roi_in->width, roi_in->height, dt_iop_module_colorspace(module));
+    // one extra run to warm up caches and let the module set up its tables:
+    for(int r=-1; r<runs; r++)
+    {
+      const double start = dt_get_wtime();
+      if(tiled)
+        module->process_tiling(module, piece, in, out, roi_in, roi_out, bpp);
+      else
+        module->process(module, piece, in, out, roi_in, roi_out);
+      if(r >= 0) times[r] = dt_get_wtime() - start;
+    }
+    qsort(times, runs, sizeof(double), compare_double);
+    time = times[runs/2];
+  }
+  dt_free_align(in);
+  dt_free_align(out);
+  free(times);
+  return time;
+}
+
+#ifdef HAVE_RAWSPEED
+/** decodes each raw file a few times through rawspeed, the way the full mipmap is filled on load. */
+static void
+bench_raw(gchar **files, const int runs, const int threads, const char *simd, const int csv)
+{
+  if(csv) printf("file,maker,model,width,height,threads,simd,runs,ms,mpix_per_s\n");
+  else printf("%-30s %-24s %11s %7s %-5s %10s %10s\n", "file", "camera", "size", "threads", "simd", "ms", "MPix/s");
+
+  double *times = (double *)malloc(sizeof(double)*runs);
+  for(gchar **file = files; *file; file++)
+  {
+    dt_image_t img;
+    dt_image_init(&img);
+    g_strlcpy(img.filename, *file, sizeof(img.filename));
+    // exif is read once by the loader anyways, keep it out of the timings:
+    dt_exif_read(&img, *file);
+
+    void *dsc = NULL;
+    dt_imageio_retval_t ret = DT_IMAGEIO_OK;
+    for(int r=-1; r<runs && ret == DT_IMAGEIO_OK; r++)
+    {
+      const double start = dt_get_wtime();
+      ret = dt_imageio_open_rawspeed(&img, *file, (dt_mipmap_cache_allocator_t)&dsc);
+      if(r >= 0) times[r] = dt_get_wtime() - start;
+    }
+    // on failure the allocator might point to the static dead image:
+    if(ret == DT_IMAGEIO_OK) dt_free_align(dsc);
+
+    gchar *base = g_path_get_basename(*file);
+    if(ret != DT_IMAGEIO_OK)
+    {
+      fprintf(stderr, "[bench] could not decode `%s'\n", *file);
+      if(csv) printf("%s,,,0,0,%d,%s,0,,\n", base, threads, simd);
+      else printf("%-30s %-24s %11s %7d %-5s %10s %10s\n", base, "failed", "-", threads, simd, "-", "-");
+    }
+    else
+    {
+      qsort(times, runs, sizeof(double), compare_double);
+      const double time = times[runs/2];
+      const double mpix = img.width*(double)img.height*1e-6;
+      gchar *camera = g_strdup_printf("%s %s", img.exif_maker, img.exif_model);
+      if(csv)
+        printf("%s,%s,%s,%d,%d,%d,%s,%d,%.3f,%.3f\n", base, img.exif_maker, img.exif_model, img.width, img.height,
+               threads, simd, runs, 1e3*time, mpix/time);
+      else
+        printf("%-30s %-24s %5dx%-5d %7d %-5s %10.3f %10.3f\n", base, camera, img.width, img.height, threads, simd,
+               1e3*time, mpix/time);
+      g_free(camera);
+    }
+    g_free(base);
+    fflush(stdout);
+  }
+  free(times);
+}
+#endif
+
+/** commits the default parameters and runs one module. returns the time, or a negative value if skipped. */
+static double
+bench_module(dt_iop_module_t *module, dt_dev_pixelpipe_t *pipe, const dt_bench_size_t *size,
+             const int runs, const int force_tiling, const char **path)
+{
+  dt_dev_pixelpipe_iop_t piece;
+  memset(&piece, 0, sizeof(piece));
+  piece.enabled = 1;
+  piece.colors  = 4;
+  piece.iscale  = pipe->iscale;
+  piece.iwidth  = pipe->iwidth;
+  piece.iheight = pipe->iheight;
+  piece.module  = module;
+  piece.pipe    = pipe;
+  dt_iop_init_pipe(module, pipe, &piece);
+
+  dt_iop_roi_t roi_out = { 0, 0, size->width, size->height, 1.0f };
+  dt_iop_roi_t roi_in = roi_out;
+  piece.buf_in = piece.buf_out = roi_out;
+  module->modify_roi_in(module, &piece, &roi_out, &roi_in);
+
+  double time = -1.0;
+  // the module might decide it has nothing to do with its defaults or on non-raw input:
+  if(piece.enabled && roi_in.width > 0 && roi_in.height > 0)
+  {
+    dt_develop_tiling_t tiling = { 0 };
+    module->tiling_callback(module, &piece, &roi_in, &roi_out, &tiling);
+    const int tiled = (module->flags() & IOP_FLAGS_ALLOW_TILING) &&
+                      (force_tiling || !dt_tiling_piece_fits_host_memory(MAX(roi_in.width, roi_out.width),
+                                                                         MAX(roi_in.height, roi_out.height),
+                                                                         4*sizeof(float), tiling.factor, tiling.overhead));
+    *path = tiled ? "cpu_tiled" : "cpu";
+    time = time_module(module, &piece, &roi_in, &roi_out, runs, tiled);
+  }
+
+  module->cleanup_pipe(module, pipe, &piece);
+  free(piece.blendop_data);
+  return time;
+}
+
+int main(int argc, char *arg[])
+{
+  bindtextdomain (GETTEXT_PACKAGE, DARKTABLE_LOCALEDIR);
+  bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+  textdomain (GETTEXT_PACKAGE);
+
+  // no display needed, we only want the type system:
+  gtk_init_check (&argc, &arg);
+
+  gchar **ops = NULL;
+  gchar **raws = NULL;
+  const char *size_str = "1024x768,2048x1536,4096x3072";
+  int runs = 5, threads = 0, force_tiling = 0, csv = 0;
+
+  int k;
+  for(k=1; k<argc; k++)
+  {
+    if(!strcmp(arg[k], "--iop") && k+1 < argc)
+      ops = g_strsplit(arg[++k], ",", -1);
+    else if(!strcmp(arg[k], "--sizes") && k+1 < argc)
+      size_str = arg[++k];
+    else if(!strcmp(arg[k], "--runs") && k+1 < argc)
+      runs = CLAMP(atoi(arg[++k]), 1, 1000);
+    else if(!strcmp(arg[k], "--threads") && k+1 < argc)
+      threads = CLAMP(atoi(arg[++k]), 1, 100);
+    else if(!strcmp(arg[k], "--tiling"))
+      force_tiling = 1;
+    else if(!strcmp(arg[k], "--csv"))
+      csv = 1;
+    else if(!strcmp(arg[k], "--raw") && k+1 < argc)
+      raws = g_strsplit(arg[++k], ",", -1);
+    else if(!strcmp(arg[k], "--core"))
+    {
+      // everything from here on should be passed to the core
+      k++;
+      break;
+    }
+    else
+    {
+      usage(arg[0]);
+      exit(1);
+    }
+  }
+
+  GArray *sizes = parse_sizes(size_str);
+  if(sizes->len == 0)
+  {
+    usage(arg[0]);
+    exit(1);
+  }
+
+  int m_argc = 0;
+  char *m_arg[7 + argc - k];
+  char thread_str[16];
+  m_arg[m_argc++] = "darktable-bench";
+  m_arg[m_argc++] = "--library";
+  m_arg[m_argc++] = ":memory:";
+  m_arg[m_argc++] = "--disable-opencl";
+  if(threads)
+  {
+    snprintf(thread_str, sizeof(thread_str), "%d", threads);
+    m_arg[m_argc++] = "-t";
+    m_arg[m_argc++] = thread_str;
+  }
+  for(; k < argc; k++) m_arg[m_argc++] = arg[k];
+  m_arg[m_argc] = NULL;
+
+  // init dt without gui:
+  if(dt_init(m_argc, m_arg, 0)) exit(1);
+
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#else
+  threads = 1;
+#endif
+#if defined(__SSE2__)
+  const char *simd = "sse2";
+#else
+  const char *simd = "none";
+#endif
+
+  if(raws)
+  {
+#ifdef HAVE_RAWSPEED
+    bench_raw(raws, runs, threads, simd, csv);
+#else
+    fprintf(stderr, "[bench] --raw needs darktable built with rawspeed\n");
+#endif
+    g_strfreev(raws);
+    g_array_free(sizes, TRUE);
+    g_strfreev(ops);
+    dt_cleanup();
+    return 0;
+  }
+
+  // a develop instance with all modules, so the modules can look at each other and at the image:
+  dt_develop_t dev;
+  dt_dev_init(&dev, 0);
+  dev.iop = dt_iop_load_modules(&dev);
+
+  // pretend we have a non-raw float image of the largest size:
+  dt_bench_size_t max_size = { 0, 0 };
+  for(guint s=0; s<sizes->len; s++)
+  {
+    max_size.width  = MAX(max_size.width,  g_array_index(sizes, dt_bench_size_t, s).width);
+    max_size.height = MAX(max_size.height, g_array_index(sizes, dt_bench_size_t, s).height);
+  }
+  dev.image_storage.width  = max_size.width;
+  dev.image_storage.height = max_size.height;
+  dev.image_storage.filters = 0;
+  dev.image_storage.bpp = 4*sizeof(float);
+  dev.image_storage.flags = DT_IMAGE_HDR;
+
+  dt_dev_pixelpipe_t pipe;
+  dt_dev_pixelpipe_init_dummy(&pipe, 1, 1);
+  pipe.type = DT_DEV_PIXELPIPE_EXPORT;
+  dt_dev_pixelpipe_set_input(&pipe, &dev, NULL, max_size.width, max_size.height, 1.0f);
+
+  if(csv) printf("op,width,height,threads,path,simd,runs,ms,mpix_per_s\n");
+  else printf("%-20s %11s %7s %-9s %-5s %10s %10s\n", "module", "size", "threads", "path", "simd", "ms", "MPix/s");
+
+  for(GList *it = dev.iop; it; it = g_list_next(it))
+  {
+    dt_iop_module_t *module = (dt_iop_module_t *)it->data;
+    if(!is_requested(module, ops)) continue;
+    for(guint s=0; s<sizes->len; s++)
+    {
+      const dt_bench_size_t *size = &g_array_index(sizes, dt_bench_size_t, s);
+      const char *path = "-";
+      const double time = bench_module(module, &pipe, size, runs, force_tiling, &path);
+      const double mpix = size->width*(double)size->height*1e-6;
+      if(time < 0.0)
+      {
+        if(csv) printf("%s,%d,%d,%d,skipped,%s,0,,\n", module->op, size->width, size->height, threads, simd);
+        else printf("%-20s %5dx%-5d %7d %-9s %-5s %10s %10s\n", module->op, size->width, size->height, threads, "skipped", simd, "-", "-");
+      }
+      else if(csv)
+        printf("%s,%d,%d,%d,%s,%s,%d,%.3f,%.3f\n", module->op, size->width, size->height, threads, path, simd, runs,
+               1e3*time, mpix/time);
+      else
+        printf("%-20s %5dx%-5d %7d %-9s %-5s %10.3f %10.3f\n", module->op, size->width, size->height, threads, path, simd,
+               1e3*time, mpix/time);
+      fflush(stdout);
+    }
+  }
+
+  dt_dev_pixelpipe_cleanup(&pipe);
+  dt_dev_cleanup(&dev);
+  g_array_free(sizes, TRUE);
+  g_strfreev(ops);
+
+  dt_cleanup();
+  return 0;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -34,19 +34,250 @@
 #include "common/image_cache.h"
 #include "common/imageio.h"
 #include "common/imageio_module.h"
+#include "common/mipmap_cache.h"
 #include "common/exif.h"
 #include "common/history.h"
 
+#include <glib/gstdio.h>
 #include <sys/time.h>
 #include <unistd.h>
 int usleep(useconds_t usec);
 #include <inttypes.h>
 #include <libintl.h>
 
+/** one input/xmp/output triple, either from the command line or from a batch manifest. */
+typedef struct dt_cli_job_t
+{
+  char *image_filename;
+  char *xmp_filename;
+  char *output_filename;
+  int id;
+  double time;
+  const char *error;
+}
+dt_cli_job_t;
+
 static void
 usage(const char* progname)
 {
   fprintf(stderr, "usage: %s <input file> [<xmp file>] <output file> [--width <max width>,--height <max height>,--bpp <bpp>,--hq <0|1|true|false>,--verbose] [--core <darktable options>]\n", progname);
+  fprintf(stderr, "       %s --batch <manifest file|-> [--threads <n>] [--width <max width>,--height <max height>,--bpp <bpp>,--hq <0|1|true|false>,--verbose] [--core <darktable options>]\n", progname);
+  fprintf(stderr, "       every line of the manifest holds <input file> [<xmp file>] <output file>, separated by tabs.\n");
+}
+
+/** split one manifest line into a job. fields are separated by tabs, or by blanks if there are no tabs. */
+static int
+parse_manifest_line(char *line, dt_cli_job_t *job)
+{
+  g_strstrip(line);
+  if(line[0] == '\0' || line[0] == '#') return 1;
+  gchar **fields = g_strsplit_set(line, strchr(line, '\t') ? "\t" : " \t", -1);
+  char *f[3];
+  int cnt = 0;
+  for(gchar **field = fields; *field; field++)
+  {
+    g_strstrip(*field);
+    if(**field == '\0') continue;
+    if(cnt == 3) { cnt++; break; }
+    f[cnt++] = *field;
+  }
+  int ret = 0;
+  memset(job, 0, sizeof(dt_cli_job_t));
+  if(cnt == 2)
+  {
+    job->image_filename  = g_strdup(f[0]);
+    job->output_filename = g_strdup(f[1]);
+  }
+  else if(cnt == 3)
+  {
+    job->image_filename  = g_strdup(f[0]);
+    job->xmp_filename    = g_strdup(f[1]);
+    job->output_filename = g_strdup(f[2]);
+  }
+  else ret = -1;
+  g_strfreev(fields);
+  return ret;
+}
+
+static GArray *
+read_manifest(const char *manifest)
+{
+  FILE *f = strcmp(manifest, "-") ? g_fopen(manifest, "rb") : stdin;
+  if(!f)
+  {
+    fprintf(stderr, _("error: can't open manifest %s"), manifest);
+    fprintf(stderr, "\n");
+    return NULL;
+  }
+  GArray *jobs = g_array_new(FALSE, FALSE, sizeof(dt_cli_job_t));
+  char line[3*DT_MAX_PATH_LEN];
+  int lineno = 0;
+  while(fgets(line, sizeof(line), f))
+  {
+    lineno++;
+    dt_cli_job_t job;
+    const int ret = parse_manifest_line(line, &job);
+    if(ret < 0)
+    {
+      fprintf(stderr, _("warning: skipping malformed line %d of manifest %s"), lineno, manifest);
+      fprintf(stderr, "\n");
+    }
+    if(ret) continue;
+    g_array_append_val(jobs, job);
+  }
+  if(f != stdin) fclose(f);
+  return jobs;
+}
+
+/** add the input to the library and apply the xmp, if requested. has to run serially.
+ *  imported maps image ids to the first job which got them. */
+static void
+import_job(dt_cli_job_t *job, GHashTable *imported, const gboolean verbose)
+{
+  dt_film_t film;
+  gchar *directory = g_path_get_dirname(job->image_filename);
+  const int filmid = dt_film_new(&film, directory);
+  g_free(directory);
+  job->id = dt_image_import(filmid, job->image_filename, TRUE);
+  if(!job->id)
+  {
+    job->error = _("can't open file");
+    return;
+  }
+
+  // the history belongs to the image id and all exports run after all imports, so the same
+  // input listed again with another xmp gets a duplicate of its own:
+  gchar *xmp_filename = job->xmp_filename;
+  const dt_cli_job_t *first = (const dt_cli_job_t *)g_hash_table_lookup(imported, GINT_TO_POINTER(job->id));
+  if(!first)
+    g_hash_table_insert(imported, GINT_TO_POINTER(job->id), job);
+  else if(g_strcmp0(first->xmp_filename, job->xmp_filename))
+  {
+    const int32_t newid = dt_image_duplicate(job->id);
+    if(newid <= 0)
+    {
+      job->error = _("can't duplicate image");
+      return;
+    }
+    job->id = newid;
+    // without an xmp given, start from the sidecar like the import did:
+    if(!xmp_filename)
+    {
+      xmp_filename = g_strconcat(job->image_filename, ".xmp", NULL);
+      if(!g_file_test(xmp_filename, G_FILE_TEST_IS_REGULAR))
+      {
+        g_free(xmp_filename);
+        xmp_filename = NULL;
+      }
+    }
+  }
+
+  // attach xmp, if requested:
+  if(xmp_filename)
+  {
+    const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, job->id);
+    dt_image_t *image = dt_image_cache_write_get(darktable.image_cache, cimg);
+    dt_exif_xmp_read(image, xmp_filename, 1);
+    // don't write new xmp:
+    dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_RELAXED);
+    dt_image_cache_read_release(darktable.image_cache, image);
+    if(xmp_filename != job->xmp_filename) g_free(xmp_filename);
+  }
+
+  // print the history stack
+  if(verbose)
+  {
+    gchar *history = dt_history_get_items_as_string(job->id);
+    if(history)
+      printf("%s\n", history);
+    else
+      printf("[%s]\n", _("empty history stack"));
+    g_free(history);
+  }
+}
+
+/** export one imported image to disk. safe to call from several threads at once. */
+static void
+export_job(dt_cli_job_t *job, dt_imageio_module_storage_t *storage, const int width, const int height, const gboolean high_quality)
+{
+  const double start = dt_get_wtime();
+
+  // the output file already exists, so there will be a sequence number added
+  if(g_file_test(job->output_filename, G_FILE_TEST_EXISTS))
+  {
+    fprintf(stderr, "%s: %s\n", job->output_filename, _("output file already exists, it will get renamed"));
+  }
+
+  // try to find out the export format from the output_filename
+  char output_filename[DT_MAX_PATH_LEN];
+  g_strlcpy(output_filename, job->output_filename, sizeof(output_filename));
+  char *ext = output_filename + strlen(output_filename);
+  while(ext > output_filename && *ext != '.') ext--;
+  *ext = '\0';
+  ext++;
+
+  if(!strcmp(ext, "jpg"))
+    ext = "jpeg";
+
+  // init the export data structures
+  dt_imageio_module_format_t *format;
+  dt_imageio_module_data_t *sdata, *fdata;
+
+  sdata = storage->get_params(storage);
+  if(sdata == NULL)
+  {
+    job->error = _("failed to get parameters from storage module");
+    return;
+  }
+
+  // and now for the really ugly hacks. don't tell your children about this one or they won't sleep at night any longer ...
+  g_strlcpy((char*)sdata, output_filename, DT_MAX_PATH_LEN);
+  // all is good now, the last line didn't happen.
+
+  format = dt_imageio_get_format_by_name(ext);
+  if(format == NULL)
+  {
+    job->error = _("unknown extension");
+    storage->free_params(storage, sdata);
+    return;
+  }
+
+  fdata = format->get_params(format);
+  if(fdata == NULL)
+  {
+    job->error = _("failed to get parameters from format module");
+    storage->free_params(storage, sdata);
+    return;
+  }
+
+  uint32_t w,h,fw,fh,sw,sh;
+  fw=fh=sw=sh=0;
+  storage->dimension(storage, &sw, &sh);
+  format->dimension(format, &fw, &fh);
+
+  if( sw==0 || fw==0) w=sw>fw?sw:fw;
+  else w=sw<fw?sw:fw;
+
+  if( sh==0 || fh==0) h=sh>fh?sh:fh;
+  else h=sh<fh?sh:fh;
+
+  fdata->max_width  = width;
+  fdata->max_height = height;
+  fdata->max_width = (w!=0 && fdata->max_width >w)?w:fdata->max_width;
+  fdata->max_height = (h!=0 && fdata->max_height >h)?h:fdata->max_height;
+  fdata->style[0] = '\0';
+
+  //TODO: add a callback to set the bpp without going through the config
+
+  if(storage->store(storage,sdata, job->id, format, fdata, 1, 1, high_quality))
+    job->error = _("export failed");
+
+  // cleanup time
+  if(storage->finalize_store) storage->finalize_store(storage, sdata);
+  storage->free_params(storage, sdata);
+  format->free_params(format, fdata);
+
+  job->time = dt_get_wtime() - start;
 }
 
 int main(int argc, char *arg[])
@@ -61,14 +292,15 @@ int main(int argc, char *arg[])
   char *image_filename = NULL;
   char *xmp_filename = NULL;
   char *output_filename = NULL;
+  char *manifest = NULL;
   int file_counter = 0;
-  int width = 0, height = 0, bpp = 0;
+  int width = 0, height = 0, bpp = 0, threads = 1;
   gboolean verbose = FALSE, high_quality = TRUE;
 
   int k;
   for(k=1; k<argc; k++)
   {
-    if(arg[k][0] == '-')
+    if(arg[k][0] == '-' && arg[k][1] != '\0')
     {
       if(!strcmp(arg[k], "--help"))
       {
@@ -112,6 +344,17 @@ int main(int argc, char *arg[])
         }
         g_free(str);
       }
+      else if(!strcmp(arg[k], "--batch") && k+1 < argc)
+      {
+        k++;
+        manifest = arg[k];
+      }
+      else if(!strcmp(arg[k], "--threads") && k+1 < argc)
+      {
+        k++;
+        // more images in flight than the mipmap cache has full buffers for would just wait for one
+        threads = CLAMP(atoi(arg[k]), 1, DT_MIPMAP_MAX_PARALLEL);
+      }
       else if(!strcmp(arg[k], "-v") || !strcmp(arg[k], "--verbose"))
       {
         verbose = TRUE;
@@ -137,144 +380,113 @@ int main(int argc, char *arg[])
   }
 
   int m_argc = 0;
-  char *m_arg[4 + argc - k];
+  char *m_arg[6 + argc - k];
+  char parallel_export[64];
   m_arg[m_argc++] = "darktable-cli";
   m_arg[m_argc++] = "--library";
   m_arg[m_argc++] = ":memory:";
+  if(threads > 1)
+  {
+    // make the mipmap cache hold one full buffer per concurrent image
+    snprintf(parallel_export, sizeof(parallel_export), "parallel_export=%d", threads);
+    m_arg[m_argc++] = "--conf";
+    m_arg[m_argc++] = parallel_export;
+  }
   for(; k < argc; k++) m_arg[m_argc++] = arg[k];
   m_arg[m_argc] = NULL;
 
-  if(file_counter < 2 || file_counter > 3)
+  GArray *jobs = NULL;
+  if(manifest)
   {
-    usage(arg[0]);
-    exit(1);
-  }
-  else if(file_counter == 2)
-  {
-    // no xmp file given
-    output_filename = xmp_filename;
-    xmp_filename = NULL;
+    if(file_counter != 0)
+    {
+      usage(arg[0]);
+      exit(1);
+    }
+    jobs = read_manifest(manifest);
+    if(!jobs) exit(1);
   }
-
-  // the output file already exists, so there will be a sequence number added
-  if(g_file_test(output_filename, G_FILE_TEST_EXISTS))
+  else
   {
-    fprintf(stderr, "%s\n", _("output file already exists, it will get renamed"));
+    if(file_counter < 2 || file_counter > 3)
+    {
+      usage(arg[0]);
+      exit(1);
+    }
+    else if(file_counter == 2)
+    {
+      // no xmp file given
+      output_filename = xmp_filename;
+      xmp_filename = NULL;
+    }
+    dt_cli_job_t job = {0};
+    job.image_filename = g_strdup(image_filename);
+    job.xmp_filename = g_strdup(xmp_filename);
+    job.output_filename = g_strdup(output_filename);
+    jobs = g_array_new(FALSE, FALSE, sizeof(dt_cli_job_t));
+    g_array_append_val(jobs, job);
   }
 
-  // init dt without gui:
+  // init dt without gui, once for all images:
   if(dt_init(m_argc, m_arg, 0)) exit(1);
 
-  dt_film_t film;
-  int id = 0;
-  int filmid = 0;
-
-  gchar *directory = g_path_get_dirname(image_filename);
-  filmid = dt_film_new(&film, directory);
-  id = dt_image_import(filmid, image_filename, TRUE);
-  if(!id)
-  {
-    fprintf(stderr, _("error: can't open file %s"), image_filename);
-    fprintf(stderr, "\n");
-    exit(1);
-  }
-  g_free(directory);
-
-  // attach xmp, if requested:
-  if(xmp_filename)
-  {
-    const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, id);
-    dt_image_t *image = dt_image_cache_write_get(darktable.image_cache, cimg);
-    dt_exif_xmp_read(image, xmp_filename, 1);
-    // don't write new xmp:
-    dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_RELAXED);
-    dt_image_cache_read_release(darktable.image_cache, image);
-  }
-
-  // print the history stack
-  if(verbose)
-  {
-    gchar *history = dt_history_get_items_as_string(id);
-    if(history)
-      printf("%s\n", history);
-    else
-      printf("[%s]\n", _("empty history stack"));
-  }
-
-  // try to find out the export format from the output_filename
-  char *ext = output_filename + strlen(output_filename);
-  while(ext > output_filename && *ext != '.') ext--;
-  *ext = '\0';
-  ext++;
-
-  if(!strcmp(ext, "jpg"))
-    ext = "jpeg";
-
-  // init the export data structures
-  dt_imageio_module_format_t *format;
-  dt_imageio_module_storage_t *storage;
-  dt_imageio_module_data_t *sdata, *fdata;
-
-  storage = dt_imageio_get_storage_by_name("disk"); // only exporting to disk makes sense
+  dt_imageio_module_storage_t *storage = dt_imageio_get_storage_by_name("disk"); // only exporting to disk makes sense
   if(storage == NULL)
   {
     fprintf(stderr, "%s\n", _("cannot find disk storage module. please check your installation, something seems to be broken."));
     exit(1);
   }
 
-  sdata = storage->get_params(storage);
-  if(sdata == NULL)
+  const int total = jobs->len;
+  const double start = dt_get_wtime();
+
+  // the library is touched by a single thread only
+  GHashTable *imported = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for(int i=0; i<total; i++)
+    import_job(&g_array_index(jobs, dt_cli_job_t, i), imported, verbose);
+  g_hash_table_destroy(imported);
+
+  // images are processed in parallel. every image gets its own pixelpipe, and the
+  // modules inside of it don't spawn threads of their own in this case.
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) shared(jobs, storage) firstprivate(width, height, high_quality, manifest) num_threads(threads) if(threads > 1)
+#endif
+  for(int i=0; i<total; i++)
   {
-    fprintf(stderr, "%s\n", _("failed to get parameters from storage module, aborting export ..."));
-    exit(1);
+    dt_cli_job_t *job = &g_array_index(jobs, dt_cli_job_t, i);
+    if(job->error) continue;
+    export_job(job, storage, width, height, high_quality);
+    if(manifest) fprintf(stderr, "[batch] %s -> %s: %.3f secs%s%s\n", job->image_filename, job->output_filename,
+                           job->time, job->error ? ", " : "", job->error ? job->error : "");
   }
 
-  // and now for the really ugly hacks. don't tell your children about this one or they won't sleep at night any longer ...
-  g_strlcpy((char*)sdata, output_filename, DT_MAX_PATH_LEN);
-  // all is good now, the last line didn't happen.
-
-  format = dt_imageio_get_format_by_name(ext);
-  if(format == NULL)
-  {
-    fprintf(stderr, _("unknown extension '.%s'"), ext);
-    fprintf(stderr, "\n");
-    exit(1);
-  }
-
-  fdata = format->get_params(format);
-  if(fdata == NULL)
+  // summary and cleanup time
+  int failed = 0;
+  for(int i=0; i<total; i++)
   {
-    fprintf(stderr, "%s\n", _("failed to get parameters from format module, aborting export ..."));
-    exit(1);
+    dt_cli_job_t *job = &g_array_index(jobs, dt_cli_job_t, i);
+    if(job->error)
+    {
+      if(!manifest && !job->id)
+      {
+        fprintf(stderr, _("error: can't open file %s"), job->image_filename);
+        fprintf(stderr, "\n");
+      }
+      else
+        fprintf(stderr, "%s: %s\n", job->image_filename, job->error);
+      failed++;
+    }
+    g_free(job->image_filename);
+    g_free(job->xmp_filename);
+    g_free(job->output_filename);
   }
-
-  uint32_t w,h,fw,fh,sw,sh;
-  fw=fh=sw=sh=0;
-  storage->dimension(storage, &sw, &sh);
-  format->dimension(format, &fw, &fh);
-
-  if( sw==0 || fw==0) w=sw>fw?sw:fw;
-  else w=sw<fw?sw:fw;
-
-  if( sh==0 || fh==0) h=sh>fh?sh:fh;
-  else h=sh<fh?sh:fh;
-
-  fdata->max_width  = width;
-  fdata->max_height = height;
-  fdata->max_width = (w!=0 && fdata->max_width >w)?w:fdata->max_width;
-  fdata->max_height = (h!=0 && fdata->max_height >h)?h:fdata->max_height;
-  fdata->style[0] = '\0';
-
-  //TODO: add a callback to set the bpp without going through the config
-
-  storage->store(storage,sdata, id, format, fdata, 1, 1, high_quality);
-
-  // cleanup time
-  if(storage->finalize_store) storage->finalize_store(storage, sdata);
-  storage->free_params(storage, sdata);
-  format->free_params(format, fdata);
+  if(manifest)
+    fprintf(stderr, "[batch] %d of %d images exported in %.3f secs, %d failed\n",
+            total - failed, total, dt_get_wtime() - start, failed);
+  g_array_free(jobs, TRUE);
 
   dt_cleanup();
+  return failed ? 1 : 0;
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
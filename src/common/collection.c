@@ -37,12 +37,30 @@
 
 /* Stores the collection query, returns 1 if changed.. */
 static int _dt_collection_store (const dt_collection_t *collection, gchar *query);
-/* Counts the number of images in the current collection */
-static uint32_t _dt_collection_compute_count(const dt_collection_t *collection);
+/* runs the query of the collection once, keeps the result and updates the count. call with the lock held. */
+static void _dt_collection_materialize(dt_collection_t *collection);
 /* signal handlers to update the cached count when something interesting might have happened.
  * we need 2 different since there are different kinds of signals we need to listen to. */
 static void _dt_collection_recount_callback_1(gpointer instace, gpointer user_data);
-static void _dt_collection_recount_callback_2(gpointer instance, uint8_t id, gpointer user_data);
+static void _dt_collection_recount_callback_2(gpointer instance, uint32_t id, gpointer user_data);
+/* a single image was imported, only test whether it's part of the collection */
+static void _dt_collection_image_import_callback(gpointer instance, uint32_t imgid, gpointer user_data);
+
+/* bumped for every row written to a table the collection filters or sorts on, by any thread. selection
+ * changes and the like don't count, so the kept offsets survive them. */
+static volatile uint32_t _dt_collection_changes = 0;
+
+static void _dt_collection_update_hook(void *data, int op, const char *db, const char *table, sqlite3_int64 rowid)
+{
+  static const char *tables[] = { "images", "film_rolls", "tagged_images", "tags", "color_labels", "meta_data", "history", NULL };
+  if(!strcmp(db, "memory") || !strcmp(db, "temp")) return;
+  for(const char **t = tables; *t; t++)
+    if(!strcmp(table, *t))
+    {
+      __sync_fetch_and_add(&_dt_collection_changes, 1);
+      return;
+    }
+}
 
 
 const dt_collection_t *
@@ -50,6 +68,9 @@ dt_collection_new (const dt_collection_t *clone)
 {
   dt_collection_t *collection = g_malloc (sizeof (dt_collection_t));
   memset (collection,0,sizeof (dt_collection_t));
+  dt_pthread_mutex_init(&collection->lock, NULL);
+  // one hook per connection, shared by all collections:
+  sqlite3_update_hook(dt_database_get(darktable.db), _dt_collection_update_hook, NULL);
 
   /* initialize collection context*/
   if (clone)   /* if clone is provided let's copy it into this context */
@@ -58,6 +79,7 @@ dt_collection_new (const dt_collection_t *clone)
     memcpy (&collection->store,&clone->store,sizeof (dt_collection_params_t));
     collection->where_ext = g_strdup(clone->where_ext);
     collection->query = g_strdup(clone->query);
+    collection->member_query = g_strdup(clone->member_query);
     collection->clone = 1;
     collection->count = clone->count;
   }
@@ -69,7 +91,7 @@ dt_collection_new (const dt_collection_t *clone)
   dt_control_signal_connect(darktable.signals, DT_SIGNAL_FILMROLLS_CHANGED, G_CALLBACK(_dt_collection_recount_callback_1), collection);
   dt_control_signal_connect(darktable.signals, DT_SIGNAL_FILMROLLS_REMOVED, G_CALLBACK(_dt_collection_recount_callback_1), collection);
 
-  dt_control_signal_connect(darktable.signals, DT_SIGNAL_IMAGE_IMPORT, G_CALLBACK(_dt_collection_recount_callback_2), collection);
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_IMAGE_IMPORT, G_CALLBACK(_dt_collection_image_import_callback), collection);
   dt_control_signal_connect(darktable.signals, DT_SIGNAL_FILMROLLS_IMPORTED, G_CALLBACK(_dt_collection_recount_callback_2), collection);
 
   return collection;
@@ -80,11 +102,15 @@ dt_collection_free (const dt_collection_t *collection)
 {
   dt_control_signal_disconnect(darktable.signals, G_CALLBACK(_dt_collection_recount_callback_1), (gpointer)collection);
   dt_control_signal_disconnect(darktable.signals, G_CALLBACK(_dt_collection_recount_callback_2), (gpointer)collection);
+  dt_control_signal_disconnect(darktable.signals, G_CALLBACK(_dt_collection_image_import_callback), (gpointer)collection);
 
   if (collection->query)
     g_free (collection->query);
   if (collection->where_ext)
     g_free (collection->where_ext);
+  g_free(collection->member_query);
+  free(collection->offsets);
+  dt_pthread_mutex_destroy(&((dt_collection_t *)collection)->lock);
   g_free ((dt_collection_t *)collection);
 }
 
@@ -160,6 +186,14 @@ dt_collection_update (const dt_collection_t *collection)
   query = dt_util_dstrcat(query, "%s %s%s", selq, sq?sq:"", (collection->params.query_flags&COLLECTION_QUERY_USE_LIMIT)?" "LIMIT_QUERY:"");
   result = _dt_collection_store(collection, query);
 
+  /* membership test for single images, the extended where part alone may contain joins */
+  dt_collection_t *c = (dt_collection_t *)collection;
+  g_free(c->member_query);
+  if(collection->params.query_flags&COLLECTION_QUERY_USE_ONLY_WHERE_EXT)
+    c->member_query = NULL;
+  else
+    c->member_query = g_strdup_printf("select id from images where (%s) and id = ?1", wq);
+
   /* free memory used */
   if (sq)
     g_free(sq);
@@ -167,8 +201,10 @@ dt_collection_update (const dt_collection_t *collection)
   g_free(selq);
   g_free (query);
 
-  /* update the cached count. collection isn't a real const anyway, we are writing to it in _dt_collection_store, too. */
-  ((dt_collection_t*)collection)->count = _dt_collection_compute_count(collection);
+  /* update the cached result and count. collection isn't a real const anyway, we are writing to it in _dt_collection_store, too. */
+  dt_pthread_mutex_lock(&c->lock);
+  _dt_collection_materialize(c);
+  dt_pthread_mutex_unlock(&c->lock);
   dt_collection_hint_message(collection);
 
   return result;
@@ -370,32 +406,49 @@ _dt_collection_store (const dt_collection_t *collection, gchar *query)
   return 1;
 }
 
-static uint32_t _dt_collection_compute_count(const dt_collection_t *collection)
+static int _dt_collection_offset_cmp(const void *a, const void *b)
 {
-  sqlite3_stmt *stmt = NULL;
-  uint32_t count=1;
-  const gchar *query = dt_collection_get_query(collection);
-  gchar *count_query = NULL;
+  const uint64_t ia = *(const uint64_t *)a, ib = *(const uint64_t *)b;
+  return ia < ib ? -1 : ia > ib;
+}
 
-  gchar *fq = g_strstr_len(query, strlen(query), "from");
-  if ((collection->params.query_flags&COLLECTION_QUERY_USE_ONLY_WHERE_EXT))
-    count_query = dt_util_dstrcat(NULL, "select count(images.id) from images %s", collection->where_ext);
-  else
-    count_query = dt_util_dstrcat(count_query, "select count(id) %s", fq);
+static void _dt_collection_materialize(dt_collection_t *collection)
+{
+  sqlite3_stmt *stmt = NULL;
+  uint32_t n = 0, size = 0;
+  uint64_t *offsets = NULL;
+  // anything written while the query runs makes the result outdated again:
+  const uint32_t changes = __sync_fetch_and_add(&_dt_collection_changes, 0);
 
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), count_query, -1, &stmt, NULL);
-  if ((collection->params.query_flags&COLLECTION_QUERY_USE_LIMIT) &&
-      !(collection->params.query_flags&COLLECTION_QUERY_USE_ONLY_WHERE_EXT))
+  // not dt_collection_get_query(), that would update the collection and we hold the lock.
+  if(collection->query)
   {
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, 0);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, -1);
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), collection->query, -1, &stmt, NULL);
+    if(sqlite3_bind_parameter_count(stmt) >= 2)
+    {
+      DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, 0);
+      DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, -1);
+    }
+    while(sqlite3_step(stmt) == SQLITE_ROW)
+    {
+      if(n == size)
+      {
+        size = MAX(1024, 2*size);
+        offsets = realloc(offsets, sizeof(uint64_t)*size);
+      }
+      offsets[n] = ((uint64_t)(uint32_t)sqlite3_column_int(stmt, 0) << 32) | n;
+      n++;
+    }
+    sqlite3_finalize(stmt);
   }
-
-  if(sqlite3_step(stmt) == SQLITE_ROW)
-    count = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
-  g_free(count_query);
-  return count;
+  qsort(offsets, n, sizeof(uint64_t), _dt_collection_offset_cmp);
+
+  free(collection->offsets);
+  collection->offsets = offsets;
+  collection->num_ids = n;
+  collection->count = n;
+  collection->ids_valid = 1;
+  collection->ids_changes = changes;
 }
 
 uint32_t dt_collection_get_count(const dt_collection_t *collection)
@@ -754,42 +807,37 @@ void dt_collection_hint_message(const dt_collection_t *collection)
 
 int dt_collection_image_offset(int imgid)
 {
-  const gchar *qin = dt_collection_get_query (darktable.collection);
+  dt_collection_t *collection = (dt_collection_t *)darktable.collection;
+  if(!dt_collection_get_query(collection)) return 0;
   int offset = 0;
-  sqlite3_stmt *stmt;
 
-  if(qin)
-  {
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), qin, -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1,  0);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, -1);
+  dt_pthread_mutex_lock(&collection->lock);
+  // ratings, labels, tags, .. written since might have changed the order, most don't send a signal:
+  if(!collection->ids_valid || collection->ids_changes != __sync_fetch_and_add(&_dt_collection_changes, 0))
+    _dt_collection_materialize(collection);
 
-    gboolean found = FALSE;
-
-    while (sqlite3_step (stmt) == SQLITE_ROW)
-    {
-      int id = sqlite3_column_int(stmt, 0);
-      if (imgid == id)
-      {
-        found = TRUE;
-        break;
-      }
-      offset++;
-    }
-
-    if (!found)
-      offset = 0;
-
-    sqlite3_finalize(stmt);
+  // binary search for the first entry of imgid:
+  const uint64_t key = (uint64_t)(uint32_t)imgid << 32;
+  uint32_t lo = 0, hi = collection->num_ids;
+  while(lo < hi)
+  {
+    const uint32_t mid = lo + (hi - lo)/2;
+    if(collection->offsets[mid] < key) lo = mid + 1;
+    else hi = mid;
   }
+  if(lo < collection->num_ids && (collection->offsets[lo] >> 32) == (uint32_t)imgid)
+    offset = collection->offsets[lo] & 0xffffffff;
+  dt_pthread_mutex_unlock(&collection->lock);
+
   return offset;
 }
 
-static void _dt_collection_recount_callback_1(gpointer instace, gpointer user_data)
+static void _dt_collection_recount(dt_collection_t *collection)
 {
-  dt_collection_t *collection = (dt_collection_t*)user_data;
+  dt_pthread_mutex_lock(&collection->lock);
   int old_count = collection->count;
-  collection->count = _dt_collection_compute_count(collection);
+  _dt_collection_materialize(collection);
+  dt_pthread_mutex_unlock(&collection->lock);
   if(!collection->clone)
   {
     if(old_count != collection->count)
@@ -798,15 +846,41 @@ static void _dt_collection_recount_callback_1(gpointer instace, gpointer user_da
   }
 }
 
-static void _dt_collection_recount_callback_2(gpointer instance, uint8_t id, gpointer user_data)
+static void _dt_collection_recount_callback_1(gpointer instace, gpointer user_data)
+{
+  _dt_collection_recount((dt_collection_t*)user_data);
+}
+
+static void _dt_collection_recount_callback_2(gpointer instance, uint32_t id, gpointer user_data)
+{
+  _dt_collection_recount((dt_collection_t*)user_data);
+}
+
+static void _dt_collection_image_import_callback(gpointer instance, uint32_t imgid, gpointer user_data)
 {
   dt_collection_t *collection = (dt_collection_t*)user_data;
-  int old_count = collection->count;
-  collection->count = _dt_collection_compute_count(collection);
+  if(!collection->member_query)
+  {
+    _dt_collection_recount(collection);
+    return;
+  }
+
+  // a new image can only add to the count. its position is found when the result is needed next time.
+  // the query changes with every update of the collection, so it's not worth caching the statement.
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), collection->member_query, -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  const int member = sqlite3_step(stmt) == SQLITE_ROW;
+  sqlite3_finalize(stmt);
+  if(!member) return;
+
+  dt_pthread_mutex_lock(&collection->lock);
+  collection->count++;
+  collection->ids_valid = 0;
+  dt_pthread_mutex_unlock(&collection->lock);
   if(!collection->clone)
   {
-    if(old_count != collection->count)
-      dt_collection_hint_message(collection);
+    dt_collection_hint_message(collection);
     dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
   }
 }
@@ -18,6 +18,7 @@
 #ifndef DT_COLLECTION_H
 #define DT_COLLECTION_H
 
+#include "common/dtpthread.h"
 #include <inttypes.h>
 #include <glib.h>
 
@@ -110,6 +111,17 @@ typedef struct dt_collection_t
   unsigned int count;
   dt_collection_params_t params;
   dt_collection_params_t store;
+
+  /** offsets of the images in the query result, as (id << 32 | offset) sorted for lookups. rebuilt
+      lazily when invalidated, or when a table the query depends on was written to since. paging
+      through the collection is done by the lighttable's memory.collected_images. */
+  uint64_t *offsets;
+  uint32_t num_ids;
+  int ids_valid;
+  uint32_t ids_changes;
+  /** tests a single image against the filters, to keep the count up to date while importing. */
+  gchar *member_query;
+  dt_pthread_mutex_t lock;
 }
 dt_collection_t;
 
@@ -0,0 +1,214 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "common/color_lut.h"
+#include <stdlib.h>
+#include <math.h>
+#include <xmmintrin.h>
+
+// offset and scale from input values to [0,1] grid coordinates
+static void
+_color_lut_domain(const dt_color_lut_domain_t domain, float offset[4], float scale[4])
+{
+  if(domain == DT_COLOR_LUT_LAB)
+  {
+    offset[0] = 0.0f;
+    offset[1] = offset[2] = 128.0f;
+    scale[0] = 1.0f/100.0f;
+    scale[1] = scale[2] = 1.0f/256.0f;
+  }
+  else
+  {
+    offset[0] = offset[1] = offset[2] = 0.0f;
+    scale[0] = scale[1] = scale[2] = 1.0f;
+  }
+  offset[3] = scale[3] = 0.0f;
+}
+
+dt_color_lut_t *dt_color_lut_new(cmsHTRANSFORM xform, const dt_color_lut_domain_t domain, const int size)
+{
+  if(!xform || size < 2) return NULL;
+  dt_color_lut_t *lut = (dt_color_lut_t *)malloc(sizeof(dt_color_lut_t));
+  if(!lut) return NULL;
+  const size_t nodes = (size_t)size*size*size;
+  lut->domain = domain;
+  lut->size = size;
+  lut->data = (float *)malloc(sizeof(float)*4*nodes);
+  float *tmp = (float *)malloc(sizeof(float)*3*nodes);
+  if(!lut->data || !tmp)
+  {
+    free(tmp);
+    dt_color_lut_free(lut);
+    return NULL;
+  }
+
+  // input values of all grid nodes
+  float offset[4], scale[4];
+  _color_lut_domain(domain, offset, scale);
+  float node[size];
+  for(int k=0; k<size; k++)
+  {
+    const float u = k/(size - 1.0f);
+    node[k] = domain == DT_COLOR_LUT_RGB ? u*u : u;
+  }
+  size_t idx = 0;
+  for(int i=0; i<size; i++)
+    for(int j=0; j<size; j++)
+      for(int k=0; k<size; k++, idx++)
+      {
+        tmp[3*idx+0] = node[i]/scale[0] - offset[0];
+        tmp[3*idx+1] = node[j]/scale[1] - offset[1];
+        tmp[3*idx+2] = node[k]/scale[2] - offset[2];
+      }
+
+  // lcms does the transform in place just fine, one call for the whole grid.
+  cmsDoTransform(xform, tmp, tmp, nodes);
+
+  for(size_t k=0; k<nodes; k++)
+  {
+    lut->data[4*k+0] = tmp[3*k+0];
+    lut->data[4*k+1] = tmp[3*k+1];
+    lut->data[4*k+2] = tmp[3*k+2];
+    lut->data[4*k+3] = 0.0f;
+  }
+  free(tmp);
+  return lut;
+}
+
+void dt_color_lut_free(dt_color_lut_t *lut)
+{
+  if(!lut) return;
+  free(lut->data);
+  free(lut);
+}
+
+// bounds of the sampled domain, in input values
+static void
+_color_lut_bounds(const dt_color_lut_domain_t domain, float lo[4], float hi[4])
+{
+  float offset[4], scale[4];
+  _color_lut_domain(domain, offset, scale);
+  for(int c=0; c<3; c++)
+  {
+    lo[c] = -offset[c];
+    hi[c] = 1.0f/scale[c] - offset[c];
+  }
+  lo[3] = hi[3] = 0.0f;
+}
+
+// run the collected pixels through the transform itself and scatter them back to out.
+static void
+_color_lut_fallback(cmsHTRANSFORM xform, const float *fb_in, float *fb_out, const int *fb_idx, const int num,
+                    float *out, const int ch)
+{
+  cmsDoTransform(xform, fb_in, fb_out, num);
+  for(int k=0; k<num; k++)
+    for(int c=0; c<3; c++) out[(size_t)ch*fb_idx[k] + c] = fb_out[3*k + c];
+}
+
+#define DT_COLOR_LUT_FALLBACK 64
+
+void dt_color_lut_apply(const dt_color_lut_t *lut, cmsHTRANSFORM xform, const float *in, float *out, const int width, const int ch)
+{
+  float offset[4], scale[4], lo[4], hi[4];
+  _color_lut_domain(lut->domain, offset, scale);
+  _color_lut_bounds(lut->domain, lo, hi);
+  const int n = lut->size;
+  const __m128 voffset = _mm_loadu_ps(offset);
+  const __m128 vscale = _mm_mul_ps(_mm_loadu_ps(scale), _mm_set1_ps(n - 1.0f));
+  const __m128 vlo = _mm_loadu_ps(lo);
+  const __m128 vhi = _mm_loadu_ps(hi);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 top = _mm_set1_ps(n - 1.0f);
+  const size_t sx = 4*(size_t)n*n, sy = 4*n, sz = 4;
+
+  // pixels outside the domain are collected here and transformed by lcms in batches
+  float fb_in[3*DT_COLOR_LUT_FALLBACK], fb_out[3*DT_COLOR_LUT_FALLBACK];
+  int fb_idx[DT_COLOR_LUT_FALLBACK];
+  int fb_num = 0;
+
+  for(int i=0; i<width; i++)
+  {
+    const float *pin = in + (size_t)ch*i;
+    float *pout = out + (size_t)ch*i;
+    __m128 v = _mm_setr_ps(pin[0], pin[1], pin[2], 0.0f);
+
+    // NaN compares false and stays with the lut, which maps it to zero
+    if(xform && (_mm_movemask_ps(_mm_or_ps(_mm_cmplt_ps(v, vlo), _mm_cmpgt_ps(v, vhi))) & 7))
+    {
+      for(int c=0; c<3; c++) fb_in[3*fb_num + c] = pin[c];
+      fb_idx[fb_num++] = i;
+      if(fb_num == DT_COLOR_LUT_FALLBACK)
+      {
+        _color_lut_fallback(xform, fb_in, fb_out, fb_idx, fb_num, out, ch);
+        fb_num = 0;
+      }
+      continue;
+    }
+
+    // grid coordinates, clamped to the domain (this also maps NaN to zero):
+    if(lut->domain == DT_COLOR_LUT_RGB)
+      v = _mm_mul_ps(_mm_sqrt_ps(_mm_min_ps(_mm_max_ps(v, zero), one)), vscale);
+    else
+      v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(v, voffset), vscale), zero), top);
+
+    float c[4];
+    _mm_storeu_ps(c, v);
+    int x = (int)c[0], y = (int)c[1], z = (int)c[2];
+    x = x > n-2 ? n-2 : x;
+    y = y > n-2 ? n-2 : y;
+    z = z > n-2 ? n-2 : z;
+    const float fx = c[0] - x, fy = c[1] - y, fz = c[2] - z;
+
+    // tetrahedral interpolation: walk from the base node to the opposite corner of the cell,
+    // along the axes in order of decreasing fractional coordinate.
+    const float *p = lut->data + x*sx + y*sy + z*sz;
+    size_t s1, s2;
+    float f1, f2, f3;
+    if(fx >= fy)
+    {
+      if(fy >= fz)      { s1 = sx; s2 = sx+sy; f1 = fx; f2 = fy; f3 = fz; }
+      else if(fx >= fz) { s1 = sx; s2 = sx+sz; f1 = fx; f2 = fz; f3 = fy; }
+      else              { s1 = sz; s2 = sx+sz; f1 = fz; f2 = fx; f3 = fy; }
+    }
+    else
+    {
+      if(fz >= fy)      { s1 = sz; s2 = sy+sz; f1 = fz; f2 = fy; f3 = fx; }
+      else if(fz >= fx) { s1 = sy; s2 = sy+sz; f1 = fy; f2 = fz; f3 = fx; }
+      else              { s1 = sy; s2 = sx+sy; f1 = fy; f2 = fx; f3 = fz; }
+    }
+    const __m128 c0 = _mm_loadu_ps(p);
+    const __m128 c1 = _mm_loadu_ps(p + s1);
+    const __m128 c2 = _mm_loadu_ps(p + s2);
+    const __m128 c3 = _mm_loadu_ps(p + sx + sy + sz);
+    const __m128 res = _mm_add_ps(_mm_add_ps(c0, _mm_mul_ps(_mm_set1_ps(f1), _mm_sub_ps(c1, c0))),
+                                  _mm_add_ps(_mm_mul_ps(_mm_set1_ps(f2), _mm_sub_ps(c2, c1)),
+                                             _mm_mul_ps(_mm_set1_ps(f3), _mm_sub_ps(c3, c2))));
+    _mm_storeu_ps(c, res);
+    pout[0] = c[0];
+    pout[1] = c[1];
+    pout[2] = c[2];
+  }
+  if(fb_num) _color_lut_fallback(xform, fb_in, fb_out, fb_idx, fb_num, out, ch);
+}
+
+#undef DT_COLOR_LUT_FALLBACK
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
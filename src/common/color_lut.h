@@ -0,0 +1,57 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_COLOR_LUT_H
+#define DT_COLOR_LUT_H
+
+#include <lcms2.h>
+
+/** default number of nodes per dimension. */
+#define DT_COLOR_LUT_SIZE 48
+
+/** the input space a lut is sampled over. */
+typedef enum dt_color_lut_domain_t
+{
+  DT_COLOR_LUT_RGB = 0,   // linear rgb in [0,1], nodes spaced in sqrt(rgb) for more precision in the shadows
+  DT_COLOR_LUT_LAB = 1    // L in [0,100], a and b in [-128,128]
+}
+dt_color_lut_domain_t;
+
+/** a lcms transform sampled on a regular 3d grid, applied by tetrahedral interpolation.
+ *  unlike the transform itself, this is cheap and can be used from many threads at once. */
+typedef struct dt_color_lut_t
+{
+  dt_color_lut_domain_t domain;
+  int size;
+  float *data;      // size^3 nodes of 4 floats each, the first index is the slowest
+}
+dt_color_lut_t;
+
+/** samples the transform (TYPE_RGB_FLT or TYPE_Lab_FLT input depending on domain, 3 float output channels). */
+dt_color_lut_t *dt_color_lut_new(cmsHTRANSFORM xform, const dt_color_lut_domain_t domain, const int size);
+void dt_color_lut_free(dt_color_lut_t *lut);
+
+/** transforms width pixels of ch floats each, in and out may be the same buffer. only the first three
+ *  channels are written. pixels outside the domain are passed to xform, the transform the lut was sampled
+ *  from, or clamped to the domain if xform is NULL. */
+void dt_color_lut_apply(const dt_color_lut_t *lut, cmsHTRANSFORM xform, const float *in, float *out, const int width,
+                        const int ch);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,43 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "common/cpu.h"
+
+#include <stdlib.h>
+
+int dt_cpu_features()
+{
+  // the answer is always the same, so racing threads only do the work twice:
+  static volatile int features = -1;
+  if(features >= 0) return features;
+
+  int f = DT_CPU_SSE2;
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+  // also checks that the os saves the ymm registers:
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) f |= DT_CPU_AVX2;
+  if(__builtin_cpu_supports("fma"))  f |= DT_CPU_FMA;
+#endif
+  if(getenv("DT_CPU_BASELINE")) f = DT_CPU_SSE2;
+
+  features = f;
+  return f;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,55 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_COMMON_CPU_H
+#define DT_COMMON_CPU_H
+
+/**
+ * runtime cpu dispatch. the code is built for sse2, so the same binary runs everywhere. hot
+ * kernels can come in a second variant for newer cpus, compiled for that instruction set
+ * function by function (DT_CPU_TARGET_AVX2), and modules pick the variant in init_global().
+ */
+typedef enum dt_cpu_feature_t
+{
+  DT_CPU_SSE2 = 1 << 0,
+  DT_CPU_AVX2 = 1 << 1,
+  DT_CPU_FMA  = 1 << 2
+}
+dt_cpu_feature_t;
+
+// compilers which can build single functions for avx2 and fma, intrinsics included:
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define DT_CPU_HAVE_AVX2_TARGET 1
+#define DT_CPU_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+/** the features of the cpu we run on, as a mask of dt_cpu_feature_t. only what the build
+ *  can make use of is reported. DT_CPU_BASELINE set in the environment turns everything past
+ *  sse2 off, to compare against the plain code paths. */
+int dt_cpu_features();
+
+/** non-zero if all of the given features are there. */
+static inline int dt_cpu_has(const int features)
+{
+  return (dt_cpu_features() & features) == features;
+}
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
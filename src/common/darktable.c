@@ -599,8 +599,8 @@ int dt_init(int argc, char *argv[], const int init_gui)
   // Initialize the signal system
   darktable.signals = dt_control_signal_init();
 
-  // Initialize the filesystem watcher
-  darktable.fswatch=dt_fswatch_new();
+  // Initialize the filesystem watcher, it keeps the library in sync with the film roll folders
+  darktable.fswatch=(init_gui && dt_conf_get_bool("watch_film_rolls")) ? dt_fswatch_new() : NULL;
 
 #ifdef HAVE_GPHOTO2
   // Initialize the camera control
@@ -681,6 +681,9 @@ int dt_init(int argc, char *argv[], const int init_gui)
   memset(darktable.mipmap_cache, 0, sizeof(dt_mipmap_cache_t));
   dt_mipmap_cache_init(darktable.mipmap_cache);
 
+  // changes to the film roll folders are applied to both caches:
+  dt_fswatch_add_film_rolls(darktable.fswatch);
+
   // The GUI must be initialized before the views, because the init()
   // functions of the views depend on darktable.control->accels_* to register
   // their keyboard accelerators
@@ -791,6 +794,11 @@ void dt_cleanup()
 
     dt_control_write_config(darktable.control);
     dt_control_shutdown(darktable.control);
+    // thumbnail loads still running need the caches and the control:
+    dt_mipmap_loader_cleanup(&darktable.mipmap_cache->loader);
+    // same for changes to the film roll folders being applied:
+    dt_fswatch_destroy(darktable.fswatch);
+    darktable.fswatch = NULL;
 
     dt_lib_cleanup(darktable.lib);
     free(darktable.lib);
@@ -825,7 +833,6 @@ void dt_cleanup()
   dt_camctl_destroy(darktable.camctl);
 #endif
   dt_pwstorage_destroy(darktable.pwstorage);
-  dt_fswatch_destroy(darktable.fswatch);
 
 #ifdef HAVE_GRAPHICSMAGICK
   DestroyMagick();
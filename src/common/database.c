@@ -32,6 +32,23 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
+
+/* a compiled statement in the cache, handed out to one caller at a time */
+typedef struct dt_database_statement_t
+{
+  sqlite3_stmt *stmt;
+  gboolean in_use;
+}
+dt_database_statement_t;
+
+/* execution counters of one sql text, collected by the profile callback */
+typedef struct dt_database_timing_t
+{
+  uint64_t count;
+  uint64_t nsec;
+}
+dt_database_timing_t;
 
 typedef struct dt_database_t
 {
@@ -43,6 +60,24 @@ typedef struct dt_database_t
 
   /* ondisk DB */
   sqlite3 *handle;
+
+  /* the database is in wal mode, so worker threads can read through their own connections */
+  gboolean wal;
+  /* a write transaction is open on the main connection */
+  volatile int transactions;
+  /* held from the outermost begin to its commit, so batches of different threads don't mix */
+  dt_pthread_mutex_t transaction_mutex;
+  pthread_t transaction_owner;
+  int transaction_depth;
+  /* read only connection of the calling thread */
+  pthread_key_t reader_key;
+  GList *readers;
+
+  /* per connection: sql text -> dt_database_statement_t */
+  GHashTable *statements;
+  /* sql text -> dt_database_timing_t, only with -d sql */
+  GHashTable *timings;
+  dt_pthread_mutex_t lock;
 } dt_database_t;
 
 
@@ -57,6 +92,79 @@ gboolean dt_database_is_new(const dt_database_t *db)
   return db->is_new_database;
 }
 
+static void _database_profile(void *data, const char *sql, sqlite3_uint64 nsec)
+{
+  dt_database_t *db = (dt_database_t *)data;
+  dt_pthread_mutex_lock(&db->lock);
+  dt_database_timing_t *t = (dt_database_timing_t *)g_hash_table_lookup(db->timings, sql);
+  if(!t)
+  {
+    t = (dt_database_timing_t *)g_malloc0(sizeof(dt_database_timing_t));
+    g_hash_table_insert(db->timings, g_strdup(sql), t);
+  }
+  t->count++;
+  t->nsec += nsec;
+  dt_pthread_mutex_unlock(&db->lock);
+}
+
+static gint _database_timing_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+  const dt_database_timing_t *ta = (const dt_database_timing_t *)g_hash_table_lookup((GHashTable *)data, a);
+  const dt_database_timing_t *tb = (const dt_database_timing_t *)g_hash_table_lookup((GHashTable *)data, b);
+  return ta->nsec < tb->nsec ? 1 : ta->nsec > tb->nsec ? -1 : 0;
+}
+
+static void _database_print_timings(dt_database_t *db)
+{
+  if(!db->timings) return;
+  GList *keys = g_list_sort_with_data(g_hash_table_get_keys(db->timings), _database_timing_cmp, db->timings);
+  int n = 0;
+  for(GList *k = keys; k && n < 20; k = g_list_next(k), n++)
+  {
+    const dt_database_timing_t *t = (const dt_database_timing_t *)g_hash_table_lookup(db->timings, k->data);
+    dt_print(DT_DEBUG_SQL, "[sql] %8.3f ms in %6"PRIu64" runs: %s\n", t->nsec*1e-6, t->count, (const char *)k->data);
+  }
+  g_list_free(keys);
+}
+
+/* finalizes all cached statements of the given connection */
+static void _database_drop_statements(dt_database_t *db, sqlite3 *handle)
+{
+  GHashTable *cache = (GHashTable *)g_hash_table_lookup(db->statements, handle);
+  if(!cache) return;
+  GHashTableIter it;
+  gpointer value;
+  g_hash_table_iter_init(&it, cache);
+  while(g_hash_table_iter_next(&it, NULL, &value))
+    sqlite3_finalize(((dt_database_statement_t *)value)->stmt);
+  g_hash_table_remove(db->statements, handle);
+}
+
+typedef struct dt_database_reader_t
+{
+  dt_database_t *db;
+  sqlite3 *handle;
+}
+dt_database_reader_t;
+
+static void _database_reader_close(dt_database_reader_t *reader)
+{
+  _database_drop_statements(reader->db, reader->handle);
+  sqlite3_close(reader->handle);
+  g_free(reader);
+}
+
+/* thread exit */
+static void _database_reader_destroy(void *data)
+{
+  dt_database_reader_t *reader = (dt_database_reader_t *)data;
+  dt_database_t *db = reader->db;
+  dt_pthread_mutex_lock(&db->lock);
+  db->readers = g_list_remove(db->readers, reader);
+  _database_reader_close(reader);
+  dt_pthread_mutex_unlock(&db->lock);
+}
+
 dt_database_t *dt_database_init(char *alternative)
 {
   /* migrate default database location to new default */
@@ -179,19 +287,175 @@ lock_again:
   sqlite3_exec(db->handle, "attach database ':memory:' as memory",NULL,NULL,NULL);
 
   sqlite3_exec(db->handle, "PRAGMA synchronous = OFF", NULL, NULL, NULL);
-  sqlite3_exec(db->handle, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
   sqlite3_exec(db->handle, "PRAGMA page_size = 32768", NULL, NULL, NULL);
 
+  /* with a write ahead log, readers on other connections don't block the writer and the other way around.
+     in-memory databases stay with an in-memory journal. */
+  sqlite3_stmt *stmt;
+  if(sqlite3_prepare_v2(db->handle, "PRAGMA main.journal_mode = WAL", -1, &stmt, NULL) == SQLITE_OK)
+  {
+    if(sqlite3_step(stmt) == SQLITE_ROW)
+      db->wal = !g_ascii_strcasecmp((const char *)sqlite3_column_text(stmt, 0), "wal");
+    sqlite3_finalize(stmt);
+  }
+  if(!db->wal)
+    sqlite3_exec(db->handle, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
+
+  dt_pthread_mutex_init(&db->lock, NULL);
+  dt_pthread_mutex_init(&db->transaction_mutex, NULL);
+  pthread_key_create(&db->reader_key, _database_reader_destroy);
+  db->statements = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_hash_table_destroy);
+  if(darktable.unmuted & DT_DEBUG_SQL)
+  {
+    db->timings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    sqlite3_profile(db->handle, _database_profile, db);
+  }
+
   g_free(dbname);
   return db;
 }
 
 void dt_database_destroy(const dt_database_t *db)
 {
+  dt_database_t *d = (dt_database_t *)db;
+  if(d->statements)
+  {
+    _database_print_timings(d);
+    pthread_key_delete(d->reader_key);
+    for(GList *r = d->readers; r; r = g_list_next(r))
+      _database_reader_close((dt_database_reader_t *)r->data);
+    g_list_free(d->readers);
+    _database_drop_statements(d, d->handle);
+    g_hash_table_destroy(d->statements);
+    if(d->timings) g_hash_table_destroy(d->timings);
+    dt_pthread_mutex_destroy(&d->lock);
+    dt_pthread_mutex_destroy(&d->transaction_mutex);
+  }
   sqlite3_close(db->handle);
   unlink(db->lockfile);
   g_free(db->lockfile);
-  g_free((dt_database_t *)db);
+  g_free(d);
+}
+
+sqlite3 *dt_database_get_reader(const dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  // a write transaction on the main connection isn't visible to other connections before it's committed:
+  if(!d->wal || d->transactions > 0) return d->handle;
+
+  dt_database_reader_t *reader = (dt_database_reader_t *)pthread_getspecific(d->reader_key);
+  if(reader) return reader->handle;
+
+  sqlite3 *handle = NULL;
+  if(sqlite3_open_v2(d->dbfilename, &handle, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+  {
+    fprintf(stderr, "[database] could not open a read only connection: %s\n", sqlite3_errmsg(handle));
+    sqlite3_close(handle);
+    return d->handle;
+  }
+  sqlite3_busy_timeout(handle, 1000);
+  reader = (dt_database_reader_t *)g_malloc(sizeof(dt_database_reader_t));
+  reader->db = d;
+  reader->handle = handle;
+  dt_pthread_mutex_lock(&d->lock);
+  d->readers = g_list_prepend(d->readers, reader);
+  if(d->timings) sqlite3_profile(handle, _database_profile, d);
+  dt_pthread_mutex_unlock(&d->lock);
+  pthread_setspecific(d->reader_key, reader);
+  return handle;
+}
+
+sqlite3_stmt *dt_database_prepare_cached(const dt_database_t *db, sqlite3 *handle, const char *sql)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  sqlite3_stmt *stmt = NULL;
+  dt_pthread_mutex_lock(&d->lock);
+  GHashTable *cache = (GHashTable *)g_hash_table_lookup(d->statements, handle);
+  if(!cache)
+  {
+    cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_hash_table_insert(d->statements, handle, cache);
+  }
+  dt_database_statement_t *entry = (dt_database_statement_t *)g_hash_table_lookup(cache, sql);
+  if(entry && !entry->in_use)
+  {
+    entry->in_use = TRUE;
+    dt_pthread_mutex_unlock(&d->lock);
+    return entry->stmt;
+  }
+  dt_pthread_mutex_unlock(&d->lock);
+
+  dt_print(DT_DEBUG_SQL, "[sql] prepare cached \"%s\"\n", sql);
+  if(sqlite3_prepare_v2(handle, sql, -1, &stmt, NULL) != SQLITE_OK)
+  {
+    fprintf(stderr, "[database] could not prepare `%s': %s\n", sql, sqlite3_errmsg(handle));
+    return NULL;
+  }
+  // the first one goes to the cache, if the entry is busy (recursion, other thread) this one will be finalized on release:
+  if(!entry)
+  {
+    dt_pthread_mutex_lock(&d->lock);
+    if(!g_hash_table_lookup(cache, sql))
+    {
+      entry = (dt_database_statement_t *)g_malloc(sizeof(dt_database_statement_t));
+      entry->stmt = stmt;
+      entry->in_use = TRUE;
+      g_hash_table_insert(cache, g_strdup(sql), entry);
+    }
+    dt_pthread_mutex_unlock(&d->lock);
+  }
+  return stmt;
+}
+
+void dt_database_release_statement(const dt_database_t *db, sqlite3_stmt *stmt)
+{
+  if(!stmt) return;
+  dt_database_t *d = (dt_database_t *)db;
+  dt_pthread_mutex_lock(&d->lock);
+  GHashTable *cache = (GHashTable *)g_hash_table_lookup(d->statements, sqlite3_db_handle(stmt));
+  dt_database_statement_t *entry = cache ? (dt_database_statement_t *)g_hash_table_lookup(cache, sqlite3_sql(stmt)) : NULL;
+  if(entry && entry->stmt == stmt)
+  {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    entry->in_use = FALSE;
+  }
+  else sqlite3_finalize(stmt);
+  dt_pthread_mutex_unlock(&d->lock);
+}
+
+void dt_database_start_transaction(const dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  // nested in a transaction of our own, that one commits everything:
+  if(d->transaction_depth > 0 && pthread_equal(d->transaction_owner, pthread_self()))
+  {
+    d->transaction_depth++;
+    return;
+  }
+  if(dt_pthread_mutex_trylock(&d->transaction_mutex))
+  {
+    // the thread in the transaction may have to raise a signal, and so take the gdk lock, before
+    // it gets to commit. the gui thread holds that lock, it must not keep it while waiting:
+    const int gui = darktable.gui && darktable.control &&
+                    pthread_equal(darktable.control->gui_thread, pthread_self());
+    if(gui) gdk_threads_leave();
+    dt_pthread_mutex_lock(&d->transaction_mutex);
+    if(gui) gdk_threads_enter();
+  }
+  d->transaction_owner = pthread_self();
+  d->transaction_depth = 1;
+  DT_DEBUG_SQLITE3_EXEC(d->handle, "begin", NULL, NULL, NULL);
+  __sync_lock_test_and_set(&d->transactions, 1);
+}
+
+void dt_database_release_transaction(const dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  if(--d->transaction_depth > 0) return;
+  DT_DEBUG_SQLITE3_EXEC(d->handle, "commit", NULL, NULL, NULL);
+  __sync_lock_release(&d->transactions);
+  dt_pthread_mutex_unlock(&d->transaction_mutex);
 }
 
 sqlite3 *dt_database_get(const dt_database_t *db)
@@ -33,6 +33,20 @@ gboolean dt_database_is_new(const struct dt_database_t *db);
 const gchar *dt_database_get_path(const struct dt_database_t *db);
 /** test if database was already locked by another instance */
 gboolean dt_database_get_lock_acquired(const struct dt_database_t *db);
+/** read only connection of the calling thread, so worker threads don't serialize on the main handle.
+    falls back to the main handle while a write transaction is open, or if the database isn't in wal mode. */
+struct sqlite3 *dt_database_get_reader(const struct dt_database_t *db);
+/** returns a compiled statement for sql on the given connection, from a cache keyed by the sql text.
+    hand it back with dt_database_release_statement() instead of sqlite3_finalize(). */
+struct sqlite3_stmt *dt_database_prepare_cached(const struct dt_database_t *db, struct sqlite3 *handle, const char *sql);
+/** resets the statement and puts it back into the cache. */
+void dt_database_release_statement(const struct dt_database_t *db, struct sqlite3_stmt *stmt);
+/** begin and commit a write transaction on the main connection. only one thread at a time can have
+    one open, others block in start until it is committed. calls nest on the same thread, the outermost
+    pair begins and commits. writes of other threads which don't use these still end up in the open
+    transaction, keep batches short. */
+void dt_database_start_transaction(const struct dt_database_t *db);
+void dt_database_release_transaction(const struct dt_database_t *db);
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
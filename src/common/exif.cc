@@ -767,6 +767,229 @@ int dt_exif_read_from_blob(dt_image_t *img, uint8_t *blob, const int size)
   }
 }
 
+// decode the metadata of an opened image into img. throws exiv2 exceptions if stuff goes wrong.
+static int _exif_read_image(dt_image_t *img, Exiv2::Image *image)
+{
+  bool res;
+
+  // EXIF metadata
+  Exiv2::ExifData &exifData = image->exifData();
+  res = dt_exif_read_exif_data(img, exifData);
+
+  // IPTC metadata.
+  Exiv2::IptcData &iptcData = image->iptcData();
+  res = dt_exif_read_iptc_data(img, iptcData) && res;
+
+  // XMP metadata
+  Exiv2::XmpData &xmpData = image->xmpData();
+  res = dt_exif_read_xmp_data(img, xmpData, false, true) && res;
+
+  // Initialize size - don't wait for full raw to be loaded to get this
+  // information. If use_embedded_thumbnail is set, it will take a
+  // change in development history to have this information
+  img->height = image->pixelHeight();
+  img->width = image->pixelWidth();
+
+  return res?0:1;
+}
+
+static void _exif_read_failed(dt_image_t *img, const char *path, const std::string &error)
+{
+  // at least set datetime taken to something useful in case there is no exif data in this file (pfm)
+  struct stat statbuf;
+  stat(path, &statbuf);
+  struct tm result;
+  strftime(img->exif_datetime_taken, 20, "%Y-%m-%d %H:%M:%S", localtime_r(&statbuf.st_mtime, &result));
+
+  std::cerr << "[exiv2] " << path << ": " << error << std::endl;
+}
+
+// identity of a file on disk. metadata cached for a file is only used as long as this stays the same.
+typedef struct dt_exif_file_id_t
+{
+  int64_t size, mtime, inode;
+}
+dt_exif_file_id_t;
+
+static int _exif_file_id(const char *path, dt_exif_file_id_t *id)
+{
+  struct stat statbuf;
+  if(!path || stat(path, &statbuf)) return 1;
+  id->size = statbuf.st_size;
+#ifdef __linux__
+  id->mtime = (int64_t)statbuf.st_mtim.tv_sec * 1000000000 + statbuf.st_mtim.tv_nsec;
+#else
+  id->mtime = statbuf.st_mtime;
+#endif
+  id->inode = statbuf.st_ino;
+  return 0;
+}
+
+static void _exif_bind_file_id(sqlite3_stmt *stmt, const int first, const dt_exif_file_id_t *id)
+{
+  sqlite3_bind_int64(stmt, first,   id->size);
+  sqlite3_bind_int64(stmt, first+1, id->mtime);
+  sqlite3_bind_int64(stmt, first+2, id->inode);
+}
+
+// does the image carry metadata that has more effects than filling in the exif fields of dt_image_t?
+// (tags, ratings, labels, ..). these files are always parsed on import.
+static bool _exif_embedded_metadata(Exiv2::Image *image)
+{
+  Exiv2::ExifData &exifData = image->exifData();
+  return !image->iptcData().empty() || !image->xmpData().empty() ||
+         exifData.findKey(Exiv2::ExifKey("Exif.Image.Rating")) != exifData.end() ||
+         exifData.findKey(Exiv2::ExifKey("Exif.Image.RatingPercent")) != exifData.end();
+}
+
+// check if the exif cache has the fields of this file, i.e. it didn't change since we parsed it last time.
+static int _exif_cache_valid(const char *path, const dt_exif_file_id_t *id)
+{
+  sqlite3_stmt *stmt = dt_database_prepare_cached(darktable.db, dt_database_get_reader(darktable.db),
+                       "select 1 from exif_cache where filename = ?1 and size = ?2 and mtime = ?3 "
+                       "and inode = ?4 and embedded = 0");
+  if(!stmt) return 0;
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, path, -1, SQLITE_STATIC);
+  _exif_bind_file_id(stmt, 2, id);
+  const int valid = sqlite3_step(stmt) == SQLITE_ROW;
+  dt_database_release_statement(darktable.db, stmt);
+  return valid;
+}
+
+// fill the exif fields of img from the cache. returns 0 on success.
+static int _exif_cache_read(dt_image_t *img, const char *path, const dt_exif_file_id_t *id)
+{
+  sqlite3_stmt *stmt = dt_database_prepare_cached(darktable.db, dt_database_get_reader(darktable.db),
+                       "select maker, model, lens, exposure, aperture, iso, focal_length, focus_distance, crop, "
+                       "datetime_taken, orientation, longitude, latitude, width, height, colorspace, color_matrix "
+                       "from exif_cache where filename = ?1 and size = ?2 and mtime = ?3 and inode = ?4 "
+                       "and embedded = 0");
+  if(!stmt) return 1;
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, path, -1, SQLITE_STATIC);
+  _exif_bind_file_id(stmt, 2, id);
+  int res = 1;
+  if(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const char *str;
+    str = (const char *)sqlite3_column_text(stmt, 0);
+    g_strlcpy(img->exif_maker, str ? str : "", sizeof(img->exif_maker));
+    str = (const char *)sqlite3_column_text(stmt, 1);
+    g_strlcpy(img->exif_model, str ? str : "", sizeof(img->exif_model));
+    str = (const char *)sqlite3_column_text(stmt, 2);
+    g_strlcpy(img->exif_lens, str ? str : "", sizeof(img->exif_lens));
+    img->exif_exposure = sqlite3_column_double(stmt, 3);
+    img->exif_aperture = sqlite3_column_double(stmt, 4);
+    img->exif_iso = sqlite3_column_double(stmt, 5);
+    img->exif_focal_length = sqlite3_column_double(stmt, 6);
+    img->exif_focus_distance = sqlite3_column_double(stmt, 7);
+    img->exif_crop = sqlite3_column_double(stmt, 8);
+    str = (const char *)sqlite3_column_text(stmt, 9);
+    g_strlcpy(img->exif_datetime_taken, str ? str : "", sizeof(img->exif_datetime_taken));
+    img->orientation = sqlite3_column_int(stmt, 10);
+    if(sqlite3_column_type(stmt, 11) == SQLITE_FLOAT)
+      img->longitude = sqlite3_column_double(stmt, 11);
+    if(sqlite3_column_type(stmt, 12) == SQLITE_FLOAT)
+      img->latitude = sqlite3_column_double(stmt, 12);
+    img->width = sqlite3_column_int(stmt, 13);
+    img->height = sqlite3_column_int(stmt, 14);
+    img->colorspace = (dt_image_colorspace_t)sqlite3_column_int(stmt, 15);
+    const void *color_matrix = sqlite3_column_blob(stmt, 16);
+    if(color_matrix && sqlite3_column_bytes(stmt, 16) == sizeof(img->d65_color_matrix))
+      memcpy(img->d65_color_matrix, color_matrix, sizeof(img->d65_color_matrix));
+    img->exif_inited = 1;
+    res = 0;
+  }
+  dt_database_release_statement(darktable.db, stmt);
+  return res;
+}
+
+// remember what we just parsed from the file. this has to be called on a freshly imported image,
+// so that the fields are exactly what the file gave us.
+static void _exif_cache_write(const dt_image_t *img, const char *path, const dt_exif_file_id_t *id, const bool embedded)
+{
+  sqlite3_stmt *stmt = dt_database_prepare_cached(darktable.db, dt_database_get(darktable.db),
+                       "insert or replace into exif_cache (filename, size, mtime, inode, embedded, maker, model, "
+                       "lens, exposure, aperture, iso, focal_length, focus_distance, crop, datetime_taken, "
+                       "orientation, longitude, latitude, width, height, colorspace, color_matrix) values "
+                       "(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16, ?17, ?18, ?19, ?20, "
+                       "?21, ?22)");
+  if(!stmt) return;
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, path, -1, SQLITE_STATIC);
+  _exif_bind_file_id(stmt, 2, id);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 5, embedded ? 1 : 0);
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 6, img->exif_maker, -1, SQLITE_STATIC);
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 7, img->exif_model, -1, SQLITE_STATIC);
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 8, img->exif_lens, -1, SQLITE_STATIC);
+  DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 9, img->exif_exposure);
+  DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 10, img->exif_aperture);
+  DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 11, img->exif_iso);
+  DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 12, img->exif_focal_length);
+  DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 13, img->exif_focus_distance);
+  DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 14, img->exif_crop);
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 15, img->exif_datetime_taken, -1, SQLITE_STATIC);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 16, img->orientation);
+  if(isnan(img->longitude)) sqlite3_bind_null(stmt, 17);
+  else DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 17, img->longitude);
+  if(isnan(img->latitude)) sqlite3_bind_null(stmt, 18);
+  else DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 18, img->latitude);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 19, img->width);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 20, img->height);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 21, img->colorspace);
+  if(isnan(img->d65_color_matrix[0])) sqlite3_bind_null(stmt, 22);
+  else DT_DEBUG_SQLITE3_BIND_BLOB(stmt, 22, img->d65_color_matrix, sizeof(img->d65_color_matrix), SQLITE_STATIC);
+  sqlite3_step(stmt);
+  dt_database_release_statement(darktable.db, stmt);
+}
+
+// the sidecar of this image is known to be in sync with the database if it still has the identity we saw
+// when we last read or wrote it (and the xmp data we wrote hashed to hash, if that isn't 0).
+static int _exif_xmp_cache_valid(const int imgid, const char *filename, const dt_exif_file_id_t *id, const uint64_t hash)
+{
+  sqlite3_stmt *stmt = dt_database_prepare_cached(darktable.db, dt_database_get_reader(darktable.db),
+                       "select hash from xmp_cache where imgid = ?1 and filename = ?2 and size = ?3 "
+                       "and mtime = ?4 and inode = ?5");
+  if(!stmt) return 0;
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 2, filename, -1, SQLITE_STATIC);
+  _exif_bind_file_id(stmt, 3, id);
+  int valid = 0;
+  if(sqlite3_step(stmt) == SQLITE_ROW)
+    valid = !hash || (uint64_t)sqlite3_column_int64(stmt, 0) == hash;
+  dt_database_release_statement(darktable.db, stmt);
+  return valid;
+}
+
+static void _exif_xmp_cache_write(const int imgid, const char *filename, const uint64_t hash)
+{
+  dt_exif_file_id_t id;
+  if(imgid <= 0 || _exif_file_id(filename, &id)) return;
+  sqlite3_stmt *stmt = dt_database_prepare_cached(darktable.db, dt_database_get(darktable.db),
+                       "insert or replace into xmp_cache (imgid, filename, size, mtime, inode, hash) "
+                       "values (?1, ?2, ?3, ?4, ?5, ?6)");
+  if(!stmt) return;
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 2, filename, -1, SQLITE_STATIC);
+  _exif_bind_file_id(stmt, 3, &id);
+  sqlite3_bind_int64(stmt, 6, (sqlite3_int64)hash);
+  sqlite3_step(stmt);
+  dt_database_release_statement(darktable.db, stmt);
+}
+
+// djb2, the xmp packet is only compared to what we wrote last time.
+static uint64_t _exif_xmp_hash(const std::string &packet)
+{
+  uint64_t hash = 5381;
+  for(size_t k=0; k<packet.size(); k++) hash = ((hash << 5) + hash) ^ (uint8_t)packet[k];
+  return hash;
+}
+
+int dt_exif_xmp_changed(const int imgid, const char *filename)
+{
+  dt_exif_file_id_t id;
+  if(_exif_file_id(filename, &id)) return 1;
+  return !_exif_xmp_cache_valid(imgid, filename, &id, 0);
+}
+
 /** read the metadata of an image.
  * XMP data trumps IPTC data trumps EXIF data
  */
@@ -778,40 +1001,95 @@ int dt_exif_read(dt_image_t *img, const char* path)
     image = Exiv2::ImageFactory::open(path);
     assert(image.get() != 0);
     image->readMetadata();
-    bool res;
-
-    // EXIF metadata
-    Exiv2::ExifData &exifData = image->exifData();
-    res = dt_exif_read_exif_data(img, exifData);
+    return _exif_read_image(img, image.get());
+  }
+  catch (Exiv2::AnyError& e)
+  {
+    _exif_read_failed(img, path, e.what());
+    return 1;
+  }
+}
 
-    // IPTC metadata.
-    Exiv2::IptcData &iptcData = image->iptcData();
-    res = dt_exif_read_iptc_data(img, iptcData) && res;
+// the parsed but not yet applied metadata of an image and its sidecar.
+struct dt_exif_prefetch_t
+{
+  Exiv2::Image::AutoPtr image;
+  Exiv2::Image::AutoPtr xmp;
+  std::string xmp_path;
+  std::string error;
+  dt_exif_file_id_t id;
+  bool have_id, cached;
+};
 
-    // XMP metadata
-    Exiv2::XmpData &xmpData = image->xmpData();
-    res = dt_exif_read_xmp_data(img, xmpData, false, true) && res;
+static void _exif_prefetch_image(dt_exif_prefetch_t *p, const char *path)
+{
+  try
+  {
+    p->image = Exiv2::ImageFactory::open(path);
+    assert(p->image.get() != 0);
+    p->image->readMetadata();
+  }
+  catch (Exiv2::AnyError& e)
+  {
+    p->image.reset();
+    p->error = e.what();
+  }
+}
 
-    // Initialize size - don't wait for full raw to be loaded to get this
-    // information. If use_embedded_thumbnail is set, it will take a
-    // change in development history to have this information
-    img->height = image->pixelHeight();
-    img->width = image->pixelWidth();
+dt_exif_prefetch_t *dt_exif_prefetch(const char *path, const char *xmp_path)
+{
+  dt_exif_prefetch_t *p = new dt_exif_prefetch_t;
+  // unchanged files we've seen before don't need exiv2 at all:
+  p->have_id = !_exif_file_id(path, &p->id);
+  p->cached = p->have_id && _exif_cache_valid(path, &p->id);
+  if(!p->cached) _exif_prefetch_image(p, path);
+  if(xmp_path)
+  {
+    p->xmp_path = xmp_path;
+    try
+    {
+      p->xmp = Exiv2::ImageFactory::open(xmp_path);
+      assert(p->xmp.get() != 0);
+      p->xmp->readMetadata();
+    }
+    catch (Exiv2::AnyError& e)
+    {
+      // no sidecar, same as in dt_exif_xmp_read()
+      p->xmp.reset();
+    }
+  }
+  return p;
+}
 
-    return res?0:1;
+int dt_exif_read_prefetched(dt_image_t *img, const char *path, dt_exif_prefetch_t *p)
+{
+  if(p->cached)
+  {
+    if(!_exif_cache_read(img, path, &p->id)) return 0;
+    // the entry went away in the meantime, so parse the file after all:
+    p->cached = false;
+    _exif_prefetch_image(p, path);
+  }
+  try
+  {
+    if(p->image.get())
+    {
+      const int res = _exif_read_image(img, p->image.get());
+      if(!res && p->have_id) _exif_cache_write(img, path, &p->id, _exif_embedded_metadata(p->image.get()));
+      return res;
+    }
   }
   catch (Exiv2::AnyError& e)
   {
-    // at least set datetime taken to something useful in case there is no exif data in this file (pfm)
-    struct stat statbuf;
-    stat(path, &statbuf);
-    struct tm result;
-    strftime(img->exif_datetime_taken, 20, "%Y-%m-%d %H:%M:%S", localtime_r(&statbuf.st_mtime, &result));
-
-    std::string s(e.what());
-    std::cerr << "[exiv2] " << path << ": " << s << std::endl;
-    return 1;
+    p->error = e.what();
   }
+  _exif_read_failed(img, path, p->error);
+  return 1;
+}
+
+void dt_exif_prefetch_free(dt_exif_prefetch_t *p)
+{
+  delete p;
 }
 
 int dt_exif_write_blob(uint8_t *blob,uint32_t size, const char* path)
@@ -1400,17 +1678,10 @@ static void _exif_import_tags(dt_image_t *img,Exiv2::XmpData::iterator &pos)
 }
 
 // need a write lock on *img (non-const) to write stars (and soon color labels).
-int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_only)
+static int _exif_xmp_read_data(dt_image_t *img, Exiv2::XmpData &xmpData, const int history_only)
 {
   try
   {
-    // read xmp sidecar
-    Exiv2::Image::AutoPtr image;
-    image = Exiv2::ImageFactory::open(filename);
-    assert(image.get() != 0);
-    image->readMetadata();
-    Exiv2::XmpData &xmpData = image->xmpData();
-
     sqlite3_stmt *stmt;
 
 #if 0
@@ -1677,6 +1948,36 @@ int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_o
   return 0;
 }
 
+int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_only)
+{
+  try
+  {
+    // read xmp sidecar
+    Exiv2::Image::AutoPtr image;
+    image = Exiv2::ImageFactory::open(filename);
+    assert(image.get() != 0);
+    image->readMetadata();
+    const int res = _exif_xmp_read_data(img, image->xmpData(), history_only);
+    if(!res && !history_only) _exif_xmp_cache_write(img->id, filename, 0);
+    return res;
+  }
+  catch (Exiv2::AnyError& e)
+  {
+    // actually nobody's interested in that if the file doesn't exist:
+    // std::string s(e.what());
+    // std::cerr << "[exiv2] " << s << std::endl;
+    return 1;
+  }
+}
+
+int dt_exif_xmp_read_prefetched(dt_image_t *img, dt_exif_prefetch_t *p, const int history_only)
+{
+  if(!p->xmp.get()) return 1;
+  const int res = _exif_xmp_read_data(img, p->xmp->xmpData(), history_only);
+  if(!res && !history_only) _exif_xmp_cache_write(img->id, p->xmp_path.c_str(), 0);
+  return res;
+}
+
 // helper to create an xmp data thing. throws exiv2 exceptions if stuff goes wrong.
 static void
 dt_exif_xmp_read_data(Exiv2::XmpData &xmpData, const int imgid)
@@ -2024,6 +2325,19 @@ int dt_exif_xmp_write (const int imgid, const char* filename)
 
   try
   {
+    // what we'd write from the database. if the sidecar is still what we left there last time,
+    // the merge with its foreign keys gives the same file again and we can skip reading and writing it.
+    Exiv2::XmpData dbData;
+    std::string dbPacket;
+    dt_exif_xmp_read_data(dbData, imgid);
+    if (Exiv2::XmpParser::encode(dbPacket, dbData) != 0)
+    {
+      throw Exiv2::Error(1, "[xmp_write] failed to serialize xmp data");
+    }
+    const uint64_t hash = _exif_xmp_hash(dbPacket);
+    dt_exif_file_id_t id;
+    if(!_exif_file_id(filename, &id) && _exif_xmp_cache_valid(imgid, filename, &id, hash)) return 0;
+
     Exiv2::XmpData xmpData;
     std::string xmpPacket;
     if(g_file_test(filename, G_FILE_TEST_EXISTS))
@@ -2049,6 +2363,7 @@ int dt_exif_xmp_write (const int imgid, const char* filename)
     {
       fout << xmpPacket;
       fout.close();
+      _exif_xmp_cache_write(imgid, filename, hash);
     }
     return 0;
   }
@@ -2125,12 +2440,22 @@ int dt_exif_thumbnail(
   }
 }
 
+// the xmp toolkit isn't thread safe by itself, and we parse sidecars from several threads during import.
+static dt_pthread_mutex_t _exif_xmp_mutex;
+
+static void _exif_xmp_lock(void *data, bool lock)
+{
+  if(lock) dt_pthread_mutex_lock((dt_pthread_mutex_t *)data);
+  else dt_pthread_mutex_unlock((dt_pthread_mutex_t *)data);
+}
+
 void dt_exif_init()
 {
   // mute exiv2:
   // Exiv2::LogMsg::setLevel(Exiv2::LogMsg::error);
 
-  Exiv2::XmpParser::initialize();
+  dt_pthread_mutex_init(&_exif_xmp_mutex, NULL);
+  Exiv2::XmpParser::initialize(_exif_xmp_lock, &_exif_xmp_mutex);
   // this has te stay with the old url (namespace already propagated outside dt)
   Exiv2::XmpProperties::registerNs("http://darktable.sf.net/", "darktable");
   Exiv2::XmpProperties::registerNs("http://ns.adobe.com/lightroom/1.0/", "lr");
@@ -2139,6 +2464,7 @@ void dt_exif_init()
 void dt_exif_cleanup()
 {
   Exiv2::XmpParser::terminate();
+  dt_pthread_mutex_destroy(&_exif_xmp_mutex);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
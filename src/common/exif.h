@@ -48,6 +48,24 @@ extern "C"
   /** read xmp sidecar file. */
   int dt_exif_xmp_read (dt_image_t * img, const char* filename, const int history_only);
 
+  /** returns 1 if the sidecar file changed since we last read or wrote it for this image. */
+  int dt_exif_xmp_changed(const int imgid, const char *filename);
+
+  /** metadata of an image and its xmp sidecar, parsed but not yet applied. */
+  typedef struct dt_exif_prefetch_t dt_exif_prefetch_t;
+
+  /** open and parse the metadata of the file and its sidecar (if xmp_path isn't NULL). files that didn't change since their exif
+   * fields went to the exif cache aren't opened at all. only reads from the database, so this can run in worker threads. */
+  dt_exif_prefetch_t *dt_exif_prefetch(const char *path, const char *xmp_path);
+
+  /** like dt_exif_read(), but takes the metadata from the prefetched data. */
+  int dt_exif_read_prefetched(dt_image_t *img, const char *path, dt_exif_prefetch_t *p);
+
+  /** like dt_exif_xmp_read(), but takes the sidecar from the prefetched data. */
+  int dt_exif_xmp_read_prefetched(dt_image_t *img, dt_exif_prefetch_t *p, const int history_only);
+
+  void dt_exif_prefetch_free(dt_exif_prefetch_t *p);
+
   /** load exif thumbnail (these are like 160x120) */
   int dt_exif_thumbnail (const char *filename, uint8_t *out, uint32_t width, uint32_t height, int orientation, uint32_t *wd, uint32_t *ht);
 
@@ -25,6 +25,7 @@
 #include "common/collection.h"
 #include "common/image_cache.h"
 #include "common/debug.h"
+#include "common/fswatch.h"
 #include "views/view.h"
 
 #include <stdio.h>
@@ -225,6 +226,7 @@ int dt_film_new(dt_film_t *film, const char *directory)
     return 0;
   g_strlcpy(film->dirname,directory,sizeof(film->dirname));
   film->last_loaded = 0;
+  dt_fswatch_add(darktable.fswatch, DT_FSWATCH_FILMROLL, GINT_TO_POINTER(film->id));
   return film->id;
 }
 
@@ -285,6 +287,9 @@ int dt_film_import(const char *dirname)
     return 0;
   }
 
+  /* from now on, files added to the folder are imported as they show up */
+  dt_fswatch_add(darktable.fswatch, DT_FSWATCH_FILMROLL, GINT_TO_POINTER(film->id));
+
   /* at last put import film job on queue */
   dt_job_t j;
   film->last_loaded = 0;
@@ -350,6 +355,86 @@ int _film_filename_cmp(gchar *a, gchar *b)
   return g_strcmp0(g_path_get_basename(a), g_path_get_basename(b));
 }
 
+/* an image in the import list. the worker threads check it and parse its metadata ahead of
+   the writer, which puts it into the database in list order. */
+typedef struct dt_film_import_item_t
+{
+  const gchar *filename;
+  /* already in the library, there is no need to parse its metadata */
+  gboolean known;
+  /* passed the import checks */
+  int ok;
+  dt_image_import_prefetch_t pre;
+  volatile int ready;
+}
+dt_film_import_item_t;
+
+/* number of images imported in one database transaction */
+#define DT_FILM_IMPORT_BATCH 64
+/* how many images per thread the workers may run ahead of the writer, parsed metadata isn't small */
+#define DT_FILM_IMPORT_AHEAD 8
+
+/* flags the images which are in the library already. one query per directory, images are
+   sorted by filename only so the directories can be interleaved. */
+static void _film_import_find_known(dt_film_import_item_t *items, const int total)
+{
+  GHashTable *dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_destroy);
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "select filename from images where film_id in (select id from film_rolls where folder = ?1)",
+                              -1, &stmt, NULL);
+  for(int k=0; k<total; k++)
+  {
+    gchar *cdn = g_path_get_dirname(items[k].filename);
+    GHashTable *files = g_hash_table_lookup(dirs, cdn);
+    if(!files)
+    {
+      files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+      DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, cdn, -1, SQLITE_STATIC);
+      while(sqlite3_step(stmt) == SQLITE_ROW)
+        g_hash_table_insert(files, g_strdup((const char *)sqlite3_column_text(stmt, 0)), GINT_TO_POINTER(1));
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      g_hash_table_insert(dirs, cdn, files);
+    }
+    else g_free(cdn);
+    gchar *base = g_path_get_basename(items[k].filename);
+    items[k].known = g_hash_table_lookup(files, base) != NULL;
+    g_free(base);
+  }
+  sqlite3_finalize(stmt);
+  g_hash_table_destroy(dirs);
+}
+
+static void _film_import_prefetch(dt_film_import_item_t *item)
+{
+  item->ok = dt_image_import_prefetch(&item->pre, item->filename, FALSE, !item->known);
+  __sync_synchronize();
+  item->ready = 1;
+}
+
+#if GLIB_CHECK_VERSION (2, 26, 0)
+static void _film_import_apply_gpx(dt_film_t *cfr)
+{
+  if(!cfr || !cfr->dir) return;
+  /* check if we can find a gpx data file to be auto applied
+     to images in the just imported filmroll */
+  g_dir_rewind(cfr->dir);
+  const gchar *dfn = NULL;
+  while ((dfn = g_dir_read_name(cfr->dir)) != NULL)
+  {
+    /* check if we have a gpx to be auto applied to filmroll */
+    if(strcmp(dfn+strlen(dfn)-4,".gpx") == 0 ||
+        strcmp(dfn+strlen(dfn)-4,".GPX") == 0)
+    {
+      gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, cfr->dirname, dfn, NULL);
+      dt_control_gpx_apply(gpx_file, cfr->id, dt_conf_get_string("plugins/lighttable/geotagging/tz"));
+      g_free(gpx_file);
+    }
+  }
+}
+#endif
+
 void dt_film_import1(dt_film_t *film)
 {
   gboolean recursive = dt_conf_get_bool("ui_last/import_recursive");
@@ -369,65 +454,93 @@ void dt_film_import1(dt_film_t *film)
   /* let's start import of images */
   gchar message[512] = {0};
   double fraction = 0;
-  uint32_t total = g_list_length(images);
+  const int total = g_list_length(images);
   g_snprintf(message, sizeof(message) - 1,
              ngettext("importing %d image","importing %d images", total), total);
   const guint *jid = dt_control_backgroundjobs_create(darktable.control, 0, message);
 
-  /* loop thru the images and import to current film roll */
+  dt_film_import_item_t *items = (dt_film_import_item_t *)calloc(total, sizeof(dt_film_import_item_t));
+  int k = 0;
+  for(GList *image = g_list_first(images); image; image = g_list_next(image))
+    items[k++].filename = (const gchar *)image->data;
+  _film_import_find_known(items, total);
+
+  /* thread 0 is the only one writing to the database and switching film rolls, in list order. the
+     others check the files and parse exif and xmp sidecars ahead of it. if the writer finds its next
+     image not parsed yet, it helps out instead of waiting. */
+  const int threads = MAX(1, MIN(omp_get_max_threads(), total));
+  volatile int next = 0, written = 0;
   dt_film_t *cfr = film;
-  GList *image = g_list_first(images);
-  do
-  {
-    gchar *cdn = g_path_get_dirname((const gchar *)image->data);
 
-    /* check if we need to initialize a new filmroll */
-    if(!cfr || g_strcmp0(cfr->dirname, cdn) != 0)
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(threads) if(threads > 1)
+#endif
+  {
+    if(omp_get_thread_num() == 0)
     {
-
-#if GLIB_CHECK_VERSION (2, 26, 0)
-      if(cfr && cfr->dir)
+      for(int i=0; i<total; i++)
       {
-        /* check if we can find a gpx data file to be auto applied
-           to images in the jsut imported filmroll */
-        g_dir_rewind(cfr->dir);
-        const gchar *dfn = NULL;
-        while ((dfn = g_dir_read_name(cfr->dir)) != NULL)
+        dt_film_import_item_t *item = items + i;
+        while(!item->ready)
         {
-          /* check if we have a gpx to be auto applied to filmroll */
-          if(strcmp(dfn+strlen(dfn)-4,".gpx") == 0 ||
-              strcmp(dfn+strlen(dfn)-4,".GPX") == 0)
-          {
-            gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, cfr->dirname, dfn, NULL);
-            dt_control_gpx_apply(gpx_file, cfr->id, dt_conf_get_string("plugins/lighttable/geotagging/tz"));
-            g_free(gpx_file);
-          }
+          const int j = __sync_fetch_and_add(&next, 1);
+          if(j < total) _film_import_prefetch(items + j);
+          else g_usleep(500);
         }
-      }
+        __sync_synchronize();
+
+        if(i % DT_FILM_IMPORT_BATCH == 0)
+          dt_database_start_transaction(darktable.db);
+
+        gchar *cdn = g_path_get_dirname(item->filename);
+
+        /* check if we need to initialize a new filmroll */
+        if(!cfr || g_strcmp0(cfr->dirname, cdn) != 0)
+        {
+#if GLIB_CHECK_VERSION (2, 26, 0)
+          _film_import_apply_gpx(cfr);
 #endif
 
-      /* cleanup previously imported filmroll*/
-      if(cfr && cfr!=film)
-      {
-        dt_film_cleanup(cfr);
-        g_free(cfr);
-        cfr = NULL;
-      }
+          /* cleanup previously imported filmroll*/
+          if(cfr && cfr!=film)
+          {
+            dt_film_cleanup(cfr);
+            g_free(cfr);
+            cfr = NULL;
+          }
 
-      /* initialize and create a new film to import to */
-      cfr = g_malloc(sizeof(dt_film_t));
-      dt_film_init(cfr);
-      dt_film_new(cfr, cdn);
-    }
+          /* initialize and create a new film to import to */
+          cfr = g_malloc(sizeof(dt_film_t));
+          dt_film_init(cfr);
+          dt_film_new(cfr, cdn);
+        }
+        g_free(cdn);
 
-    /* import image */
-    dt_image_import(cfr->id, (const gchar *)image->data, FALSE);
+        /* import image */
+        if(item->ok) dt_image_import_prefetched(cfr->id, &item->pre);
 
-    fraction+=1.0/total;
-    dt_control_backgroundjobs_progress(darktable.control, jid, fraction);
+        if(i % DT_FILM_IMPORT_BATCH == DT_FILM_IMPORT_BATCH - 1 || i == total - 1)
+          dt_database_release_transaction(darktable.db);
+        written = i + 1;
 
+        fraction+=1.0/total;
+        dt_control_backgroundjobs_progress(darktable.control, jid, fraction);
+      }
+    }
+    else
+    {
+      const int ahead = DT_FILM_IMPORT_AHEAD * threads;
+      while(1)
+      {
+        const int j = __sync_fetch_and_add(&next, 1);
+        if(j >= total) break;
+        while(j >= written + ahead) g_usleep(500);
+        _film_import_prefetch(items + j);
+      }
+    }
   }
-  while( (image = g_list_next(image)) != NULL);
+  free(items);
+  g_list_free_full(images, g_free);
 
   // only redraw at the end, to not spam the cpu with exposure events
   dt_control_queue_redraw_center();
@@ -437,24 +550,7 @@ void dt_film_import1(dt_film_t *film)
   dt_control_signal_raise(darktable.signals , DT_SIGNAL_FILMROLLS_IMPORTED,film->id);
 
 #if GLIB_CHECK_VERSION (2, 26, 0)
-  if(cfr && cfr->dir)
-  {
-    /* check if we can find a gpx data file to be auto applied
-       to images in the just imported filmroll */
-    g_dir_rewind(cfr->dir);
-    const gchar *dfn = NULL;
-    while ((dfn = g_dir_read_name(cfr->dir)) != NULL)
-    {
-      /* check if we have a gpx to be auto applied to filmroll */
-      if(strcmp(dfn+strlen(dfn)-4,".gpx") == 0 ||
-          strcmp(dfn+strlen(dfn)-4,".GPX") == 0)
-      {
-        gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, cfr->dirname, dfn, NULL);
-        dt_control_gpx_apply(gpx_file, cfr->id, dt_conf_get_string("plugins/lighttable/geotagging/tz"));
-        g_free(gpx_file);
-      }
-    }
-  }
+  _film_import_apply_gpx(cfr);
 #endif
 }
 
@@ -471,6 +567,7 @@ void dt_film_remove_empty()
     sqlite3_stmt *inner_stmt;
     raise_signal = TRUE;
     gint id = sqlite3_column_int(stmt, 0);
+    dt_fswatch_remove(darktable.fswatch, DT_FSWATCH_FILMROLL, GINT_TO_POINTER(id));
     DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                                 "delete from film_rolls where id=?1", -1, &inner_stmt, NULL);
     DT_DEBUG_SQLITE3_BIND_INT(inner_stmt, 1, id);
@@ -563,6 +660,20 @@ void dt_film_remove(const int id)
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, id);
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "delete from xmp_cache where imgid in "
+                              "(select id from images where film_id = ?1)", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, id);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "delete from exif_cache where filename in "
+                              "(select folder || '/' || filename from images, film_rolls "
+                              "where images.film_id = film_rolls.id and film_rolls.id = ?1)",
+                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, id);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
 
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "select id from images where film_id = ?1", -1, &stmt, NULL);
@@ -583,6 +694,7 @@ void dt_film_remove(const int id)
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
 
+  dt_fswatch_remove(darktable.fswatch, DT_FSWATCH_FILMROLL, GINT_TO_POINTER(id));
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "delete from film_rolls where id = ?1", -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, id);
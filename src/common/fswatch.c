@@ -20,17 +20,26 @@
 #endif
 
 #include "common/darktable.h"
+#include "common/collection.h"
+#include "common/database.h"
+#include "common/debug.h"
 #include "common/dtpthread.h"
+#include "common/exif.h"
 #include "common/image.h"
+#include "common/image_cache.h"
+#include "common/mipmap_cache.h"
 #include "common/fswatch.h"
-#include "develop/develop.h"
+#include "control/control.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <glib.h>
 #include <strings.h>
-#if 0//def  HAVE_INOTIFY
+#ifdef  HAVE_INOTIFY
+#include <poll.h>
 #include <sys/inotify.h>
 #endif
 
@@ -40,124 +49,463 @@ typedef struct _watch_t
   int descriptor;   // Handle
   dt_fswatch_type_t type;        // DT_FSWATCH_* type
   void *data;				// Assigned data
-  int events;				// events occurred..
+  gchar *path;      // watched directory
 } _watch_t;
 
 
-#if 0// def  HAVE_INOTIFY
+#ifdef  HAVE_INOTIFY
 
-typedef struct inotify_event_t
+// events on the film roll directories are collected per file and only applied once the directory
+// calmed down, so copying a shoot in results in one import per new file, done in batches.
+#define DT_FSWATCH_QUIET 1.0
+// a steady stream of events (a long rsync) still gets applied every few seconds:
+#define DT_FSWATCH_MAX_DELAY 10.0
+// files which were created but not closed yet are still being copied:
+#define DT_FSWATCH_QUIET_OPEN 30.0
+// files applied per transaction. the shared db handle is serialized while a transaction is open,
+// so the gui and import jobs only ever wait for this many:
+#define DT_FSWATCH_BATCH 32
+
+#define DT_FSWATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE \
+                         | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef enum _change_flags_t
+{
+  _CHANGE_CREATED = 1 << 0,   // created, but not closed yet
+  _CHANGE_WRITTEN = 1 << 1,   // contents changed, or moved in
+  _CHANGE_GONE    = 1 << 2,   // deleted, or moved out
+  _CHANGE_RESCAN  = 1 << 3    // events were lost, only check if it's still there
+}
+_change_flags_t;
+
+typedef struct _change_t
+{
+  int film_id;
+  gchar *path;
+  int flags;
+  double last;
+  // if it got here by a rename within the watched directories:
+  int moved_from_film;
+  gchar *moved_from;
+}
+_change_t;
+
+typedef struct _moved_t
+{
+  int film_id;
+  gchar *path;
+}
+_moved_t;
+
+static void _watch_free(gpointer data)
+{
+  _watch_t *item = (_watch_t *)data;
+  g_free(item->path);
+  g_free(item);
+}
+
+static void _change_free(gpointer data)
+{
+  _change_t *c = (_change_t *)data;
+  g_free(c->path);
+  g_free(c->moved_from);
+  g_free(c);
+}
+
+static void _moved_free(gpointer data)
+{
+  _moved_t *m = (_moved_t *)data;
+  g_free(m->path);
+  g_free(m);
+}
+
+static gboolean _fswatch_is_xmp(const char *name)
+{
+  const size_t len = strlen(name);
+  return len > 4 && !g_ascii_strcasecmp(name + len - 4, ".xmp");
+}
+
+// only images and their sidecars, not the temporary files of rsync and friends:
+static gboolean _fswatch_interesting(const char *name)
+{
+  return name[0] != '.' && (_fswatch_is_xmp(name) || dt_supported_image(name));
+}
+
+// the pending change for this file, takes ownership of path.
+static _change_t *_fswatch_queue(GHashTable *pending, const int film_id, gchar *path, const double now)
+{
+  _change_t *c = (_change_t *)g_hash_table_lookup(pending, path);
+  if(c)
+    g_free(path);
+  else
+  {
+    c = (_change_t *)g_malloc0(sizeof(_change_t));
+    c->path = path;
+    g_hash_table_insert(pending, c->path, c);
+  }
+  c->film_id = film_id;
+  c->last = now;
+  return c;
+}
+
+// ids of an image and its duplicates
+static GList *_fswatch_image_ids(const int film_id, const char *filename)
+{
+  GList *ids = NULL;
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "select id from images where film_id = ?1 and filename = ?2", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, film_id);
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 2, filename, -1, SQLITE_STATIC);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    ids = g_list_prepend(ids, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+  sqlite3_finalize(stmt);
+  return ids;
+}
+
+// the kernel dropped events: queue everything in the watched directories and in their film rolls,
+// applying that only imports and removes what really changed.
+static void _fswatch_rescan(dt_fswatch_t *fswatch, GHashTable *pending, const double now)
 {
-  uint32_t wd;       /* Watch descriptor */
-  uint32_t mask;     /* Mask of events */
-  uint32_t cookie;   /* Unique cookie associating related events (for rename(2)) */
-  uint32_t len;      /* Size of 'name' field */
-  char     name[];   /* Optional null-terminated name */
-} inotify_event_t;
+  GList *dirs = NULL;
+  dt_pthread_mutex_lock(&fswatch->mutex);
+  GHashTableIter it;
+  gpointer key, value;
+  g_hash_table_iter_init(&it, fswatch->items);
+  while(g_hash_table_iter_next(&it, &key, &value))
+  {
+    const _watch_t *item = (const _watch_t *)value;
+    _moved_t *d = (_moved_t *)g_malloc(sizeof(_moved_t));
+    d->film_id = GPOINTER_TO_INT(item->data);
+    d->path = g_strdup(item->path);
+    dirs = g_list_prepend(dirs, d);
+  }
+  dt_pthread_mutex_unlock(&fswatch->mutex);
 
-// Compare func for GList
-static gint _fswatch_items_by_data(const void* a,const void *b)
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "select filename from images where film_id = ?1", -1, &stmt, NULL);
+  for(GList *l = dirs; l; l = g_list_next(l))
+  {
+    const _moved_t *d = (const _moved_t *)l->data;
+    // not there, maybe unmounted: don't take that as all images being deleted.
+    GDir *dir = g_dir_open(d->path, 0, NULL);
+    if(!dir) continue;
+    const gchar *name;
+    while((name = g_dir_read_name(dir)))
+      if(_fswatch_interesting(name))
+        _fswatch_queue(pending, d->film_id, g_build_filename(d->path, name, NULL), now)->flags |= _CHANGE_RESCAN;
+    g_dir_close(dir);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, d->film_id);
+    while(sqlite3_step(stmt) == SQLITE_ROW)
+      _fswatch_queue(pending, d->film_id, g_build_filename(d->path, (const char *)sqlite3_column_text(stmt, 0), NULL),
+                     now)->flags |= _CHANGE_RESCAN;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  }
+  sqlite3_finalize(stmt);
+  g_list_free_full(dirs, _moved_free);
+}
+
+static void _fswatch_event(dt_fswatch_t *fswatch, GHashTable *pending, GHashTable *cookies,
+                           const struct inotify_event *event, const double now)
 {
-  return (((_watch_t*)a)->data<b)?-1:((((_watch_t*)a)->data==b)?0:1);
+  if(event->mask & IN_Q_OVERFLOW)
+  {
+    dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] event queue overflow, rescanning all film rolls\n");
+    _fswatch_rescan(fswatch, pending, now);
+    return;
+  }
+
+  int film_id = 0;
+  gchar *path = NULL;
+  dt_pthread_mutex_lock(&fswatch->mutex);
+  _watch_t *item = (_watch_t *)g_hash_table_lookup(fswatch->items, GINT_TO_POINTER(event->wd));
+  if(item)
+  {
+    film_id = GPOINTER_TO_INT(item->data);
+    if(event->len && !(event->mask & IN_ISDIR) && _fswatch_interesting(event->name))
+      path = g_build_filename(item->path, event->name, NULL);
+    if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+    {
+      // the directory is gone, or somewhere else now. leave its images alone, same as for unmounted drives.
+      dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] film roll %d at %s went away\n", film_id, item->path);
+      if(!(event->mask & IN_IGNORED)) inotify_rm_watch(fswatch->inotify_fd, event->wd);
+      g_hash_table_remove(fswatch->items, GINT_TO_POINTER(event->wd));
+    }
+  }
+  dt_pthread_mutex_unlock(&fswatch->mutex);
+  if(!path) return;
+
+  _change_t *c = _fswatch_queue(pending, film_id, path, now);
+  if(event->mask & IN_CREATE)
+    c->flags = (c->flags & ~_CHANGE_GONE) | _CHANGE_CREATED;
+  if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+    c->flags = (c->flags & ~(_CHANGE_CREATED | _CHANGE_GONE)) | _CHANGE_WRITTEN;
+  if(event->mask & (IN_DELETE | IN_MOVED_FROM))
+    c->flags = (c->flags & ~(_CHANGE_CREATED | _CHANGE_WRITTEN)) | _CHANGE_GONE;
+
+  if(event->mask & IN_MOVED_FROM)
+  {
+    _moved_t *m = (_moved_t *)g_malloc(sizeof(_moved_t));
+    m->film_id = film_id;
+    m->path = g_strdup(c->path);
+    g_hash_table_insert(cookies, GUINT_TO_POINTER(event->cookie), m);
+  }
+  else if(event->mask & IN_MOVED_TO)
+  {
+    _moved_t *m = (_moved_t *)g_hash_table_lookup(cookies, GUINT_TO_POINTER(event->cookie));
+    g_free(c->moved_from);
+    c->moved_from = NULL;
+    if(m)
+    {
+      c->moved_from_film = m->film_id;
+      c->moved_from = g_strdup(m->path);
+      g_hash_table_remove(cookies, GUINT_TO_POINTER(event->cookie));
+    }
+  }
+}
+
+// a sidecar was written by some other program (or another darktable): read it if it really changed.
+static void _fswatch_sidecar_changed(const int film_id, const char *path)
+{
+  // IMG_1234.CR2.xmp belongs to IMG_1234.CR2, IMG_1234_01.CR2.xmp most likely to a duplicate of it.
+  gchar *filename = g_path_get_basename(path);
+  filename[strlen(filename) - 4] = '\0';
+  GList *ids = _fswatch_image_ids(film_id, filename);
+  char *ext = strrchr(filename, '.');
+  char *version = ext ? g_strrstr_len(filename, ext - filename, "_") : NULL;
+  if(version && version + 1 < ext && strspn(version + 1, "0123456789") == (size_t)(ext - version - 1))
+  {
+    memmove(version, ext, strlen(ext) + 1);
+    ids = g_list_concat(ids, _fswatch_image_ids(film_id, filename));
+  }
+  g_free(filename);
+
+  for(GList *l = ids; l; l = g_list_next(l))
+  {
+    const int imgid = GPOINTER_TO_INT(l->data);
+    gchar xmp[DT_MAX_PATH_LEN];
+    gboolean from_cache = FALSE;
+    dt_image_full_path(imgid, xmp, DT_MAX_PATH_LEN, &from_cache);
+    dt_image_path_append_version(imgid, xmp, DT_MAX_PATH_LEN);
+    g_strlcat(xmp, ".xmp", DT_MAX_PATH_LEN);
+    // our own writes don't count as changed:
+    if(strcmp(xmp, path) || !dt_exif_xmp_changed(imgid, path)) continue;
+
+    const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, imgid);
+    dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
+    (void)dt_exif_xmp_read(img, path, 0);
+    dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+    dt_image_cache_read_release(darktable.image_cache, img);
+    // the history might be a different one now:
+    dt_mipmap_cache_remove(darktable.mipmap_cache, imgid);
+    dt_print(DT_DEBUG_FSWATCH,"[fswatch] reread sidecar %s\n", path);
+  }
+  g_list_free(ids);
 }
 
-// Compare func for GList
-static gint _fswatch_items_by_descriptor(const void *a,const void *b)
+// a file of the library was renamed, or moved to another film roll. keep history and tags
+// by updating its images instead of removing and importing it again. returns an id if it did.
+static int _fswatch_move(const _change_t *c)
 {
-  gint result=(((_watch_t*)a)->descriptor < *(const int *)b)?-1:((((_watch_t*)a)->descriptor==*(const int *)b)?0:1);
+  if(g_file_test(c->moved_from, G_FILE_TEST_EXISTS)) return 0;
+  gchar *oldname = g_path_get_basename(c->moved_from);
+  GList *ids = _fswatch_image_ids(c->moved_from_film, oldname);
+  g_free(oldname);
+  gchar *filename = g_path_get_basename(c->path);
+
+  int result = 0;
+  for(GList *l = ids; l; l = g_list_next(l))
+  {
+    const int imgid = GPOINTER_TO_INT(l->data);
+    sqlite3_stmt *stmt;
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "update images set filename = ?1 where id = ?2", -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, filename, -1, SQLITE_STATIC);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, imgid);
+    dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
+    img->film_id = c->film_id;
+    g_strlcpy(img->filename, filename, sizeof(img->filename));
+    // write through to db, and a sidecar next to the new name
+    dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_SAFE);
+    dt_image_cache_read_release(darktable.image_cache, img);
+    result = imgid;
+  }
+  if(result) dt_print(DT_DEBUG_FSWATCH,"[fswatch] moved %s to %s\n", c->moved_from, c->path);
+  g_list_free(ids);
+  g_free(filename);
   return result;
 }
 
+// brings the library up to date with the file as it is now. returns 1 if images came or went.
+static int _fswatch_apply(const _change_t *c)
+{
+  const gboolean exists = g_file_test(c->path, G_FILE_TEST_IS_REGULAR);
+  gchar *filename = g_path_get_basename(c->path);
+  if(_fswatch_is_xmp(filename))
+  {
+    g_free(filename);
+    if(exists) _fswatch_sidecar_changed(c->film_id, c->path);
+    return 0;
+  }
+  GList *ids = _fswatch_image_ids(c->film_id, filename);
+  g_free(filename);
+
+  int changed = 0;
+  if(!exists)
+  {
+    // deleted, or moved out of the film rolls we know about
+    for(GList *l = ids; l; l = g_list_next(l))
+    {
+      const int imgid = GPOINTER_TO_INT(l->data);
+      const dt_image_t *img = dt_image_cache_read_get(darktable.image_cache, imgid);
+      // the original of a local copy isn't expected to be around all the time.
+      const int local_copy = img->flags & DT_IMAGE_LOCAL_COPY;
+      dt_image_cache_read_release(darktable.image_cache, img);
+      if(local_copy) continue;
+      dt_image_remove(imgid);
+      changed = 1;
+    }
+    if(changed) dt_print(DT_DEBUG_FSWATCH,"[fswatch] removed %s\n", c->path);
+  }
+  else if(!ids)
+  {
+    int imgid = c->moved_from ? _fswatch_move(c) : 0;
+    if(!imgid && (imgid = dt_image_import(c->film_id, c->path, FALSE)))
+      dt_print(DT_DEBUG_FSWATCH,"[fswatch] imported %s\n", c->path);
+    changed = imgid != 0;
+  }
+  else if(c->flags & _CHANGE_WRITTEN)
+  {
+    // replaced or edited by some other program: forget everything which came from the old contents.
+    for(GList *l = ids; l; l = g_list_next(l))
+    {
+      const int imgid = GPOINTER_TO_INT(l->data);
+      const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, imgid);
+      dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
+      (void)dt_exif_read(img, c->path);
+      dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+      dt_image_cache_read_release(darktable.image_cache, img);
+      dt_mipmap_cache_remove_file(darktable.mipmap_cache, imgid);
+    }
+    dt_print(DT_DEBUG_FSWATCH,"[fswatch] %s changed\n", c->path);
+  }
+  g_list_free(ids);
+  return changed;
+}
+
+// applies all pending changes except for files still being written, in short transactions.
+static void _fswatch_flush(GHashTable *pending, GHashTable *cookies, const double now)
+{
+  // renames go first, so their old names are out of the library before anyone looks at them:
+  GList *moves = NULL, *others = NULL;
+  GHashTableIter it;
+  gpointer key, value;
+  g_hash_table_iter_init(&it, pending);
+  while(g_hash_table_iter_next(&it, &key, &value))
+  {
+    _change_t *c = (_change_t *)value;
+    if((c->flags & _CHANGE_CREATED) && now - c->last < DT_FSWATCH_QUIET_OPEN) continue;
+    g_hash_table_iter_steal(&it);
+    if(c->moved_from) moves = g_list_prepend(moves, c);
+    else others = g_list_prepend(others, c);
+  }
+  // a rename not completed by now left the watched directories:
+  g_hash_table_remove_all(cookies);
+  GList *ready = g_list_concat(moves, others);
+  if(!ready) return;
+
+  int changed = 0, count = 0;
+  for(GList *l = ready; l; l = g_list_next(l), count++)
+  {
+    if(count % DT_FSWATCH_BATCH == 0) dt_database_start_transaction(darktable.db);
+    changed |= _fswatch_apply((const _change_t *)l->data);
+    if(count % DT_FSWATCH_BATCH == DT_FSWATCH_BATCH - 1 || !g_list_next(l))
+      dt_database_release_transaction(darktable.db);
+  }
+  g_list_free_full(ready, _change_free);
+  dt_print(DT_DEBUG_FSWATCH,"[fswatch] applied %d changed files in %.3f secs\n", count, dt_get_wtime() - now);
+
+  if(changed)
+  {
+    dt_collection_update_query(darktable.collection);
+    dt_control_queue_redraw_center();
+  }
+}
 
 static void *_fswatch_thread(void *data)
 {
   dt_fswatch_t *fswatch=(dt_fswatch_t *)data;
-  uint32_t res=0;
-  uint32_t event_hdr_size=sizeof(inotify_event_t);
-  inotify_event_t *event_hdr=g_malloc(sizeof(inotify_event_t));
-  memset (event_hdr,0,event_hdr_size);
-  char *name=g_malloc(2048);
-  memset (name,0, 2048);
+  GHashTable *pending = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, _change_free);
+  GHashTable *cookies = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, _moved_free);
+  char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  double first = 0.0, last = 0.0;
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] Starting thread of context %p\n", data);
   while(1)
   {
-    // Blocking read loop of event fd into event
-    if(read(fswatch->inotify_fd,event_hdr,event_hdr_size) != event_hdr_size)
+    struct pollfd fds[2] = { { fswatch->inotify_fd, POLLIN, 0 }, { fswatch->wakeup[0], POLLIN, 0 } };
+    // sleep until something happens, unless there are changes to apply:
+    if(poll(fds, 2, g_hash_table_size(pending) ? 250 : -1) < 0)
     {
       if(errno == EINTR) continue;
-      perror("[fswatch_thread] read inotify fd");
+      perror("[fswatch_thread] poll");
       break;
     }
+    if(fds[1].revents) break;
 
-    // Read name into buffer if any...
-    if( event_hdr->len > 0 )
-    {
-      res=read(fswatch->inotify_fd,name,event_hdr_size);
-      name[res]='\0';
-    }
-
-    dt_pthread_mutex_lock(&fswatch->mutex);
-    GList *gitem=g_list_find_custom(fswatch->items,&event_hdr->wd,&_fswatch_items_by_descriptor);
-    if( gitem )
+    const double now = dt_get_wtime();
+    if(fds[0].revents & POLLIN)
     {
-      _watch_t *item = gitem->data;
-      item->events=item->events|event_hdr->mask;
-
-      switch( item->type )
+      const ssize_t len = read(fswatch->inotify_fd, buf, sizeof(buf));
+      if(len < 0)
       {
-        case DT_FSWATCH_IMAGE:
-        {
-          if( (event_hdr->mask&IN_CLOSE) && (item->events&IN_MODIFY) ) // Check if file modified and closed...
-          {
-            //  Something wrote on image externally and closed it, lets tag item as dirty...
-            dt_image_t *img=(dt_image_t *)item->data;
-            img->force_reimport = 1;
-            if(darktable.develop->image==img)
-              dt_dev_raw_reload(darktable.develop);
-            item->events=0;
-          }
-          else if( (event_hdr->mask&IN_ATTRIB) && (item->events&IN_DELETE_SELF) && (item->events&IN_IGNORED))
-          {
-            // This pattern showed up when another file is replacing the original...
-            dt_image_t *img=(dt_image_t *)item->data;
-            img->force_reimport = 1;
-            if(darktable.develop->image==img)
-              dt_dev_raw_reload(darktable.develop);
-            item->events=0;
-          }
-        }
+        if(errno == EINTR || errno == EAGAIN) continue;
+        perror("[fswatch_thread] read inotify fd");
         break;
-
-        default:
-          dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] Unhandled object type %d for event descriptor %ld\n", item->type, event_hdr->wd );
-          break;
       }
+      if(!g_hash_table_size(pending)) first = now;
+      for(char *p = buf; p < buf + len; )
+      {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        _fswatch_event(fswatch, pending, cookies, event, now);
+        p += sizeof(struct inotify_event) + event->len;
+      }
+      last = now;
     }
-    else
-      dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] Failed to found watch item for descriptor %ld\n", event_hdr->wd );
 
-    dt_pthread_mutex_unlock(&fswatch->mutex);
+    if(g_hash_table_size(pending) && (now - last >= DT_FSWATCH_QUIET || now - first >= DT_FSWATCH_MAX_DELAY))
+    {
+      _fswatch_flush(pending, cookies, now);
+      first = now;
+    }
   }
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] terminating.\n");
-  g_free(event_hdr);
-  g_free(name);
+  g_hash_table_destroy(pending);
+  g_hash_table_destroy(cookies);
   return NULL;
 }
 
 
-
-
-
 const dt_fswatch_t* dt_fswatch_new()
 {
-  dt_fswatch_t *fswatch=g_malloc(sizeof(dt_fswatch_t));
-  memset (fswatch, 0, sizeof(dt_fswatch_t));
-  if((fswatch->inotify_fd=inotify_init())==-1)
+  dt_fswatch_t *fswatch=g_malloc0(sizeof(dt_fswatch_t));
+  if((fswatch->inotify_fd=inotify_init1(IN_NONBLOCK | IN_CLOEXEC))==-1)
   {
     g_free(fswatch);
     return NULL;
   }
-  fswatch->items=NULL;
+  if(pipe(fswatch->wakeup))
+  {
+    close(fswatch->inotify_fd);
+    g_free(fswatch);
+    return NULL;
+  }
+  fswatch->items=g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, _watch_free);
   dt_pthread_mutex_init(&fswatch->mutex, NULL);
   pthread_create(&fswatch->thread, NULL, &_fswatch_thread, fswatch);
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_new] Creating new context %p\n", fswatch);
@@ -167,71 +515,102 @@ const dt_fswatch_t* dt_fswatch_new()
 
 void dt_fswatch_destroy(const dt_fswatch_t *fswatch)
 {
+  if(!fswatch) return;
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_destroy] Destroying context %p\n", fswatch);
   dt_fswatch_t *ctx=(dt_fswatch_t *)fswatch;
+  // changes not applied yet are dropped, a batch being applied is finished first.
+  if(write(ctx->wakeup[1], "", 1) == 1)
+    pthread_join(ctx->thread, NULL);
+  close(ctx->wakeup[0]);
+  close(ctx->wakeup[1]);
+  close(ctx->inotify_fd);
+  g_hash_table_destroy(ctx->items);
   dt_pthread_mutex_destroy(&ctx->mutex);
-  GList *item=g_list_first(fswatch->items);
-  while(item)
+  g_free(ctx);
+}
+
+static void _fswatch_add(dt_fswatch_t *ctx, dt_fswatch_type_t type, void *data, const char *path)
+{
+  const int descriptor=inotify_add_watch(ctx->inotify_fd, path, DT_FSWATCH_MASK);
+  if(descriptor < 0)
   {
-    g_free( item->data );
-    item=g_list_next(item);
+    // ENOSPC means fs.inotify.max_user_watches is too low for this library
+    dt_print(DT_DEBUG_FSWATCH,"[fswatch_add] can't watch %s: %s\n", path, strerror(errno));
+    return;
   }
-  g_list_free(fswatch->items);
-  g_free(ctx);
+  dt_pthread_mutex_lock(&ctx->mutex);
+  if(!g_hash_table_lookup(ctx->items, GINT_TO_POINTER(descriptor)))
+  {
+    _watch_t *item = g_malloc(sizeof(_watch_t));
+    item->descriptor=descriptor;
+    item->type=type;
+    item->data=data;
+    item->path=g_strdup(path);
+    g_hash_table_insert(ctx->items, GINT_TO_POINTER(descriptor), item);
+    dt_print(DT_DEBUG_FSWATCH,"[fswatch_add] Watch on object %p added on directory %s\n", data, path);
+  }
+  dt_pthread_mutex_unlock(&ctx->mutex);
 }
 
 void dt_fswatch_add(const dt_fswatch_t * fswatch,dt_fswatch_type_t type, void *data)
 {
-  char filename[DT_MAX_PATH_LEN];
-  uint32_t mask=0;
-  dt_fswatch_t *ctx=(dt_fswatch_t *)fswatch;
-  filename[0] = '\0';
+  if(!fswatch) return;
+  gchar *path = NULL;
 
   switch(type)
   {
-    case DT_FSWATCH_IMAGE:
-      mask=IN_ALL_EVENTS;
-      dt_image_full_path(((dt_image_t *)data)->id, filename, DT_MAX_PATH_LEN);
-      break;
-    case DT_FSWATCH_CURVE_DIRECTORY:
-      break;
+    case DT_FSWATCH_FILMROLL:
+    {
+      sqlite3_stmt *stmt;
+      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                  "select folder from film_rolls where id = ?1", -1, &stmt, NULL);
+      DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, GPOINTER_TO_INT(data));
+      if(sqlite3_step(stmt) == SQLITE_ROW)
+        path = g_strdup((const char *)sqlite3_column_text(stmt, 0));
+      sqlite3_finalize(stmt);
+    }
+    break;
     default:
       dt_print(DT_DEBUG_FSWATCH,"[fswatch_add] Unhandled object type %d\n",type);
       break;
   }
 
-  if(filename[0] != '\0')
-  {
-    dt_pthread_mutex_lock(&ctx->mutex);
-    _watch_t *item = g_malloc(sizeof(_watch_t));
-    item->type=type;
-    item->data=data;
-    ctx->items=g_list_append(fswatch->items, item);
-    item->descriptor=inotify_add_watch(fswatch->inotify_fd,filename,mask);
-    dt_pthread_mutex_unlock(&ctx->mutex);
-    dt_print(DT_DEBUG_FSWATCH,"[fswatch_add] Watch on object %p added on file %s\n", data,filename);
-  }
+  if(path)
+    _fswatch_add((dt_fswatch_t *)fswatch, type, data, path);
   else
     dt_print(DT_DEBUG_FSWATCH,"[fswatch_add] No watch added, failed to get related filename of object type %d\n",type);
+  g_free(path);
+}
 
+void dt_fswatch_add_film_rolls(const dt_fswatch_t *fswatch)
+{
+  if(!fswatch) return;
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "select id, folder from film_rolls", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    _fswatch_add((dt_fswatch_t *)fswatch, DT_FSWATCH_FILMROLL, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)),
+                 (const char *)sqlite3_column_text(stmt, 1));
+  sqlite3_finalize(stmt);
 }
 
 void dt_fswatch_remove(const dt_fswatch_t * fswatch,dt_fswatch_type_t type, void *data)
 {
+  if(!fswatch) return;
   dt_fswatch_t *ctx=(dt_fswatch_t *)fswatch;
   dt_pthread_mutex_lock(&ctx->mutex);
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_remove] removing watch on object %p\n", data);
-  GList *gitem=g_list_find_custom(fswatch->items,data,&_fswatch_items_by_data);
-  if( gitem )
+  GHashTableIter it;
+  gpointer key, value;
+  g_hash_table_iter_init(&it, ctx->items);
+  while(g_hash_table_iter_next(&it, &key, &value))
   {
-    _watch_t *item=gitem->data;
-    ctx->items=g_list_remove(ctx->items,item);
-    inotify_rm_watch(fswatch->inotify_fd,item->descriptor);
-    g_free(item);
+    const _watch_t *item = (const _watch_t *)value;
+    if(item->type != type || item->data != data) continue;
+    inotify_rm_watch(ctx->inotify_fd, item->descriptor);
+    g_hash_table_iter_remove(&it);
+    break;
   }
-  else
-    dt_print(DT_DEBUG_FSWATCH,"[fswatch_remove] Didn't find watch on object %p type %d\n", data,type);
-
   dt_pthread_mutex_unlock(&ctx->mutex);
 }
 
@@ -244,6 +623,7 @@ const dt_fswatch_t* dt_fswatch_new()
 void dt_fswatch_destroy(const dt_fswatch_t *fswatch) {}
 void dt_fswatch_add(const dt_fswatch_t *fswatch, dt_fswatch_type_t type, void *data) {}
 void dt_fswatch_remove(const dt_fswatch_t * fswatch, dt_fswatch_type_t type, void *data) {}
+void dt_fswatch_add_film_rolls(const dt_fswatch_t *fswatch) {}
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
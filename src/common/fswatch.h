@@ -25,20 +25,19 @@
 /** fswatch context */
 typedef struct dt_fswatch_t
 {
-  uint32_t inotify_fd;
+  int inotify_fd;
+  int wakeup[2];            // pipe, to stop the thread
   dt_pthread_mutex_t mutex;
   pthread_t thread;
-  GList *items;
+  GHashTable *items;        // watch descriptor -> watch
 }
 dt_fswatch_t;
 
 /** Types of filesystem watches. */
 typedef enum dt_fswatch_type_t
 {
-  /** watch is an image file */
-  DT_FSWATCH_IMAGE = 0,
-  /** watch is on directory for curves files << Just an test  */
-  DT_FSWATCH_CURVE_DIRECTORY,
+  /** watch is on the directory of a film roll, data is the film id. */
+  DT_FSWATCH_FILMROLL = 0,
 }
 dt_fswatch_type_t;
 
@@ -46,10 +45,12 @@ dt_fswatch_type_t;
 const dt_fswatch_t* dt_fswatch_new();
 /** cleanup and destroy fswatch context. \remarks After this point pointer at fswatch is invalid.*/
 void dt_fswatch_destroy(const dt_fswatch_t *fswatch);
-/** adds an watch of type and assign data. */
+/** adds an watch of type and assign data. adding the same film roll twice is fine. */
 void dt_fswatch_add(const dt_fswatch_t *fswatch, dt_fswatch_type_t type, void *data);
 /** removes an watch of type and assigned data. */
 void dt_fswatch_remove(const dt_fswatch_t * fswatch, dt_fswatch_type_t type, void *data);
+/** watches the directories of all film rolls in the library. */
+void dt_fswatch_add_film_rolls(const dt_fswatch_t *fswatch);
 
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
@@ -19,6 +19,9 @@
 #ifndef DT_HEAP_H
 #define DT_HEAP_H
 
+#include <stdint.h>
+#include <stdlib.h>
+
 // simple implementation of a heap/priority queue, using uint64_t as key and
 // float values to sort the elements.
 // meant to support scheduling of background jobs with priorities.
@@ -31,7 +34,7 @@ typedef struct heap_t
 }
 heap_t;
 
-heap_t *heap_init(uint32_t size)
+static inline heap_t *heap_init(uint32_t size)
 {
   heap_t *h = (heap_t *)malloc(sizeof(heap_t));
   h->keys = (uint64_t *)malloc(sizeof(uint64_t)*size);
@@ -41,34 +44,34 @@ heap_t *heap_init(uint32_t size)
   return h;
 }
 
-void heap_cleanup(heap_t *h)
+static inline void heap_cleanup(heap_t *h)
 {
   free(h->keys);
   free(h->vals);
   free(h);
 }
 
-int heap_empty(heap_t *h)
+static inline int heap_empty(heap_t *h)
 {
   return h->end == 0;
 }
 
-int heap_full(heap_t *h)
+static inline int heap_full(heap_t *h)
 {
   return h->end >= h->size;
 }
 
-static uint32_t heap_parent(uint32_t i)
+static inline uint32_t heap_parent(uint32_t i)
 {
   return (i-1)/2;
 }
 
-static uint32_t heap_child(uint32_t i, uint32_t right)
+static inline uint32_t heap_child(uint32_t i, uint32_t right)
 {
   return 2*i + 1 + right;
 }
 
-static void heap_swap(heap_t *h, uint32_t i, uint32_t j)
+static inline void heap_swap(heap_t *h, uint32_t i, uint32_t j)
 {
   uint64_t tmpi = h->keys[i];
   h->keys[i] = h->keys[j];
@@ -79,8 +82,10 @@ static void heap_swap(heap_t *h, uint32_t i, uint32_t j)
   h->vals[j] = tmpf;
 }
 
-int heap_insert(heap_t *h, uint64_t key, float val)
+// returns non-zero if the heap is full.
+static inline int heap_insert(heap_t *h, uint64_t key, float val)
 {
+  if(heap_full(h)) return 1;
   uint32_t pos = (h->end)++;
   h->keys[pos] = key;
   h->vals[pos] = val;
@@ -98,9 +103,10 @@ int heap_insert(heap_t *h, uint64_t key, float val)
       break;
     }
   }
+  return 0;
 }
 
-void heap_remove(heap_t *h, uint64_t *key, float *val)
+static inline void heap_remove(heap_t *h, uint64_t *key, float *val)
 {
   *key = h->keys[0];
   *val = h->vals[0];
@@ -473,6 +473,17 @@ void dt_image_remove(const int32_t imgid)
   if(darktable.gui && darktable.gui->expanded_group_id == old_group_id)
     darktable.gui->expanded_group_id = new_group_id;
 
+  // the exif cache is keyed by file name, keep it as long as a duplicate still uses the file.
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "delete from exif_cache where filename = "
+                              "(select folder || '/' || filename from images, film_rolls "
+                              "where images.film_id = film_rolls.id and images.id = ?1) "
+                              "and not exists (select 1 from images as a, images as b "
+                              "where b.id = ?1 and a.id != b.id and a.film_id = b.film_id "
+                              "and a.filename = b.filename)", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "delete from images where id = ?1", -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
@@ -511,6 +522,11 @@ void dt_image_remove(const int32_t imgid)
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "delete from xmp_cache where imgid = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
   // also clear all thumbnails in mipmap_cache.
   dt_mipmap_cache_remove(darktable.mipmap_cache, imgid);
 }
@@ -620,11 +636,15 @@ void dt_image_read_duplicates(const uint32_t id, const char *filename)
     }
 
     int newid = dt_image_duplicate_with_version(id, version);
-    const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, newid);
-    dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
-    (void)dt_exif_xmp_read(img, xmpfilename, 0);
-    dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
-    dt_image_cache_read_release(darktable.image_cache, img);
+    // rescanning a film roll only needs to look at the sidecars that changed:
+    if(dt_exif_xmp_changed(newid, xmpfilename))
+    {
+      const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, newid);
+      dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
+      (void)dt_exif_xmp_read(img, xmpfilename, 0);
+      dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+      dt_image_cache_read_release(darktable.image_cache, img);
+    }
 
     file_iter = g_list_next(file_iter);
   }
@@ -635,8 +655,11 @@ void dt_image_read_duplicates(const uint32_t id, const char *filename)
 }
 
 
-uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs)
+int dt_image_import_prefetch(dt_image_import_prefetch_t *pre, const char *filename, gboolean override_ignore_jpegs,
+                             gboolean read_metadata)
 {
+  pre->filename = pre->ext = NULL;
+  pre->exif = NULL;
   if(!g_file_test(filename, G_FILE_TEST_IS_REGULAR) || dt_util_get_file_size(filename) == 0)
     return 0;
   const char *cc = filename + strlen(filename);
@@ -665,23 +688,51 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
     g_free(ext);
     return 0;
   }
+  pre->filename = g_strdup(filename);
+  pre->ext = ext;
+  if(read_metadata)
+  {
+    gchar *xmpfilename = g_strconcat(filename, ".xmp", NULL);
+    pre->exif = dt_exif_prefetch(filename, xmpfilename);
+    g_free(xmpfilename);
+  }
+  return 1;
+}
+
+void dt_image_import_prefetch_cleanup(dt_image_import_prefetch_t *pre)
+{
+  if(pre->exif) dt_exif_prefetch_free(pre->exif);
+  g_free(pre->filename);
+  g_free(pre->ext);
+  pre->filename = pre->ext = NULL;
+  pre->exif = NULL;
+}
+
+uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs)
+{
+  dt_image_import_prefetch_t pre;
+  if(!dt_image_import_prefetch(&pre, filename, override_ignore_jpegs, FALSE)) return 0;
+  return dt_image_import_prefetched(film_id, &pre);
+}
+
+uint32_t dt_image_import_prefetched(const int32_t film_id, dt_image_import_prefetch_t *pre)
+{
+  const char *filename = pre->filename;
+  const char *ext = pre->ext;
   int rc;
   uint32_t id = 0;
   // select from images; if found => return
   gchar *imgfname;
   imgfname = g_path_get_basename((const gchar*)filename);
-  sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "select id from images where film_id = ?1 and filename = ?2",
-                              -1, &stmt, NULL);
+  sqlite3_stmt *stmt = dt_database_prepare_cached(darktable.db, dt_database_get(darktable.db),
+                       "select id from images where film_id = ?1 and filename = ?2");
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, film_id);
   DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 2, imgfname, strlen(imgfname), SQLITE_STATIC);
   if(sqlite3_step(stmt) == SQLITE_ROW)
   {
     id = sqlite3_column_int(stmt, 0);
+    dt_database_release_statement(darktable.db, stmt);
     g_free(imgfname);
-    sqlite3_finalize(stmt);
-    g_free(ext);
     const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, id);
     dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
     img->flags &= ~DT_IMAGE_REMOVE;
@@ -689,9 +740,10 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
     dt_image_cache_read_release(darktable.image_cache, img);
     dt_image_read_duplicates(id, filename);
     dt_image_synch_all_xmp(filename);
+    dt_image_import_prefetch_cleanup(pre);
     return id;
   }
-  sqlite3_finalize(stmt);
+  dt_database_release_statement(darktable.db, stmt);
 
   // also need to set the no-legacy bit, to make sure we get the right presets (new ones)
   uint32_t flags = dt_conf_get_int("ui_last/import_initial_rating");
@@ -702,26 +754,24 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
   }
   flags |= DT_IMAGE_NO_LEGACY_PRESETS;
   // insert dummy image entry in database
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "insert into images (id, film_id, filename, caption, description, "
-                              "license, sha1sum, flags, version, max_version) values (null, ?1, ?2, '', '', '', '', ?3, 0, 0)",
-                              -1, &stmt, NULL);
+  stmt = dt_database_prepare_cached(darktable.db, dt_database_get(darktable.db),
+                                    "insert into images (id, film_id, filename, caption, description, "
+                                    "license, sha1sum, flags, version, max_version) values (null, ?1, ?2, '', '', '', '', ?3, 0, 0)");
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, film_id);
   DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 2, imgfname, strlen(imgfname),
                              SQLITE_TRANSIENT);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 3, flags);
   rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) fprintf(stderr, "sqlite3 error %d\n", rc);
-  sqlite3_finalize(stmt);
+  dt_database_release_statement(darktable.db, stmt);
 
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "select id from images where film_id = ?1 and filename = ?2",
-                              -1, &stmt, NULL);
+  stmt = dt_database_prepare_cached(darktable.db, dt_database_get(darktable.db),
+                                    "select id from images where film_id = ?1 and filename = ?2");
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, film_id);
   DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 2, imgfname, strlen(imgfname),
                              SQLITE_STATIC);
   if(sqlite3_step(stmt) == SQLITE_ROW) id = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  dt_database_release_statement(darktable.db, stmt);
 
   // Try to find out if this should be grouped already.
   gchar *basename = g_strdup(imgfname);
@@ -805,14 +855,17 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
   img->group_id = group_id;
 
   // read dttags and exif for database queries!
-  (void) dt_exif_read(img, filename);
-  char dtfilename[DT_MAX_PATH_LEN];
-  g_strlcpy(dtfilename, filename, DT_MAX_PATH_LEN);
-  //dt_image_path_append_version(id, dtfilename, DT_MAX_PATH_LEN);
-  char *c = dtfilename + strlen(dtfilename);
-  sprintf(c, ".xmp");
-
-  int res = dt_exif_xmp_read(img, dtfilename, 0);
+  if(!pre->exif)
+  {
+    char dtfilename[DT_MAX_PATH_LEN];
+    g_strlcpy(dtfilename, filename, DT_MAX_PATH_LEN);
+    //dt_image_path_append_version(id, dtfilename, DT_MAX_PATH_LEN);
+    char *c = dtfilename + strlen(dtfilename);
+    sprintf(c, ".xmp");
+    pre->exif = dt_exif_prefetch(filename, dtfilename);
+  }
+  (void) dt_exif_read_prefetched(img, filename, pre->exif);
+  const int res = dt_exif_xmp_read_prefetched(img, pre->exif, 0);
 
   // write through to db, but not to xmp.
   dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
@@ -828,7 +881,6 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
   guint tagid = 0;
   char tagname[512];
   snprintf(tagname, 512, "darktable|format|%s", ext);
-  g_free(ext);
   dt_tag_new(tagname, &tagid);
   dt_tag_attach(tagid,id);
 
@@ -839,6 +891,7 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
   g_free(imgfname);
   g_free(basename);
   g_free(sql_pattern);
+  dt_image_import_prefetch_cleanup(pre);
 
   dt_control_signal_raise(darktable.signals,DT_SIGNAL_IMAGE_IMPORT,id);
   // the following line would look logical with new_tags_set being the return value
@@ -1259,8 +1312,7 @@ int dt_image_local_copy_reset(const int32_t imgid)
 
 void dt_image_write_sidecar_file(int imgid)
 {
-  // TODO: compute hash and don't write if not needed!
-  // write .xmp file
+  // write .xmp file, dt_exif_xmp_write() skips it if nothing changed
   if(imgid > 0 && dt_conf_get_bool("write_sidecar_files"))
   {
     gboolean from_cache = TRUE;
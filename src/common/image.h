@@ -141,6 +141,23 @@ void dt_image_print_exif(const dt_image_t *img, char *line, int len);
 void dt_image_read_duplicates(const uint32_t id, const char *filename);
 /** imports a new image from raw/etc file and adds it to the data base and image cache. */
 uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs);
+/** a file which passed the import checks, optionally with its metadata parsed already. */
+typedef struct dt_image_import_prefetch_t
+{
+  char *filename;
+  char *ext;
+  struct dt_exif_prefetch_t *exif;
+}
+dt_image_import_prefetch_t;
+/** first half of dt_image_import(): checks the file and, if read_metadata is set, parses its exif and xmp sidecar.
+    doesn't touch the data base or the image cache, so this can run in worker threads. returns 0 if the file
+    won't be imported. */
+int dt_image_import_prefetch(dt_image_import_prefetch_t *pre, const char *filename, gboolean override_ignore_jpegs,
+                             gboolean read_metadata);
+/** second half of dt_image_import(): adds the prefetched file to the data base and image cache, and releases pre. */
+uint32_t dt_image_import_prefetched(const int32_t film_id, dt_image_import_prefetch_t *pre);
+/** releases a prefetched file which won't be imported after all. */
+void dt_image_import_prefetch_cleanup(dt_image_import_prefetch_t *pre);
 /** removes the given image from the database. */
 void dt_image_remove(const int32_t imgid);
 /** duplicates the given image in the database with the duplicate getting the supplied version number. if that version
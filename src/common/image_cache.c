@@ -37,8 +37,8 @@ dt_image_cache_allocate(void *data, const uint32_t key, int32_t *cost, void **bu
   dt_image_t *img = c->images + slot;
   // load stuff from db and store in cache:
   char *str;
-  sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select id, group_id, film_id, width, height, filename, maker, model, lens, exposure, aperture, iso, focal_length, datetime_taken, flags, crop, orientation, focus_distance, raw_parameters, longitude, latitude, color_matrix, colorspace, version from images where id = ?1", -1, &stmt, NULL);
+  sqlite3 *handle = dt_database_get_reader(darktable.db);
+  sqlite3_stmt *stmt = dt_database_prepare_cached(darktable.db, handle, "select id, group_id, film_id, width, height, filename, maker, model, lens, exposure, aperture, iso, focal_length, datetime_taken, flags, crop, orientation, focus_distance, raw_parameters, longitude, latitude, color_matrix, colorspace, version from images where id = ?1");
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, key);
   if(sqlite3_step(stmt) == SQLITE_ROW)
   {
@@ -105,9 +105,9 @@ dt_image_cache_allocate(void *data, const uint32_t key, int32_t *cost, void **bu
   else
   {
     img->id = -1;
-    fprintf(stderr, "[image_cache_allocate] failed to open image %d from database: %s\n", key, sqlite3_errmsg(dt_database_get(darktable.db)));
+    fprintf(stderr, "[image_cache_allocate] failed to open image %d from database: %s\n", key, sqlite3_errmsg(handle));
   }
-  sqlite3_finalize(stmt);
+  dt_database_release_statement(darktable.db, stmt);
 
   *buf = c->images + slot;
   return 0; // no write lock required, we inited it all right here.
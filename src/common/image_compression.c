@@ -21,6 +21,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <emmintrin.h>
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
 
 typedef union
 {
@@ -29,14 +33,62 @@ typedef union
 }
 dt_image_float_int_t;
 
-void dt_image_uncompress(const uint8_t *in, float *out, const int32_t width, const int32_t height)
+// the chroma part of the bitstream, shared by both implementations:
+// 7 bits of r and b for each of the four 2x2 quads, packed into bytes 9..15.
+static inline void
+_uncompress_chroma(const uint8_t *block, float chrom[4][3])
+{
+  uint8_t r[4], b[4];
+  r[0] =                              block[ 9] >> 1;
+  b[0] = ((block[ 9] & 0x01) << 6) | (block[10] >> 2);
+  r[1] = ((block[10] & 0x03) << 5) | (block[11] >> 3);
+  b[1] = ((block[11] & 0x07) << 4) | (block[12] >> 4);
+  r[2] = ((block[12] & 0x0f) << 3) | (block[13] >> 5);
+  b[2] = ((block[13] & 0x1f) << 2) | (block[14] >> 6);
+  r[3] = ((block[14] & 0x3f) << 1) | (block[15] >> 7);
+  b[3] =   block[15] & 0x7f;
+
+  for(int q=0; q<4; q++)
+  {
+    chrom[q][0] = r[q]*(1./127.);
+    chrom[q][2] = b[q]*(1./127.);
+    chrom[q][1] = 1. - chrom[q][0] - chrom[q][2];
+  }
+}
+
+static inline int
+_clamp_coord(const int x, const int size)
+{
+  return x < size ? x : size - 1;
+}
+
+static inline void
+_quantize_chroma(const float chrom[3], uint8_t *r, uint8_t *b)
+{
+  const float norm = 1./(chrom[0] + 2*chrom[1] + chrom[2]);
+  *r = (int)(127.*(chrom[0]*norm));
+  *b = (int)(127.*(chrom[2]*norm));
+}
+
+static inline void
+_compress_chroma(uint8_t *block, const uint8_t r[4], const uint8_t b[4])
+{
+  block[ 9] = (r[0] << 1) | (b[0] >> 6);
+  block[10] = (b[0] << 2) | (r[1] >> 5);
+  block[11] = (r[1] << 3) | (b[1] >> 4);
+  block[12] = (b[1] << 4) | (r[2] >> 3);
+  block[13] = (r[2] << 5) | (b[2] >> 2);
+  block[14] = (b[2] << 6) | (r[3] >> 1);
+  block[15] = (r[3] << 7) | (b[3] >> 0);
+}
+
+void dt_image_uncompress_reference(const uint8_t *in, float *out, const int32_t width, const int32_t height)
 {
   dt_image_float_int_t L[16];
   float chrom[4][3];
   const float fac[3] = {4., 2., 4.};
   uint16_t L16[16];
   int32_t n_zeroes, Lbias;
-  uint8_t r[4], b[4];
   const uint8_t *block = in;
   for(int j=0; j<height; j+=4)
   {
@@ -58,30 +110,20 @@ void dt_image_uncompress(const uint8_t *in, float *out, const int32_t width, con
         L[k].i |= (L16[k] & 0x3ff)<<13;
       }
       // chroma
-      r[0] =                              block[ 9] >> 1;
-      b[0] = ((block[ 9] & 0x01) << 6) | (block[10] >> 2);
-      r[1] = ((block[10] & 0x03) << 5) | (block[11] >> 3);
-      b[1] = ((block[11] & 0x07) << 4) | (block[12] >> 4);
-      r[2] = ((block[12] & 0x0f) << 3) | (block[13] >> 5);
-      b[2] = ((block[13] & 0x1f) << 2) | (block[14] >> 6);
-      r[3] = ((block[14] & 0x3f) << 1) | (block[15] >> 7);
-      b[3] =   block[15] & 0x7f;
-
-      for(int q=0; q<4; q++)
-      {
-        chrom[q][0] = r[q]*(1./127.);
-        chrom[q][2] = b[q]*(1./127.);
-        chrom[q][1] = 1. - chrom[q][0] - chrom[q][2];
-      }
+      _uncompress_chroma(block, chrom);
       for(int k=0; k<16; k++)
+      {
+        // partial blocks at the right and bottom border only cover the pixels inside the image
+        if(i + (k & 3) >= width || j + (k>>2) >= height) continue;
         for(int c=0; c<3; c++)
           out[3*(i + (k & 3) + width*(j + (k>>2))) + c] = L[k].f*fac[c]*chrom[((k>>3)<<1)|((k&3)>>1)][c];
+      }
       block += 16*sizeof(uint8_t);
     }
   }
 }
 
-void dt_image_compress(const float *in, uint8_t *out, const int32_t width, const int32_t height)
+void dt_image_compress_reference(const float *in, uint8_t *out, const int32_t width, const int32_t height)
 {
   dt_image_float_int_t L[16];
   int16_t Lmin, Lmax, n_zeroes, L16[16];
@@ -99,7 +141,8 @@ void dt_image_compress(const float *in, uint8_t *out, const int32_t width, const
           for(int pi=0; pi<2; pi++)
           {
             const int io = (pi+((q&1)<<1)), jo = (pj+(q&2));
-            const int ii = i + io, jj = j + jo;
+            // partial blocks at the right and bottom border repeat the last column and row
+            const int ii = _clamp_coord(i + io, width), jj = _clamp_coord(j + jo, height);
 
             L[io+4*jo].f = (in[3*(ii+width*jj) + 0] + 2*in[3*(ii+width*jj) +1] + in[3*(ii+width*jj) +2])*.25;
             for(int k=0; k<3; k++) chrom[k] += L[io+4*jo].f*in[3*(ii+width*jj) + k];
@@ -111,9 +154,7 @@ void dt_image_compress(const float *in, uint8_t *out, const int32_t width, const
             Lmin = Lmin < L16[io+4*jo] ? Lmin : L16[io+4*jo];
           }
         }
-        const float norm = 1./(chrom[0] + 2*chrom[1] + chrom[2]);
-        r[q] = (int)(127.*(chrom[0]*norm));
-        b[q] = (int)(127.*(chrom[2]*norm));
+        _quantize_chroma(chrom, r+q, b+q);
       }
       // store luma
       Lmin &= ~0x3ff;
@@ -138,13 +179,202 @@ void dt_image_compress(const float *in, uint8_t *out, const int32_t width, const
         block[k+1] = L16[2*k+1] | (L16[2*k]<<4);
       }
       // store chroma
-      block[ 9] = (r[0] << 1) | (b[0] >> 6);
-      block[10] = (b[0] << 2) | (r[1] >> 5);
-      block[11] = (r[1] << 3) | (b[1] >> 4);
-      block[12] = (b[1] << 4) | (r[2] >> 3);
-      block[13] = (r[2] << 5) | (b[2] >> 2);
-      block[14] = (b[2] << 6) | (r[3] >> 1);
-      block[15] = (r[3] << 7) | (b[3] >> 0);
+      _compress_chroma(block, r, b);
+      block += 16*sizeof(uint8_t);
+    }
+  }
+}
+
+
+// sse2 version of one block of the decoder. in is the 16 byte block, out points to the
+// top left pixel of the 4x4 block in an image of the given width.
+static inline void
+_uncompress_block_sse2(const uint8_t *block, float *out, const int32_t width)
+{
+  float chrom[4][3];
+  const int32_t Lbias = (block[0] >> 3) << 10;
+  const int32_t n_zeroes = block[0] & 0x7;
+  const __m128i shift = _mm_cvtsi32_si128(14-n_zeroes-4+1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i lo4 = _mm_set1_epi8(0xf);
+
+  // luma: 16 nibbles, high nibble first, to 16 bit
+  const __m128i packed = _mm_loadl_epi64((const __m128i *)(block+1));
+  const __m128i nibbles = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(packed, 4), lo4), _mm_and_si128(packed, lo4));
+  const __m128i bias = _mm_set1_epi16(Lbias);
+  const __m128i L16[2] =
+  {
+    _mm_add_epi16(_mm_sll_epi16(_mm_unpacklo_epi8(nibbles, zero), shift), bias),
+    _mm_add_epi16(_mm_sll_epi16(_mm_unpackhi_epi8(nibbles, zero), shift), bias)
+  };
+
+  _uncompress_chroma(block, chrom);
+  // rgb rgb rgb rgb of one row of the block is written as three vectors:
+  const __m128 fac[3] = { _mm_setr_ps(4., 2., 4., 4.), _mm_setr_ps(2., 4., 4., 2.), _mm_setr_ps(4., 4., 2., 4.) };
+  __m128 chr[2][3];
+  for(int h=0; h<2; h++)
+  {
+    const float *qa = chrom[2*h], *qb = chrom[2*h+1];
+    chr[h][0] = _mm_setr_ps(qa[0], qa[1], qa[2], qa[0]);
+    chr[h][1] = _mm_setr_ps(qa[1], qa[2], qb[0], qb[1]);
+    chr[h][2] = _mm_setr_ps(qb[2], qb[0], qb[1], qb[2]);
+  }
+
+  const __m128i mant = _mm_set1_epi32(0x3ff);
+  const __m128i ebias = _mm_set1_epi32(127-15);
+  for(int jo=0; jo<4; jo++)
+  {
+    const __m128i l16 = (jo & 1) ? _mm_unpackhi_epi16(L16[jo>>1], zero) : _mm_unpacklo_epi16(L16[jo>>1], zero);
+    const __m128i li = _mm_or_si128(
+                         _mm_slli_epi32(_mm_add_epi32(_mm_srli_epi32(l16, 10), ebias), 23),
+                         _mm_slli_epi32(_mm_and_si128(l16, mant), 13));
+    const __m128 L = _mm_castsi128_ps(li);
+    const __m128 La = _mm_shuffle_ps(L, L, _MM_SHUFFLE(1,0,0,0));
+    const __m128 Lb = _mm_shuffle_ps(L, L, _MM_SHUFFLE(2,2,1,1));
+    const __m128 Lc = _mm_shuffle_ps(L, L, _MM_SHUFFLE(3,3,3,2));
+    float *o = out + 3*width*jo;
+    _mm_storeu_ps(o,   _mm_mul_ps(_mm_mul_ps(La, fac[0]), chr[jo>>1][0]));
+    _mm_storeu_ps(o+4, _mm_mul_ps(_mm_mul_ps(Lb, fac[1]), chr[jo>>1][1]));
+    _mm_storeu_ps(o+8, _mm_mul_ps(_mm_mul_ps(Lc, fac[2]), chr[jo>>1][2]));
+  }
+}
+
+// sse2 version of one block of the encoder, in points to the top left pixel of the block.
+static inline void
+_compress_block_sse2(const float *in, uint8_t *block, const int32_t width)
+{
+  const __m128 quarter = _mm_set1_ps(.25f);
+  const __m128i ebias = _mm_set1_epi32(127-15);
+  const __m128i mant = _mm_set1_epi32(0x3ff);
+  __m128i e[4], m[4];
+  __m128 c[4][3];
+  for(int jo=0; jo<4; jo++)
+  {
+    // deinterleave rgb rgb rgb rgb into r, g and b of the four pixels in this row:
+    const float *a = in + 3*width*jo;
+    const __m128 v0 = _mm_loadu_ps(a), v1 = _mm_loadu_ps(a+4), v2 = _mm_loadu_ps(a+8);
+    const __m128 R = _mm_shuffle_ps(_mm_shuffle_ps(v0, v0, _MM_SHUFFLE(3,3,0,0)), _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1,1,2,2)), _MM_SHUFFLE(2,0,2,0));
+    const __m128 G = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0,0,1,1)), _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2,2,3,3)), _MM_SHUFFLE(2,0,2,0));
+    const __m128 B = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1,1,2,2)), _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3,3,0,0)), _MM_SHUFFLE(2,0,2,0));
+    // same order of operations as the reference, so we get the same bits:
+    const __m128 L = _mm_mul_ps(_mm_add_ps(_mm_add_ps(R, _mm_add_ps(G, G)), B), quarter);
+    const __m128i li = _mm_castps_si128(L);
+    e[jo] = _mm_sub_epi32(_mm_srli_epi32(li, 23), ebias);
+    m[jo] = _mm_and_si128(_mm_srli_epi32(li, 13), mant);
+    c[jo][0] = _mm_mul_ps(L, R);
+    c[jo][1] = _mm_mul_ps(L, G);
+    c[jo][2] = _mm_mul_ps(L, B);
+  }
+
+  // chroma, summed over the 2x2 quads in the same order as the reference:
+  uint8_t r[4], b[4];
+  float chrom[3][4];
+  for(int k=0; k<3; k++)
+  {
+    __m128 sum = _mm_setzero_ps();
+    sum = _mm_add_ps(sum, _mm_shuffle_ps(c[0][k], c[2][k], _MM_SHUFFLE(2,0,2,0)));
+    sum = _mm_add_ps(sum, _mm_shuffle_ps(c[0][k], c[2][k], _MM_SHUFFLE(3,1,3,1)));
+    sum = _mm_add_ps(sum, _mm_shuffle_ps(c[1][k], c[3][k], _MM_SHUFFLE(2,0,2,0)));
+    sum = _mm_add_ps(sum, _mm_shuffle_ps(c[1][k], c[3][k], _MM_SHUFFLE(3,1,3,1)));
+    _mm_storeu_ps(chrom[k], sum);
+  }
+  for(int q=0; q<4; q++)
+  {
+    const float ch[3] = { chrom[0][q], chrom[1][q], chrom[2][q] };
+    _quantize_chroma(ch, r+q, b+q);
+  }
+
+  // luma as 16 bit half floats, exponent clamped to [0,30]:
+  __m128i L16[2];
+  for(int h=0; h<2; h++)
+  {
+    __m128i ex = _mm_packs_epi32(e[2*h], e[2*h+1]);
+    ex = _mm_min_epi16(_mm_max_epi16(ex, _mm_setzero_si128()), _mm_set1_epi16(30));
+    L16[h] = _mm_or_si128(_mm_packs_epi32(m[2*h], m[2*h+1]), _mm_slli_epi16(ex, 10));
+  }
+  __m128i v = _mm_min_epi16(L16[0], L16[1]);
+  v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+  v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+  v = _mm_min_epi16(v, _mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1)));
+  const int16_t Lmin = _mm_cvtsi128_si32(v) & ~0x3ff;
+  block[0] = (Lmin>>10)<<3; // Lbias
+
+  const __m128i vmin = _mm_set1_epi16(Lmin);
+  L16[0] = _mm_sub_epi16(L16[0], vmin);
+  L16[1] = _mm_sub_epi16(L16[1], vmin);
+  v = _mm_max_epi16(L16[0], L16[1]);
+  v = _mm_max_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+  v = _mm_max_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+  v = _mm_max_epi16(v, _mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1)));
+  const int16_t Lmax = _mm_cvtsi128_si32(v);
+  int n_zeroes = 0;
+  for(int k=1<<14; (k&Lmax)==0&&n_zeroes<7; k>>=1) n_zeroes++;
+  block[0] |= n_zeroes;
+
+  // quantize to 4 bits and pack two per byte, high nibble first:
+  const __m128i shift = _mm_cvtsi32_si128(14-n_zeroes-4+1);
+  const __m128i off = _mm_set1_epi16((1<<(14-n_zeroes-4+1))>>1);
+  const __m128i max = _mm_set1_epi16(0xf);
+  const __m128i q0 = _mm_min_epi16(_mm_sra_epi16(_mm_add_epi16(L16[0], off), shift), max);
+  const __m128i q1 = _mm_min_epi16(_mm_sra_epi16(_mm_add_epi16(L16[1], off), shift), max);
+  const __m128i bytes = _mm_packus_epi16(q0, q1);
+  const __m128i pairs = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(bytes, _mm_set1_epi16(0xff)), 4), _mm_srli_epi16(bytes, 8));
+  _mm_storel_epi64((__m128i *)(block+1), _mm_packus_epi16(pairs, _mm_setzero_si128()));
+
+  _compress_chroma(block, r, b);
+}
+
+void dt_image_uncompress(const uint8_t *in, float *out, const int32_t width, const int32_t height)
+{
+  const int32_t blocks_per_row = (width+3)/4;
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for(int j=0; j<height; j+=4)
+  {
+    const uint8_t *block = in + 16*(size_t)blocks_per_row*(j/4);
+    for(int i=0; i<width; i+=4)
+    {
+      if(i + 4 <= width && j + 4 <= height)
+        _uncompress_block_sse2(block, out + 3*(i + (size_t)width*j), width);
+      else
+      {
+        // the vector stores would run past the row (or the buffer): decode into a
+        // 4x4 block and copy only the pixels inside the image.
+        float tmp[4*4*3];
+        _uncompress_block_sse2(block, tmp, 4);
+        const int wd = width - i < 4 ? width - i : 4;
+        const int ht = height - j < 4 ? height - j : 4;
+        for(int jo=0; jo<ht; jo++)
+          memcpy(out + 3*(i + (size_t)width*(j+jo)), tmp + 3*4*jo, sizeof(float)*3*wd);
+      }
+      block += 16*sizeof(uint8_t);
+    }
+  }
+}
+
+void dt_image_compress(const float *in, uint8_t *out, const int32_t width, const int32_t height)
+{
+  const int32_t blocks_per_row = (width+3)/4;
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for(int j=0; j<height; j+=4)
+  {
+    uint8_t *block = out + 16*(size_t)blocks_per_row*(j/4);
+    for(int i=0; i<width; i+=4)
+    {
+      if(i + 4 <= width && j + 4 <= height)
+        _compress_block_sse2(in + 3*(i + (size_t)width*j), block, width);
+      else
+      {
+        // same padding as the reference: repeat the last column and row of the image
+        float tmp[4*4*3];
+        for(int jo=0; jo<4; jo++)
+          for(int io=0; io<4; io++)
+            memcpy(tmp + 3*(io + 4*jo), in + 3*(_clamp_coord(i+io, width) + (size_t)width*_clamp_coord(j+jo, height)), sizeof(float)*3);
+        _compress_block_sse2(tmp, block, 4);
+      }
       block += 16*sizeof(uint8_t);
     }
   }
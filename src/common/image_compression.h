@@ -16,12 +16,21 @@
     along with darktable.  If not, see <http://www.gnu.org/licenses/>.
 */
 #ifndef DT_IMAGE_COMPRESSION
+#define DT_IMAGE_COMPRESSION
 #include <inttypes.h>
 
 /** K. Roimela, T. Aarnio and J. Itäranta. High Dynamic Range Texture Compression. Proceedings of SIGGRAPH 2006. */
+/** 3 channel float codec, not built into darktable at the moment: nothing calls it, and the DT_MIPMAP_F
+    buffers are 4 channel floats which are handed to the pixelpipe directly. only src/tests/image_compression uses it. */
+/** 4x4 blocks of 16 bytes each, sse2 and parallel over block rows. the output holds (width+3)/4 * (height+3)/4 blocks,
+    partial blocks at the right and bottom border repeat the last column and row of the image. */
 void dt_image_compress(const float *in, uint8_t *out, const int32_t width, const int32_t height);
 void dt_image_uncompress(const uint8_t *in, float *out, const int32_t width, const int32_t height);
 
+/** plain single threaded reference implementation, produces the same bitstream. */
+void dt_image_compress_reference(const float *in, uint8_t *out, const int32_t width, const int32_t height);
+void dt_image_uncompress_reference(const uint8_t *in, float *out, const int32_t width, const int32_t height);
+
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
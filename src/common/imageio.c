@@ -59,6 +59,9 @@
 #include <string.h>
 #include <strings.h>
 #include <glib/gstdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 // load a full-res thumbnail:
@@ -168,6 +171,169 @@ dt_imageio_flip_buffers(char *out, const char *in, const size_t bpp, const int w
   }
 }
 
+void
+dt_imageio_flip_buffers_scale_ui16(uint16_t *out, const uint16_t *in, const int black[4], const int white, const int offx, const int offy, const int wd, const int ht, const int fwd, const int fht, const int stride, const int orientation)
+{
+  // same fixed point arithmetic and dither as rawspeed's scaleValues(), but writing the rotated
+  // result directly, so the raw is only touched once after decoding. rawspeed picks its sse2
+  // variant for app_scale < 63, which has a 10 bit fraction and a different dither, so we do the
+  // same to get identical raw values. both depend on the position of the crop inside the sensor.
+  const int black0 = black[(offx&1) ^ ((offy&1)<<1)];
+  const float app_scale = 65535.0f / (white - black0);
+  const int64_t full_scale_fp = (int)(app_scale * 4.0f);
+  const int64_t half_scale_fp = (int)(app_scale * 4095.0f);
+  // per row parity: black and 10 bit multiplier of the even and odd sensor columns, packed like rawspeed does.
+  uint32_t sub2[2] = { 0 }, mul2[2] = { 0 };
+#ifdef __SSE2__
+  const int sse2 = app_scale < 63;
+  for(int r=0; r<2; r++)
+  {
+    const int be = black[2*r], bo = black[2*r+1];
+    sub2[r] = be | (bo << 16);
+    mul2[r] = (int)(1024.0f * 65535.0f / (float)(white - be));
+    mul2[r] |= (uint32_t)(int)(1024.0f * 65535.0f / (float)(white - bo)) << 16;
+  }
+#endif
+  int64_t mul[4];
+  for(int k=0; k<4; k++) mul[k] = (int64_t)(16384.0f * 65535.0f / (float)(white - black[k]));
+
+  int ii = 0, jj = 0;
+  int si = 1, sj = wd;
+  if(orientation & 4)
+  {
+    sj = 1;
+    si = ht;
+  }
+  if(orientation & 2)
+  {
+    jj = (int)fht - jj - 1;
+    sj = -sj;
+  }
+  if(orientation & 1)
+  {
+    ii = (int)fwd - ii - 1;
+    si = -si;
+  }
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static) default(none) shared(in, out, jj, ii, sj, si, black, mul, sub2, mul2)
+#endif
+  for(int j=0; j<ht; j++)
+  {
+    uint16_t *out2 = out + (size_t)abs(sj)*jj + (size_t)abs(si)*ii + (ptrdiff_t)sj*j;
+    const uint16_t *in2 = in + (size_t)stride*j;
+#ifdef __SSE2__
+    if(sse2)
+    {
+      // rawspeed runs over whole 8 pixel groups of the uncropped row, with one random state per row.
+      const uint16_t *row = in2 - offx;
+      const __m128i sub = _mm_set1_epi32(sub2[j&1]);
+      const __m128i scale = _mm_set1_epi32(mul2[j&1]);
+      const __m128i round = _mm_set1_epi32(512);
+      const __m128i sub16 = _mm_set1_epi32(32768);
+      const __m128i sign = _mm_set1_epi32(0x80008000);
+      const __m128i sse_full_scale_fp = _mm_set1_epi32(full_scale_fp | (full_scale_fp << 16));
+      const __m128i sse_half_scale_fp = _mm_set1_epi32(half_scale_fp >> 4);
+      const __m128i rand_mul = _mm_set1_epi32(0x4d9f1d32);
+      const __m128i rand_mask = _mm_set1_epi32(0x00ff00ff);
+      const __m128i zero = _mm_setzero_si128();
+      __m128i random = _mm_set_epi32((uint32_t)wd*1676u + (uint32_t)j*18000u, (uint32_t)wd*2342u + (uint32_t)j*34311u,
+                                     (uint32_t)wd*4272u + (uint32_t)j*12123u, (uint32_t)wd*1234u + (uint32_t)j*23464u);
+      const int g1 = (offx + wd + 7) / 8;
+      for(int g=0; g<g1; g++)
+      {
+        random = _mm_xor_si128(_mm_mulhi_epi16(random, rand_mul), _mm_mullo_epi16(random, rand_mul));
+        const int x0 = 8*g;
+        if(x0 + 8 <= offx) continue;
+
+        __m128i pix_low = _mm_loadu_si128((const __m128i *)(row + x0));
+        pix_low = _mm_subs_epu16(pix_low, sub);
+        __m128i pix_high = _mm_mulhi_epu16(pix_low, scale);
+        const __m128i temp = _mm_mullo_epi16(pix_low, scale);
+        pix_low = _mm_add_epi32(_mm_unpacklo_epi16(temp, pix_high), round);
+        pix_high = _mm_add_epi32(_mm_unpackhi_epi16(temp, pix_high), round);
+        const __m128i rand_masked = _mm_mullo_epi16(_mm_and_si128(random, rand_mask), sse_full_scale_fp);
+        pix_low = _mm_add_epi32(pix_low, _mm_sub_epi32(sse_half_scale_fp, _mm_unpacklo_epi16(rand_masked, zero)));
+        pix_high = _mm_add_epi32(pix_high, _mm_sub_epi32(sse_half_scale_fp, _mm_unpackhi_epi16(rand_masked, zero)));
+        pix_low = _mm_sub_epi32(_mm_srai_epi32(pix_low, 10), sub16);
+        pix_high = _mm_sub_epi32(_mm_srai_epi32(pix_high, 10), sub16);
+        uint16_t px[8] __attribute__((aligned(16)));
+        _mm_store_si128((__m128i *)px, _mm_xor_si128(_mm_packs_epi32(pix_low, pix_high), sign));
+
+        const int k0 = MAX(offx - x0, 0), k1 = MIN(offx + wd - x0, 8);
+        for(int k=k0; k<k1; k++) out2[(ptrdiff_t)si*(x0 + k - offx)] = px[k];
+      }
+      continue;
+    }
+#endif
+    const int *b = black + 2*(j&1);
+    const int64_t *m = mul + 2*(j&1);
+    int v = wd + j * 36969;
+    for(int i=0; i<wd; i++)
+    {
+      v = 18000 * (v & 65535) + (v >> 16);
+      const int64_t rand = half_scale_fp - full_scale_fp * (v & 2047);
+      const int64_t px = ((in2[i] - b[i&1]) * m[i&1] + 8192 + rand) >> 14;
+      *out2 = CLAMPS(px, 0, 0xffff);
+      out2 += si;
+    }
+  }
+}
+
+void
+dt_imageio_flip_buffers_bin_ui16_to_float(float *out, const uint16_t *in, const float black[4], const float white, const uint32_t filters, const int wd, const int ht, const int stride, const int orientation)
+{
+  // every 2x2 bayer block becomes one rgb pixel, the two greens are averaged:
+  const int bw = wd/2, bh = ht/2;
+  float scale[4];
+  int c[4];
+  for(int k=0; k<4; k++)
+  {
+    scale[k] = 1.0f/(white - black[k]);
+    c[k] = filters >> ((((k>>1) << 1 & 14) + (k & 1)) << 1) & 3;
+    // the second green of an rggb pattern is reported as channel 3:
+    if(c[k] == 3) c[k] = 1;
+  }
+  int ii = 0, jj = 0;
+  int si = 4, sj = bw*4;
+  if(orientation & 4)
+  {
+    sj = 4;
+    si = bh*4;
+  }
+  if(orientation & 2)
+  {
+    jj = (int)bh - jj - 1;
+    sj = -sj;
+  }
+  if(orientation & 1)
+  {
+    ii = (int)bw - ii - 1;
+    si = -si;
+  }
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static) default(none) shared(in, out, jj, ii, sj, si, black, scale, c)
+#endif
+  for(int j=0; j<bh; j++)
+  {
+    float *out2 = out + (size_t)abs(sj)*jj + (size_t)abs(si)*ii + (ptrdiff_t)sj*j;
+    const uint16_t *in2 = in + (size_t)stride*2*j;
+    for(int i=0; i<bw; i++)
+    {
+      float px[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+      for(int k=0; k<4; k++)
+      {
+        const float v = (in2[(k>>1)*stride + 2*i + (k&1)] - black[k])*scale[k];
+        px[c[k]] += CLAMPS(v, 0.0f, 1.0f);
+      }
+      out2[0] = px[0];
+      out2[1] = 0.5f*px[1];
+      out2[2] = px[2];
+      out2[3] = 0.0f;
+      out2 += si;
+    }
+  }
+}
+
 void
 dt_imageio_flip_buffers_ui16_to_float(float *out, const uint16_t *in, const float black, const float white, const int ch, const int wd, const int ht, const int fwd, const int fht, const int stride, const int orientation)
 {
@@ -588,10 +754,22 @@ int dt_imageio_export_with_flags(
   dt_develop_t dev;
   dt_dev_init(&dev, 0);
   dt_mipmap_buffer_t buf;
+  // low quality thumbnails are always made from the demosaiced mipf. the others only reuse it if it's
+  // around anyways, since it comes from a binned raw now. we check below whether it's large enough.
+  int reuse_mipf = 0;
   if(thumbnail_export && dt_conf_get_bool("plugins/lighttable/low_quality_thumbnails"))
     dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_F, DT_MIPMAP_BLOCKING);
   else
-    dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
+  {
+    if(thumbnail_export)
+    {
+      dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_F, DT_MIPMAP_TESTLOCK);
+      if(buf.buf && buf.width > 0 && buf.height > 0) reuse_mipf = 1;
+      else dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+    }
+    if(!reuse_mipf)
+      dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
+  }
   dt_dev_load_image(&dev, imgid);
   const dt_image_t *img = &dev.image_storage;
   const int wd = img->width;
@@ -666,10 +844,34 @@ int dt_imageio_export_with_flags(
     }
   }
 
+  pipe.downsampled_input = reuse_mipf;
   dt_dev_pixelpipe_set_input(&pipe, &dev, (float *)buf.buf, buf.width, buf.height, 1.0);
   dt_dev_pixelpipe_create_nodes(&pipe, &dev);
   dt_dev_pixelpipe_synch_all(&pipe, &dev);
   dt_dev_pixelpipe_get_dimensions(&pipe, &dev, pipe.iwidth, pipe.iheight, &pipe.processed_width, &pipe.processed_height);
+  // mipf dimensions are truncated, allow for one pixel less than what was asked for:
+  if(reuse_mipf &&
+     (format_params->max_width  == 0 || pipe.processed_width  + 1 < format_params->max_width) &&
+     (format_params->max_height == 0 || pipe.processed_height + 1 < format_params->max_height))
+  {
+    // cropped (or the thumbnail is larger than mipf), we would have to upscale. start over with the full buffer:
+    dt_dev_pixelpipe_cleanup_nodes(&pipe);
+    dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+    dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
+    if(!buf.buf)
+    {
+      dt_control_log(_("image `%s' is not available!"), img->filename);
+      dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+      dt_dev_pixelpipe_cleanup(&pipe);
+      dt_dev_cleanup(&dev);
+      return 1;
+    }
+    pipe.downsampled_input = 0;
+    dt_dev_pixelpipe_set_input(&pipe, &dev, (float *)buf.buf, buf.width, buf.height, 1.0);
+    dt_dev_pixelpipe_create_nodes(&pipe, &dev);
+    dt_dev_pixelpipe_synch_all(&pipe, &dev);
+    dt_dev_pixelpipe_get_dimensions(&pipe, &dev, pipe.iwidth, pipe.iheight, &pipe.processed_width, &pipe.processed_height);
+  }
   if(filter)
   {
     if(!strncmp(filter, "pre:", 4))
@@ -897,6 +1099,30 @@ dt_imageio_open(
   return ret;
 }
 
+dt_imageio_retval_t
+dt_imageio_open_half_size(
+  dt_image_t  *img,
+  const char  *filename,
+  float      **buf,
+  int         *width,
+  int         *height)
+{
+  *buf = NULL;
+  if(!g_file_test(filename, G_FILE_TEST_IS_REGULAR))
+    return !DT_IMAGEIO_OK;
+
+  // no mosaic to bin in these, and they are cheap to load anyways:
+  if(dt_imageio_is_ldr(filename) || dt_imageio_is_hdr(filename))
+    return DT_IMAGEIO_FILE_CORRUPTED;
+
+  dt_imageio_retval_t ret = DT_IMAGEIO_FILE_CORRUPTED;
+#ifdef HAVE_RAWSPEED
+  ret = dt_imageio_open_rawspeed_half_size(img, filename, buf, width, height);
+#endif
+  // libraw and the other loaders only provide the full buffer.
+  return ret;
+}
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
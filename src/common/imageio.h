@@ -49,6 +49,10 @@ dt_imageio_retval_t dt_imageio_open_raw(dt_image_t *img, const char *filename, d
 dt_imageio_retval_t dt_imageio_open_ldr(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a);
 // try both, first libraw.
 dt_imageio_retval_t dt_imageio_open(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a);
+// reduced resolution load for previews: bins the raw mosaic into a dt_alloc_align'ed, oriented float4
+// buffer of half the size. img gets the full dimensions as with dt_imageio_open(). fails for everything
+// that can't be loaded this way, the caller has to fall back to the full buffer then.
+dt_imageio_retval_t dt_imageio_open_half_size(dt_image_t *img, const char *filename, float **buf, int *width, int *height);
 
 struct dt_imageio_module_format_t;
 struct dt_imageio_module_data_t;
@@ -87,6 +91,11 @@ dt_imageio_flip_buffers(
   const int stride,
   const int orientation);
 
+// subtract per-cfa black levels, scale to white and flip in one pass. stride is in pixels, offx/offy is
+// the position of in on the uncropped sensor, which rawspeed's dither depends on.
+void dt_imageio_flip_buffers_scale_ui16(uint16_t *out, const uint16_t *in, const int black[4], const int white, const int offx, const int offy, const int wd, const int ht, const int fwd, const int fht, const int stride, const int orientation);
+// bin each 2x2 block of a bayer mosaic into one float4 pixel with black/white scaling, and flip. stride is in pixels.
+void dt_imageio_flip_buffers_bin_ui16_to_float(float *out, const uint16_t *in, const float black[4], const float white, const uint32_t filters, const int wd, const int ht, const int stride, const int orientation);
 void dt_imageio_flip_buffers_ui16_to_float(float *out, const uint16_t *in, const float black, const float white, const int ch, const int wd, const int ht, const int fwd, const int fht, const int stride, const int orientation);
 void dt_imageio_flip_buffers_ui8_to_float(float *out, const uint8_t *in, const float black, const float white, const int ch, const int wd, const int ht, const int fwd, const int fht, const int stride, const int orientation);
 
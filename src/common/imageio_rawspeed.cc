@@ -44,7 +44,8 @@ int
 rawspeed_get_number_of_processor_cores()
 {
 #ifdef _OPENMP
-  return omp_get_num_procs();
+  // honour -t, the decoder's slice and band threads share the cores with our own omp loops
+  return omp_get_max_threads();
 #else
   return 1;
 #endif
@@ -55,35 +56,10 @@ using namespace RawSpeed;
 dt_imageio_retval_t dt_imageio_open_rawspeed_sraw(dt_image_t *img, RawImage r, dt_mipmap_cache_allocator_t a);
 static CameraMetaData *meta = NULL;
 
-#if 0
-static void
-scale_black_white(uint16_t *const buf, const uint16_t black, const uint16_t white, const int width, const int height, const int stride)
+// decodes the mosaic and applies the camera metadata, throws if anything goes wrong.
+static RawImage
+_rawspeed_decode(const char *filename)
 {
-  const float scale = 65535.0f/(white-black);
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
-#endif
-  for(int j=0; j<height; j++)
-  {
-    uint16_t *b = buf + j*stride;
-    for(int i=0; i<width; i++)
-    {
-      b[0] = CLAMPS((b[0] - black)*scale, 0, 0xffff);
-      b++;
-    }
-  }
-}
-#endif
-
-dt_imageio_retval_t
-dt_imageio_open_rawspeed(
-  dt_image_t  *img,
-  const char  *filename,
-  dt_mipmap_cache_allocator_t a)
-{
-  if(!img->exif_inited)
-    (void) dt_exif_read(img, filename);
-
 #ifdef __WIN32__
   const size_t len = strlen(filename) + 1;
   wchar_t filen[len];
@@ -95,43 +71,90 @@ dt_imageio_open_rawspeed(
   FileReader f(filen);
 #endif
 
-  std::auto_ptr<RawDecoder> d;
-  std::auto_ptr<FileMap> m;
-
-  try
+  /* Load rawspeed cameras.xml meta file once */
+  if(meta == NULL)
   {
-    /* Load rawspeed cameras.xml meta file once */
+    dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
     if(meta == NULL)
     {
-      dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-      if(meta == NULL)
-      {
-        char datadir[1024], camfile[1024];
-        dt_loc_get_datadir(datadir, 1024);
-        snprintf(camfile, 1024, "%s/rawspeed/cameras.xml", datadir);
-        // never cleaned up (only when dt closes)
-        meta = new CameraMetaData(camfile);
-      }
-      dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+      char datadir[1024], camfile[1024];
+      dt_loc_get_datadir(datadir, 1024);
+      snprintf(camfile, 1024, "%s/rawspeed/cameras.xml", datadir);
+      // never cleaned up (only when dt closes)
+      meta = new CameraMetaData(camfile);
     }
+    dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  }
 
-    m = auto_ptr<FileMap>(f.readFile());
+  /* the auto pointers free the file and decoder on return, the image is reference counted */
+  std::auto_ptr<FileMap> m(f.readFile());
 
-    RawParser t(m.get());
-    d = auto_ptr<RawDecoder>(t.getDecoder());
+  RawParser t(m.get());
+  std::auto_ptr<RawDecoder> d(t.getDecoder());
 
-    if(!d.get())
-      return DT_IMAGEIO_FILE_CORRUPTED;
+  if(!d.get())
+    ThrowRDE("no decoder for this file");
+
+  d->failOnUnknown = true;
+  d->checkSupport(meta);
+  d->decodeRaw();
+  d->decodeMetaData(meta);
+  return d->mRaw;
+}
 
-    d->failOnUnknown = true;
-    d->checkSupport(meta);
-    d->decodeRaw();
-    d->decodeMetaData(meta);
-    RawImage r = d->mRaw;
+// fetches black and white of a 16-bit mosaic, black levels aligned with the cropped data.
+// returns 0 if nothing has to be scaled any more, the black levels had to be estimated from
+// the pixels in that case and rawspeed scaled them in place.
+static int
+_rawspeed_black_white(RawImage &r, int black[4], int *white)
+{
+  if((r->blackAreas.empty() && r->blackLevelSeparate[0] < 0 && r->blackLevel < 0) || r->whitePoint >= 65536)
+  {
+    r->scaleBlackWhite();
+    return 0;
+  }
+  if((r->blackAreas.empty() && r->blackLevel == 0 && r->whitePoint == 65535 && r->blackLevelSeparate[0] < 0)
+     || r->dim.area() <= 0)
+    return 0;
+
+  if(r->blackLevelSeparate[0] < 0) r->calculateBlackAreas();
+  // black levels are given relative to the uncropped sensor:
+  const iPoint2D off = r->getCropOffset();
+  for(int k=0; k<4; k++) black[k] = r->blackLevelSeparate[k ^ (off.x&1) ^ ((off.y&1)<<1)];
+  *white = r->whitePoint;
+  return 1;
+}
+
+static void
+_rawspeed_set_flags(dt_image_t *img, RawImage &r)
+{
+  img->bpp = r->getBpp();
+  img->filters = r->cfa.getDcrawFilter();
+  if(img->filters)
+  {
+    img->flags &= ~DT_IMAGE_LDR;
+    img->flags |= DT_IMAGE_RAW;
+    if(r->getDataType() == TYPE_FLOAT32) img->flags |= DT_IMAGE_HDR;
+  }
 
-    /* free auto pointers on spot */
-    d.reset();
-    m.reset();
+  // also include used override in orient:
+  const int orientation = dt_image_orientation(img);
+  img->width  = (orientation & 4) ? r->dim.y : r->dim.x;
+  img->height = (orientation & 4) ? r->dim.x : r->dim.y;
+}
+
+dt_imageio_retval_t
+dt_imageio_open_rawspeed(
+  dt_image_t  *img,
+  const char  *filename,
+  dt_mipmap_cache_allocator_t a)
+{
+  if(!img->exif_inited)
+    (void) dt_exif_read(img, filename);
+
+  try
+  {
+    RawImage r = _rawspeed_decode(filename);
 
     img->filters = 0;
     if( !r->isCFA )
@@ -140,28 +163,25 @@ dt_imageio_open_rawspeed(
       return ret;
     }
 
-    // only scale colors for sizeof(uint16_t) per pixel, not sizeof(float)
-    // if(r->getDataType() != TYPE_FLOAT32) scale_black_white((uint16_t *)r->getData(), r->blackLevel, r->whitePoint, r->dim.x, r->dim.y, r->pitch/r->getBpp());
-    if(r->getDataType() != TYPE_FLOAT32) r->scaleBlackWhite();
-    img->bpp = r->getBpp();
-    img->filters = r->cfa.getDcrawFilter();
-    if(img->filters)
-    {
-      img->flags &= ~DT_IMAGE_LDR;
-      img->flags |= DT_IMAGE_RAW;
-      if(r->getDataType() == TYPE_FLOAT32) img->flags |= DT_IMAGE_HDR;
-    }
-
-    // also include used override in orient:
+    // only scale colors for sizeof(uint16_t) per pixel, not sizeof(float).
+    // if black and white are known, this is done while copying into the cache buffer below.
+    int black[4], white = 65535;
+    const int scale = r->getDataType() != TYPE_FLOAT32 && _rawspeed_black_white(r, black, &white);
+    _rawspeed_set_flags(img, r);
     const int orientation = dt_image_orientation(img);
-    img->width  = (orientation & 4) ? r->dim.y : r->dim.x;
-    img->height = (orientation & 4) ? r->dim.x : r->dim.y;
 
     void *buf = dt_mipmap_cache_alloc(img, DT_MIPMAP_FULL, a);
     if(!buf)
       return DT_IMAGEIO_CACHE_FULL;
 
-    dt_imageio_flip_buffers((char *)buf, (char *)r->getData(), r->getBpp(), r->dim.x, r->dim.y, r->dim.x, r->dim.y, r->pitch, orientation);
+    if(scale)
+    {
+      const iPoint2D off = r->getCropOffset();
+      dt_imageio_flip_buffers_scale_ui16((uint16_t *)buf, (const uint16_t *)r->getData(), black, white, off.x, off.y,
+                                         r->dim.x, r->dim.y, r->dim.x, r->dim.y, r->pitch/sizeof(uint16_t), orientation);
+    }
+    else
+      dt_imageio_flip_buffers((char *)buf, (char *)r->getData(), r->getBpp(), r->dim.x, r->dim.y, r->dim.x, r->dim.y, r->pitch, orientation);
   }
   catch (const std::exception &exc)
   {
@@ -180,6 +200,58 @@ dt_imageio_open_rawspeed(
   return DT_IMAGEIO_OK;
 }
 
+dt_imageio_retval_t
+dt_imageio_open_rawspeed_half_size(
+  dt_image_t  *img,
+  const char  *filename,
+  float      **buf,
+  int         *width,
+  int         *height)
+{
+  if(!img->exif_inited)
+    (void) dt_exif_read(img, filename);
+
+  *buf = NULL;
+  try
+  {
+    RawImage r = _rawspeed_decode(filename);
+
+    // only plain 16-bit bayer data can be binned, everything else goes the full way:
+    const uint32_t filters = r->isCFA ? r->cfa.getDcrawFilter() : 0;
+    if(!filters || r->getDataType() == TYPE_FLOAT32 || r->dim.x < 2 || r->dim.y < 2)
+      return DT_IMAGEIO_FILE_CORRUPTED;
+
+    int iblack[4] = { 0, 0, 0, 0 }, iwhite = 65535;
+    _rawspeed_black_white(r, iblack, &iwhite);
+    const float black[4] = { (float)iblack[0], (float)iblack[1], (float)iblack[2], (float)iblack[3] };
+
+    img->filters = 0;
+    _rawspeed_set_flags(img, r);
+    const int orientation = dt_image_orientation(img);
+
+    const int wd = r->dim.x/2, ht = r->dim.y/2;
+    *buf = (float *)dt_alloc_align(64, 4*sizeof(float)*wd*ht);
+    if(!*buf)
+      return DT_IMAGEIO_CACHE_FULL;
+    dt_imageio_flip_buffers_bin_ui16_to_float(*buf, (const uint16_t *)r->getData(), black, iwhite, filters,
+                                              r->dim.x, r->dim.y, r->pitch/sizeof(uint16_t), orientation);
+    *width  = (orientation & 4) ? ht : wd;
+    *height = (orientation & 4) ? wd : ht;
+  }
+  catch (const std::exception &exc)
+  {
+    printf("[rawspeed] %s\n", exc.what());
+    return DT_IMAGEIO_FILE_CORRUPTED;
+  }
+  catch (...)
+  {
+    printf("Unhandled exception in imageio_rawspeed\n");
+    return DT_IMAGEIO_FILE_CORRUPTED;
+  }
+
+  return DT_IMAGEIO_OK;
+}
+
 dt_imageio_retval_t
 dt_imageio_open_rawspeed_sraw(dt_image_t *img, RawImage r, dt_mipmap_cache_allocator_t a)
 {
@@ -27,6 +27,8 @@ extern "C"
 #include "common/mipmap_cache.h"
 
   dt_imageio_retval_t dt_imageio_open_rawspeed(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a);
+  // decodes a bayer raw into a malloc'ed, oriented float4 buffer of half the size, binning 2x2 blocks.
+  dt_imageio_retval_t dt_imageio_open_rawspeed_half_size(dt_image_t *img, const char *filename, float **buf, int *width, int *height);
 
 #ifdef __cplusplus
 }
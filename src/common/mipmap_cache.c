@@ -24,6 +24,7 @@
 #include "common/imageio_module.h"
 #include "common/imageio_jpeg.h"
 #include "common/mipmap_cache.h"
+#include "common/mipmap_store.h"
 #include "control/conf.h"
 #include "control/jobs.h"
 #include "libraw/libraw.h"
@@ -43,8 +44,6 @@
 #include <errno.h>
 #include <xmmintrin.h>
 
-#define DT_MIPMAP_CACHE_FILE_MAGIC 0xD71337
-#define DT_MIPMAP_CACHE_FILE_VERSION 23
 #define DT_MIPMAP_CACHE_DEFAULT_FILE_NAME "mipmaps"
 
 #define DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE (1<<0)
@@ -153,63 +152,6 @@ get_size(const uint32_t key)
   return (dt_mipmap_size_t)(key >> 29);
 }
 
-typedef struct _iterate_data_t
-{
-  FILE *f;
-  uint8_t *blob;
-  int compression_type;
-  dt_mipmap_size_t mip;
-}
-_iterate_data_t;
-
-static int
-_write_buffer(const uint32_t key, const void *data, void *user_data)
-{
-  if(!data) return 1;
-  struct dt_mipmap_buffer_dsc* dsc = (struct dt_mipmap_buffer_dsc*)data;
-  // too small to write. no error, but don't write.
-  if(dsc->width <= 8 && dsc->height <= 8) return 0;
-
-  _iterate_data_t *d = (_iterate_data_t *)user_data;
-  int written = fwrite(&(d->mip), sizeof(dt_mipmap_size_t), 1, d->f);
-  if(written != 1) return 1;
-  written = fwrite(&key, sizeof(uint32_t), 1, d->f);
-  if(written != 1) return 1;
-
-  if(d->compression_type)
-  {
-    // write buffer size, wd, ht and the full blob, as it is in memory.
-    const int32_t length = compressed_buffer_size(d->compression_type, dsc->width, dsc->height);
-    written = fwrite(&length, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(&dsc->width, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(&dsc->height, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(dsc+1, sizeof(uint8_t), length, d->f);
-    if(written != length) return 1;
-  }
-  else
-  {
-    dt_mipmap_buffer_t buf;
-    buf.width  = dsc->width;
-    buf.height = dsc->height;
-    buf.imgid  = get_imgid(key);
-    buf.size   = get_size(key);
-    // skip to next 8-byte alignment, for sse buffers.
-    buf.buf    = (uint8_t *)(dsc+1);
-
-    const int cache_quality = dt_conf_get_int("database_cache_quality");
-    const int32_t length = dt_imageio_jpeg_compress(buf.buf, d->blob, buf.width, buf.height, MIN(100, MAX(10, cache_quality)));
-    written = fwrite(&length, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(d->blob, sizeof(uint8_t), length, d->f);
-    if(written != length) return 1;
-  }
-
-  return 0;
-}
-
 static int
 dt_mipmap_cache_get_filename(
   gchar* mipmapfilename, size_t size)
@@ -252,236 +194,163 @@ exit:
   return r;
 }
 
-static int
-dt_mipmap_cache_serialize(dt_mipmap_cache_t *cache)
+static void
+dt_mipmap_cache_store_open(dt_mipmap_cache_t *cache)
 {
-  gchar dbfilename[DT_MAX_PATH_LEN];
-  if (dt_mipmap_cache_get_filename(dbfilename, sizeof(dbfilename)))
+  gchar filename[DT_MAX_PATH_LEN];
+  if (dt_mipmap_cache_get_filename(filename, sizeof(filename)))
   {
-    fprintf(stderr, "[mipmap_cache] could not retrieve cache filename; not serializing\n");
-    return 1;
+    fprintf(stderr, "[mipmap_cache] could not retrieve cache filename; thumbnails will not be kept\n");
+    return;
   }
-  if (!strcmp(dbfilename, ":memory:"))
+  if (!strcmp(filename, ":memory:"))
   {
-    // fprintf(stderr, "[mipmap_cache] library is in memory; not serializing\n");
-    return 0;
+    // library is in memory, so are the thumbnails.
+    return;
   }
 
-  // only store smallest thumbs.
-  const dt_mipmap_size_t mip = DT_MIPMAP_2;
-
-  _iterate_data_t d;
-  d.f = NULL;
-  d.blob = (uint8_t *)malloc(cache->mip[mip].buffer_size);
-  int written = 0;
-  FILE *f = fopen(dbfilename, "wb");
-  if(!f) goto write_error;
-  d.f = f;
-  // fprintf(stderr, "[mipmap_cache] serializing to `%s'\n", dbfilename);
-
-  // write version info:
-  const int32_t magic = DT_MIPMAP_CACHE_FILE_MAGIC + DT_MIPMAP_CACHE_FILE_VERSION;
-  written = fwrite(&magic, sizeof(int32_t), 1, f);
-  if(written != 1) goto write_error;
+  // the single file written at shutdown by earlier versions is of no use any more:
+  if(g_file_test(filename, G_FILE_TEST_IS_REGULAR)) g_unlink(filename);
 
-  // store compression type
-  written = fwrite(&cache->compression_type, sizeof(int32_t), 1, f);
-  if(written != 1) goto write_error;
-
-  for(int i=0; i<=mip; i++)
-  {
-    // print max sizes for this cache
-    written = fwrite(&cache->mip[i].max_width, sizeof(int32_t), 1, f);
-    if(written != 1) goto write_error;
-    written = fwrite(&cache->mip[i].max_height, sizeof(int32_t), 1, f);
-    if(written != 1) goto write_error;
-  }
-
-  for(int i=0; i<=mip; i++)
+  uint32_t max_width[DT_MIPMAP_STORE_LEVELS], max_height[DT_MIPMAP_STORE_LEVELS];
+  for(int k=0; k<DT_MIPMAP_STORE_LEVELS; k++)
   {
-    d.mip = (dt_mipmap_size_t)i;
-    d.compression_type = cache->compression_type;
-    if(dt_cache_for_all(&cache->mip[i].cache, _write_buffer, &d)) goto write_error;
+    max_width[k]  = cache->mip[k].max_width;
+    max_height[k] = cache->mip[k].max_height;
   }
-
-  free(d.blob);
-  fclose(f);
-  return 0;
-
-write_error:
-  fprintf(stderr, "[mipmap_cache] serialization to `%s' failed!\n", dbfilename);
-  if(f) fclose(f);
-  free(d.blob);
-  return 1;
+  // drop any old thumbnails if the database is new. in that case newly imported images would probably be mapped to old thumbnails
+  const int reset = dt_database_is_new(darktable.db);
+  if(reset) fprintf(stderr, "[mipmap_cache] database is new, dropping old thumbnails `%s'\n", filename);
+  cache->store_enabled = !dt_mipmap_store_open(&cache->store, filename, reset, cache->compression_type, max_width, max_height);
 }
 
+// try to fill a freshly allocated 8-bit thumbnail from the persistent store.
+// only the pages of this one thumbnail are read from disk. returns 0 on success.
 static int
-dt_mipmap_cache_deserialize(dt_mipmap_cache_t *cache)
+dt_mipmap_cache_store_load(dt_mipmap_cache_t *cache, struct dt_mipmap_buffer_dsc *dsc, const uint32_t key, const dt_mipmap_size_t mip)
 {
-  int32_t rd = 0;
-  const dt_mipmap_size_t mip = DT_MIPMAP_2;
-  uint8_t *blob = NULL;
-  FILE *f = NULL;
-  int file_width[mip+1], file_height[mip+1];
-
-  gchar dbfilename[DT_MAX_PATH_LEN];
-  if (dt_mipmap_cache_get_filename(dbfilename, sizeof(dbfilename)))
-  {
-    fprintf(stderr, "[mipmap_cache] could not retrieve cache filename; not deserializing\n");
-    return 1;
-  }
-  if (!strcmp(dbfilename, ":memory:"))
-  {
-    // fprintf(stderr, "[mipmap_cache] library is in memory; not deserializing\n");
-    return 0;
-  }
-
-  // drop any old cache if the database is new. in that case newly imported images will probably mapped to old thumbnails
-  if(dt_database_is_new(darktable.db) && g_file_test(dbfilename, G_FILE_TEST_IS_REGULAR))
+  if(!cache->store_enabled) return 1;
+  const size_t max_length = cache->mip[mip].buffer_size - sizeof(*dsc);
+  uint32_t wd = 0, ht = 0;
+  if(cache->compression_type)
   {
-    fprintf(stderr, "[mipmap_cache] database is new, dropping old cache `%s'\n", dbfilename);
-    goto read_finalize;
+    // directly read from disk into cache:
+    const size_t length = dt_mipmap_store_read(&cache->store, key, (uint8_t *)(dsc+1), max_length, &wd, &ht);
+    if(!length || wd > cache->mip[mip].max_width || ht > cache->mip[mip].max_height ||
+       length != compressed_buffer_size(cache->compression_type, wd, ht))
+      return 1;
   }
-
-  f = fopen(dbfilename, "rb");
-  if(!f)
+  else
   {
-    if (errno == ENOENT)
-    {
-      fprintf(stderr, "[mipmap_cache] cache is empty, file `%s' doesn't exist\n", dbfilename);
-    }
-    else
+    // no compression, the image is still compressed on disk, as jpg
+    uint8_t *blob = (uint8_t *)malloc(max_length);
+    if(!blob) return 1;
+    const size_t length = dt_mipmap_store_read(&cache->store, key, blob, max_length, &wd, &ht);
+    dt_imageio_jpeg_t jpg;
+    if(!length || dt_imageio_jpeg_decompress_header(blob, length, &jpg) ||
+       jpg.width > cache->mip[mip].max_width || jpg.height > cache->mip[mip].max_height ||
+       dt_imageio_jpeg_decompress(&jpg, (uint8_t *)(dsc+1)))
     {
-      fprintf(stderr, "[mipmap_cache] failed to open the cache from `%s'\n", dbfilename);
+      free(blob);
+      return 1;
     }
-    goto read_finalize;
-  }
-
-  // read version info:
-  const int32_t magic = DT_MIPMAP_CACHE_FILE_MAGIC + DT_MIPMAP_CACHE_FILE_VERSION;
-  int32_t magic_file = 0;
-  rd = fread(&magic_file, sizeof(int32_t), 1, f);
-  if(rd != 1) goto read_error;
-  if(magic_file == DT_MIPMAP_CACHE_FILE_MAGIC + 22)
-  {
-    // same format, but compression was broken in 22 and below
-  }
-  else if(magic_file != magic)
-  {
-    if(magic_file > DT_MIPMAP_CACHE_FILE_MAGIC && magic_file < magic)
-      fprintf(stderr, "[mipmap_cache] cache version too old, dropping `%s' cache\n", dbfilename);
-    else
-      fprintf(stderr, "[mipmap_cache] invalid cache file, dropping `%s' cache\n", dbfilename);
-    goto read_finalize;
+    free(blob);
+    wd = jpg.width;
+    ht = jpg.height;
   }
+  dsc->width = wd;
+  dsc->height = ht;
+  return 0;
+}
 
-  // also read compression type and yell out on missmatch.
-  int32_t compression = -1;
-  rd = fread(&compression, sizeof(int32_t), 1, f);
-  if(rd != 1) goto read_error;
-  if(compression != cache->compression_type)
-  {
-    fprintf(stderr, "[mipmap_cache] cache is %s, but settings say we should use %s, dropping `%s' cache\n",
-            compression == 0 ? "uncompressed" : (compression == 1 ? "low quality compressed" : "high quality compressed"),
-            cache->compression_type == 0 ? "no compression" : (cache->compression_type == 1 ? "low quality compression" : "high quality compression"),
-            dbfilename);
-    goto read_finalize;
-  }
-  if(compression && (magic_file == DT_MIPMAP_CACHE_FILE_MAGIC + 22))
+// append a freshly generated 8-bit thumbnail to the persistent store.
+static void
+dt_mipmap_cache_store_save(dt_mipmap_cache_t *cache, const struct dt_mipmap_buffer_dsc *dsc, const uint32_t key)
+{
+  if(!cache->store_enabled) return;
+  // too small to write, skulls are regenerated.
+  if(dsc->width <= 8 && dsc->height <= 8) return;
+  if(cache->compression_type)
   {
-    // compression is enabled and we have the affected version. can't read that.
-    fprintf(stderr, "[mipmap_cache] dropping compressed cache v22 to regenerate mips without artifacts.\n");
-    goto read_finalize;
+    // write the blob, as it is in memory.
+    const int32_t length = compressed_buffer_size(cache->compression_type, dsc->width, dsc->height);
+    dt_mipmap_store_write(&cache->store, key, (const uint8_t *)(dsc+1), length, dsc->width, dsc->height);
   }
-
-  for (int i=0; i<=mip; i++)
+  else
   {
-    rd = fread(&file_width[i], sizeof(int32_t), 1, f);
-    if(rd != 1) goto read_error;
-    rd = fread(&file_height[i], sizeof(int32_t), 1, f);
-    if(rd != 1) goto read_error;
-    if(file_width[i]  != cache->mip[i].max_width ||
-        file_height[i] != cache->mip[i].max_height)
-    {
-      fprintf(stderr, "[mipmap_cache] cache settings changed, dropping `%s' cache\n", dbfilename);
-      goto read_finalize;
-    }
+    uint8_t *blob = (uint8_t *)malloc(sizeof(uint32_t)*dsc->width*dsc->height);
+    if(!blob) return;
+    const int cache_quality = dt_conf_get_int("database_cache_quality");
+    const int32_t length = dt_imageio_jpeg_compress((const uint8_t *)(dsc+1), blob, dsc->width, dsc->height, MIN(100, MAX(10, cache_quality)));
+    if(length > 0) dt_mipmap_store_write(&cache->store, key, blob, length, dsc->width, dsc->height);
+    free(blob);
   }
+}
 
-  if(cache->compression_type) blob = NULL;
-  else blob = malloc(sizeof(uint32_t)*file_width[mip]*file_height[mip]);
+static void _init_f(float   *buf, uint32_t *width, uint32_t *height, const uint32_t imgid);
+static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, const uint32_t imgid, const dt_mipmap_size_t size);
 
-  while(!feof(f))
+// fill all smaller levels of the same image which are not in the cache yet from a freshly
+// generated thumbnail, so zooming out in lighttable doesn't run the pixelpipe again.
+static void
+_init_smaller_8(
+  dt_mipmap_cache_t      *cache,
+  const uint8_t          *in,
+  const uint32_t          width,
+  const uint32_t          height,
+  const uint32_t          imgid,
+  const dt_mipmap_size_t  mip)
+{
+  // skulls are not worth it:
+  if(width <= 8 || height <= 8) return;
+  uint8_t *scratchmem = NULL;
+  for(int k=(int)mip-1; k>=DT_MIPMAP_0; k--)
   {
-    int level = 0;
-    rd = fread(&level, sizeof(int), 1, f);
-    if (level > mip) break;
-
-    int32_t key = 0;
-    rd = fread(&key, sizeof(int32_t), 1, f);
-    if(rd != 1) break; // first value is break only, goes to eof.
-    int32_t length = 0;
-    rd = fread(&length, sizeof(int32_t), 1, f);
-    if(rd != 1) goto read_error;
-
-    uint8_t *data = (uint8_t *)dt_cache_read_get(&cache->mip[level].cache, key);
-    struct dt_mipmap_buffer_dsc* dsc = (struct dt_mipmap_buffer_dsc*)data;
+    const uint32_t key = get_key(imgid, k);
+    if(dt_cache_contains(&cache->mip[k].cache, key)) continue;
+    struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)dt_cache_read_get(&cache->mip[k].cache, key);
+    if(!dsc) continue;
+    // somebody else might have been faster, only fill it if we got the write lock from the alloc callback:
     if(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE)
     {
-      if(cache->compression_type)
+      if(cache->compression_type && !scratchmem)
+        scratchmem = (uint8_t *)dt_alloc_align(64, sizeof(uint32_t)*cache->mip[k].max_width*cache->mip[k].max_height);
+      uint8_t *out = cache->compression_type ? scratchmem : (uint8_t *)(dsc+1);
+      if(!out)
+      {
+        dsc->width = dsc->height = 0;
+      }
+      else if(width <= cache->mip[k].max_width && height <= cache->mip[k].max_height)
       {
-        int32_t wd, ht;
-        rd = fread(&wd, sizeof(int32_t), 1, f);
-        if(rd != 1) goto read_error;
-        rd = fread(&ht, sizeof(int32_t), 1, f);
-        if(rd != 1) goto read_error;
-        dsc->width = wd;
-        dsc->height = ht;
-        if(length != compressed_buffer_size(cache->compression_type, wd, ht)) goto read_error;
-        // directly read from disk into cache:
-        rd = fread(data + sizeof(*dsc), 1, length, f);
-        if(rd != length) goto read_error;
+        // the pixelpipe doesn't upscale either:
+        memcpy(out, in, sizeof(uint32_t)*width*height);
+        dsc->width  = width;
+        dsc->height = height;
       }
       else
       {
-        // jpg too large?
-        if(length > sizeof(uint32_t)*file_width[mip]*file_height[mip]) goto read_error;
-        rd = fread(blob, sizeof(uint8_t), length, f);
-        if(rd != length) goto read_error;
-        // no compression, the image is still compressed on disk, as jpg
-        dt_imageio_jpeg_t jpg;
-        if(dt_imageio_jpeg_decompress_header(blob, length, &jpg) ||
-            (jpg.width > file_width[level] || jpg.height > file_height[level]) ||
-            dt_imageio_jpeg_decompress(&jpg, data+sizeof(*dsc)))
-        {
-          fprintf(stderr, "[mipmap_cache] failed to decompress thumbnail for image %d!\n", get_imgid(key));
-        }
-        dsc->width = jpg.width;
-        dsc->height = jpg.height;
+        dt_iop_flip_and_zoom_8(in, width, height, out, cache->mip[k].max_width, cache->mip[k].max_height, 0,
+                               &dsc->width, &dsc->height);
+      }
+      if(cache->compression_type && out)
+      {
+        dt_mipmap_buffer_t buf;
+        buf.size   = k;
+        buf.imgid  = imgid;
+        buf.width  = dsc->width;
+        buf.height = dsc->height;
+        buf.buf    = (uint8_t *)(dsc+1);
+        dt_mipmap_cache_compress(&buf, scratchmem);
       }
+      dt_mipmap_cache_store_save(cache, dsc, key);
       dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
-      // these come write locked in case idata[3] == 1, so release that!
-      dt_cache_write_release(&cache->mip[level].cache, key);
+      dt_cache_write_release(&cache->mip[k].cache, key);
     }
-    dt_cache_read_release(&cache->mip[level].cache, key);
+    dt_cache_read_release(&cache->mip[k].cache, key);
   }
-
-  fclose(f);
-  free(blob);
-  return 0;
-
-read_error:
-  fprintf(stderr, "[mipmap_cache] failed to recover the cache from `%s'\n", dbfilename);
-read_finalize:
-  if(f) fclose(f);
-  free(blob);
-  g_unlink(dbfilename);
-  return 1;
+  free(scratchmem);
 }
 
-static void _init_f(float   *buf, uint32_t *width, uint32_t *height, const uint32_t imgid);
-static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, const uint32_t imgid, const dt_mipmap_size_t size);
-
 static int32_t
 scratchmem_allocate(void *data, const uint32_t key, int32_t *cost, void **buf)
 {
@@ -654,7 +523,7 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   // adjust numbers to be large enough to hold what mem limit suggests.
   // we want at least 100MB, and consider 8G just still reasonable.
   size_t max_mem = CLAMPS(dt_conf_get_int64("cache_memory"), 100u<<20, ((uint64_t)8)<<30);
-  const uint32_t parallel = CLAMP(dt_conf_get_int ("worker_threads")*dt_conf_get_int("parallel_export"), 1, 8);
+  const uint32_t parallel = CLAMP(dt_conf_get_int ("worker_threads")*dt_conf_get_int("parallel_export"), 1, DT_MIPMAP_MAX_PARALLEL);
   const int32_t max_size = 2048, min_size = 32;
   int32_t wd = darktable.thumbnail_width;
   int32_t ht = darktable.thumbnail_height;
@@ -663,6 +532,8 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   // round up to a multiple of 8, so we can divide by two 3 times
   if(wd & 0xf) wd = (wd & ~0xf) + 0x10;
   if(ht & 0xf) ht = (ht & ~0xf) + 0x10;
+  // generate smaller thumbnails along with every larger one:
+  cache->cascade = dt_conf_get_bool("mipmap_cascade");
   // cache these, can't change at runtime:
   cache->mip[DT_MIPMAP_F].max_width  = wd;
   cache->mip[DT_MIPMAP_F].max_height = ht;
@@ -682,7 +553,9 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
     cache->scratchmem.buffer_size = wd*ht*sizeof(uint32_t);
     cache->scratchmem.size = DT_MIPMAP_3; // at max.
     // TODO: use thread local storage instead (zero performance penalty on linux)
-    dt_cache_init(&cache->scratchmem.cache, parallel, parallel, 64, 0.9f*parallel*wd*ht*sizeof(uint32_t));
+    // one slot per control worker, one shared by all other threads and one per thumbnail loader:
+    const int scratch = CLAMP(dt_conf_get_int("worker_threads"), 1, 8) + 1 + dt_mipmap_loader_num_threads();
+    dt_cache_init(&cache->scratchmem.cache, scratch, scratch, 64, 0.9f*scratch*wd*ht*sizeof(uint32_t));
     // might have been rounded to power of two:
     const int cnt = dt_cache_capacity(&cache->scratchmem.cache);
     cache->scratchmem.buf = dt_alloc_align(64, cnt * wd*ht*sizeof(uint32_t));
@@ -740,7 +613,9 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   }
 
   // full buffer needs dynamic alloc:
-  const int full_entries = MAX(2, parallel); // even with one thread you want two buffers. one for dr one for thumbs.
+  // even with one thread you want two buffers. one for dr one for thumbs.
+  // on top of that, export keeps the decoded inputs of the next few images pinned.
+  const int full_entries = MAX(2, parallel) + CLAMP(dt_conf_get_int("export_prefetch_depth"), 0, 8);
   int32_t max_mem_bufs = nearest_power_of_two(full_entries);
 
   // for this buffer, because it can be very busy during import, we want the minimum
@@ -766,12 +641,15 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   cache->mip[DT_MIPMAP_F].size = DT_MIPMAP_F;
   cache->mip[DT_MIPMAP_F].buf = NULL;
 
-  dt_mipmap_cache_deserialize(cache);
+  dt_mipmap_cache_store_open(cache);
+  dt_mipmap_loader_init(&cache->loader);
 }
 
 void dt_mipmap_cache_cleanup(dt_mipmap_cache_t *cache)
 {
-  dt_mipmap_cache_serialize(cache);
+  dt_mipmap_loader_cleanup(&cache->loader);
+  if(cache->store_enabled) dt_mipmap_store_close(&cache->store);
+  cache->store_enabled = 0;
   for(int k=0; k<DT_MIPMAP_F; k++)
   {
     dt_cache_cleanup(&cache->mip[k].cache);
@@ -834,6 +712,8 @@ void dt_mipmap_cache_print(dt_mipmap_cache_t *cache)
         100.0*cache->mip[k].stats_standin/(float)sum_standins,
         100.0*cache->mip[k].stats_fetches/(float)sum_fetches,
         100.0*cache->mip[k].stats_requests/(float)sum);
+  printf("\n");
+  dt_mipmap_loader_print(&cache->loader);
   printf("\n\n");
   // very verbose stats about locks/users
   //dt_cache_print(&cache->mip[DT_MIPMAP_3].cache);
@@ -874,8 +754,16 @@ dt_mipmap_cache_read_get(
   {
     // and opposite: prefetch without locking
     if(mip > DT_MIPMAP_FULL || mip < DT_MIPMAP_0) return;
+    // thumbnails go through the loader, which knows what is on screen:
+    if(mip < DT_MIPMAP_F)
+    {
+      dt_mipmap_loader_request(&cache->loader, imgid, mip, 0);
+      return;
+    }
     dt_job_t j;
     dt_image_load_job_init(&j, imgid, mip);
+    // someone is waiting to look at this image, don't queue it behind exports:
+    dt_control_job_set_priority(&j, DT_JOB_PRIORITY_HIGH);
     // if the job already exists, make it high-priority, if not, add it:
     if(dt_control_revive_job(darktable.control, &j) < 0)
       dt_control_add_job(darktable.control, &j);
@@ -957,13 +845,19 @@ dt_mipmap_cache_read_get(
         {
           _init_f((float *)(dsc+1), &dsc->width, &dsc->height, imgid);
         }
+        else if(!dt_mipmap_cache_store_load(cache, dsc, key, mip))
+        {
+          // 8-bit thumb was generated in an earlier session
+        }
         else
         {
           // 8-bit thumbs, possibly need to be compressed:
           if(cache->compression_type)
           {
-            // get per-thread temporary storage without malloc from a separate cache:
-            const int key = dt_control_get_threadid();
+            // get per-thread temporary storage without malloc from a separate cache.
+            // the loader threads are no control workers, they come after the shared slot:
+            const int loader = dt_mipmap_loader_get_threadid();
+            const int key = loader >= 0 ? darktable.control->num_threads + 1 + loader : dt_control_get_threadid();
             // const void *cbuf =
             dt_cache_read_get(&cache->scratchmem.cache, key);
             uint8_t *scratchmem = (uint8_t *)dt_cache_write_get(&cache->scratchmem.cache, key);
@@ -974,13 +868,17 @@ dt_mipmap_cache_read_get(
             buf->size   = mip;
             buf->buf = (uint8_t *)(dsc+1);
             dt_mipmap_cache_compress(buf, scratchmem);
+            if(cache->cascade) _init_smaller_8(cache, scratchmem, dsc->width, dsc->height, imgid, mip);
             dt_cache_write_release(&cache->scratchmem.cache, key);
             dt_cache_read_release(&cache->scratchmem.cache, key);
           }
           else
           {
             _init_8((uint8_t *)(dsc+1), &dsc->width, &dsc->height, imgid, mip);
+            if(cache->cascade) _init_smaller_8(cache, (uint8_t *)(dsc+1), dsc->width, dsc->height, imgid, mip);
           }
+          // keep it for the next session right away
+          dt_mipmap_cache_store_save(cache, dsc, key);
         }
         dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
         // drop the write lock
@@ -1118,7 +1016,75 @@ dt_mipmap_cache_remove(
   {
     const uint32_t key = get_key(imgid, k);
     dt_cache_remove(&cache->mip[k].cache, key);
+    if(cache->store_enabled) dt_mipmap_store_remove(&cache->store, key);
+  }
+}
+
+void
+dt_mipmap_cache_remove_file(
+  dt_mipmap_cache_t *cache,
+  const uint32_t imgid)
+{
+  dt_mipmap_cache_remove(cache, imgid);
+  // and the float buffers decoded from the old contents. buffers still in use are skipped.
+  for(int k=DT_MIPMAP_F; k<DT_MIPMAP_NONE; k++)
+    dt_cache_remove(&cache->mip[k].cache, get_key(imgid, k));
+}
+
+// fills mipf from a half size load of the raw, so no full buffer has to be decoded and cached.
+// returns non-zero if the image can't be loaded that way or would need upsampling.
+static int
+_init_f_half_size(
+  float          *out,
+  uint32_t       *width,
+  uint32_t       *height,
+  const uint32_t  imgid,
+  const char     *filename)
+{
+  const uint32_t wd = *width, ht = *height;
+
+  const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, imgid);
+  dt_image_t buffered_image = *cimg;
+  dt_image_cache_read_release(darktable.image_cache, cimg);
+
+  float *buf = NULL;
+  int bw = 0, bh = 0;
+  if(dt_imageio_open_half_size(&buffered_image, filename, &buf, &bw, &bh) != DT_IMAGEIO_OK)
+  {
+    dt_free_align(buf);
+    return 1;
   }
+
+  dt_iop_roi_t roi_in, roi_out;
+  roi_in.x = roi_in.y = 0;
+  roi_in.width = bw;
+  roi_in.height = bh;
+  roi_in.scale = 1.0f;
+
+  // same dimensions as if downscaled from the full buffer:
+  const float scale = fminf(wd/(float)buffered_image.width, ht/(float)buffered_image.height);
+  roi_out.x = roi_out.y = 0;
+  roi_out.width  = scale * buffered_image.width;
+  roi_out.height = scale * buffered_image.height;
+  if(roi_out.width > bw || roi_out.height > bh)
+  {
+    dt_free_align(buf);
+    return 1;
+  }
+  roi_out.scale = fminf(roi_out.width/(float)bw, roi_out.height/(float)bh);
+  dt_iop_clip_and_zoom(out, buf, &roi_out, &roi_in, roi_out.width, bw);
+  dt_free_align(buf);
+
+  // the loader found out about size and flags, keep them like the full load would:
+  cimg = dt_image_cache_read_get(darktable.image_cache, imgid);
+  dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
+  *img = buffered_image;
+  dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+  dt_image_cache_read_release(darktable.image_cache, img);
+
+  *width  = roi_out.width;
+  *height = roi_out.height;
+  return 0;
 }
 
 static void
@@ -1141,7 +1107,13 @@ _init_f(
   }
 
   dt_mipmap_buffer_t buf;
-  dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
+  dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL, DT_MIPMAP_TESTLOCK);
+  if(!buf.buf)
+  {
+    // nobody needs the full buffer right now, try not to decode one just for this:
+    if(!_init_f_half_size(out, width, height, imgid, filename)) return;
+    dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
+  }
 
   // lock image after we have the buffer, we might need to lock the image struct for
   // writing during raw loading, to write to width/height.
@@ -1337,10 +1309,7 @@ _init_8(
     return;
   }
 
-  // TODO: various speed optimizations:
-  // TODO: also init all smaller mips!
-  // TODO: use mipf, but:
-  // TODO: if output is cropped, don't use mipf!
+  // smaller mips are initialized by the caller, export reuses mipf if it's already there.
 }
 
 // compression stuff: alloc a buffer if needed
@@ -20,7 +20,11 @@
 
 #include "common/cache.h"
 #include "common/image.h"
+#include "common/mipmap_loader.h"
+#include "common/mipmap_store.h"
 
+// the cache holds a full buffer for at most this many images being processed at the same time.
+#define DT_MIPMAP_MAX_PARALLEL 8
 
 // sizes stored in the mipmap cache.
 // _4 can be a user-supplied size. down to _0,
@@ -108,8 +112,15 @@ typedef struct dt_mipmap_cache_t
   dt_mipmap_cache_one_t mip[DT_MIPMAP_NONE];
   // global setting: which compression type are we using?
   int compression_type; // 0 - none, 1 - low quality, 2 - slow
+  // generate all smaller 8-bit levels along with a larger one?
+  int cascade;
   // per-thread cache of uncompressed buffers, in case compression is requested.
   dt_mipmap_cache_one_t scratchmem;
+  // thumbnails on disk, backing the 8-bit levels across sessions.
+  dt_mipmap_store_t store;
+  int store_enabled;
+  // generates the 8-bit levels in the background, for DT_MIPMAP_PREFETCH.
+  dt_mipmap_loader_t loader;
 }
 dt_mipmap_cache_t;
 
@@ -164,6 +175,12 @@ dt_mipmap_cache_remove(
   dt_mipmap_cache_t *cache,
   const uint32_t imgid);
 
+// the image file changed on disk: remove thumbnails and the float buffers.
+void
+dt_mipmap_cache_remove_file(
+  dt_mipmap_cache_t *cache,
+  const uint32_t imgid);
+
 // return the closest mipmap size
 // for the given window you wish to draw.
 // a dt_mipmap_size_t has always a fixed resolution associated with it,
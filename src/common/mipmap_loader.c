@@ -0,0 +1,253 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/darktable.h"
+#include "common/heap.h"
+#include "common/mipmap_cache.h"
+#include "common/mipmap_loader.h"
+#include "control/conf.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// initial queue size, grows when needed.
+#define DT_MIPMAP_LOADER_QUEUE_SIZE 256
+
+// set once by each worker, so the mipmap cache can give it its own scratch memory.
+static __thread int _loader_threadid = -1;
+
+typedef struct dt_mipmap_loader_request_t
+{
+  uint32_t imgid;
+  int mip;
+  int priority;
+  uint32_t serial;    // of the queue entry which is still valid for this request
+  double requested;   // time of the first request
+}
+dt_mipmap_loader_request_t;
+
+static inline gpointer
+_key(const uint32_t imgid, const int mip)
+{
+  // imgids start at 1, so this is never NULL
+  return GUINT_TO_POINTER((imgid << 3) | (uint32_t)mip);
+}
+
+static void
+_queue_push(dt_mipmap_loader_t *l, dt_mipmap_loader_request_t *r)
+{
+  r->serial = ++l->serial;
+  const uint64_t entry = ((uint64_t)r->serial << 32) | GPOINTER_TO_UINT(_key(r->imgid, r->mip));
+  // the heap sorts largest first:
+  if(!heap_insert(l->queue, entry, -(float)r->priority)) return;
+
+  // full of outdated entries, or really that many requests. rebuild from what's pending:
+  if(g_hash_table_size(l->pending) >= l->queue->size/2)
+  {
+    const uint32_t size = 2*l->queue->size;
+    heap_cleanup(l->queue);
+    l->queue = heap_init(size);
+  }
+  l->queue->end = 0;
+  GHashTableIter it;
+  gpointer key, value;
+  g_hash_table_iter_init(&it, l->pending);
+  while(g_hash_table_iter_next(&it, &key, &value))
+  {
+    dt_mipmap_loader_request_t *p = (dt_mipmap_loader_request_t *)value;
+    heap_insert(l->queue, ((uint64_t)p->serial << 32) | GPOINTER_TO_UINT(key), -(float)p->priority);
+  }
+}
+
+// the most urgent pending request, moved over to the loading table. called with the mutex held.
+static dt_mipmap_loader_request_t *
+_queue_pop(dt_mipmap_loader_t *l)
+{
+  while(!heap_empty(l->queue))
+  {
+    uint64_t entry;
+    float val;
+    heap_remove(l->queue, &entry, &val);
+    const gpointer key = GUINT_TO_POINTER((uint32_t)(entry & 0xffffffffu));
+    dt_mipmap_loader_request_t *r = (dt_mipmap_loader_request_t *)g_hash_table_lookup(l->pending, key);
+    // cancelled, or queued again with a different priority:
+    if(!r || r->serial != (uint32_t)(entry >> 32)) continue;
+    g_hash_table_steal(l->pending, key);
+    g_hash_table_insert(l->loading, key, r);
+    return r;
+  }
+  return NULL;
+}
+
+static void *
+_loader_work(void *ptr)
+{
+  dt_mipmap_loader_t *l = (dt_mipmap_loader_t *)ptr;
+  dt_pthread_mutex_lock(&l->mutex);
+  _loader_threadid = l->num_ids++;
+  while(l->running)
+  {
+    dt_mipmap_loader_request_t *r = _queue_pop(l);
+    if(!r)
+    {
+      dt_pthread_cond_wait(&l->cond, &l->mutex);
+      continue;
+    }
+    dt_pthread_mutex_unlock(&l->mutex);
+
+    // this generates the thumbnail and raises the mipmap updated signal, so the views redraw.
+    dt_mipmap_buffer_t buf;
+    dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, r->imgid, r->mip, DT_MIPMAP_BLOCKING);
+    if(buf.buf) dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+    const double latency = dt_get_wtime() - r->requested;
+
+    dt_pthread_mutex_lock(&l->mutex);
+    l->stats.loaded++;
+    // the priority might have been raised while loading:
+    if(r->priority == 0)
+    {
+      l->stats.loaded_visible++;
+      l->stats.latency_visible += latency;
+      l->stats.latency_visible_max = MAX(l->stats.latency_visible_max, latency);
+    }
+    else l->stats.latency_prefetch += latency;
+    g_hash_table_remove(l->loading, _key(r->imgid, r->mip));
+  }
+  dt_pthread_mutex_unlock(&l->mutex);
+  return NULL;
+}
+
+void
+dt_mipmap_loader_init(dt_mipmap_loader_t *l)
+{
+  memset(l, 0, sizeof(*l));
+  dt_pthread_mutex_init(&l->mutex, NULL);
+  pthread_cond_init(&l->cond, NULL);
+  l->pending = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+  l->loading = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+  l->queue = heap_init(DT_MIPMAP_LOADER_QUEUE_SIZE);
+}
+
+void
+dt_mipmap_loader_cleanup(dt_mipmap_loader_t *l)
+{
+  if(!l->pending) return;
+  dt_pthread_mutex_lock(&l->mutex);
+  l->running = 0;
+  pthread_cond_broadcast(&l->cond);
+  dt_pthread_mutex_unlock(&l->mutex);
+  for(int k=0; k<l->num_threads; k++) pthread_join(l->thread[k], NULL);
+  l->num_threads = 0;
+
+  g_hash_table_destroy(l->pending);
+  g_hash_table_destroy(l->loading);
+  l->pending = l->loading = NULL;
+  heap_cleanup(l->queue);
+  l->queue = NULL;
+  pthread_cond_destroy(&l->cond);
+  dt_pthread_mutex_destroy(&l->mutex);
+}
+
+void
+dt_mipmap_loader_request(dt_mipmap_loader_t *l, const uint32_t imgid, const int mip, const int priority)
+{
+  if(!l->pending || !imgid) return;
+  const gpointer key = _key(imgid, mip);
+  dt_pthread_mutex_lock(&l->mutex);
+  l->stats.requests++;
+  dt_mipmap_loader_request_t *r;
+  if((r = (dt_mipmap_loader_request_t *)g_hash_table_lookup(l->loading, key)))
+  {
+    l->stats.coalesced++;
+    r->priority = MIN(r->priority, priority);
+  }
+  else if((r = (dt_mipmap_loader_request_t *)g_hash_table_lookup(l->pending, key)))
+  {
+    l->stats.coalesced++;
+    if(priority < r->priority)
+    {
+      r->priority = priority;
+      _queue_push(l, r);
+    }
+  }
+  else
+  {
+    r = (dt_mipmap_loader_request_t *)malloc(sizeof(dt_mipmap_loader_request_t));
+    r->imgid = imgid;
+    r->mip = mip;
+    r->priority = priority;
+    r->requested = dt_get_wtime();
+    g_hash_table_insert(l->pending, key, r);
+    _queue_push(l, r);
+
+    // start the workers with the first request, so command line tools never spawn any:
+    if(!l->running)
+    {
+      l->running = 1;
+      const int threads = dt_mipmap_loader_num_threads();
+      for(int k=0; k<threads; k++)
+        if(!pthread_create(&l->thread[l->num_threads], NULL, _loader_work, l)) l->num_threads++;
+    }
+    pthread_cond_signal(&l->cond);
+  }
+  dt_pthread_mutex_unlock(&l->mutex);
+}
+
+int
+dt_mipmap_loader_num_threads()
+{
+  return CLAMP(dt_conf_get_int("worker_threads"), 1, DT_MIPMAP_LOADER_MAX_THREADS);
+}
+
+int
+dt_mipmap_loader_get_threadid()
+{
+  return _loader_threadid;
+}
+
+void
+dt_mipmap_loader_viewport_changed(dt_mipmap_loader_t *l)
+{
+  if(!l->pending) return;
+  dt_pthread_mutex_lock(&l->mutex);
+  l->stats.cancelled += g_hash_table_size(l->pending);
+  g_hash_table_remove_all(l->pending);
+  l->queue->end = 0;
+  dt_pthread_mutex_unlock(&l->mutex);
+}
+
+void
+dt_mipmap_loader_print(dt_mipmap_loader_t *l)
+{
+  if(!l->pending) return;
+  dt_pthread_mutex_lock(&l->mutex);
+  const dt_mipmap_loader_stats_t s = l->stats;
+  const uint32_t pending = g_hash_table_size(l->pending), loading = g_hash_table_size(l->loading);
+  dt_pthread_mutex_unlock(&l->mutex);
+  const uint64_t prefetched = s.loaded - s.loaded_visible;
+  printf("[mipmap_loader] %"PRIu64" requests, %"PRIu64" coalesced, %"PRIu64" cancelled, %u queued, %u loading\n",
+         s.requests, s.coalesced, s.cancelled, pending, loading);
+  printf("[mipmap_loader] %"PRIu64" visible loaded, latency avg %.1f ms max %.1f ms; %"PRIu64" prefetched, latency avg %.1f ms\n",
+         s.loaded_visible, s.loaded_visible ? 1e3*s.latency_visible/s.loaded_visible : 0.0, 1e3*s.latency_visible_max,
+         prefetched, prefetched ? 1e3*s.latency_prefetch/prefetched : 0.0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,82 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_COMMON_MIPMAP_LOADER_H
+#define DT_COMMON_MIPMAP_LOADER_H
+
+#include "common/dtpthread.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <glib.h>
+
+#define DT_MIPMAP_LOADER_MAX_THREADS 8
+
+typedef struct dt_mipmap_loader_stats_t
+{
+  uint64_t requests;            // all requests, duplicates included
+  uint64_t coalesced;           // requests for thumbnails already queued or being loaded
+  uint64_t cancelled;           // dropped because the viewport moved before they were loaded
+  uint64_t loaded;              // thumbnails generated by the loader
+  uint64_t loaded_visible;      // of these, the ones that were requested as visible
+  double latency_visible;       // summed seconds from first request to ready, visible ones
+  double latency_visible_max;
+  double latency_prefetch;      // same for prefetched ones
+}
+dt_mipmap_loader_stats_t;
+
+/**
+ * background loader for the 8-bit thumbnails, replacing one control job per prefetch.
+ *
+ * requests are kept in a priority queue, lower priority values are loaded first: visible
+ * thumbnails come in with 0, prefetches with their distance to the viewport. a request for
+ * something that is already queued or being loaded only updates its priority. when the view
+ * scrolls away, everything that didn't start loading yet is dropped, so fast scrolling through
+ * a large collection never piles up work for images that are long gone.
+ */
+typedef struct dt_mipmap_loader_t
+{
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int running, num_threads;
+  int num_ids;                  // thread ids handed out to the workers so far
+  pthread_t thread[DT_MIPMAP_LOADER_MAX_THREADS];
+  GHashTable *pending;          // key -> request, waiting in the queue
+  GHashTable *loading;          // key -> request, being generated right now
+  struct heap_t *queue;         // (serial, key) by priority, outdated entries are skipped
+  uint32_t serial;
+  dt_mipmap_loader_stats_t stats;
+}
+dt_mipmap_loader_t;
+
+void dt_mipmap_loader_init(dt_mipmap_loader_t *l);
+/** joins the threads and drops everything queued. safe to call more than once. */
+void dt_mipmap_loader_cleanup(dt_mipmap_loader_t *l);
+/** queue thumbnail mip of imgid, lower priority values are more urgent. threads are started on first use. */
+void dt_mipmap_loader_request(dt_mipmap_loader_t *l, const uint32_t imgid, const int mip, const int priority);
+/** the viewport moved on: drop all requests which are not being loaded yet. */
+void dt_mipmap_loader_viewport_changed(dt_mipmap_loader_t *l);
+void dt_mipmap_loader_print(dt_mipmap_loader_t *l);
+/** how many loader threads get started, at most. */
+int dt_mipmap_loader_num_threads();
+/** index of the calling loader thread, -1 for any other thread. */
+int dt_mipmap_loader_get_threadid();
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,411 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/mipmap_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef __WIN32__
+#  include <sys/mman.h>
+#endif
+
+#define DT_MIPMAP_STORE_MAGIC   0xD7137E
+#define DT_MIPMAP_STORE_VERSION 1
+#define DT_MIPMAP_STORE_RECORD_MAGIC 0xD7137EC0
+// initial number of index slots, grows by doubling when 3/4 full
+#define DT_MIPMAP_STORE_MIN_CAPACITY (1<<16)
+// data file mappings grow in steps of this
+#define DT_MIPMAP_STORE_MAP_STEP ((size_t)64<<20)
+
+typedef struct dt_mipmap_store_header_t
+{
+  uint32_t magic, version;
+  int32_t compression_type;
+  uint32_t capacity, count;
+  uint32_t max_width[DT_MIPMAP_STORE_LEVELS], max_height[DT_MIPMAP_STORE_LEVELS];
+  uint32_t padding;
+  uint64_t live_bytes, dead_bytes;
+}
+dt_mipmap_store_header_t;
+
+typedef struct dt_mipmap_store_slot_t
+{
+  uint32_t key;     // 0 means empty
+  uint32_t length;  // 0 means removed
+  uint64_t offset;  // of the record in the data file
+  uint32_t width, height;
+}
+dt_mipmap_store_slot_t;
+
+// in front of every payload in the data file
+typedef struct dt_mipmap_store_record_t
+{
+  uint32_t magic, key, length, checksum;
+}
+dt_mipmap_store_record_t;
+
+static inline dt_mipmap_store_slot_t *
+_slots(const dt_mipmap_store_t *store)
+{
+  return (dt_mipmap_store_slot_t *)(store->header + 1);
+}
+
+static inline uint32_t
+_checksum(const uint8_t *buf, const size_t length)
+{
+  // fnv-1a
+  uint32_t hash = 2166136261u;
+  for(size_t k=0; k<length; k++) hash = (hash ^ buf[k]) * 16777619u;
+  return hash;
+}
+
+static inline uint32_t
+_hash(const uint32_t key)
+{
+  // keys are imgid | mip << 29, spread them over the table
+  uint32_t h = key * 0x9E3779B1u;
+  return h ^ (h >> 16);
+}
+
+// returns the slot holding key, or the empty slot where it would go.
+static dt_mipmap_store_slot_t *
+_find_slot(dt_mipmap_store_slot_t *slots, const uint32_t capacity, const uint32_t key)
+{
+  const uint32_t mask = capacity - 1;
+  for(uint32_t i = _hash(key) & mask;; i = (i + 1) & mask)
+    if(slots[i].key == key || slots[i].key == 0) return slots + i;
+}
+
+#ifndef __WIN32__
+
+static int
+_map_index(dt_mipmap_store_t *store, const uint32_t capacity)
+{
+  const size_t size = sizeof(dt_mipmap_store_header_t) + (size_t)capacity * sizeof(dt_mipmap_store_slot_t);
+  if(ftruncate(store->fd_index, size)) return 1;
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd_index, 0);
+  if(map == MAP_FAILED) return 1;
+  store->header = (dt_mipmap_store_header_t *)map;
+  store->index_size = size;
+  return 0;
+}
+
+static int
+_map_data(dt_mipmap_store_t *store, const size_t needed)
+{
+  if(store->data && needed <= store->data_mapped) return 0;
+  size_t size = DT_MIPMAP_STORE_MAP_STEP;
+  while(size < needed + needed/2) size += DT_MIPMAP_STORE_MAP_STEP;
+  // mapping past the end of the file is fine, we never touch pages that haven't been written.
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, store->fd_data, 0);
+  if(map == MAP_FAILED) return 1;
+  if(store->data) munmap(store->data, store->data_mapped);
+  store->data = (uint8_t *)map;
+  store->data_mapped = size;
+  return 0;
+}
+
+static int
+_reset(dt_mipmap_store_t *store, const int32_t compression_type,
+       const uint32_t max_width[DT_MIPMAP_STORE_LEVELS], const uint32_t max_height[DT_MIPMAP_STORE_LEVELS])
+{
+  if(store->header) munmap(store->header, store->index_size);
+  store->header = NULL;
+  if(ftruncate(store->fd_index, 0) || ftruncate(store->fd_data, 0)) return 1;
+  if(_map_index(store, DT_MIPMAP_STORE_MIN_CAPACITY)) return 1;
+  dt_mipmap_store_header_t *h = store->header;
+  memset(h, 0, store->index_size);
+  h->magic = DT_MIPMAP_STORE_MAGIC;
+  h->version = DT_MIPMAP_STORE_VERSION;
+  h->compression_type = compression_type;
+  h->capacity = DT_MIPMAP_STORE_MIN_CAPACITY;
+  for(int k=0; k<DT_MIPMAP_STORE_LEVELS; k++)
+  {
+    h->max_width[k]  = max_width[k];
+    h->max_height[k] = max_height[k];
+  }
+  store->data_end = 0;
+  return 0;
+}
+
+// double the index capacity. has to hold the write lock.
+static int
+_grow_index(dt_mipmap_store_t *store)
+{
+  const uint32_t capacity = store->header->capacity;
+  const size_t slots_size = (size_t)capacity * sizeof(dt_mipmap_store_slot_t);
+  dt_mipmap_store_slot_t *old = (dt_mipmap_store_slot_t *)malloc(slots_size);
+  if(!old) return 1;
+  memcpy(old, _slots(store), slots_size);
+  dt_mipmap_store_header_t header = *store->header;
+  munmap(store->header, store->index_size);
+  store->header = NULL;
+  if(_map_index(store, 2*capacity))
+  {
+    free(old);
+    return 1;
+  }
+  *store->header = header;
+  store->header->capacity = 2*capacity;
+  dt_mipmap_store_slot_t *slots = _slots(store);
+  memset(slots, 0, 2*slots_size);
+  store->header->count = 0;
+  for(uint32_t k=0; k<capacity; k++)
+  {
+    if(!old[k].key || !old[k].length) continue; // drop removed entries on the way
+    *_find_slot(slots, 2*capacity, old[k].key) = old[k];
+    store->header->count++;
+  }
+  free(old);
+  return 0;
+}
+
+// rewrite the data file with only the live records.
+static void
+_compact(dt_mipmap_store_t *store)
+{
+  char tmpname[1040];
+  snprintf(tmpname, sizeof(tmpname), "%s.dat.tmp", store->filename);
+  int fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) return;
+  dt_mipmap_store_slot_t *slots = _slots(store);
+  const uint32_t capacity = store->header->capacity;
+  uint64_t *offsets = (uint64_t *)malloc(sizeof(uint64_t) * capacity);
+  uint64_t end = 0;
+  for(uint32_t k=0; offsets && k<capacity; k++)
+  {
+    offsets[k] = slots[k].offset;
+    if(!slots[k].key || !slots[k].length) continue;
+    const size_t size = sizeof(dt_mipmap_store_record_t) + slots[k].length;
+    if(pwrite(fd, store->data + slots[k].offset, size, end) != (ssize_t)size) goto error;
+    offsets[k] = end;
+    end += size;
+  }
+  if(!offsets || fsync(fd)) goto error;
+  char dataname[1040];
+  snprintf(dataname, sizeof(dataname), "%s.dat", store->filename);
+  if(rename(tmpname, dataname)) goto error;
+  // the new data file is in place, now point the index to it.
+  for(uint32_t k=0; k<capacity; k++) slots[k].offset = offsets[k];
+  store->header->dead_bytes = 0;
+  free(offsets);
+  close(fd);
+  return;
+
+error:
+  fprintf(stderr, "[mipmap_store] failed to compact `%s'\n", tmpname);
+  free(offsets);
+  close(fd);
+  unlink(tmpname);
+}
+
+int
+dt_mipmap_store_open(dt_mipmap_store_t *store, const char *filename, const int reset, const int32_t compression_type,
+                     const uint32_t max_width[DT_MIPMAP_STORE_LEVELS], const uint32_t max_height[DT_MIPMAP_STORE_LEVELS])
+{
+  memset(store, 0, sizeof(dt_mipmap_store_t));
+  store->fd_index = store->fd_data = -1;
+  pthread_rwlock_init(&store->lock, NULL);
+  pthread_mutex_init(&store->append_mutex, NULL);
+  snprintf(store->filename, sizeof(store->filename), "%s", filename);
+
+  char name[1040];
+  snprintf(name, sizeof(name), "%s.idx", filename);
+  store->fd_index = open(name, O_RDWR | O_CREAT, 0644);
+  snprintf(name, sizeof(name), "%s.dat", filename);
+  store->fd_data = open(name, O_RDWR | O_CREAT, 0644);
+  if(store->fd_index < 0 || store->fd_data < 0) goto error;
+
+  struct stat st;
+  if(fstat(store->fd_index, &st)) goto error;
+  dt_mipmap_store_header_t header;
+  int valid = !reset && st.st_size >= (off_t)sizeof(header) &&
+              pread(store->fd_index, &header, sizeof(header), 0) == sizeof(header) &&
+              header.magic == DT_MIPMAP_STORE_MAGIC && header.version == DT_MIPMAP_STORE_VERSION &&
+              header.compression_type == compression_type && header.capacity >= DT_MIPMAP_STORE_MIN_CAPACITY &&
+              !(header.capacity & (header.capacity - 1)) &&
+              st.st_size == (off_t)(sizeof(header) + (size_t)header.capacity * sizeof(dt_mipmap_store_slot_t));
+  for(int k=0; valid && k<DT_MIPMAP_STORE_LEVELS; k++)
+    valid = header.max_width[k] == max_width[k] && header.max_height[k] == max_height[k];
+
+  if(!valid)
+  {
+    if(st.st_size > 0) fprintf(stderr, "[mipmap_store] dropping outdated thumbnail store `%s'\n", filename);
+    if(_reset(store, compression_type, max_width, max_height)) goto error;
+  }
+  else
+  {
+    if(_map_index(store, header.capacity)) goto error;
+    if(fstat(store->fd_data, &st)) goto error;
+    store->data_end = st.st_size;
+  }
+  if(_map_data(store, store->data_end)) goto error;
+  return 0;
+
+error:
+  fprintf(stderr, "[mipmap_store] failed to open thumbnail store `%s', thumbnails will not be kept\n", filename);
+  dt_mipmap_store_close(store);
+  return 1;
+}
+
+void
+dt_mipmap_store_close(dt_mipmap_store_t *store)
+{
+  if(!store->filename[0]) return; // not open
+  if(store->header && store->data &&
+     store->header->dead_bytes > store->header->live_bytes &&
+     store->header->dead_bytes > DT_MIPMAP_STORE_MAP_STEP)
+    _compact(store);
+  if(store->header)
+  {
+    msync(store->header, store->index_size, MS_SYNC);
+    munmap(store->header, store->index_size);
+  }
+  if(store->data) munmap(store->data, store->data_mapped);
+  if(store->fd_index >= 0) close(store->fd_index);
+  if(store->fd_data >= 0) close(store->fd_data);
+  store->header = NULL;
+  store->data = NULL;
+  store->fd_index = store->fd_data = -1;
+  store->filename[0] = '\0';
+  pthread_rwlock_destroy(&store->lock);
+  pthread_mutex_destroy(&store->append_mutex);
+}
+
+size_t
+dt_mipmap_store_read(dt_mipmap_store_t *store, const uint32_t key, uint8_t *out, const size_t max_length,
+                     uint32_t *width, uint32_t *height)
+{
+  if(!store->header || !key) return 0;
+  size_t length = 0;
+  // the mapping may reach past the end of the file, and touching that raises SIGBUS. a stale
+  // index after a crash can point there, so records have to end before data_end.
+  pthread_rwlock_rdlock(&store->lock);
+  const dt_mipmap_store_slot_t *slot = _find_slot(_slots(store), store->header->capacity, key);
+  if(slot->key == key && slot->length && slot->length <= max_length &&
+     slot->offset + sizeof(dt_mipmap_store_record_t) + slot->length <= store->data_end)
+  {
+    // this is where the page-in happens.
+    const dt_mipmap_store_record_t *rec = (const dt_mipmap_store_record_t *)(store->data + slot->offset);
+    const uint8_t *payload = (const uint8_t *)(rec + 1);
+    if(rec->magic == DT_MIPMAP_STORE_RECORD_MAGIC && rec->key == key && rec->length == slot->length &&
+       rec->checksum == _checksum(payload, rec->length))
+    {
+      memcpy(out, payload, rec->length);
+      *width  = slot->width;
+      *height = slot->height;
+      length = rec->length;
+    }
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return length;
+}
+
+int
+dt_mipmap_store_write(dt_mipmap_store_t *store, const uint32_t key, const uint8_t *in, const size_t length,
+                      const uint32_t width, const uint32_t height)
+{
+  if(!store->header || !key || !length || length > UINT32_MAX) return 1;
+  dt_mipmap_store_record_t rec = { DT_MIPMAP_STORE_RECORD_MAGIC, key, (uint32_t)length, _checksum(in, length) };
+
+  // reserve space at the end and write the record, without blocking readers.
+  pthread_mutex_lock(&store->append_mutex);
+  const size_t offset = store->data_end;
+  int err = pwrite(store->fd_data, &rec, sizeof(rec), offset) != sizeof(rec) ||
+            pwrite(store->fd_data, in, length, offset + sizeof(rec)) != (ssize_t)length;
+
+  // publish it in the index
+  pthread_rwlock_wrlock(&store->lock);
+  if(!err) store->data_end = offset + sizeof(rec) + length;
+  if(!err) err = _map_data(store, store->data_end);
+  if(!err && 4*(store->header->count + 1) > 3*store->header->capacity) err = _grow_index(store);
+  if(!err)
+  {
+    dt_mipmap_store_slot_t *slot = _find_slot(_slots(store), store->header->capacity, key);
+    if(slot->key == key)
+    {
+      store->header->live_bytes -= slot->length;
+      store->header->dead_bytes += slot->length;
+    }
+    else
+      store->header->count++;
+    slot->offset = offset;
+    slot->length = length;
+    slot->width  = width;
+    slot->height = height;
+    slot->key    = key;
+    store->header->live_bytes += length;
+  }
+  pthread_rwlock_unlock(&store->lock);
+  pthread_mutex_unlock(&store->append_mutex);
+  return err;
+}
+
+void
+dt_mipmap_store_remove(dt_mipmap_store_t *store, const uint32_t key)
+{
+  if(!store->header || !key) return;
+  pthread_rwlock_wrlock(&store->lock);
+  dt_mipmap_store_slot_t *slot = _find_slot(_slots(store), store->header->capacity, key);
+  if(slot->key == key && slot->length)
+  {
+    // keep the key, so probing chains stay intact.
+    store->header->live_bytes -= slot->length;
+    store->header->dead_bytes += slot->length;
+    slot->length = 0;
+  }
+  pthread_rwlock_unlock(&store->lock);
+}
+
+#else // __WIN32__
+
+int
+dt_mipmap_store_open(dt_mipmap_store_t *store, const char *filename, const int reset, const int32_t compression_type,
+                     const uint32_t max_width[DT_MIPMAP_STORE_LEVELS], const uint32_t max_height[DT_MIPMAP_STORE_LEVELS])
+{
+  memset(store, 0, sizeof(dt_mipmap_store_t));
+  return 1;
+}
+
+void dt_mipmap_store_close(dt_mipmap_store_t *store) {}
+
+size_t
+dt_mipmap_store_read(dt_mipmap_store_t *store, const uint32_t key, uint8_t *out, const size_t max_length,
+                     uint32_t *width, uint32_t *height)
+{
+  return 0;
+}
+
+int
+dt_mipmap_store_write(dt_mipmap_store_t *store, const uint32_t key, const uint8_t *in, const size_t length,
+                      const uint32_t width, const uint32_t height)
+{
+  return 1;
+}
+
+void dt_mipmap_store_remove(dt_mipmap_store_t *store, const uint32_t key) {}
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
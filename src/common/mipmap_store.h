@@ -0,0 +1,72 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_COMMON_MIPMAP_STORE_H
+#define DT_COMMON_MIPMAP_STORE_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define DT_MIPMAP_STORE_LEVELS 4
+
+/**
+ * persistent thumbnail store backing the 8-bit levels of the mipmap cache.
+ *
+ * two files: an append-only data file holding the (jpeg or dxt compressed) thumbnails,
+ * and an index file which is an open addressing hash table from mipmap cache keys
+ * (imgid and mip level) to records in the data file. both are mmap'ed, so opening the
+ * store is O(1) no matter how many thumbnails it holds, and pages are only read in when
+ * a thumbnail is actually requested. every thumbnail is appended as soon as it has been
+ * generated, and records carry a checksum, so a crash loses at most the last few.
+ */
+typedef struct dt_mipmap_store_t
+{
+  int fd_index, fd_data;
+  struct dt_mipmap_store_header_t *header;  // mapped index file, slots follow the header
+  size_t index_size;
+  uint8_t *data;                            // mapped data file
+  size_t data_mapped, data_end;
+  char filename[1024];
+  // protects the mappings: read for lookups, write for publishing and remapping.
+  pthread_rwlock_t lock;
+  // serializes writers. data_end, the size of the data file, is changed holding both.
+  pthread_mutex_t append_mutex;
+}
+dt_mipmap_store_t;
+
+/** open or create the store at filename(.idx|.dat). if the files were written with different
+ *  settings, or reset is set, the store starts out empty. returns non-zero if the store is unusable,
+ *  in which case all other calls are no-ops. */
+int dt_mipmap_store_open(dt_mipmap_store_t *store, const char *filename, const int reset, const int32_t compression_type,
+                         const uint32_t max_width[DT_MIPMAP_STORE_LEVELS], const uint32_t max_height[DT_MIPMAP_STORE_LEVELS]);
+/** flush to disk, compact the data file if it has too much garbage, and unmap. */
+void dt_mipmap_store_close(dt_mipmap_store_t *store);
+/** copy the record for key into out, which holds max_length bytes. returns the length of
+ *  the record or 0 if there is no valid record. */
+size_t dt_mipmap_store_read(dt_mipmap_store_t *store, const uint32_t key, uint8_t *out, const size_t max_length,
+                            uint32_t *width, uint32_t *height);
+/** append a record for key, replacing any older one. returns non-zero on failure. */
+int dt_mipmap_store_write(dt_mipmap_store_t *store, const uint32_t key, const uint8_t *in, const size_t length,
+                          const uint32_t width, const uint32_t height);
+/** forget the record for key. */
+void dt_mipmap_store_remove(dt_mipmap_store_t *store, const uint32_t key);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
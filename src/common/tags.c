@@ -23,6 +23,9 @@
 #include "control/conf.h"
 #include "control/control.h"
 
+// images per statement of the bulk functions, keeps the sql text well below its limit
+#define DT_TAG_BULK_CHUNK 5000
+
 gboolean dt_tag_new(const char *name,guint *tagid)
 {
   int rt;
@@ -191,67 +194,215 @@ gboolean dt_tag_exists(const char *name,guint *tagid)
   return FALSE;
 }
 
+/* the images to work on: imgid, or the selected images if imgid < 0 */
+static GList *_tag_get_images(gint imgid)
+{
+  if(imgid > 0) return g_list_append(NULL, GINT_TO_POINTER(imgid));
+  GList *imgs = NULL;
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT DISTINCT imgid FROM selected_images", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    imgs = g_list_prepend(imgs, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+  sqlite3_finalize(stmt);
+  return g_list_reverse(imgs);
+}
+
+static void _tag_add_delta(GHashTable *deltas, const guint a, const guint b, const gint64 delta)
+{
+  if(delta == 0) return;
+  guint64 key = a < b ? ((guint64)a << 32) | b : ((guint64)b << 32) | a;
+  gint64 *value = (gint64 *)g_hash_table_lookup(deltas, &key);
+  if(!value)
+  {
+    guint64 *k = g_new(guint64, 1);
+    *k = key;
+    value = g_new0(gint64, 1);
+    g_hash_table_insert(deltas, k, value);
+  }
+  *value += delta;
+}
+
+/* attaches (or detaches) all tags to all images in the comma separated id list, and updates tagxtag the same way
+   as calling dt_tag_attach() (dt_tag_detach()) for every image and tag in list order would:
+   when tag t is attached to image i, the pairs (t, x) and (x, t) are counted up for every tag x which i
+   has by then, t itself included. detaching counts down the pairs with all tags i still has, before
+   t is removed. summed over the images, a pair of t with a tag handled before it in the list changes by
+   the number of images (attach) or not at all (detach), and a pair with any other tag x by the number
+   of images which had x before we started. */
+static void _tag_bulk(GList *tags, const char *ids, const gboolean attach)
+{
+  sqlite3 *db = dt_database_get(darktable.db);
+  sqlite3_stmt *stmt;
+  gchar *query;
+
+  int num_images = 0;
+  query = g_strdup_printf("SELECT COUNT(*) FROM images WHERE id IN (%s)", ids);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, query, -1, &stmt, NULL);
+  if(sqlite3_step(stmt) == SQLITE_ROW) num_images = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  g_free(query);
+
+  // how many of the images have which tag, before we start:
+  GHashTable *counts = g_hash_table_new(NULL, NULL);
+  query = g_strdup_printf("SELECT tagid, COUNT(DISTINCT imgid) FROM tagged_images WHERE imgid IN (%s) GROUP BY tagid", ids);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, query, -1, &stmt, NULL);
+  g_free(query);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    g_hash_table_insert(counts, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)), GINT_TO_POINTER(sqlite3_column_int(stmt, 1)));
+  sqlite3_finalize(stmt);
+
+  GHashTable *deltas = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+  GHashTable *before = g_hash_table_new(NULL, NULL);
+  for(GList *t = tags; t; t = g_list_next(t))
+  {
+    const guint tagid = GPOINTER_TO_INT(t->data);
+    if(attach)
+    {
+      g_hash_table_insert(before, t->data, GINT_TO_POINTER(1));
+      _tag_add_delta(deltas, tagid, tagid, num_images);
+    }
+    else if(!g_hash_table_lookup(before, t->data))
+      _tag_add_delta(deltas, tagid, tagid, -GPOINTER_TO_INT(g_hash_table_lookup(counts, t->data)));
+
+    GHashTableIter it;
+    gpointer key, value;
+    if(attach)
+    {
+      g_hash_table_iter_init(&it, before);
+      while(g_hash_table_iter_next(&it, &key, NULL))
+        if(GPOINTER_TO_INT(key) != tagid) _tag_add_delta(deltas, tagid, GPOINTER_TO_INT(key), num_images);
+    }
+    g_hash_table_iter_init(&it, counts);
+    while(g_hash_table_iter_next(&it, &key, &value))
+      if(GPOINTER_TO_INT(key) != tagid && !g_hash_table_lookup(before, key))
+        _tag_add_delta(deltas, tagid, GPOINTER_TO_INT(key), attach ? GPOINTER_TO_INT(value) : -GPOINTER_TO_INT(value));
+    if(!attach)
+      g_hash_table_insert(before, t->data, GINT_TO_POINTER(1));
+  }
+
+  // now the images themselves, every tag once:
+  query = attach ? g_strdup_printf("INSERT OR REPLACE INTO tagged_images SELECT id, ?1 FROM images WHERE id IN (%s)", ids)
+                 : g_strdup_printf("DELETE FROM tagged_images WHERE tagid = ?1 AND imgid IN (%s)", ids);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, query, -1, &stmt, NULL);
+  g_free(query);
+  GHashTableIter it;
+  gpointer key, value;
+  g_hash_table_iter_init(&it, before);
+  while(g_hash_table_iter_next(&it, &key, NULL))
+  {
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, GPOINTER_TO_INT(key));
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+
+  // and tagxtag, every pair once:
+  DT_DEBUG_SQLITE3_PREPARE_V2(db,
+                              "UPDATE tagxtag SET count = count + ?3 WHERE (id1 = ?1 AND id2 = ?2) OR (id1 = ?2 AND id2 = ?1)",
+                              -1, &stmt, NULL);
+  g_hash_table_iter_init(&it, deltas);
+  while(g_hash_table_iter_next(&it, &key, &value))
+  {
+    const guint64 pair = *(guint64 *)key;
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, pair >> 32);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, pair & 0xffffffff);
+    sqlite3_bind_int64(stmt, 3, *(gint64 *)value);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+
+  g_hash_table_destroy(before);
+  g_hash_table_destroy(deltas);
+  g_hash_table_destroy(counts);
+}
+
+static void _tag_bulk_images(GList *tags, GList *imgs, const gboolean attach)
+{
+  if(!tags || !imgs) return;
+
+  // nests into the transaction of an import, if there is one:
+  dt_database_start_transaction(darktable.db);
+
+  // the ids go into the statements as literals, so concurrent callers can't see each other's images.
+  // sql text is limited in length, so in chunks, every image once:
+  GHashTable *seen = g_hash_table_new(NULL, NULL);
+  GList *i = imgs;
+  while(i)
+  {
+    GString *ids = g_string_new(NULL);
+    for(int n=0; i && n<DT_TAG_BULK_CHUNK; i = g_list_next(i))
+    {
+      if(g_hash_table_lookup(seen, i->data)) continue;
+      g_hash_table_insert(seen, i->data, i->data);
+      g_string_append_printf(ids, "%s%d", ids->len ? "," : "", GPOINTER_TO_INT(i->data));
+      n++;
+    }
+    if(ids->len) _tag_bulk(tags, ids->str, attach);
+    g_string_free(ids, TRUE);
+  }
+  g_hash_table_destroy(seen);
+
+  dt_database_release_transaction(darktable.db);
+}
+
+void dt_tag_attach_images(GList *tags, GList *imgs)
+{
+  _tag_bulk_images(tags, imgs, TRUE);
+}
+
+void dt_tag_detach_images(GList *tags, GList *imgs)
+{
+  _tag_bulk_images(tags, imgs, FALSE);
+}
+
 //FIXME: shall we increment count in tagxtag if the image was already tagged?
 void dt_tag_attach(guint tagid,gint imgid)
 {
   sqlite3_stmt *stmt;
   if(imgid > 0)
   {
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "INSERT OR REPLACE INTO tagged_images (imgid, tagid) VALUES (?1, ?2)",
-                                -1, &stmt, NULL);
+    // this runs for every imported image, keep the statements compiled:
+    stmt = dt_database_prepare_cached(darktable.db, dt_database_get(darktable.db),
+                                      "INSERT OR REPLACE INTO tagged_images (imgid, tagid) VALUES (?1, ?2)");
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, tagid);
     sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    dt_database_release_statement(darktable.db, stmt);
 
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "UPDATE tagxtag SET count = count + 1 WHERE "
-                                "(id1 = ?1 AND id2 IN (SELECT tagid FROM tagged_images WHERE imgid = ?2)) "
-                                "OR "
-                                "(id2 = ?1 AND id1 IN (SELECT tagid FROM tagged_images WHERE imgid = ?2))",
-                                -1, &stmt, NULL);
+    stmt = dt_database_prepare_cached(darktable.db, dt_database_get(darktable.db),
+                                      "UPDATE tagxtag SET count = count + 1 WHERE "
+                                      "(id1 = ?1 AND id2 IN (SELECT tagid FROM tagged_images WHERE imgid = ?2)) "
+                                      "OR "
+                                      "(id2 = ?1 AND id1 IN (SELECT tagid FROM tagged_images WHERE imgid = ?2))");
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
     sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    dt_database_release_statement(darktable.db, stmt);
   }
   else
   {
-    // insert into tagged_images if not there already.
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "INSERT OR REPLACE INTO tagged_images SELECT imgid, ?1 "
-                                "FROM selected_images", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "UPDATE tagxtag SET count = count + 1 WHERE (id1 = ?1 AND id2 IN "
-                                "(SELECT tagid FROM selected_images JOIN tagged_images)) OR "
-                                "(id2 = ?1 AND id1 IN (SELECT tagid FROM selected_images "
-                                "JOIN tagged_images))",
-                                -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    // all selected images at once
+    GList *tags = g_list_append(NULL, GINT_TO_POINTER(tagid));
+    GList *imgs = _tag_get_images(imgid);
+    dt_tag_attach_images(tags, imgs);
+    g_list_free(imgs);
+    g_list_free(tags);
   }
 }
 
 void dt_tag_attach_list(GList *tags,gint imgid)
 {
-  GList *child=NULL;
-  if( (child=g_list_first(tags))!=NULL )
-    do
-    {
-      dt_tag_attach(GPOINTER_TO_INT(child->data), imgid);
-    }
-    while( (child=g_list_next(child)) !=NULL);
+  GList *imgs = _tag_get_images(imgid);
+  dt_tag_attach_images(tags, imgs);
+  g_list_free(imgs);
 }
 
 void dt_tag_attach_string_list(const gchar *tags, gint imgid)
 {
   gchar **tokens = g_strsplit(tags, ",", 0);
+  GList *tagids = NULL;
   if(tokens)
   {
     gchar **entry = tokens;
@@ -267,12 +418,14 @@ void dt_tag_attach_string_list(const gchar *tags, gint imgid)
         // add the tag to the image
         guint tagid = 0;
         dt_tag_new(e,&tagid);
-        dt_tag_attach(tagid, imgid);
+        tagids = g_list_append(tagids, GINT_TO_POINTER(tagid));
       }
       entry++;
     }
   }
   g_strfreev(tokens);
+  dt_tag_attach_list(tagids, imgid);
+  g_list_free(tagids);
 }
 
 void dt_tag_detach(guint tagid,gint imgid)
@@ -302,23 +455,12 @@ void dt_tag_detach(guint tagid,gint imgid)
   }
   else
   {
-    // remove from all selected images
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "update tagxtag set count = count - 1 where (id1 = ?1 and id2 in "
-                                "(select tagid from selected_images join tagged_images)) or (id2 = ?1 "
-                                "and id1 in (select tagid from selected_images join tagged_images))",
-                                -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    // remove from tagged_images
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "delete from tagged_images where tagid = ?1 and imgid in "
-                                "(select imgid from selected_images)", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    // remove from all selected images at once
+    GList *tags = g_list_append(NULL, GINT_TO_POINTER(tagid));
+    GList *imgs = _tag_get_images(imgid);
+    dt_tag_detach_images(tags, imgs);
+    g_list_free(imgs);
+    g_list_free(tags);
   }
 }
 
@@ -52,6 +52,13 @@ void dt_tag_attach_list(GList *tags,gint imgid);
 /** attach a list of tags on selected images. \param[in] tags a comma separated string of tags. \param[in] imgid the image id to attach tag to, if < 0 selected images are used. \note If tag not exists it's created.*/
 void dt_tag_attach_string_list(const gchar *tags, gint imgid);
 
+/** attach a list of tags to a list of images in one transaction. counts in tagxtag end up the same as
+    calling dt_tag_attach() for every image and tag. \param[in] tags a list of tag ids. \param[in] imgs a list of image ids. */
+void dt_tag_attach_images(GList *tags, GList *imgs);
+
+/** detach a list of tags from a list of images in one transaction, like dt_tag_detach() for every image and tag. */
+void dt_tag_detach_images(GList *tags, GList *imgs);
+
 /** detach tag from images. \param[in] tagid if of tag to deattach. \param[in] imgid the image id to attach tag from, if < 0 selected images are used. */
 void dt_tag_detach(guint tagid,gint imgid);
 
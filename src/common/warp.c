@@ -0,0 +1,183 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "common/darktable.h"
+#include "common/warp.h"
+
+#include <math.h>
+#include <string.h>
+#include <xmmintrin.h>
+
+// output pixels mapped in one go, positions for all of them fit on the stack:
+#define DT_WARP_BLOCK 64
+// largest interpolation kernel (lanczos3) is 6 taps, one more to cover a spread of the channels:
+#define DT_WARP_MAX_TAPS 7
+
+void
+dt_warp_init(dt_warp_t *warp)
+{
+  memset(warp, 0, sizeof(dt_warp_t));
+}
+
+int
+dt_warp_append(dt_warp_t *warp, dt_warp_map_t map, const void *data)
+{
+  if(warp->num_maps >= DT_WARP_MAX_MAPS) return 1;
+  warp->map[warp->num_maps] = map;
+  warp->data[warp->num_maps] = data;
+  warp->num_maps++;
+  return 0;
+}
+
+void
+dt_warp_set_rgb(dt_warp_t *warp, dt_warp_map_rgb_t map, const void *data)
+{
+  warp->map_rgb = map;
+  warp->data_rgb = data;
+}
+
+void
+dt_warp_map(const dt_warp_t *warp, float *points, const int count)
+{
+  for(int k = 0; k < warp->num_maps; k++)
+    warp->map[k](warp->data[k], points, count);
+}
+
+void
+dt_warp_pixel4c(const struct dt_interpolation *itor, const float *in, const float x, const float y,
+                const int width, const int height, float *out)
+{
+  const int ix = (int)x, iy = (int)y;
+  if(itor->id != DT_INTERPOLATION_BILINEAR || !(x >= 0.0f && y >= 0.0f && ix < width-1 && iy < height-1))
+  {
+    dt_interpolation_compute_pixel4c(itor, in, out, x, y, width, height, 4*width);
+    return;
+  }
+  // bilinear needs no kernel evaluation nor normalization, just the four neighbours:
+  const float *p = in + 4*((size_t)width*iy + ix);
+  const __m128 wx = _mm_set1_ps(x - ix), wy = _mm_set1_ps(y - iy);
+  const __m128 a = _mm_load_ps(p), b = _mm_load_ps(p + 4);
+  const __m128 c = _mm_load_ps(p + 4*width), d = _mm_load_ps(p + 4*width + 4);
+  const __m128 top = _mm_add_ps(a, _mm_mul_ps(wx, _mm_sub_ps(b, a)));
+  const __m128 bot = _mm_add_ps(c, _mm_mul_ps(wx, _mm_sub_ps(d, c)));
+  _mm_store_ps(out, _mm_add_ps(top, _mm_mul_ps(wy, _mm_sub_ps(bot, top))));
+}
+
+// with lateral ca the positions of the channels are less than a pixel apart, so one window one
+// tap wider than the kernel holds all of them: the lanes of each sse vector are the channels,
+// each with its own kernel weights, zero outside its support. close to the border or further
+// apart the channels are done one by one, as dt_interpolation_compute_sample() does.
+void
+dt_warp_pixel_rgb(const struct dt_interpolation *itor, const float *in, const float *x, const float *y,
+                  const int width, const int height, float *out)
+{
+  const int w = itor->width;
+  const float xmin = fminf(fminf(x[0], x[1]), x[2]), xmax = fmaxf(fmaxf(x[0], x[1]), x[2]);
+  const float ymin = fminf(fminf(y[0], y[1]), y[2]), ymax = fmaxf(fmaxf(y[0], y[1]), y[2]);
+
+  if(!(xmin >= w-1 && ymin >= w-1 && xmax < width-w && ymax < height-w)
+     || (int)xmax - (int)xmin > 1 || (int)ymax - (int)ymin > 1)
+  {
+    for(int c = 0; c < 4; c++)
+    {
+      const int k = c == 3 ? 1 : c;
+      out[c] = dt_interpolation_compute_sample(itor, in+c, x[k], y[k], width, height, 4, 4*width);
+    }
+    return;
+  }
+
+  const int fx = (int)xmin - w + 1, fy = (int)ymin - w + 1;
+  const int tx = 2*w + (int)xmax - (int)xmin, ty = 2*w + (int)ymax - (int)ymin;
+  const __m128 vw = _mm_set1_ps(w);
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  const __m128 vx = _mm_set_ps(x[1], x[2], x[1], x[0]);
+  const __m128 vy = _mm_set_ps(y[1], y[2], y[1], y[0]);
+
+  __m128 kh[DT_WARP_MAX_TAPS], kv[DT_WARP_MAX_TAPS];
+  __m128 normh = _mm_setzero_ps(), normv = _mm_setzero_ps();
+  for(int i = 0; i < tx; i++)
+  {
+    const __m128 t = _mm_sub_ps(vx, _mm_set1_ps(fx + i));
+    const __m128 inside = _mm_cmplt_ps(_mm_andnot_ps(sign, t), vw);
+    kh[i] = _mm_and_ps(inside, itor->funcsse(vw, t));
+    normh = _mm_add_ps(normh, kh[i]);
+  }
+  for(int j = 0; j < ty; j++)
+  {
+    const __m128 t = _mm_sub_ps(vy, _mm_set1_ps(fy + j));
+    const __m128 inside = _mm_cmplt_ps(_mm_andnot_ps(sign, t), vw);
+    kv[j] = _mm_and_ps(inside, itor->funcsse(vw, t));
+    normv = _mm_add_ps(normv, kv[j]);
+  }
+
+  const float *p = in + 4*((size_t)width*fy + fx);
+  __m128 s = _mm_setzero_ps();
+  for(int j = 0; j < ty; j++, p += 4*width)
+  {
+    __m128 h = _mm_setzero_ps();
+    for(int i = 0; i < tx; i++) h = _mm_add_ps(h, _mm_mul_ps(kh[i], _mm_load_ps(p + 4*i)));
+    s = _mm_add_ps(s, _mm_mul_ps(kv[j], h));
+  }
+  _mm_store_ps(out, _mm_div_ps(s, _mm_mul_ps(normh, normv)));
+}
+
+void
+dt_warp_process(const dt_warp_t *warp, const struct dt_interpolation *itor, const float *in,
+                const dt_iop_roi_t *roi_in, float *out, const dt_iop_roi_t *roi_out)
+{
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(warp, itor, in, roi_in, out, roi_out) schedule(static)
+#endif
+  for(int j = 0; j < roi_out->height; j++)
+  {
+    float points[2*DT_WARP_BLOCK];
+    float rgb[6*DT_WARP_BLOCK];
+    for(int i0 = 0; i0 < roi_out->width; i0 += DT_WARP_BLOCK)
+    {
+      const int n = MIN(DT_WARP_BLOCK, roi_out->width - i0);
+      for(int k = 0; k < n; k++)
+      {
+        points[2*k]   = roi_out->x + i0 + k;
+        points[2*k+1] = roi_out->y + j;
+      }
+      dt_warp_map(warp, points, n);
+
+      float *o = out + 4*((size_t)roi_out->width*j + i0);
+      if(warp->map_rgb)
+      {
+        warp->map_rgb(warp->data_rgb, points, n, rgb);
+        for(int k = 0; k < n; k++, o += 4)
+        {
+          const float *p = rgb + 6*k;
+          const float x[3] = { p[0] - roi_in->x, p[2] - roi_in->x, p[4] - roi_in->x };
+          const float y[3] = { p[1] - roi_in->y, p[3] - roi_in->y, p[5] - roi_in->y };
+          dt_warp_pixel_rgb(itor, in, x, y, roi_in->width, roi_in->height, o);
+        }
+      }
+      else
+      {
+        for(int k = 0; k < n; k++, o += 4)
+          dt_warp_pixel4c(itor, in, points[2*k] - roi_in->x, points[2*k+1] - roi_in->y,
+                          roi_in->width, roi_in->height, o);
+      }
+    }
+  }
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,73 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_COMMON_WARP_H
+#define DT_COMMON_WARP_H
+
+#include "common/interpolation.h"
+
+#define DT_WARP_MAX_MAPS 8
+
+/** maps count points (x and y, absolute coordinates) in place, from the output of a distortion
+ *  back to its input. this is the contract of the distort_backtransform() hook of the modules. */
+typedef void (*dt_warp_map_t)(const void *data, float *points, const int count);
+
+/** like dt_warp_map_t, but red, green and blue come from different places (lateral ca): writes
+ *  the x and y of all three, 6 floats per point, to rgb. */
+typedef void (*dt_warp_map_rgb_t)(const void *data, const float *points, const int count, float *rgb);
+
+/**
+ * a chain of inverse mappings for resampling a 4 channel buffer. the first map gets the
+ * positions of the output pixels and each one hands its result to the next, so a series of
+ * distortions is interpolated once: sharper and cheaper than resampling after every step.
+ * an optional per channel map goes last.
+ */
+typedef struct dt_warp_t
+{
+  int num_maps;
+  dt_warp_map_t map[DT_WARP_MAX_MAPS];
+  const void *data[DT_WARP_MAX_MAPS];
+  dt_warp_map_rgb_t map_rgb;
+  const void *data_rgb;
+}
+dt_warp_t;
+
+void dt_warp_init(dt_warp_t *warp);
+/** append an inverse mapping, returns non-zero if the chain is full. */
+int dt_warp_append(dt_warp_t *warp, dt_warp_map_t map, const void *data);
+/** set the per channel mapping applied after all others. */
+void dt_warp_set_rgb(dt_warp_t *warp, dt_warp_map_rgb_t map, const void *data);
+/** run count points through all mappings but the per channel one. */
+void dt_warp_map(const dt_warp_t *warp, float *points, const int count);
+
+/** fill roi_out with the 4 channel input in (covering roi_in), sampled where the chain maps
+ *  every output pixel to. rows are done in parallel, positions are mapped a block at a time. */
+void dt_warp_process(const dt_warp_t *warp, const struct dt_interpolation *itor, const float *in,
+                     const dt_iop_roi_t *roi_in, float *out, const dt_iop_roi_t *roi_out);
+
+/** interpolate all 4 channels at (x, y), relative to the buffer. */
+void dt_warp_pixel4c(const struct dt_interpolation *itor, const float *in, const float x, const float y,
+                     const int width, const int height, float *out);
+
+/** interpolate red, green and blue each at its own position x[c], y[c], alpha at green's. */
+void dt_warp_pixel_rgb(const struct dt_interpolation *itor, const float *in, const float *x, const float *y,
+                       const int width, const int height, float *out);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
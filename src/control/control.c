@@ -58,6 +58,88 @@
 */
 static void * _control_worker_kicker(void *ptr);
 
+/* what a worker thread gets passed on creation */
+typedef struct _control_worker_params_t
+{
+  dt_control_t *self;
+  int32_t threadid;
+}
+_control_worker_params_t;
+static _control_worker_params_t *_control_worker_params = NULL;
+
+/* two jobs are equivalent if they run the same function on the same parameters.
+    the hash decides which worker queue a job goes to, so duplicates always meet. */
+static guint _control_job_hash(gconstpointer key)
+{
+  const dt_job_t *j = (const dt_job_t *)key;
+  // fnv-1a
+  uint32_t hash = 2166136261u;
+  const uint8_t *c = (const uint8_t *)&j->execute;
+  for(size_t k=0; k<sizeof(j->execute); k++) hash = (hash ^ c[k]) * 16777619u;
+  c = (const uint8_t *)j->param;
+  for(size_t k=0; k<sizeof(j->param); k++) hash = (hash ^ c[k]) * 16777619u;
+  return hash;
+}
+
+static gboolean _control_job_equal(gconstpointer a, gconstpointer b)
+{
+  const dt_job_t *ja = (const dt_job_t *)a, *jb = (const dt_job_t *)b;
+  return ja->execute == jb->execute && !memcmp(ja->param, jb->param, sizeof(ja->param));
+}
+
+/* ring buffer operations on one priority class, queue mutex has to be held. */
+static int _control_queue_push_back(dt_control_queue_t *q, const int p, dt_job_t *j)
+{
+  if(q->count[p] >= DT_CONTROL_MAX_JOBS) return 1;
+  q->jobs[p][(q->head[p] + q->count[p]) & (DT_CONTROL_QUEUE_SIZE-1)] = j;
+  q->count[p]++;
+  return 0;
+}
+
+static int _control_queue_push_front(dt_control_queue_t *q, const int p, dt_job_t *j)
+{
+  if(q->count[p] >= DT_CONTROL_MAX_JOBS) return 1;
+  q->head[p] = (q->head[p] - 1) & (DT_CONTROL_QUEUE_SIZE-1);
+  q->jobs[p][q->head[p]] = j;
+  q->count[p]++;
+  return 0;
+}
+
+static dt_job_t *_control_queue_pop(dt_control_queue_t *q, const int p)
+{
+  if(!q->count[p]) return NULL;
+  dt_job_t *j = q->jobs[p][q->head[p]];
+  q->head[p] = (q->head[p] + 1) & (DT_CONTROL_QUEUE_SIZE-1);
+  q->count[p]--;
+  return j;
+}
+
+static void _control_queue_remove(dt_control_queue_t *q, const int p, dt_job_t *j)
+{
+  int k = 0;
+  for(; k<q->count[p]; k++)
+    if(q->jobs[p][(q->head[p] + k) & (DT_CONTROL_QUEUE_SIZE-1)] == j) break;
+  if(k == q->count[p]) return;
+  // close the gap, queues are short.
+  for(; k<q->count[p]-1; k++)
+    q->jobs[p][(q->head[p] + k) & (DT_CONTROL_QUEUE_SIZE-1)] = q->jobs[p][(q->head[p] + k + 1) & (DT_CONTROL_QUEUE_SIZE-1)];
+  q->count[p]--;
+}
+
+static inline dt_control_queue_t *_control_queue_for_job(dt_control_t *s, const dt_job_t *j)
+{
+  return s->queues + _control_job_hash(j) % s->num_threads;
+}
+
+/* wake exactly one sleeping worker, if any. it will find the job by stealing. */
+static void _control_wake_worker(dt_control_t *s)
+{
+  if(__sync_fetch_and_add(&s->idle, 0) <= 0) return;
+  dt_pthread_mutex_lock(&s->idle_mutex);
+  pthread_cond_signal(&s->idle_cond);
+  dt_pthread_mutex_unlock(&s->idle_mutex);
+}
+
 /* redraw mutex to synchronize redraws */
 static dt_pthread_mutex_t _control_gdk_lock_threads_mutex;
 
@@ -486,6 +568,17 @@ void dt_control_create_database_schema()
                         NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "CREATE INDEX metadata_index ON meta_data (id,key)", NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
+                        "create table exif_cache (filename varchar primary key, size integer, mtime integer, inode integer, "
+                        "embedded integer, maker varchar, model varchar, lens varchar, exposure real, aperture real, "
+                        "iso real, focal_length real, focus_distance real, crop real, datetime_taken char(20), "
+                        "orientation integer, longitude double, latitude double, width int, height int, "
+                        "colorspace integer, color_matrix blob)",
+                        NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
+                        "create table xmp_cache (imgid integer primary key, filename varchar, size integer, mtime integer, "
+                        "inode integer, hash integer)",
+                        NULL, NULL, NULL);
   // quick hack to detect if the db is already used by another process
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "create table lock (id integer)",
@@ -522,16 +615,31 @@ void dt_control_init(dt_control_t *s)
   dt_pthread_mutex_init(&s->cond_mutex, NULL);
   dt_pthread_mutex_init(&s->queue_mutex, NULL);
   dt_pthread_mutex_init(&s->run_mutex, NULL);
+  pthread_cond_init(&s->idle_cond, NULL);
+  dt_pthread_mutex_init(&s->idle_mutex, NULL);
   pthread_rwlock_init(&s->xprofile_lock, NULL);
 
   // start threads
   s->num_threads = CLAMP(dt_conf_get_int ("worker_threads"), 1, 8);
   s->thread = (pthread_t *)malloc(sizeof(pthread_t)*s->num_threads);
+  s->queues = (dt_control_queue_t *)calloc(s->num_threads, sizeof(dt_control_queue_t));
+  for(int k=0; k<s->num_threads; k++)
+  {
+    dt_pthread_mutex_init(&s->queues[k].mutex, NULL);
+    s->queues[k].index = g_hash_table_new(_control_job_hash, _control_job_equal);
+  }
+  s->queued = s->idle = 0;
+  s->scheduled = NULL;
+  _control_worker_params = (_control_worker_params_t *)malloc(sizeof(_control_worker_params_t)*s->num_threads);
   dt_pthread_mutex_lock(&s->run_mutex);
   s->running = 1;
   dt_pthread_mutex_unlock(&s->run_mutex);
   for(int k=0; k<s->num_threads; k++)
-    pthread_create(&s->thread[k], NULL, dt_control_work, s);
+  {
+    _control_worker_params[k].self = s;
+    _control_worker_params[k].threadid = k;
+    pthread_create(&s->thread[k], NULL, dt_control_work, _control_worker_params + k);
+  }
 
   /* create queue kicker thread */
   pthread_create(&s->kick_on_workers_thread, NULL, _control_worker_kicker, s);
@@ -803,6 +911,19 @@ void dt_control_init(dt_control_t *s)
       sqlite3_exec(dt_database_get(darktable.db), "update images set max_version=(select count(*)-1 from images i where i.filename=images.filename and i.film_id=images.film_id) where max_version is NULL", NULL, NULL, NULL);
       sqlite3_exec(dt_database_get(darktable.db), "update images set version=(select count(*) from images i where i.filename=images.filename and i.film_id=images.film_id and i.id<images.id) where version is NULL", NULL, NULL, NULL);
 
+      // metadata parsed from image files and sidecars, valid as long as the file keeps its size, mtime and inode:
+      sqlite3_exec(dt_database_get(darktable.db),
+                   "create table exif_cache (filename varchar primary key, size integer, mtime integer, inode integer, "
+                   "embedded integer, maker varchar, model varchar, lens varchar, exposure real, aperture real, "
+                   "iso real, focal_length real, focus_distance real, crop real, datetime_taken char(20), "
+                   "orientation integer, longitude double, latitude double, width int, height int, "
+                   "colorspace integer, color_matrix blob)",
+                   NULL, NULL, NULL);
+      sqlite3_exec(dt_database_get(darktable.db),
+                   "create table xmp_cache (imgid integer primary key, filename varchar, size integer, mtime integer, "
+                   "inode integer, hash integer)",
+                   NULL, NULL, NULL);
+
       dt_pthread_mutex_unlock(&(darktable.control->global_mutex));
     }
     dt_control_sanitize_database();
@@ -897,6 +1018,9 @@ void dt_control_shutdown(dt_control_t *s)
   dt_pthread_mutex_unlock(&s->run_mutex);
   dt_pthread_mutex_unlock(&s->cond_mutex);
   pthread_cond_broadcast(&s->cond);
+  dt_pthread_mutex_lock(&s->idle_mutex);
+  pthread_cond_broadcast(&s->idle_cond);
+  dt_pthread_mutex_unlock(&s->idle_mutex);
 
   /* cancel background job if any */
   dt_control_job_cancel(&s->job_res[DT_CTL_WORKER_7]);
@@ -927,8 +1051,25 @@ void dt_control_cleanup(dt_control_t *s)
   // vacuum TODO: optional?
   // DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "PRAGMA incremental_vacuum(0)", NULL, NULL, NULL);
   // DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "vacuum", NULL, NULL, NULL);
+  // drop the jobs nobody got around to
+  for(int k=0; s->queues && k<s->num_threads; k++)
+  {
+    dt_job_t *j;
+    for(int p=0; p<DT_JOB_PRIORITY_COUNT; p++)
+      while((j = _control_queue_pop(s->queues + k, p))) g_free(j);
+    g_hash_table_destroy(s->queues[k].index);
+    dt_pthread_mutex_destroy(&s->queues[k].mutex);
+  }
+  free(s->queues);
+  s->queues = NULL;
+  free(_control_worker_params);
+  _control_worker_params = NULL;
+  g_list_free_full(s->scheduled, g_free);
+  s->scheduled = NULL;
   dt_pthread_mutex_destroy(&s->queue_mutex);
   dt_pthread_mutex_destroy(&s->cond_mutex);
+  dt_pthread_mutex_destroy(&s->idle_mutex);
+  pthread_cond_destroy(&s->idle_cond);
   dt_pthread_mutex_destroy(&s->log_mutex);
   dt_pthread_mutex_destroy(&s->run_mutex);
   pthread_rwlock_destroy(&s->xprofile_lock);
@@ -950,6 +1091,7 @@ void dt_control_job_init(dt_job_t *j, const char *msg, ...)
   va_end(ap);
 #endif
   j->state = DT_JOB_STATE_INITIALIZED;
+  j->priority = DT_JOB_PRIORITY_NORMAL;
   dt_pthread_mutex_init (&j->state_mutex,NULL);
   dt_pthread_mutex_init (&j->wait_mutex,NULL);
 }
@@ -960,6 +1102,11 @@ void dt_control_job_set_state_callback(dt_job_t *j,dt_job_state_change_callback
   j->user_data = user_data;
 }
 
+void dt_control_job_set_priority(dt_job_t *j, int32_t priority)
+{
+  j->priority = CLAMP(priority, DT_JOB_PRIORITY_HIGH, DT_JOB_PRIORITY_LOW);
+}
+
 
 void dt_control_job_print(dt_job_t *j)
 {
@@ -1039,55 +1186,34 @@ int32_t dt_control_run_job_res(dt_control_t *s, int32_t res)
 }
 
 
-int32_t dt_control_run_job(dt_control_t *s)
+/* take the most urgent job: highest priority class first, own queue before stealing from the others. */
+static dt_job_t *_control_take_job(dt_control_t *s, const int32_t threadid)
 {
-  dt_job_t *j=NULL,*bj=NULL;
-  dt_pthread_mutex_lock(&s->queue_mutex);
-
-  /* check if queue is empty */
-  if(g_list_length(s->queue) == 0)
+  for(int p=0; p<DT_JOB_PRIORITY_COUNT; p++)
   {
-    dt_pthread_mutex_unlock(&s->queue_mutex);
-    return -1;
-  }
-
-  /* go thru the queue and find one normal job and a background job
-      that is up for execution.*/
-  time_t ts_now = time(NULL);
-  GList *jobitem=g_list_first(s->queue);
-  if(jobitem)
-    do
+    for(int k=0; k<s->num_threads; k++)
     {
-      dt_job_t *tj = jobitem->data;
-
-      /* check if it's a scheduled job and is waiting to be executed */
-      if(!bj && (tj->ts_execute > tj->ts_added) && tj->ts_execute <= ts_now)
-        bj = tj;
-      else if ((tj->ts_execute < tj->ts_added) && !j)
-        j = tj;
-
-      /* if we got a normal job, and a background job, we are finished */
-      if(bj && j) break;
-
+      dt_control_queue_t *q = s->queues + (threadid + k) % s->num_threads;
+      // unlocked peek, only to skip empty queues. checked again under the lock.
+      if(!q->count[p]) continue;
+      dt_pthread_mutex_lock(&q->mutex);
+      dt_job_t *j = _control_queue_pop(q, p);
+      if(j) g_hash_table_remove(q->index, j);
+      dt_pthread_mutex_unlock(&q->mutex);
+      if(j)
+      {
+        __sync_fetch_and_sub(&s->queued, 1);
+        return j;
+      }
     }
-    while ((jobitem = g_list_next(jobitem)));
-
-  /* remove the found jobs from queue */
-  if (bj)
-    s->queue = g_list_remove(s->queue, bj);
-
-  if (j)
-    s->queue = g_list_remove(s->queue, j);
+  }
+  return NULL;
+}
 
-  /* unlock the queue */
-  dt_pthread_mutex_unlock(&s->queue_mutex);
+static int32_t _control_run_job(dt_control_t *s, const int32_t threadid)
+{
+  dt_job_t *j = _control_take_job(s, threadid);
 
-  /* push background job on reserved background worker */
-  if(bj)
-  {
-    dt_control_add_job_res(s,bj,DT_CTL_WORKER_7);
-    g_free (bj);
-  }
   /* don't continue if we don't have have a job to execute */
   if(!j)
     return -1;
@@ -1097,7 +1223,7 @@ int32_t dt_control_run_job(dt_control_t *s)
   if (dt_control_job_get_state (j) == DT_JOB_STATE_QUEUED)
   {
     dt_print(DT_DEBUG_CONTROL, "[run_job+] %02d %f ",
-             DT_CTL_WORKER_RESERVED+dt_control_get_threadid(), dt_get_wtime());
+             DT_CTL_WORKER_RESERVED+threadid, dt_get_wtime());
     dt_control_job_print(j);
     dt_print(DT_DEBUG_CONTROL, "\n");
 
@@ -1109,20 +1235,22 @@ int32_t dt_control_run_job(dt_control_t *s)
     _control_job_set_state (j,DT_JOB_STATE_FINISHED);
 
     dt_print(DT_DEBUG_CONTROL, "[run_job-] %02d %f ",
-             DT_CTL_WORKER_RESERVED+dt_control_get_threadid(), dt_get_wtime());
+             DT_CTL_WORKER_RESERVED+threadid, dt_get_wtime());
     dt_control_job_print(j);
     dt_print(DT_DEBUG_CONTROL, "\n");
-
-    /* free job */
-    dt_pthread_mutex_unlock (&j->wait_mutex);
-    g_free(j);
-    j = NULL;
   }
-  if(j) dt_pthread_mutex_unlock (&j->wait_mutex);
+  /* free job, cancelled ones are dropped without running */
+  dt_pthread_mutex_unlock (&j->wait_mutex);
+  g_free(j);
 
   return 0;
 }
 
+int32_t dt_control_run_job(dt_control_t *s)
+{
+  return _control_run_job(s, dt_control_get_threadid());
+}
+
 int32_t dt_control_add_job_res(dt_control_t *s, dt_job_t *job, int32_t res)
 {
   // TODO: pthread cancel and restart in tough cases?
@@ -1160,84 +1288,99 @@ int32_t dt_control_add_job(dt_control_t *s, dt_job_t *job)
   if (job->ts_added == 0)
     job->ts_added = time(NULL);
 
-  dt_pthread_mutex_lock(&s->queue_mutex);
-
-  /* check if equivalent job exist in queue, and discard job
-      if duplicate found .*/
-  GList *jobitem = g_list_first(s->queue);
-  if(jobitem)
-    do
+  /* delayed jobs wait in their own list for the kicker thread */
+  if(job->ts_execute > job->ts_added)
+  {
+    dt_pthread_mutex_lock(&s->queue_mutex);
+    for(GList *jobitem = s->scheduled; jobitem; jobitem = g_list_next(jobitem))
     {
-      if(!memcmp(job, jobitem->data, sizeof(dt_job_t)))
+      if(_control_job_equal(job, jobitem->data))
       {
-        dt_print(DT_DEBUG_CONTROL, "[add_job] found job already in queue\n");
+        dt_print(DT_DEBUG_CONTROL, "[add_job] found job already scheduled\n");
         _control_job_set_state (job,DT_JOB_STATE_DISCARDED);
         dt_pthread_mutex_unlock(&s->queue_mutex);
         return -1;
       }
     }
-    while((jobitem=g_list_next(jobitem)));
+    dt_job_t *thejob = g_malloc(sizeof(dt_job_t));
+    memcpy(thejob,job,sizeof(dt_job_t));
+    _control_job_set_state (thejob,DT_JOB_STATE_QUEUED);
+    s->scheduled = g_list_append(s->scheduled, thejob);
+    dt_pthread_mutex_unlock(&s->queue_mutex);
+    return 0;
+  }
+
+  dt_control_queue_t *q = _control_queue_for_job(s, job);
+  dt_pthread_mutex_lock(&q->mutex);
+
+  /* check if equivalent job exist in queue, and discard job
+      if duplicate found .*/
+  if(g_hash_table_lookup(q->index, job))
+  {
+    dt_print(DT_DEBUG_CONTROL, "[add_job] found job already in queue\n");
+    _control_job_set_state (job,DT_JOB_STATE_DISCARDED);
+    dt_pthread_mutex_unlock(&q->mutex);
+    return -1;
+  }
 
-  dt_print(DT_DEBUG_CONTROL, "[add_job] %d ", g_list_length(s->queue));
+  dt_print(DT_DEBUG_CONTROL, "[add_job] %d ", __sync_fetch_and_add(&s->queued, 0));
   dt_control_job_print(job);
   dt_print(DT_DEBUG_CONTROL, "\n");
 
   /* add job to queue if not full, otherwise discard the job */
-  if( g_list_length(s->queue) < DT_CONTROL_MAX_JOBS)
+  const int p = CLAMP(job->priority, DT_JOB_PRIORITY_HIGH, DT_JOB_PRIORITY_LOW);
+  if(q->count[p] < DT_CONTROL_MAX_JOBS)
   {
     /* allocate storage for the job, and set job state */
     dt_job_t *thejob = g_malloc(sizeof(dt_job_t));
     memcpy(thejob,job,sizeof(dt_job_t));
+    thejob->priority = p;
     _control_job_set_state (thejob,DT_JOB_STATE_QUEUED);
-    s->queue = g_list_append(s->queue, thejob);
-    dt_pthread_mutex_unlock(&s->queue_mutex);
+    _control_queue_push_back(q, p, thejob);
+    g_hash_table_insert(q->index, thejob, thejob);
+    dt_pthread_mutex_unlock(&q->mutex);
   }
   else
   {
     dt_print(DT_DEBUG_CONTROL, "[add_job] too many jobs in queue!\n");
     _control_job_set_state (job,DT_JOB_STATE_DISCARDED);
-    dt_pthread_mutex_unlock(&s->queue_mutex);
+    dt_pthread_mutex_unlock(&q->mutex);
     return -1;
   }
 
   // notify workers
-  dt_pthread_mutex_lock(&s->cond_mutex);
-  pthread_cond_broadcast(&s->cond);
-  dt_pthread_mutex_unlock(&s->cond_mutex);
+  __sync_fetch_and_add(&s->queued, 1);
+  _control_wake_worker(s);
   return 0;
 }
 
 int32_t dt_control_revive_job(dt_control_t *s, dt_job_t *job)
 {
   int32_t found_j = -1;
-  dt_pthread_mutex_lock(&s->queue_mutex);
+  dt_control_queue_t *q = _control_queue_for_job(s, job);
+  dt_pthread_mutex_lock(&q->mutex);
   dt_print(DT_DEBUG_CONTROL, "[revive_job] ");
   dt_control_job_print(job);
   dt_print(DT_DEBUG_CONTROL, "\n");
 
   /* find equivalent job and move it to top of the stack */
-  GList *jobitem = g_list_first(s->queue);
-  if (jobitem)
-    do
-    {
-      if(!memcmp(job, jobitem->data, sizeof(dt_job_t)))
-      {
-        s->queue = g_list_remove_link(s->queue, jobitem);
-        s->queue = g_list_insert(s->queue, jobitem->data, 0);
-        g_free(jobitem);
-        found_j = 1;
-        break;
-      }
-    }
-    while((jobitem=g_list_next(jobitem)));
+  dt_job_t *thejob = (dt_job_t *)g_hash_table_lookup(q->index, job);
+  if(thejob)
+  {
+    const int p = thejob->priority;
+    _control_queue_remove(q, p, thejob);
+    if(_control_queue_push_front(q, DT_JOB_PRIORITY_HIGH, thejob))
+      _control_queue_push_front(q, p, thejob); // high class is full, stay in our own.
+    else
+      thejob->priority = DT_JOB_PRIORITY_HIGH;
+    found_j = 1;
+  }
 
   /* unlock the queue */
-  dt_pthread_mutex_unlock(&s->queue_mutex);
+  dt_pthread_mutex_unlock(&q->mutex);
 
   /* notify workers */
-  dt_pthread_mutex_lock(&s->cond_mutex);
-  pthread_cond_broadcast(&s->cond);
-  dt_pthread_mutex_unlock(&s->cond_mutex);
+  if(found_j > 0) _control_wake_worker(s);
   return found_j;
 }
 
@@ -1269,11 +1412,13 @@ void *dt_control_work_res(void *ptr)
     // dt_print(DT_DEBUG_CONTROL, "[control_work] %d\n", threadid);
     if(dt_control_run_job_res(s, threadid) < 0)
     {
-      // wait for a new job.
+      // wait for a new job. dt_control_add_job_res() sets new_res before it broadcasts under
+      // cond_mutex, so looking again under that mutex can't miss the wakeup.
       int old;
       pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
       dt_pthread_mutex_lock(&s->cond_mutex);
-      dt_pthread_cond_wait(&s->cond, &s->cond_mutex);
+      if(!s->new_res[threadid] && dt_control_running())
+        dt_pthread_cond_wait(&s->cond, &s->cond_mutex);
       dt_pthread_mutex_unlock(&s->cond_mutex);
       pthread_setcancelstate(old, NULL);
     }
@@ -1287,9 +1432,27 @@ void * _control_worker_kicker(void *ptr)
   while(dt_control_running())
   {
     sleep(2);
-    dt_pthread_mutex_lock(&s->cond_mutex);
-    pthread_cond_broadcast(&s->cond);
-    dt_pthread_mutex_unlock(&s->cond_mutex);
+
+    /* push the first due background job on the reserved background worker */
+    time_t ts_now = time(NULL);
+    dt_job_t *bj = NULL;
+    dt_pthread_mutex_lock(&s->queue_mutex);
+    for(GList *jobitem = s->scheduled; jobitem; jobitem = g_list_next(jobitem))
+    {
+      dt_job_t *tj = (dt_job_t *)jobitem->data;
+      if(tj->ts_execute <= ts_now)
+      {
+        bj = tj;
+        s->scheduled = g_list_delete_link(s->scheduled, jobitem);
+        break;
+      }
+    }
+    dt_pthread_mutex_unlock(&s->queue_mutex);
+    if(bj)
+    {
+      dt_control_add_job_res(s,bj,DT_CTL_WORKER_7);
+      g_free (bj);
+    }
   }
   return NULL;
 }
@@ -1299,17 +1462,22 @@ void *dt_control_work(void *ptr)
 #ifdef _OPENMP // need to do this in every thread
   omp_set_num_threads(darktable.num_openmp_threads);
 #endif
-  dt_control_t *s = (dt_control_t *)ptr;
-  // int32_t threadid = dt_control_get_threadid();
+  _control_worker_params_t *params = (_control_worker_params_t *)ptr;
+  dt_control_t *s = params->self;
+  const int32_t threadid = params->threadid;
   while(dt_control_running())
   {
     // dt_print(DT_DEBUG_CONTROL, "[control_work] %d\n", threadid);
-    if(dt_control_run_job(s) < 0)
+    if(_control_run_job(s, threadid) < 0)
     {
-      // wait for a new job.
-      dt_pthread_mutex_lock(&s->cond_mutex);
-      dt_pthread_cond_wait(&s->cond, &s->cond_mutex);
-      dt_pthread_mutex_unlock(&s->cond_mutex);
+      // wait for a new job. announce we're idle first, then look again,
+      // so a job added in between will either be seen here or wake us up.
+      dt_pthread_mutex_lock(&s->idle_mutex);
+      __sync_fetch_and_add(&s->idle, 1);
+      if(__sync_fetch_and_add(&s->queued, 0) <= 0 && dt_control_running())
+        dt_pthread_cond_wait(&s->idle_cond, &s->idle_mutex);
+      __sync_fetch_and_sub(&s->idle, 1);
+      dt_pthread_mutex_unlock(&s->idle_mutex);
     }
   }
   return NULL;
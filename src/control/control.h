@@ -33,7 +33,11 @@
 #include "libs/lib.h"
 // #include "control/job.def"
 
+// queued jobs per worker queue and priority class, so up to
+// DT_CONTROL_MAX_JOBS * num_threads * DT_JOB_PRIORITY_COUNT in total.
 #define DT_CONTROL_MAX_JOBS 30
+// ring buffer size of the per-worker job queues, power of two >= DT_CONTROL_MAX_JOBS
+#define DT_CONTROL_QUEUE_SIZE 32
 #define DT_CONTROL_JOB_DEBUG
 #define DT_CONTROL_DESCRIPTION_LEN 256
 // reserved workers
@@ -151,6 +155,11 @@ typedef void (*dt_job_state_change_callback)(struct dt_job_t*,int state);
 #define DT_JOB_STATE_FINISHED       3
 #define DT_JOB_STATE_CANCELLED      4
 #define DT_JOB_STATE_DISCARDED      5
+/* priority classes, workers always drain higher classes first */
+#define DT_JOB_PRIORITY_HIGH        0
+#define DT_JOB_PRIORITY_NORMAL      1
+#define DT_JOB_PRIORITY_LOW         2
+#define DT_JOB_PRIORITY_COUNT       3
 typedef struct dt_job_t
 {
   int32_t (*execute) (struct dt_job_t *job);
@@ -166,6 +175,7 @@ typedef struct dt_job_t
   dt_pthread_mutex_t wait_mutex;
 
   int32_t state;
+  int32_t priority;
   dt_job_state_change_callback state_changed_cb;
   void *user_data;
 
@@ -180,6 +190,8 @@ dt_job_t;
 void dt_control_job_init(dt_job_t *j, const char *msg, ...);
 /** setup a state callback for job. */
 void dt_control_job_set_state_callback(dt_job_t *j,dt_job_state_change_callback cb,void *user_data);
+/** set the priority class of a job, has to be done before adding it. */
+void dt_control_job_set_priority(dt_job_t *j, int32_t priority);
 void dt_control_job_print(dt_job_t *j);
 /** cancel a job, running or in queue. */
 void dt_control_job_cancel(dt_job_t *j);
@@ -198,6 +210,21 @@ typedef struct dt_control_accels_t
 
 } dt_control_accels_t;
 
+/**
+ * job queue owned by one worker thread. it holds one ring buffer per
+ * priority class, other workers steal from it when they run dry.
+ */
+typedef struct dt_control_queue_t
+{
+  dt_pthread_mutex_t mutex;
+  dt_job_t *jobs[DT_JOB_PRIORITY_COUNT][DT_CONTROL_QUEUE_SIZE];
+  int32_t head[DT_JOB_PRIORITY_COUNT];
+  int32_t count[DT_JOB_PRIORITY_COUNT];
+  // the queued jobs, to find duplicates in O(1)
+  GHashTable *index;
+}
+dt_control_queue_t;
+
 #define DT_CTL_LOG_SIZE 10
 #define DT_CTL_LOG_MSG_SIZE 200
 #define DT_CTL_LOG_TIMEOUT 20000
@@ -258,7 +285,14 @@ typedef struct dt_control_t
   pthread_cond_t cond;
   int32_t num_threads;
   pthread_t *thread,kick_on_workers_thread;
-  GList *queue;
+  // one queue per worker, jobs are placed by their hash so duplicates meet.
+  dt_control_queue_t *queues;
+  // total number of queued jobs and sleeping workers, atomic access only.
+  int32_t queued, idle;
+  dt_pthread_mutex_t idle_mutex;
+  pthread_cond_t idle_cond;
+  // delayed background jobs, waiting for the kicker thread. protected by queue_mutex.
+  GList *scheduled;
   dt_job_t job_res[DT_CTL_WORKER_RESERVED];
   uint8_t new_res[DT_CTL_WORKER_RESERVED];
   pthread_t thread_res[DT_CTL_WORKER_RESERVED];
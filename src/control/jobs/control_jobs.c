@@ -59,6 +59,7 @@ void dt_control_write_sidecar_files()
 {
   dt_job_t j;
   dt_control_write_sidecar_files_job_init(&j);
+  dt_control_job_set_priority(&j, DT_JOB_PRIORITY_LOW);
   dt_control_add_job(darktable.control, &j);
 }
 
@@ -1054,30 +1055,89 @@ int32_t dt_control_local_copy_images_job_run(dt_job_t *job)
   dt_control_backgroundjobs_set_cancellable(darktable.control, jid, job);
   const dt_control_t *control = darktable.control;
 
+  GList *done = NULL;
   while(t && dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED)
   {
     imgid = GPOINTER_TO_INT(t->data);
     if (GPOINTER_TO_INT(job->user_data) == 1)
-    {
       dt_image_local_copy_set(imgid);
-      dt_tag_attach(tagid, imgid);
-    }
     else
-    {
       dt_image_local_copy_reset(imgid);
-      dt_tag_detach(tagid, imgid);
-    }
+    done = g_list_prepend(done, t->data);
     t = g_list_delete_link(t, t);
 
     fraction += 1.0/total;
     dt_control_backgroundjobs_progress(control, jid, fraction);
   }
 
+  // tag all the images we got to in one go
+  GList *tags = g_list_append(NULL, GINT_TO_POINTER(tagid));
+  if(is_copy) dt_tag_attach_images(tags, done);
+  else        dt_tag_detach_images(tags, done);
+  g_list_free(tags);
+  g_list_free(done);
+
   dt_control_backgroundjobs_destroy(control, jid);
   dt_control_signal_raise(darktable.signals, DT_SIGNAL_FILMROLLS_CHANGED);
   return 0;
 }
 
+/* decode stage of the export: loads the full buffers of the next images into the
+   mipmap cache while the processing threads are busy with the pixelpipe and the
+   format/storage modules. a decoded buffer stays pinned (read locked) until its
+   image has been stored, so the cache can't evict it in between. */
+typedef struct dt_control_export_prefetch_t
+{
+  dt_job_t *job;
+  int *imgids;
+  dt_mipmap_buffer_t *buf;
+  uint8_t *pinned, *stored;
+  int total, depth;
+  int taken;     // images handed out to the processing threads
+  int finished;  // processing stage is done, stop decoding
+  int num_decoded;
+  double time_decode;
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond;
+}
+dt_control_export_prefetch_t;
+
+static void *_control_export_prefetch(void *data)
+{
+  dt_control_export_prefetch_t *p = (dt_control_export_prefetch_t *)data;
+  for(int k=0; k<p->total; k++)
+  {
+    dt_pthread_mutex_lock(&p->mutex);
+    // bounded queue: don't run more than depth images ahead of processing
+    while(!p->finished && k >= p->taken + p->depth)
+      dt_pthread_cond_wait(&p->cond, &p->mutex);
+    const int stop = p->finished, skip = p->stored[k];
+    dt_pthread_mutex_unlock(&p->mutex);
+    if(stop || dt_control_job_get_state(p->job) == DT_JOB_STATE_CANCELLED) break;
+    if(skip) continue;
+
+    const double start = dt_get_wtime();
+    dt_mipmap_buffer_t buf;
+    dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, p->imgids[k], DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
+    const double end = dt_get_wtime();
+
+    dt_pthread_mutex_lock(&p->mutex);
+    p->time_decode += end - start;
+    p->num_decoded++;
+    if(p->stored[k])
+    {
+      // processing was faster, nothing left to keep alive.
+      dt_pthread_mutex_unlock(&p->mutex);
+      dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+      continue;
+    }
+    p->buf[k] = buf;
+    p->pinned[k] = 1;
+    dt_pthread_mutex_unlock(&p->mutex);
+  }
+  return NULL;
+}
+
 static int32_t dt_control_export_job_run(dt_job_t *job)
 {
   int imgid = -1;
@@ -1119,7 +1179,30 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
   dt_control_backgroundjobs_set_cancellable(darktable.control, jid, job);
   const dt_control_t *control = darktable.control;
 
-  double fraction=0;
+  // set up the decode stage. the mipmap cache reserves room for this many
+  // extra full buffers, see dt_mipmap_cache_init().
+  dt_control_export_prefetch_t prefetch;
+  memset(&prefetch, 0, sizeof(prefetch));
+  prefetch.job = job;
+  prefetch.total = total;
+  prefetch.depth = CLAMP(dt_conf_get_int("export_prefetch_depth"), 0, 8);
+  prefetch.imgids = (int *)malloc(sizeof(int)*MAX(total, 1));
+  prefetch.buf = (dt_mipmap_buffer_t *)calloc(MAX(total, 1), sizeof(dt_mipmap_buffer_t));
+  prefetch.pinned = (uint8_t *)calloc(MAX(total, 1), sizeof(uint8_t));
+  prefetch.stored = (uint8_t *)calloc(MAX(total, 1), sizeof(uint8_t));
+  for(int k=0; t; k++)
+  {
+    prefetch.imgids[k] = GPOINTER_TO_INT(t->data);
+    t = g_list_delete_link(t, t);
+  }
+  dt_pthread_mutex_init(&prefetch.mutex, NULL);
+  pthread_cond_init(&prefetch.cond, NULL);
+  pthread_t prefetch_thread;
+  const int prefetching = prefetch.depth > 0 && total > 1 &&
+                          !pthread_create(&prefetch_thread, NULL, _control_export_prefetch, &prefetch);
+
+  double fraction=0, time_store=0;
+  const double time_start = dt_get_wtime();
 #ifdef _OPENMP
   // limit this to num threads = num full buffers - 1 (keep one for darkroom mode)
   // use min of user request and mipmap cache entries
@@ -1128,9 +1211,9 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
   // it set but not used, which makes for instance Fedora break.
   const __attribute__((__unused__)) int num_threads = MAX(1, MIN(full_entries, 8));
 #if !defined(__SUNOS__) && !defined(__NetBSD__) && !defined(__WIN32__)
-  #pragma omp parallel default(none) private(imgid) shared(control, fraction, w, h, stderr, mformat, mstorage, t, sdata, job, jid, darktable, settings) num_threads(num_threads) if(num_threads > 1)
+  #pragma omp parallel default(none) private(imgid) shared(control, fraction, time_store, w, h, stderr, mformat, mstorage, prefetch, sdata, job, jid, darktable, settings) num_threads(num_threads) if(num_threads > 1)
 #else
-  #pragma omp parallel private(imgid) shared(control, fraction, w, h, mformat, mstorage, t, sdata, job, jid, darktable, settings) num_threads(num_threads) if(num_threads > 1)
+  #pragma omp parallel private(imgid) shared(control, fraction, time_store, w, h, mformat, mstorage, prefetch, sdata, job, jid, darktable, settings) num_threads(num_threads) if(num_threads > 1)
 #endif
   {
 #endif
@@ -1148,21 +1231,17 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
     dt_tag_new("darktable|changed",&tagid);
     dt_tag_new("darktable|exported",&etagid);
 
-    while(t && dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED)
+    while(dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED)
     {
-#ifdef _OPENMP
-      #pragma omp critical
-#endif
-      {
-        if(!t)
-          imgid = 0;
-        else
-        {
-          imgid = GPOINTER_TO_INT(t->data);
-          t = g_list_delete_link(t, t);
-          num = total - g_list_length(t);
-        }
-      }
+      // take the next image, and let the decode stage move on.
+      dt_pthread_mutex_lock(&prefetch.mutex);
+      num = prefetch.taken < prefetch.total ? ++prefetch.taken : 0;
+      pthread_cond_broadcast(&prefetch.cond);
+      dt_pthread_mutex_unlock(&prefetch.mutex);
+      if(!num) break;
+      imgid = prefetch.imgids[num-1];
+
+      const double start = dt_get_wtime();
       // remove 'changed' tag from image
       dt_tag_detach(tagid, imgid);
       // make sure the 'exported' tag is set on the image
@@ -1187,10 +1266,24 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
           mstorage->store(mstorage,sdata, imgid, mformat, fdata, num, total, settings->high_quality);
         }
       }
+
+      // unpin the decoded input, if the decode stage got to it first.
+      dt_mipmap_buffer_t buf = { .size = DT_MIPMAP_NONE };
+      dt_pthread_mutex_lock(&prefetch.mutex);
+      prefetch.stored[num-1] = 1;
+      if(prefetch.pinned[num-1])
+      {
+        buf = prefetch.buf[num-1];
+        prefetch.pinned[num-1] = 0;
+      }
+      dt_pthread_mutex_unlock(&prefetch.mutex);
+      dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+      const double end = dt_get_wtime();
 #ifdef _OPENMP
       #pragma omp critical
 #endif
       {
+        time_store += end - start;
         fraction+=1.0/total;
 	if(fraction > 1.0) fraction = 1.0;
         dt_control_backgroundjobs_progress(control, jid, fraction);
@@ -1210,6 +1303,31 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
 #ifdef _OPENMP
   }
 #endif
+
+  // shut down the decode stage and drop whatever it left pinned (cancelled exports)
+  dt_pthread_mutex_lock(&prefetch.mutex);
+  prefetch.finished = 1;
+  pthread_cond_broadcast(&prefetch.cond);
+  dt_pthread_mutex_unlock(&prefetch.mutex);
+  if(prefetching) pthread_join(prefetch_thread, NULL);
+  for(int k=0; k<total; k++)
+    if(prefetch.pinned[k]) dt_mipmap_cache_read_release(darktable.mipmap_cache, prefetch.buf + k);
+
+  const double time_total = dt_get_wtime() - time_start;
+  dt_print(DT_DEBUG_PERF, "[export] %d images in %.3f secs (%.2f images/sec)\n",
+           prefetch.taken, time_total, time_total > 0.0 ? prefetch.taken/time_total : 0.0);
+  dt_print(DT_DEBUG_PERF, "[export]   decode  (depth %d): %d images, %.3f secs busy (%.2f images/sec)\n",
+           prefetching ? prefetch.depth : 0, prefetch.num_decoded, prefetch.time_decode,
+           prefetch.time_decode > 0.0 ? prefetch.num_decoded/prefetch.time_decode : 0.0);
+  dt_print(DT_DEBUG_PERF, "[export]   process+store: %d images, %.3f secs busy (%.2f images/sec)\n",
+           prefetch.taken, time_store, time_store > 0.0 ? prefetch.taken/time_store : 0.0);
+
+  pthread_cond_destroy(&prefetch.cond);
+  dt_pthread_mutex_destroy(&prefetch.mutex);
+  free(prefetch.imgids);
+  free(prefetch.buf);
+  free(prefetch.pinned);
+  free(prefetch.stored);
   g_free(t1->data);
   return 0;
 }
@@ -1231,6 +1349,8 @@ void dt_control_export(GList *imgid_list,int max_width, int max_height, int form
   g_strlcpy(data->style,style,sizeof(data->style));
   t->data = data;
   dt_control_signal_raise(darktable.signals,DT_SIGNAL_IMAGE_EXPORT_MULTIPLE,t);
+  // exports take long and nobody looks at them while they run, interactive jobs go first:
+  dt_control_job_set_priority(&job, DT_JOB_PRIORITY_LOW);
   dt_control_add_job(darktable.control, &job);
 }
 
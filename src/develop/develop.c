@@ -862,9 +862,10 @@ void dt_dev_read_history(dt_develop_t *dev)
   // maybe prepend auto-presets to history before loading it:
   auto_apply_presets(dev);
 
-  sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "select imgid, num, module, operation, op_params, enabled, blendop_params, blendop_version, multi_priority, multi_name from history where imgid = ?1 order by num", -1, &stmt, NULL);
+  // thumbnail and export pipes read through the connection of their worker thread:
+  sqlite3 *handle = dev->gui_attached ? dt_database_get(darktable.db) : dt_database_get_reader(darktable.db);
+  sqlite3_stmt *stmt = dt_database_prepare_cached(darktable.db, handle,
+                       "select imgid, num, module, operation, op_params, enabled, blendop_params, blendop_version, multi_priority, multi_name from history where imgid = ?1 order by num");
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dev->image_storage.id);
   dev->history_end = 0;
   while(sqlite3_step(stmt) == SQLITE_ROW)
@@ -1014,7 +1015,7 @@ void dt_dev_read_history(dt_develop_t *dev)
     /* signal history changed */
     dt_control_signal_raise(darktable.signals,DT_SIGNAL_DEVELOP_HISTORY_CHANGE);
   }
-  sqlite3_finalize (stmt);
+  dt_database_release_statement(darktable.db, stmt);
 }
 
 
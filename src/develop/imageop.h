@@ -64,6 +64,7 @@ struct dt_develop_tiling_t;
 #define IOP_FLAGS_PREVIEW_NON_OPENCL  256                       // Preview pixelpipe of this module must not run on GPU but always on CPU
 #define IOP_FLAGS_NO_HISTORY_STACK    512                       // This iop will never show up in the history stack
 #define IOP_FLAGS_NO_MASKS  1024    // The module doesn't support masks (used with SUPPORT_BLENDING)
+#define IOP_FLAGS_ALLOW_PARALLEL_TILES 2048             // process() has no side effects, so several tiles may be processed at the same time on the CPU
 /** status of a module*/
 typedef enum dt_iop_module_state_t
 {
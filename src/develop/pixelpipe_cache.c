@@ -20,6 +20,10 @@
 #include "develop/pixelpipe_hb.h"
 #include "libs/lib.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
 
 
 // TODO: make cache global (needs to be thread safe then)
@@ -31,52 +35,373 @@
 //   ping, pong, and priority buffer (focused plugin)
 // - drop read by the time another is requested (with priority, drop that, or alternating ping and pong?)
 
-int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, int size)
+#define DT_PIXELPIPE_CACHE_INVALID ((uint64_t)-1)
+#define DT_PIXELPIPE_CACHE_SPILL_MAGIC 0xD7CAC11E
+// only spill buffers which take longer to recompute than to write at about this speed (bytes/s):
+#define DT_PIXELPIPE_CACHE_SPILL_SPEED 200e6
+
+typedef struct dt_dev_pixelpipe_cache_spilled_t
 {
-  cache->entries = entries;
-  cache->data = (void **)malloc(sizeof(void *)*entries);
-  cache->size = (size_t *)malloc(sizeof(size_t)*entries);
-  cache->hash = (uint64_t *)malloc(sizeof(uint64_t)*entries);
-  cache->used = (int32_t *)malloc(sizeof(int32_t)*entries);
-  memset(cache->data,0,sizeof(void *)*entries);
-  for(int k=0; k<entries; k++)
+  uint64_t hash;
+  size_t   length;     // uncompressed bytes
+  size_t   file_size;
+  uint64_t used;
+  float    cost;
+}
+dt_dev_pixelpipe_cache_spilled_t;
+
+typedef struct dt_dev_pixelpipe_cache_spill_header_t
+{
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t hash;
+  uint64_t length;
+}
+dt_dev_pixelpipe_cache_spill_header_t;
+
+static inline int
+_cache_is_protected(const dt_dev_pixelpipe_cache_t *cache, const dt_dev_pixelpipe_cache_line_t *line)
+{
+  return line->data == cache->last || line->data == cache->important[0] || line->data == cache->important[1];
+}
+
+static dt_dev_pixelpipe_cache_line_t *
+_cache_find_data(dt_dev_pixelpipe_cache_t *cache, const void *data)
+{
+  for(guint k=0; k<cache->lines->len; k++)
+  {
+    dt_dev_pixelpipe_cache_line_t *line = (dt_dev_pixelpipe_cache_line_t *)g_ptr_array_index(cache->lines, k);
+    if(line->data == data) return line;
+  }
+  return NULL;
+}
+
+static dt_dev_pixelpipe_cache_line_t *
+_cache_new_line(dt_dev_pixelpipe_cache_t *cache, const size_t size)
+{
+  dt_dev_pixelpipe_cache_line_t *line = (dt_dev_pixelpipe_cache_line_t *)calloc(1, sizeof(dt_dev_pixelpipe_cache_line_t));
+  if(!line) return NULL;
+  line->data = (void *)dt_alloc_align(16, size);
+  if(!line->data)
   {
-    cache->data[k] = (void *)dt_alloc_align(16, size);
-    if(!cache->data[k])
-      goto alloc_memory_fail;
-    cache->size[k] = size;
+    free(line);
+    return NULL;
+  }
 #ifdef _DEBUG
-    memset(cache->data[k], 0x5d, size);
+  memset(line->data, 0x5d, size);
 #endif
-    cache->hash[k] = -1;
-    cache->used[k] = 0;
+  line->size = size;
+  line->hash = DT_PIXELPIPE_CACHE_INVALID;
+  cache->allocated += size;
+  g_ptr_array_add(cache->lines, line);
+  return line;
+}
+
+// the contents are gone, but the buffer is kept for reuse.
+static void
+_cache_drop_line(dt_dev_pixelpipe_cache_t *cache, dt_dev_pixelpipe_cache_line_t *line)
+{
+  if(line->hash != DT_PIXELPIPE_CACHE_INVALID) g_hash_table_remove(cache->index, &line->hash);
+  line->hash = DT_PIXELPIPE_CACHE_INVALID;
+  line->cost = 0.0f;
+  line->weight = 0;
+}
+
+static void
+_cache_free_line(dt_dev_pixelpipe_cache_t *cache, dt_dev_pixelpipe_cache_line_t *line)
+{
+  _cache_drop_line(cache, line);
+  cache->allocated -= line->size;
+  g_ptr_array_remove_fast(cache->lines, line);
+  dt_free_align(line->data);
+  free(line);
+}
+
+static gchar *
+_cache_spill_filename(const dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
+{
+  return g_strdup_printf("%s/%016"PRIx64".buf", cache->spill_dir, hash);
+}
+
+static void
+_cache_spill_remove(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
+{
+  dt_dev_pixelpipe_cache_spilled_t *s = (dt_dev_pixelpipe_cache_spilled_t *)g_hash_table_lookup(cache->spilled, &hash);
+  if(!s) return;
+  gchar *filename = _cache_spill_filename(cache, hash);
+  g_unlink(filename);
+  g_free(filename);
+  cache->disk_used -= s->file_size;
+  g_hash_table_remove(cache->spilled, &hash);
+}
+
+static void
+_cache_spill_clear(dt_dev_pixelpipe_cache_t *cache)
+{
+  if(!cache->spill_dir) return;
+  GDir *dir = g_dir_open(cache->spill_dir, 0, NULL);
+  if(dir)
+  {
+    const gchar *name;
+    while((name = g_dir_read_name(dir)))
+    {
+      if(!g_str_has_suffix(name, ".buf")) continue;
+      gchar *filename = g_build_filename(cache->spill_dir, name, NULL);
+      g_unlink(filename);
+      g_free(filename);
+    }
+    g_dir_close(dir);
   }
-  cache->queries = cache->misses = 0;
-  return 1;
+  g_hash_table_remove_all(cache->spilled);
+  cache->disk_used = 0;
+}
 
-alloc_memory_fail:
-  for(int k=0; k<entries; k++)
+// floats compress a lot better if the bytes of the same significance are next to each other.
+static void
+_cache_shuffle(const uint8_t *in, uint8_t *out, const size_t length, const int forward)
+{
+  const size_t n = length/4;
+  for(int b=0; b<4; b++)
+    for(size_t i=0; i<n; i++)
+    {
+      if(forward) out[b*n + i] = in[4*i + b];
+      else        out[4*i + b] = in[b*n + i];
+    }
+  memcpy(out + 4*n, in + 4*n, length - 4*n);
+}
+
+static size_t
+_cache_convert(GConverter *converter, const uint8_t *in, const size_t in_size, uint8_t *out, const size_t out_size)
+{
+  size_t in_pos = 0, out_pos = 0;
+  GConverterResult res;
+  do
   {
-    if(cache->data[k])
-      dt_free_align(cache->data[k]);
+    gsize read = 0, written = 0;
+    res = g_converter_convert(converter, in + in_pos, in_size - in_pos, out + out_pos, out_size - out_pos,
+                              G_CONVERTER_INPUT_AT_END, &read, &written, NULL);
+    in_pos += read;
+    out_pos += written;
   }
+  while(res == G_CONVERTER_CONVERTED);
+  g_object_unref(converter);
+  return res == G_CONVERTER_FINISHED ? out_pos : 0;
+}
 
-  free(cache->data);
-  free(cache->size);
-  free(cache->hash);
-  free(cache->used);
+// write the contents of this line to disk, if it's worth it. the line itself stays untouched.
+static void
+_cache_spill(dt_dev_pixelpipe_cache_t *cache, dt_dev_pixelpipe_cache_line_t *line)
+{
+  if(!cache->spill_dir || line->hash == DT_PIXELPIPE_CACHE_INVALID) return;
+  if(g_hash_table_lookup(cache->spilled, &line->hash)) return; // still there from an earlier visit
+  if(line->cost < line->length / DT_PIXELPIPE_CACHE_SPILL_SPEED) return;
 
-  return 0;
+  const size_t length = line->length;
+  uint8_t *buf = (uint8_t *)malloc(2*length);
+  if(!buf) return;
+  _cache_shuffle((const uint8_t *)line->data, buf, length, 1);
+  const size_t compressed = _cache_convert(G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW, 1)),
+                                           buf, length, buf + length, length);
+  const size_t file_size = sizeof(dt_dev_pixelpipe_cache_spill_header_t) + compressed;
+  if(!compressed || file_size > cache->disk_limit)
+  {
+    free(buf);
+    return;
+  }
+
+  // make room, least recently used first:
+  while(cache->disk_used + file_size > cache->disk_limit)
+  {
+    GHashTableIter it;
+    gpointer key, value;
+    dt_dev_pixelpipe_cache_spilled_t *oldest = NULL;
+    g_hash_table_iter_init(&it, cache->spilled);
+    while(g_hash_table_iter_next(&it, &key, &value))
+    {
+      dt_dev_pixelpipe_cache_spilled_t *s = (dt_dev_pixelpipe_cache_spilled_t *)value;
+      if(!oldest || s->used < oldest->used) oldest = s;
+    }
+    if(!oldest) break;
+    _cache_spill_remove(cache, oldest->hash);
+  }
+
+  gchar *filename = _cache_spill_filename(cache, line->hash);
+  FILE *f = fopen(filename, "wb");
+  int ok = 0;
+  if(f)
+  {
+    const dt_dev_pixelpipe_cache_spill_header_t header = { DT_PIXELPIPE_CACHE_SPILL_MAGIC, 0, line->hash, length };
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(buf + length, 1, compressed, f) == compressed;
+    ok &= fclose(f) == 0;
+    if(!ok) g_unlink(filename);
+  }
+  g_free(filename);
+  free(buf);
+  if(!ok) return;
+
+  dt_dev_pixelpipe_cache_spilled_t *s = (dt_dev_pixelpipe_cache_spilled_t *)malloc(sizeof(dt_dev_pixelpipe_cache_spilled_t));
+  s->hash = line->hash;
+  s->length = length;
+  s->file_size = file_size;
+  s->used = line->used;
+  s->cost = line->cost;
+  g_hash_table_insert(cache->spilled, &s->hash, s);
+  cache->disk_used += file_size;
+}
+
+// read the buffer for the hash of this line back from disk. returns 0 on success.
+static int
+_cache_unspill(dt_dev_pixelpipe_cache_t *cache, dt_dev_pixelpipe_cache_line_t *line, const size_t length)
+{
+  if(!cache->spill_dir) return 1;
+  dt_dev_pixelpipe_cache_spilled_t *s = (dt_dev_pixelpipe_cache_spilled_t *)g_hash_table_lookup(cache->spilled, &line->hash);
+  if(!s) return 1;
+  if(s->length != length || line->size < length)
+  {
+    _cache_spill_remove(cache, line->hash);
+    return 1;
+  }
+
+  int err = 1;
+  const size_t compressed = s->file_size - sizeof(dt_dev_pixelpipe_cache_spill_header_t);
+  uint8_t *buf = (uint8_t *)malloc(length + compressed);
+  gchar *filename = _cache_spill_filename(cache, line->hash);
+  FILE *f = buf ? fopen(filename, "rb") : NULL;
+  g_free(filename);
+  if(f)
+  {
+    dt_dev_pixelpipe_cache_spill_header_t header;
+    if(fread(&header, sizeof(header), 1, f) == 1 && header.magic == DT_PIXELPIPE_CACHE_SPILL_MAGIC &&
+       header.hash == line->hash && header.length == length &&
+       fread(buf + length, 1, compressed, f) == compressed &&
+       _cache_convert(G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW)),
+                      buf + length, compressed, buf, length) == length)
+    {
+      _cache_shuffle(buf, (uint8_t *)line->data, length, 0);
+      line->cost = s->cost;
+      s->used = cache->tick;
+      err = 0;
+    }
+    fclose(f);
+  }
+  free(buf);
+  if(err) _cache_spill_remove(cache, line->hash);
+  else cache->disk_hits++;
+  return err;
+}
+
+// lower means better to drop: cheap to recompute, and not used in a while.
+static inline float
+_cache_score(const dt_dev_pixelpipe_cache_t *cache, const dt_dev_pixelpipe_cache_line_t *line)
+{
+  return (line->cost + 1e-3f) * (line->weight ? 4.0f : 1.0f) / (1.0f + (cache->tick - line->used));
+}
+
+// returns a line with a buffer of at least size bytes, which can be overwritten.
+static dt_dev_pixelpipe_cache_line_t *
+_cache_alloc(dt_dev_pixelpipe_cache_t *cache, const size_t size)
+{
+  // 1) smallest free buffer which is large enough:
+  dt_dev_pixelpipe_cache_line_t *best = NULL;
+  for(guint k=0; k<cache->lines->len; k++)
+  {
+    dt_dev_pixelpipe_cache_line_t *line = (dt_dev_pixelpipe_cache_line_t *)g_ptr_array_index(cache->lines, k);
+    if(line->hash != DT_PIXELPIPE_CACHE_INVALID || line->size < size || _cache_is_protected(cache, line)) continue;
+    if(!best || line->size < best->size) best = line;
+  }
+  if(best) return best;
 
+  // 2) drop buffers until the new one fits. free ones first, then the valid ones with the lowest score:
+  while(cache->allocated + size > cache->memory_limit)
+  {
+    dt_dev_pixelpipe_cache_line_t *victim = NULL;
+    float victim_score = 0.0f;
+    for(guint k=0; k<cache->lines->len; k++)
+    {
+      dt_dev_pixelpipe_cache_line_t *line = (dt_dev_pixelpipe_cache_line_t *)g_ptr_array_index(cache->lines, k);
+      if(_cache_is_protected(cache, line)) continue;
+      const float score = line->hash == DT_PIXELPIPE_CACHE_INVALID ? -1.0f : _cache_score(cache, line);
+      if(!victim || score < victim_score)
+      {
+        victim = line;
+        victim_score = score;
+      }
+    }
+    if(!victim) break; // only buffers in use left, go over the limit
+    _cache_spill(cache, victim);
+    if(victim->size >= size)
+    {
+      _cache_drop_line(cache, victim);
+      return victim;
+    }
+    _cache_free_line(cache, victim);
+  }
+
+  // 3) a new buffer:
+  dt_dev_pixelpipe_cache_line_t *line = _cache_new_line(cache, size);
+  if(line) return line;
+  // out of memory, give up everything we can and try again:
+  for(int k=cache->lines->len-1; k>=0; k--)
+  {
+    dt_dev_pixelpipe_cache_line_t *victim = (dt_dev_pixelpipe_cache_line_t *)g_ptr_array_index(cache->lines, k);
+    if(!_cache_is_protected(cache, victim)) _cache_free_line(cache, victim);
+  }
+  return _cache_new_line(cache, size);
+}
+
+int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, int size)
+{
+  memset(cache, 0, sizeof(dt_dev_pixelpipe_cache_t));
+  cache->entries = entries;
+  cache->memory_limit = (size_t)entries*size;
+  cache->lines = g_ptr_array_new();
+  cache->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+  cache->spilled = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free);
+  // allocate the buffers which are needed in any case right away, so we fail early:
+  for(int k=0; k<entries; k++)
+  {
+    if(!_cache_new_line(cache, size))
+    {
+      dt_dev_pixelpipe_cache_cleanup(cache);
+      return 0;
+    }
+  }
+  return 1;
 }
 
 void dt_dev_pixelpipe_cache_cleanup(dt_dev_pixelpipe_cache_t *cache)
 {
-  for(int k=0; k<cache->entries; k++) dt_free_align(cache->data[k]);
-  free(cache->data);
-  free(cache->hash);
-  free(cache->used);
-  free(cache->size);
+  if(!cache->lines) return;
+  cache->last = cache->important[0] = cache->important[1] = NULL;
+  while(cache->lines->len)
+    _cache_free_line(cache, (dt_dev_pixelpipe_cache_line_t *)g_ptr_array_index(cache->lines, cache->lines->len-1));
+  g_ptr_array_free(cache->lines, TRUE);
+  cache->lines = NULL;
+  g_hash_table_destroy(cache->index);
+  _cache_spill_clear(cache);
+  if(cache->spill_dir) g_rmdir(cache->spill_dir);
+  g_hash_table_destroy(cache->spilled);
+  g_free(cache->spill_dir);
+  cache->spill_dir = NULL;
+}
+
+void dt_dev_pixelpipe_cache_set_limits(dt_dev_pixelpipe_cache_t *cache, const size_t memory_limit,
+                                       const char *spill_dir, const size_t disk_limit)
+{
+  cache->memory_limit = MAX(cache->memory_limit, memory_limit);
+  _cache_spill_clear(cache);
+  g_free(cache->spill_dir);
+  cache->spill_dir = NULL;
+  if(!spill_dir || !disk_limit) return;
+  if(g_mkdir_with_parents(spill_dir, 0700))
+  {
+    fprintf(stderr, "[pixelpipe_cache] could not create `%s', keeping buffers in memory only\n", spill_dir);
+    return;
+  }
+  cache->spill_dir = g_strdup(spill_dir);
+  cache->disk_limit = disk_limit;
+  // left over from an earlier session which didn't shut down cleanly:
+  _cache_spill_clear(cache);
 }
 
 uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const dt_iop_roi_t *roi, dt_dev_pixelpipe_t *pipe, int module)
@@ -116,8 +441,9 @@ uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const dt_iop_roi_t *roi, dt_dev_
 
 int dt_dev_pixelpipe_cache_available(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
 {
-  // search for hash in cache
-  for(int32_t k=0; k<cache->entries; k++) if(cache->hash[k] == hash) return 1;
+  // search for hash in cache, and on disk
+  if(g_hash_table_lookup(cache->index, &hash)) return 1;
+  if(cache->spill_dir && g_hash_table_lookup(cache->spilled, &hash)) return 1;
   return 0;
 }
 
@@ -134,85 +460,92 @@ int dt_dev_pixelpipe_cache_get(dt_dev_pixelpipe_cache_t *cache, const uint64_t h
 int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data, int weight)
 {
   cache->queries ++;
+  cache->tick ++;
   *data = NULL;
-  int max_used = -1, max = 0;
-  size_t sz = 0;
-  for(int k=0; k<cache->entries; k++)
+  int miss = 0;
+  dt_dev_pixelpipe_cache_line_t *line = (dt_dev_pixelpipe_cache_line_t *)g_hash_table_lookup(cache->index, &hash);
+  if(line && line->size < size)
   {
-    // search for hash in cache
-    if(cache->used[k] > max_used)
-    {
-      max_used = cache->used[k];
-      max = k;
-    }
-    cache->used[k]++; // age all entries
-    if(cache->hash[k] == hash)
+    // too small, needs to be recomputed anyways.
+    _cache_drop_line(cache, line);
+    line = NULL;
+  }
+  if(!line)
+  {
+    line = _cache_alloc(cache, size);
+    if(!line)
     {
-      *data = cache->data[k];
-      sz = cache->size[k];
-      cache->used[k] = weight; // this is the MRU entry
+      // out of memory, as before this is a miss without a buffer:
+      cache->misses++;
+      return 1;
     }
+    line->hash = hash;
+    line->length = size;
+    g_hash_table_insert(cache->index, &line->hash, line);
+    miss = _cache_unspill(cache, line, size);
+    if(miss) cache->misses++;
   }
-
-  if(!*data || sz < size)
+  line->used = cache->tick; // this is the MRU entry
+  if(weight < 0)
   {
-    // kill LRU entry
-    // printf("[pixelpipe_cache_get] hash not found, returning slot %d/%d age %d\n", max, cache->entries, weight);
-    if(cache->size[max] < size)
+    line->weight = 1;
+    if(cache->important[0] != line->data)
     {
-      dt_free_align(cache->data[max]);
-      cache->data[max] = (void *)dt_alloc_align(16, size);
-      cache->size[max] = size;
+      cache->important[1] = cache->important[0];
+      cache->important[0] = line->data;
     }
-    *data = cache->data[max];
-    cache->hash[max] = hash;
-    cache->used[max] = weight;
-    cache->misses++;
-    return 1;
   }
-  else return 0;
+  cache->last = *data = line->data;
+  return miss;
 }
 
 void dt_dev_pixelpipe_cache_flush(dt_dev_pixelpipe_cache_t *cache)
 {
-  for(int k=0; k<cache->entries; k++)
-  {
-    cache->hash[k] = -1;
-    cache->used[k] = 0;
-  }
+  for(guint k=0; k<cache->lines->len; k++)
+    _cache_drop_line(cache, (dt_dev_pixelpipe_cache_line_t *)g_ptr_array_index(cache->lines, k));
+  _cache_spill_clear(cache);
 }
 
 void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data)
 {
-  for(int k=0; k<cache->entries; k++)
+  dt_dev_pixelpipe_cache_line_t *line = _cache_find_data(cache, data);
+  if(line)
   {
-    if(cache->data[k] == data)
-    {
-      cache->used[k] = -cache->entries;
-    }
+    line->weight = 1;
+    line->used = cache->tick;
   }
 }
 
 void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *data)
 {
-  for(int k=0; k<cache->entries; k++)
-  {
-    if(cache->data[k] == data)
-    {
-      cache->hash[k] = -1;
-    }
-  }
+  dt_dev_pixelpipe_cache_line_t *line = _cache_find_data(cache, data);
+  if(line) _cache_drop_line(cache, line);
+}
+
+void dt_dev_pixelpipe_cache_set_cost(dt_dev_pixelpipe_cache_t *cache, void *data, const float cost)
+{
+  dt_dev_pixelpipe_cache_line_t *line = _cache_find_data(cache, data);
+  if(line && line->hash != DT_PIXELPIPE_CACHE_INVALID) line->cost = cost;
+}
+
+float dt_dev_pixelpipe_cache_get_cost(dt_dev_pixelpipe_cache_t *cache, void *data)
+{
+  dt_dev_pixelpipe_cache_line_t *line = _cache_find_data(cache, data);
+  return line ? line->cost : 0.0f;
 }
 
 void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache)
 {
-  for(int k=0; k<cache->entries; k++)
+  for(guint k=0; k<cache->lines->len; k++)
   {
-    printf("pixelpipe cacheline %d ", k);
-    printf("used %d by %"PRIu64"", cache->used[k], cache->hash[k]);
+    dt_dev_pixelpipe_cache_line_t *line = (dt_dev_pixelpipe_cache_line_t *)g_ptr_array_index(cache->lines, k);
+    printf("pixelpipe cacheline %u ", k);
+    printf("used %"PRIu64" by %"PRIu64" size %zu cost %.3fs", cache->tick - line->used, line->hash, line->size, line->cost);
     printf("\n");
   }
-  printf("cache hit rate so far: %.3f\n", (cache->queries - cache->misses)/(float)cache->queries);
+  printf("cache memory %zu/%zu MB, %u buffers on disk (%zu MB)\n", cache->allocated >> 20, cache->memory_limit >> 20,
+         g_hash_table_size(cache->spilled), cache->disk_used >> 20);
+  printf("cache hit rate so far: %.3f (%"PRIu64" from disk)\n", (cache->queries - cache->misses)/(float)cache->queries, cache->disk_hits);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
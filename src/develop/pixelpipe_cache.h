@@ -19,25 +19,48 @@
 #define DT_PIXELPIPE_CACHE_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <glib.h>
 /**
- * implements a simple pixel cache suitable for caching float images
+ * implements a pixel cache suitable for caching float images
  * corresponding to history items and zoom/pan settings in the develop module.
- * it is optimized for very few entries (~5), so most operations are O(N).
+ * buffers are looked up by the hash of the module stack (see dt_dev_pixelpipe_cache_hash()),
+ * may have any size, and are kept until the memory limit is reached. then the buffers
+ * which are cheapest to recompute and least recently used are dropped first, or optionally
+ * written to a directory on disk, compressed, from where they can be read back later.
  */
 struct dt_dev_pixelpipe_t;
+typedef struct dt_dev_pixelpipe_cache_line_t
+{
+  uint64_t hash;    // -1 if the buffer holds no valid data
+  void    *data;
+  size_t   size;    // allocated bytes
+  size_t   length;  // bytes requested for the current contents
+  uint64_t used;    // value of the access counter at the last request
+  float    cost;    // seconds it takes to recompute this buffer from the pipe input
+  int32_t  weight;  // non-zero for buffers which are likely to be requested again soon
+}
+dt_dev_pixelpipe_cache_line_t;
+
 typedef struct dt_dev_pixelpipe_cache_t
 {
-  int32_t  entries;
-  void    **data;
-  size_t   *size;
-  uint64_t *hash;
-  int32_t  *used;
-#ifdef HAVE_OPENCL
-  void    **gpu_mem;
-#endif
+  int32_t  entries;         // buffers the initial memory limit is sized for
+  size_t   memory_limit;    // soft limit, we never drop the buffers in use
+  size_t   allocated;
+  GPtrArray  *lines;        // all allocated buffers
+  GHashTable *index;        // hash -> line, for valid lines
+  uint64_t tick;
+  void    *last;            // the most recently requested buffer, input to the module being processed
+  void    *important[2];    // the latest important buffers, one of them might be displayed as backbuf
+  // optional second level on disk:
+  char    *spill_dir;
+  size_t   disk_limit;
+  size_t   disk_used;
+  GHashTable *spilled;      // hash -> dt_dev_pixelpipe_cache_spilled_t
   // profiling:
   uint64_t queries;
   uint64_t misses;
+  uint64_t disk_hits;
 }
 dt_dev_pixelpipe_cache_t;
 
@@ -47,13 +70,18 @@ dt_dev_pixelpipe_cache_t;
 int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, int size);
 void dt_dev_pixelpipe_cache_cleanup(dt_dev_pixelpipe_cache_t *cache);
 
+/** raise the memory limit to the given number of bytes, and spill dropped buffers to spill_dir,
+  * keeping at most disk_limit bytes there. pass NULL to keep everything in memory. */
+void dt_dev_pixelpipe_cache_set_limits(dt_dev_pixelpipe_cache_t *cache, const size_t memory_limit,
+                                       const char *spill_dir, const size_t disk_limit);
+
 struct dt_iop_roi_t;
 /** creates a hopefully unique hash from the complete module stack up to the module-th. */
 uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const struct dt_iop_roi_t *roi, struct dt_dev_pixelpipe_t *pipe, int module);
 
 /** returns the float data buffer for the given hash from the cache. if the hash does not match any
-  * cache line, the least recently used cache line will be cleared and an empty buffer is returned
-  * together with a non-zero return value. */
+  * cache line, buffers will be dropped until the new one fits, and an empty buffer is returned
+  * together with a non-zero return value. the buffer returned by the previous call stays valid. */
 int dt_dev_pixelpipe_cache_get(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data);
 int dt_dev_pixelpipe_cache_get_important(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data);
 int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data, int weight);
@@ -70,6 +98,10 @@ void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data
 /** mark the given cache line pointer as invalid. */
 void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *data);
 
+/** remember how many seconds it takes to recompute this buffer, used to decide what to drop. */
+void dt_dev_pixelpipe_cache_set_cost(dt_dev_pixelpipe_cache_t *cache, void *data, const float cost);
+float dt_dev_pixelpipe_cache_get_cost(dt_dev_pixelpipe_cache_t *cache, void *data);
+
 /** print out cache lines/hashes (debug). */
 void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache);
 
@@ -24,6 +24,7 @@
 #include "control/signal.h"
 #include "common/opencl.h"
 #include "common/imageio.h"
+#include "common/file_location.h"
 #include "libs/lib.h"
 #include "libs/colorpicker.h"
 #include "iop/colorout.h"
@@ -62,6 +63,9 @@ static char *_pipe_type_to_str(int pipe_type)
   return r;
 }
 
+// needs _pipe_type_to_str():
+#include "develop/pixelpipe_trace.c"
+
 int dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height, int levels)
 {
   int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2);
@@ -84,10 +88,28 @@ int dt_dev_pixelpipe_init_dummy(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t
   return res;
 }
 
+// the interactive pipes keep as many intermediate buffers as the configured memory allows,
+// so going back in history or to a previous image doesn't need to process everything again.
+static void _init_cache_limits(dt_dev_pixelpipe_t *pipe)
+{
+  const size_t memory = MAX(0, dt_conf_get_int64("pixelpipe_cache_memory"));
+  char *spill_dir = NULL;
+  if(dt_conf_get_bool("pixelpipe_cache_spill"))
+  {
+    char cachedir[DT_MAX_PATH_LEN];
+    dt_loc_get_user_cache_dir(cachedir, sizeof(cachedir));
+    spill_dir = g_strdup_printf("%s/pixelpipe-%s", cachedir, _pipe_type_to_str(pipe->type));
+  }
+  const size_t disk = ((size_t)MAX(0, dt_conf_get_int("pixelpipe_cache_disk"))) << 20;
+  dt_dev_pixelpipe_cache_set_limits(&(pipe->cache), memory, spill_dir, disk);
+  g_free(spill_dir);
+}
+
 int dt_dev_pixelpipe_init_preview(dt_dev_pixelpipe_t *pipe)
 {
   int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5);
   pipe->type = DT_DEV_PIXELPIPE_PREVIEW;
+  if(res) _init_cache_limits(pipe);
   return res;
 }
 
@@ -95,6 +117,7 @@ int dt_dev_pixelpipe_init(dt_dev_pixelpipe_t *pipe)
 {
   int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5);
   pipe->type = DT_DEV_PIXELPIPE_FULL;
+  if(res) _init_cache_limits(pipe);
   return res;
 }
 
@@ -105,6 +128,7 @@ int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, int32_t size, int32_t
   pipe->processed_width  = pipe->backbuf_width  = pipe->iwidth = 0;
   pipe->processed_height = pipe->backbuf_height = pipe->iheight = 0;
   pipe->nodes = NULL;
+  pipe->trace = NULL;
   pipe->backbuf_size = size;
   if(!dt_dev_pixelpipe_cache_init(&(pipe->cache), entries, pipe->backbuf_size))
     return 0;
@@ -116,9 +140,11 @@ int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, int32_t size, int32_t
   pipe->tiling = 0;
   pipe->mask_display = 0;
   pipe->input_timestamp = 0;
+  pipe->downsampled_input = 0;
   pipe->levels = IMAGEIO_RGB | IMAGEIO_INT8;
   dt_pthread_mutex_init(&(pipe->backbuf_mutex), NULL);
   dt_pthread_mutex_init(&(pipe->busy_mutex), NULL);
+  dt_dev_pixelpipe_trace_init(pipe);
   return 1;
 }
 
@@ -140,6 +166,7 @@ void dt_dev_pixelpipe_cleanup(dt_dev_pixelpipe_t *pipe)
   dt_dev_pixelpipe_cleanup_nodes(pipe);
   // so now it's safe to clean up cache:
   dt_dev_pixelpipe_cache_cleanup(&(pipe->cache));
+  dt_dev_pixelpipe_trace_cleanup(pipe);
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
   dt_pthread_mutex_destroy(&(pipe->backbuf_mutex));
   dt_pthread_mutex_destroy(&(pipe->busy_mutex));
@@ -654,6 +681,23 @@ pixelpipe_picker_cl(int devid, dt_iop_module_t *module, cl_mem img, const dt_iop
 
 
 // recursive helper for process:
+/* process module on cpu. use tiling if needed and possible. */
+static dt_dev_pixelpipe_trace_path_t
+_process_on_cpu(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, void *input, void *output,
+                const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const int in_bpp, const int bpp,
+                const dt_develop_tiling_t *tiling)
+{
+  if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
+      !dt_tiling_piece_fits_host_memory(MAX(roi_in->width, roi_out->width), MAX(roi_in->height, roi_out->height),
+                                        MAX(in_bpp, bpp), tiling->factor, tiling->overhead))
+  {
+    module->process_tiling(module, piece, input, output, roi_in, roi_out, in_bpp);
+    return DT_DEV_PIXELPIPE_TRACE_CPU_TILED;
+  }
+  module->process(module, piece, input, output, roi_in, roi_out);
+  return DT_DEV_PIXELPIPE_TRACE_CPU;
+}
+
 static int
 dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void **output, void **cl_mem_output, int *out_bpp,
                              const dt_iop_roi_t *roi_out, GList *modules, GList *pieces, int pos)
@@ -687,13 +731,22 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     return 1;
   }
   uint64_t hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, roi_out, pipe, pos);
+  int cached = 0;
   if(dt_dev_pixelpipe_cache_available(&(pipe->cache), hash))
+  {
+    // the buffer might still be lost on the way, if it can't be read back from disk or there's no memory
+    // for it. drop the line reserved for it then, so it's computed again below:
+    cached = !dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output) && *output;
+    if(!cached && *output) dt_dev_pixelpipe_cache_invalidate(&(pipe->cache), *output);
+  }
+  if(cached)
   {
     // if(module) printf("found valid buf pos %d in cache for module %s %s %lu\n", pos, module->op, pipe == dev->preview_pipe ? "[preview]" : "", hash);
     // copy over cached processed max for clipping:
     if(piece) for(int k=0; k<3; k++) pipe->processed_maximum[k] = piece->processed_maximum[k];
     else      for(int k=0; k<3; k++) pipe->processed_maximum[k] = 1.0f;
-    (void) dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output);
+    dt_dev_pixelpipe_trace_add(pipe, module ? module->op : NULL, pos, DT_DEV_PIXELPIPE_TRACE_CACHED, NULL,
+                               &roi_in, roi_out, bufsize);
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
     if(!modules) return 0;
     // go to post-collect directly:
@@ -731,7 +784,12 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       }
       else if(dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output))
       {
-        memset(*output, 0, pipe->backbuf_size);
+        if(!*output)
+        {
+          dt_pthread_mutex_unlock(&pipe->busy_mutex);
+          return 1;
+        }
+        memset(*output, 0, bufsize);
         if(roi_in.scale == 1.0f)
         {
           // fast branch for 1:1 pixel copies.
@@ -770,6 +828,11 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       // reserve new cache line: output
       if(dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output))
       {
+        if(!*output)
+        {
+          dt_pthread_mutex_unlock(&pipe->busy_mutex);
+          return 1;
+        }
         roi_in.x /= roi_out->scale;
         roi_in.y /= roi_out->scale;
         roi_in.width = pipe->iwidth;
@@ -778,6 +841,8 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
         dt_iop_clip_and_zoom(*output, pipe->input, roi_out, &roi_in, roi_out->width, pipe->iwidth);
       }
     }
+    dt_dev_pixelpipe_cache_set_cost(&(pipe->cache), *output, dt_get_wtime() - start.clock);
+    dt_dev_pixelpipe_trace_add(pipe, NULL, pos, DT_DEV_PIXELPIPE_TRACE_INPUT, &start, &roi_in, roi_out, bufsize);
     dt_show_times(&start, "[dev_pixelpipe]", "initing base buffer [%s]", _pipe_type_to_str(pipe->type));
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
   }
@@ -812,6 +877,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     else
       (void) dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output);
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    if(!*output) return 1;
 
     // if(module) printf("reserving new buf in cache for module %s %s: %ld buf %p\n", module->op, pipe == dev->preview_pipe ? "[preview]" : "", hash, *output);
 
@@ -865,6 +931,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 
     dt_times_t start;
     dt_get_times(&start);
+    dt_dev_pixelpipe_trace_path_t trace_path = DT_DEV_PIXELPIPE_TRACE_CPU;
 
     dt_develop_tiling_t tiling = { 0 };
     dt_develop_tiling_t tiling_blendop = { 0 };
@@ -921,6 +988,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
         if(dt_opencl_image_fits_device(pipe->devid, MAX(roi_in.width, roi_out->width), MAX(roi_in.height, roi_out->height), MAX(in_bpp, bpp), tiling.factor, tiling.overhead))
         {
           /* image is small enough -> try to directly process entire image with opencl */
+          trace_path = DT_DEV_PIXELPIPE_TRACE_OPENCL;
 
           // fprintf(stderr, "[opencl_pixelpipe 2] module '%s' running directly with process_cl\n", module->op);
 
@@ -1040,6 +1108,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
         else if(module->flags() & IOP_FLAGS_ALLOW_TILING)
         {
           /* image is too big for direct opencl processing -> try to process image via tiling */
+          trace_path = DT_DEV_PIXELPIPE_TRACE_OPENCL_TILED;
 
           // fprintf(stderr, "[opencl_pixelpipe 3] module '%s' tiling with process_tiling_cl\n", module->op);
 
@@ -1246,12 +1315,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
           }
 
           /* process module on cpu. use tiling if needed and possible. */
-          if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-              !dt_tiling_piece_fits_host_memory(MAX(roi_in.width, roi_out->width), MAX(roi_in.height, roi_out->height),
-                                                MAX(in_bpp, bpp), tiling.factor, tiling.overhead))
-            module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
-          else
-            module->process(module, piece, input, *output, &roi_in, roi_out);
+          trace_path = _process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, bpp, &tiling);
 
           if(pipe->shutdown)
           {
@@ -1350,12 +1414,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
         }
 
         /* process module on cpu. use tiling if needed and possible. */
-        if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-            !dt_tiling_piece_fits_host_memory(MAX(roi_in.width, roi_out->width), MAX(roi_in.height, roi_out->height),
-                                              MAX(in_bpp, bpp), tiling.factor, tiling.overhead))
-          module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
-        else
-          module->process(module, piece, input, *output, &roi_in, roi_out);
+        trace_path = _process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, bpp, &tiling);
 
         if(pipe->shutdown)
         {
@@ -1422,12 +1481,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       /* opencl is not inited or not enabled or we got no resource/device -> everything runs on cpu */
 
       /* process module on cpu. use tiling if needed and possible. */
-      if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-          !dt_tiling_piece_fits_host_memory(MAX(roi_in.width, roi_out->width), MAX(roi_in.height, roi_out->height),
-                                            MAX(in_bpp, bpp), tiling.factor, tiling.overhead))
-        module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
-      else
-        module->process(module, piece, input, *output, &roi_in, roi_out);
+      trace_path = _process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, bpp, &tiling);
 
       if(pipe->shutdown)
       {
@@ -1480,12 +1534,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     }
 #else
     /* process module on cpu. use tiling if needed and possible. */
-    if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-        !dt_tiling_piece_fits_host_memory(MAX(roi_in.width, roi_out->width), MAX(roi_in.height, roi_out->height),
-                                          MAX(in_bpp, bpp), tiling.factor, tiling.overhead))
-      module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
-    else
-      module->process(module, piece, input, *output, &roi_in, roi_out);
+    trace_path = _process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, bpp, &tiling);
 
     if(pipe->shutdown)
     {
@@ -1537,6 +1586,10 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     dt_develop_blend_process(module, piece, input, *output, &roi_in, roi_out);
 #endif
 
+    // the time it takes to get this buffer back, including everything upstream which might be gone by then:
+    dt_dev_pixelpipe_cache_set_cost(&(pipe->cache), *output,
+                                    dt_dev_pixelpipe_cache_get_cost(&(pipe->cache), input) + dt_get_wtime() - start.clock);
+    dt_dev_pixelpipe_trace_add(pipe, module->op, pos, trace_path, &start, &roi_in, roi_out, bufsize);
     dt_show_times(&start, "[dev_pixelpipe]", "processing `%s' [%s]", module->name(),
                   _pipe_type_to_str(pipe->type));
     // in case we get this buffer from the cache, also get the processed max:
@@ -2121,6 +2174,8 @@ int dt_dev_pixelpipe_process(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, int x,
   // re-entry point: in case of late opencl errors we start all over again with opencl-support disabled
 restart:
 
+  dt_dev_pixelpipe_trace_begin(pipe);
+
   // image max is normalized before
   for(int k=0; k<3; k++) pipe->processed_maximum[k] = 1.0f; // dev->image->maximum;
 
@@ -2175,6 +2230,8 @@ restart:
     dt_opencl_unlock_device(pipe->devid);
     pipe->devid = -1;
   }
+  dt_dev_pixelpipe_trace_end(pipe, err);
+
   // ... and in case of other errors ...
   if (err)
   {
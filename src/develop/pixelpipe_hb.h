@@ -24,6 +24,7 @@
 #include "develop/imageop.h"
 #include "develop/develop.h"
 #include "develop/pixelpipe_cache.h"
+#include "develop/pixelpipe_trace.h"
 
 /**
  * struct used by iop modules to connect to pixelpipe.
@@ -126,6 +127,8 @@ typedef struct dt_dev_pixelpipe_t
   int mask_display;
   // input data based on this timestamp:
   int input_timestamp;
+  // input is the demosaiced and downscaled mipf buffer, even though this is not a preview pipe:
+  int downsampled_input;
   dt_dev_pixelpipe_type_t type;
   // the final output pixel format this pixelpipe will be converted to
   dt_imageio_levels_t levels;
@@ -133,6 +136,8 @@ typedef struct dt_dev_pixelpipe_t
   int devid;
   // image struct as it was when the pixelpipe was initialized. copied to avoid race conditions.
   dt_image_t image;
+  // structured trace of the runs, if enabled
+  dt_dev_pixelpipe_trace_t *trace;
 }
 dt_dev_pixelpipe_t;
 
@@ -194,6 +199,7 @@ void dt_dev_pixelpipe_remove_node(dt_dev_pixelpipe_t *pipe, struct dt_develop_t
 // i.e. four floats per pixel already demosaiced/downsampled
 static inline int dt_dev_pixelpipe_uses_downsampled_input(dt_dev_pixelpipe_t *pipe)
 {
+  if(pipe->downsampled_input) return 1;
   if(!dt_conf_get_bool("plugins/lighttable/low_quality_thumbnails"))
     return pipe->type == DT_DEV_PIXELPIPE_PREVIEW;
   else
@@ -0,0 +1,199 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "develop/pixelpipe_trace.h"
+#include "develop/pixelpipe_hb.h"
+#include "common/file_location.h"
+#include "control/conf.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+static const char *_trace_path_to_str(const dt_dev_pixelpipe_trace_path_t path)
+{
+  switch(path)
+  {
+    case DT_DEV_PIXELPIPE_TRACE_CACHED:
+      return "cached";
+    case DT_DEV_PIXELPIPE_TRACE_CPU:
+      return "cpu";
+    case DT_DEV_PIXELPIPE_TRACE_CPU_TILED:
+      return "cpu_tiled";
+    case DT_DEV_PIXELPIPE_TRACE_OPENCL:
+      return "opencl";
+    case DT_DEV_PIXELPIPE_TRACE_OPENCL_TILED:
+      return "opencl_tiled";
+    case DT_DEV_PIXELPIPE_TRACE_INPUT:
+      return "input";
+  }
+  return "unknown";
+}
+
+void dt_dev_pixelpipe_trace_init(dt_dev_pixelpipe_t *pipe)
+{
+  pipe->trace = NULL;
+  gchar *format = dt_conf_get_string("pixelpipe_trace");
+  dt_dev_pixelpipe_trace_format_t f = DT_DEV_PIXELPIPE_TRACE_OFF;
+  if(format && !strcmp(format, "json")) f = DT_DEV_PIXELPIPE_TRACE_JSON;
+  else if(format && !strcmp(format, "csv")) f = DT_DEV_PIXELPIPE_TRACE_CSV;
+  g_free(format);
+  if(f == DT_DEV_PIXELPIPE_TRACE_OFF) return;
+
+  dt_dev_pixelpipe_trace_t *trace = (dt_dev_pixelpipe_trace_t *)malloc(sizeof(dt_dev_pixelpipe_trace_t));
+  trace->format = f;
+  trace->dir = dt_conf_get_string("pixelpipe_trace_dir");
+  if(!trace->dir || !trace->dir[0])
+  {
+    char cachedir[DT_MAX_PATH_LEN];
+    dt_loc_get_user_cache_dir(cachedir, sizeof(cachedir));
+    g_free(trace->dir);
+    trace->dir = g_build_filename(cachedir, "traces", NULL);
+  }
+  if(g_mkdir_with_parents(trace->dir, 0750))
+  {
+    fprintf(stderr, "[pixelpipe_trace] could not create directory `%s', tracing disabled\n", trace->dir);
+    g_free(trace->dir);
+    free(trace);
+    return;
+  }
+  trace->events = g_array_new(FALSE, FALSE, sizeof(dt_dev_pixelpipe_trace_event_t));
+  trace->start = 0.0;
+  pipe->trace = trace;
+}
+
+void dt_dev_pixelpipe_trace_cleanup(dt_dev_pixelpipe_t *pipe)
+{
+  dt_dev_pixelpipe_trace_t *trace = pipe->trace;
+  if(!trace) return;
+  g_array_free(trace->events, TRUE);
+  g_free(trace->dir);
+  free(trace);
+  pipe->trace = NULL;
+}
+
+void dt_dev_pixelpipe_trace_begin(dt_dev_pixelpipe_t *pipe)
+{
+  dt_dev_pixelpipe_trace_t *trace = pipe->trace;
+  if(!trace) return;
+  g_array_set_size(trace->events, 0);
+  trace->start = dt_get_wtime();
+  trace->queries = pipe->cache.queries;
+  trace->misses = pipe->cache.misses;
+  trace->disk_hits = pipe->cache.disk_hits;
+}
+
+void dt_dev_pixelpipe_trace_add(dt_dev_pixelpipe_t *pipe, const char *op, const int pos,
+                                const dt_dev_pixelpipe_trace_path_t path, const dt_times_t *start,
+                                const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const size_t bytes)
+{
+  dt_dev_pixelpipe_trace_t *trace = pipe->trace;
+  if(!trace) return;
+  dt_dev_pixelpipe_trace_event_t ev;
+  memset(&ev, 0, sizeof(ev));
+  g_strlcpy(ev.op, op ? op : "input", sizeof(ev.op));
+  ev.pos = pos;
+  ev.path = path;
+  if(start)
+  {
+    dt_times_t end;
+    dt_get_times(&end);
+    ev.start = start->clock - trace->start;
+    ev.wall = end.clock - start->clock;
+    ev.user = end.user - start->user;
+  }
+  else ev.start = dt_get_wtime() - trace->start;
+  ev.in_x = roi_in->x;
+  ev.in_y = roi_in->y;
+  ev.in_width = roi_in->width;
+  ev.in_height = roi_in->height;
+  ev.out_x = roi_out->x;
+  ev.out_y = roi_out->y;
+  ev.out_width = roi_out->width;
+  ev.out_height = roi_out->height;
+  ev.scale = roi_out->scale;
+  ev.bytes = bytes;
+  g_array_append_val(trace->events, ev);
+}
+
+static void _trace_write_json(dt_dev_pixelpipe_t *pipe, FILE *f, const int err)
+{
+  dt_dev_pixelpipe_trace_t *trace = pipe->trace;
+  const char *type = _pipe_type_to_str(pipe->type);
+  fprintf(f, "{\"traceEvents\":[\n");
+  for(guint k=0; k<trace->events->len; k++)
+  {
+    const dt_dev_pixelpipe_trace_event_t *ev = &g_array_index(trace->events, dt_dev_pixelpipe_trace_event_t, k);
+    fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":\"%s\",\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f,"
+            "\"args\":{\"pos\":%d,\"cpu_us\":%.1f,\"roi_in\":[%d,%d,%d,%d],\"roi_out\":[%d,%d,%d,%d],\"scale\":%g,\"bytes\":%zu}}%s\n",
+            ev->op, _trace_path_to_str(ev->path), type, pipe->image.id, 1e6*ev->start, 1e6*ev->wall,
+            ev->pos, 1e6*ev->user, ev->in_x, ev->in_y, ev->in_width, ev->in_height,
+            ev->out_x, ev->out_y, ev->out_width, ev->out_height, ev->scale, ev->bytes,
+            k+1 < trace->events->len ? "," : "");
+  }
+  fprintf(f, "],\n\"otherData\":{\"pipe\":\"%s\",\"image\":%d,\"error\":%d,\"wall_s\":%.6f,"
+          "\"cache_queries\":%"PRIu64",\"cache_misses\":%"PRIu64",\"cache_disk_hits\":%"PRIu64",\"cache_bytes\":%zu}}\n",
+          type, pipe->image.id, err, dt_get_wtime() - trace->start,
+          pipe->cache.queries - trace->queries, pipe->cache.misses - trace->misses,
+          pipe->cache.disk_hits - trace->disk_hits, pipe->cache.allocated);
+}
+
+static void _trace_write_csv(dt_dev_pixelpipe_t *pipe, FILE *f, const int err)
+{
+  dt_dev_pixelpipe_trace_t *trace = pipe->trace;
+  const char *type = _pipe_type_to_str(pipe->type);
+  fprintf(f, "pipe,image,op,pos,path,start_ms,wall_ms,cpu_ms,in_x,in_y,in_width,in_height,out_x,out_y,out_width,out_height,scale,bytes\n");
+  for(guint k=0; k<trace->events->len; k++)
+  {
+    const dt_dev_pixelpipe_trace_event_t *ev = &g_array_index(trace->events, dt_dev_pixelpipe_trace_event_t, k);
+    fprintf(f, "%s,%d,%s,%d,%s,%.3f,%.3f,%.3f,%d,%d,%d,%d,%d,%d,%d,%d,%g,%zu\n",
+            type, pipe->image.id, ev->op, ev->pos, _trace_path_to_str(ev->path), 1e3*ev->start, 1e3*ev->wall, 1e3*ev->user,
+            ev->in_x, ev->in_y, ev->in_width, ev->in_height, ev->out_x, ev->out_y, ev->out_width, ev->out_height,
+            ev->scale, ev->bytes);
+  }
+  // the run as a whole, with cache statistics in place of the module columns:
+  fprintf(f, "# total wall_ms %.3f error %d cache_queries %"PRIu64" cache_misses %"PRIu64" cache_disk_hits %"PRIu64" cache_bytes %zu\n",
+          1e3*(dt_get_wtime() - trace->start), err, pipe->cache.queries - trace->queries,
+          pipe->cache.misses - trace->misses, pipe->cache.disk_hits - trace->disk_hits, pipe->cache.allocated);
+}
+
+void dt_dev_pixelpipe_trace_end(dt_dev_pixelpipe_t *pipe, const int err)
+{
+  dt_dev_pixelpipe_trace_t *trace = pipe->trace;
+  if(!trace) return;
+  static int run = 0;
+  const int n = __sync_fetch_and_add(&run, 1);
+  gchar *filename = g_strdup_printf("%s/pixelpipe-%d-%04d-%s-%d.%s", trace->dir, (int)getpid(), n,
+                                    _pipe_type_to_str(pipe->type), pipe->image.id,
+                                    trace->format == DT_DEV_PIXELPIPE_TRACE_JSON ? "json" : "csv");
+  FILE *f = fopen(filename, "wb");
+  if(f)
+  {
+    if(trace->format == DT_DEV_PIXELPIPE_TRACE_JSON) _trace_write_json(pipe, f, err);
+    else _trace_write_csv(pipe, f, err);
+    fclose(f);
+  }
+  else fprintf(stderr, "[pixelpipe_trace] could not write `%s'\n", filename);
+  g_free(filename);
+  g_array_set_size(trace->events, 0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,95 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_PIXELPIPE_TRACE_H
+#define DT_PIXELPIPE_TRACE_H
+
+#include "common/darktable.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <glib.h>
+
+/**
+ * machine readable record of what a pixelpipe run did: one event per module with
+ * timings, regions of interest, buffer sizes and the code path taken, plus the
+ * pixelpipe cache statistics. every run is written to its own file, either as
+ * chrome trace-event json (load it in chrome://tracing) or as csv.
+ * enabled by the pixelpipe_trace config option.
+ */
+struct dt_dev_pixelpipe_t;
+struct dt_iop_roi_t;
+
+typedef enum dt_dev_pixelpipe_trace_format_t
+{
+  DT_DEV_PIXELPIPE_TRACE_OFF = 0,
+  DT_DEV_PIXELPIPE_TRACE_JSON,
+  DT_DEV_PIXELPIPE_TRACE_CSV
+}
+dt_dev_pixelpipe_trace_format_t;
+
+typedef enum dt_dev_pixelpipe_trace_path_t
+{
+  DT_DEV_PIXELPIPE_TRACE_CACHED = 0,  // buffer came from the pixelpipe cache
+  DT_DEV_PIXELPIPE_TRACE_CPU,
+  DT_DEV_PIXELPIPE_TRACE_CPU_TILED,
+  DT_DEV_PIXELPIPE_TRACE_OPENCL,
+  DT_DEV_PIXELPIPE_TRACE_OPENCL_TILED,
+  DT_DEV_PIXELPIPE_TRACE_INPUT        // import of the input buffer
+}
+dt_dev_pixelpipe_trace_path_t;
+
+typedef struct dt_dev_pixelpipe_trace_event_t
+{
+  char op[20];
+  int pos;
+  dt_dev_pixelpipe_trace_path_t path;
+  double start;                 // wall clock seconds since the start of the run
+  double wall;                  // wall clock seconds spent in this module
+  double user;                  // user cpu seconds of the process spent in this module, all threads
+  int in_x, in_y, in_width, in_height;
+  int out_x, out_y, out_width, out_height;
+  float scale;
+  size_t bytes;                 // size of the output buffer
+}
+dt_dev_pixelpipe_trace_event_t;
+
+typedef struct dt_dev_pixelpipe_trace_t
+{
+  dt_dev_pixelpipe_trace_format_t format;
+  char *dir;
+  GArray *events;
+  double start;
+  uint64_t queries, misses, disk_hits;   // cache statistics at the start of the run
+}
+dt_dev_pixelpipe_trace_t;
+
+/** reads the config and sets up pipe->trace, or leaves it NULL if tracing is off. */
+void dt_dev_pixelpipe_trace_init(struct dt_dev_pixelpipe_t *pipe);
+void dt_dev_pixelpipe_trace_cleanup(struct dt_dev_pixelpipe_t *pipe);
+/** start a new run. */
+void dt_dev_pixelpipe_trace_begin(struct dt_dev_pixelpipe_t *pipe);
+/** record one module, op is NULL for the input. start is when processing began, or NULL for cache hits. */
+void dt_dev_pixelpipe_trace_add(struct dt_dev_pixelpipe_t *pipe, const char *op, const int pos,
+                                const dt_dev_pixelpipe_trace_path_t path, const dt_times_t *start,
+                                const struct dt_iop_roi_t *roi_in, const struct dt_iop_roi_t *roi_out, const size_t bytes);
+/** finish the run and write it to disk. */
+void dt_dev_pixelpipe_trace_end(struct dt_dev_pixelpipe_t *pipe, const int err);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -29,6 +29,9 @@
 #include <math.h>
 #include <unistd.h>
 #include <assert.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define CLAMPI(a, mn, mx) ((a) < (mn) ? (mn) : ((a) > (mx) ? (mx) : (a)))
 
@@ -592,12 +595,158 @@ _fit_output_to_input_roi(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_i
 }
 
 
+/* everything needed to process one tile on the host. tiles are planned ahead,
+   so that they can be processed in any order and also concurrently. */
+typedef struct _tiling_tile_t
+{
+  /* roi_in and roi_out passed to process() */
+  dt_iop_roi_t iroi, oroi;
+  /* offset of the tile into ivoid, and of its good part into ovoid */
+  size_t ioffs, ooffs;
+  /* good part of the tile within its output buffer */
+  int origin_x, origin_y, good_wd, good_ht;
+  /* resulting processed_maximum */
+  float processed_maximum[3];
+}
+_tiling_tile_t;
+
+
+/* number of tiles we are allowed to process at the same time. this is limited to modules
+   which explicitly allow it (as process() must not have side effects besides writing its output),
+   and to pipes which are not connected to the gui. */
+static int
+_tiling_max_parallel(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece)
+{
+#ifdef _OPENMP
+  if(!(self->flags() & IOP_FLAGS_ALLOW_PARALLEL_TILES)) return 1;
+  if(piece->pipe->type != DT_DEV_PIXELPIPE_EXPORT && piece->pipe->type != DT_DEV_PIXELPIPE_THUMBNAIL) return 1;
+  return CLAMPS(dt_conf_get_int("host_parallel_tiles"), 1, omp_get_max_threads());
+#else
+  return 1;
+#endif
+}
+
+
+/* number of tiles which fit into the available memory at the same time. every tile needs
+   factor times its buffer size, plus the overhead of the module (already deducted once from available) */
+static int
+_tiling_in_flight(const int max_parallel, const int num_tiles, const float available, const float factor,
+                  const unsigned overhead, const int width, const int height, const int max_bpp)
+{
+  const float tile = factor * width * height * max_bpp;
+  const int fit = 1 + (int)fmax(floorf((available - tile) / (tile + overhead)), 0.0f);
+  return _max(1, _min(_min(max_parallel, num_tiles), fit));
+}
+
+
+/* process all planned tiles, in_flight of them at the same time. tiles only share the input buffer,
+   which is read only, and write to disjoint parts of the output buffer. as every tile is processed with
+   exactly the same roi and input as in the serial case, the result doesn't depend on in_flight.
+   returns non-zero if we ran out of memory. */
+static int
+_tiling_process_tiles(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid,
+                      const int ipitch, const int opitch, const int in_bpp, const int out_bpp,
+                      _tiling_tile_t *tiles, const int num_tiles, const int in_flight, const char *caller)
+{
+  size_t insize = 0, outsize = 0;
+  for(int t=0; t<num_tiles; t++)
+  {
+    insize  = MAX(insize,  (size_t)tiles[t].iroi.width*tiles[t].iroi.height*in_bpp);
+    outsize = MAX(outsize, (size_t)tiles[t].oroi.width*tiles[t].oroi.height*out_bpp);
+  }
+
+  /* store processed_maximum to be re-used and aggregated */
+  float processed_maximum_saved[3];
+  for(int k=0; k<3; k++)
+    processed_maximum_saved[k] = piece->pipe->processed_maximum[k];
+
+  piece->pipe->tiling = 1;
+  int err = 0;
+
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(in_flight) if(in_flight > 1)
+#endif
+  {
+    /* reserve input and output buffers for tiles. concurrent tiles also get their own copy of
+       the pipe, as process() reads and writes processed_maximum there. */
+    void *input = dt_alloc_align(64, insize);
+    void *output = dt_alloc_align(64, outsize);
+    dt_dev_pixelpipe_t tile_pipe = *piece->pipe;
+    dt_dev_pixelpipe_iop_t tile_piece = *piece;
+    tile_piece.pipe = &tile_pipe;
+    dt_dev_pixelpipe_iop_t *p = in_flight > 1 ? &tile_piece : piece;
+
+    if(input == NULL || output == NULL)
+    {
+      dt_print(DT_DEBUG_DEV, "[%s] could not alloc tile buffers for module '%s'\n", caller, self->op);
+      err = 1;
+    }
+
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic, 1)
+#endif
+    for(int t=0; t<num_tiles; t++)
+    {
+      if(err) continue;
+      _tiling_tile_t *tile = tiles + t;
+
+      dt_print(DT_DEBUG_DEV, "[%s] tile %d with %d x %d at origin [%d, %d]\n", caller, t, tile->iroi.width, tile->iroi.height, tile->iroi.x, tile->iroi.y);
+
+      /* prepare input tile buffer */
+#ifdef _OPENMP
+      #pragma omp parallel for schedule(static)
+#endif
+      for(int j=0; j<tile->iroi.height; j++)
+        memcpy((char *)input+(size_t)j*tile->iroi.width*in_bpp, (char *)ivoid+tile->ioffs+(size_t)j*ipitch, (size_t)tile->iroi.width*in_bpp);
+
+      /* take original processed_maximum as starting point */
+      for(int k=0; k<3; k++)
+        p->pipe->processed_maximum[k] = processed_maximum_saved[k];
+
+      /* call process() of module */
+      self->process(self, p, input, output, &tile->iroi, &tile->oroi);
+
+      for(int k=0; k<3; k++)
+        tile->processed_maximum[k] = p->pipe->processed_maximum[k];
+
+      /* copy "good" part of tile to output buffer */
+#ifdef _OPENMP
+      #pragma omp parallel for schedule(static)
+#endif
+      for(int j=0; j<tile->good_ht; j++)
+        memcpy((char *)ovoid+tile->ooffs+(size_t)j*opitch, (char *)output+((size_t)(j+tile->origin_y)*tile->oroi.width+tile->origin_x)*out_bpp, (size_t)tile->good_wd*out_bpp);
+    }
+
+    if(input != NULL) dt_free_align(input);
+    if(output != NULL) dt_free_align(output);
+  }
+  if(err) return 1;
+
+  /* aggregate resulting processed_maximum, in the same order as tiles would have been processed serially */
+  /* TODO: check if there really can be differences between tiles and take
+           appropriate action (calculate minimum, maximum, average, ...?) */
+  float processed_maximum_new[3] = { 1.0f };
+  for(int t=0; t<num_tiles; t++)
+    for(int k=0; k<3; k++)
+    {
+      if(t > 0 && fabs(processed_maximum_new[k] - tiles[t].processed_maximum[k]) > 1.0e-6f)
+        dt_print(DT_DEBUG_DEV, "[%s] processed_maximum[%d] differs between tiles in module '%s'\n", caller, k, self->op);
+      processed_maximum_new[k] = tiles[t].processed_maximum[k];
+    }
+
+  /* copy back final processed_maximum */
+  for(int k=0; k<3; k++)
+    piece->pipe->processed_maximum[k] = processed_maximum_new[k];
+
+  return 0;
+}
+
+
 /* simple tiling algorithm for roi_in == roi_out, i.e. for pixel to pixel modules/operations */
 static void
 _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const int in_bpp)
 {
-  void *input = NULL;
-  void *output = NULL;
+  _tiling_tile_t *tiles = NULL;
 
   const int out_bpp = self->output_bpp(self, piece->pipe, piece);
   const int ipitch = roi_in->width * in_bpp;
@@ -628,7 +777,11 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   singlebuffer = fmax(singlebuffer, 2.0f*1024.0f*1024.0f);
   float factor = fmax(tiling.factor, 1.0f);
   float maxbuf = fmax(tiling.maxbuf, 1.0f);
-  singlebuffer = fmax(available / factor, singlebuffer);
+  /* size the tiles such that max_parallel of them, each with its own overhead, fit into available at
+     the same time. this only depends on the configuration, so the tile layout is the same for every run. */
+  const int max_parallel = _tiling_max_parallel(self, piece);
+  const float available_tile = fmax(available - (max_parallel - 1) * (float)tiling.overhead, 0.0f) / max_parallel;
+  singlebuffer = fmax(available_tile / factor, singlebuffer);
 
   int width = roi_in->width;
   int height = roi_in->height;
@@ -697,107 +850,53 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] use tiling on module '%s' for image with full size %d x %d\n", self->op, roi_in->width, roi_in->height);
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] (%d x %d) tiles with max dimensions %d x %d and overlap %d\n", tiles_x, tiles_y, width, height, overlap);
 
-  /* reserve input and output buffers for tiles */
-  input = dt_alloc_align(64, width*height*in_bpp);
-  if(input == NULL)
-  {
-    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] could not alloc input buffer for module '%s'\n", self->op);
-    goto error;
-  }
-  output = dt_alloc_align(64, width*height*out_bpp);
-  if(output == NULL)
-  {
-    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] could not alloc output buffer for module '%s'\n", self->op);
-    goto error;
-  }
-
-  /* store processed_maximum to be re-used and aggregated */
-  float processed_maximum_saved[3];
-  float processed_maximum_new[3] = { 1.0f };
-  for(int k=0; k<3; k++)
-    processed_maximum_saved[k] = piece->pipe->processed_maximum[k];
-
-
-  /* iterate over tiles */
+  /* plan tiles in the order they would be processed serially */
+  tiles = (_tiling_tile_t *)malloc(sizeof(_tiling_tile_t)*tiles_x*tiles_y);
+  if(tiles == NULL) goto error;
+  int num_tiles = 0;
   for(int tx=0; tx<tiles_x; tx++)
     for(int ty=0; ty<tiles_y; ty++)
     {
-      piece->pipe->tiling = 1;
-
-      size_t wd = tx * tile_wd + width > roi_in->width  ? roi_in->width - tx * tile_wd : width;
-      size_t ht = ty * tile_ht + height > roi_in->height ? roi_in->height- ty * tile_ht : height;
+      const int wd = tx * tile_wd + width > roi_in->width  ? roi_in->width - tx * tile_wd : width;
+      const int ht = ty * tile_ht + height > roi_in->height ? roi_in->height- ty * tile_ht : height;
 
       /* no need to process end-tiles that are smaller than overlap */
       if((wd <= overlap && tx > 0) || (ht <= overlap && ty > 0)) continue;
 
-      /* origin and region of effective part of tile, which we want to store later */
-      size_t origin[] = { 0, 0, 0 };
-      size_t region[] = { wd, ht, 1 };
+      _tiling_tile_t *tile = tiles + num_tiles++;
 
-      /* roi_in and roi_out for process_cl on subbuffer */
-      dt_iop_roi_t iroi = { roi_in->x+tx*tile_wd, roi_in->y+ty*tile_ht, wd, ht, roi_in->scale };
-      dt_iop_roi_t oroi = { roi_out->x+tx*tile_wd, roi_out->y+ty*tile_ht, wd, ht, roi_out->scale };
+      /* roi_in and roi_out for process() on tile buffer */
+      tile->iroi = (dt_iop_roi_t){ roi_in->x+tx*tile_wd, roi_in->y+ty*tile_ht, wd, ht, roi_in->scale };
+      tile->oroi = (dt_iop_roi_t){ roi_out->x+tx*tile_wd, roi_out->y+ty*tile_ht, wd, ht, roi_out->scale };
 
       /* offsets of tile into ivoid and ovoid */
-      size_t ioffs = (ty * tile_ht)*ipitch + (tx * tile_wd)*in_bpp;
-      size_t ooffs = (ty * tile_ht)*opitch + (tx * tile_wd)*out_bpp;
-
-
-      dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] tile (%d, %d) with %d x %d at origin [%d, %d]\n", tx, ty, wd, ht, tx*tile_wd, ty*tile_ht);
-
-      /* prepare input tile buffer */
-#ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(input,width,ivoid,ioffs,wd,ht) schedule(static)
-#endif
-      for(size_t j=0; j<ht; j++)
-        memcpy((char *)input+j*wd*in_bpp, (char *)ivoid+ioffs+j*ipitch, wd*in_bpp);
-
-      /* take original processed_maximum as starting point */
-      for(int k=0; k<3; k++)
-        piece->pipe->processed_maximum[k] = processed_maximum_saved[k];
+      tile->ioffs = (size_t)(ty * tile_ht)*ipitch + (size_t)(tx * tile_wd)*in_bpp;
+      tile->ooffs = (size_t)(ty * tile_ht)*opitch + (size_t)(tx * tile_wd)*out_bpp;
 
-      /* call process() of module */
-      self->process(self, piece, input, output, &iroi, &oroi);
-
-      /* aggregate resulting processed_maximum */
-      /* TODO: check if there really can be differences between tiles and take
-               appropriate action (calculate minimum, maximum, average, ...?) */
-      for(int k=0; k<3; k++)
-      {
-        if(tx+ty > 0 && fabs(processed_maximum_new[k] - piece->pipe->processed_maximum[k]) > 1.0e-6f)
-          dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] processed_maximum[%d] differs between tiles in module '%s'\n", k, self->op);
-        processed_maximum_new[k] = piece->pipe->processed_maximum[k];
-      }
-
-      /* correct origin and region of tile for overlap.
+      /* origin and region of effective part of tile, corrected for overlap.
          make sure that we only copy back the "good" part. */
-      if(tx > 0)
-      {
-        origin[0] += overlap;
-        region[0] -= overlap;
-        ooffs += overlap*out_bpp;
-      }
-      if(ty > 0)
-      {
-        origin[1] += overlap;
-        region[1] -= overlap;
-        ooffs += overlap*opitch;
-      }
-
-      /* copy "good" part of tile to output buffer */
-#ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(ovoid,ooffs,output,width,origin,region,wd) schedule(static)
-#endif
-      for(size_t j=0; j<region[1]; j++)
-        memcpy((char *)ovoid+ooffs+j*opitch, (char *)output+((j+origin[1])*wd+origin[0])*out_bpp, region[0]*out_bpp);
+      tile->origin_x = tx > 0 ? overlap : 0;
+      tile->origin_y = ty > 0 ? overlap : 0;
+      tile->good_wd = wd - tile->origin_x;
+      tile->good_ht = ht - tile->origin_y;
+      tile->ooffs += (size_t)tile->origin_y*opitch + (size_t)tile->origin_x*out_bpp;
+
+      /* the trailing overlap is overwritten by the next tile anyway. leave it out, so that
+         the good parts of all tiles are disjoint and can be written in any order. */
+      if(tx+1 < tiles_x && roi_in->width - (tx+1)*tile_wd > overlap)
+        tile->good_wd = _min(tile->good_wd, tile_wd + overlap - tile->origin_x);
+      if(ty+1 < tiles_y && roi_in->height - (ty+1)*tile_ht > overlap)
+        tile->good_ht = _min(tile->good_ht, tile_ht + overlap - tile->origin_y);
     }
 
-  /* copy back final processed_maximum */
-  for(int k=0; k<3; k++)
-    piece->pipe->processed_maximum[k] = processed_maximum_new[k];
+  const int in_flight = _tiling_in_flight(max_parallel, num_tiles, available, factor, tiling.overhead, width, height, max_bpp);
+  if(in_flight > 1)
+    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] processing %d tiles at a time\n", in_flight);
+
+  if(_tiling_process_tiles(self, piece, ivoid, ovoid, ipitch, opitch, in_bpp, out_bpp, tiles, num_tiles, in_flight, "default_process_tiling_ptp"))
+    goto error;
 
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
+  free(tiles);
   piece->pipe->tiling = 0;
   return;
 
@@ -806,8 +905,7 @@ error:
   // fall through
 
 fallback:
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
+  free(tiles);
   piece->pipe->tiling = 0;
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] fall back to standard processing for module '%s'\n", self->op);
   self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
@@ -822,8 +920,7 @@ fallback:
 static void
 _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const int in_bpp)
 {
-  void *input = NULL;
-  void *output = NULL;
+  _tiling_tile_t *tiles = NULL;
 
   //_print_roi(roi_in, "module roi_in");
   //_print_roi(roi_out, "module roi_out");
@@ -865,7 +962,11 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   singlebuffer = fmax(singlebuffer, 2.0f*1024.0f*1024.0f);
   float factor = fmax(tiling.factor, 1.0f);
   float maxbuf = fmax(tiling.maxbuf, 1.0f);
-  singlebuffer = fmax(available / factor, singlebuffer);
+  /* size the tiles such that max_parallel of them, each with its own overhead, fit into available at
+     the same time. this only depends on the configuration, so the tile layout is the same for every run. */
+  const int max_parallel = _tiling_max_parallel(self, piece);
+  const float available_tile = fmax(available - (max_parallel - 1) * (float)tiling.overhead, 0.0f) / max_parallel;
+  singlebuffer = fmax(available_tile / factor, singlebuffer);
 
   int width = _max(roi_in->width, roi_out->width);
   int height = _max(roi_in->height, roi_out->height);
@@ -943,18 +1044,13 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] (%d x %d) tiles with max dimensions %d x %d\n", tiles_x, tiles_y, width, height);
 
 
-  /* store processed_maximum to be re-used and aggregated */
-  float processed_maximum_saved[3];
-  float processed_maximum_new[3] = { 1.0f };
-  for(int k=0; k<3; k++)
-    processed_maximum_saved[k] = piece->pipe->processed_maximum[k];
-
-  /* iterate over tiles */
+  /* plan tiles in the order they would be processed serially */
+  tiles = (_tiling_tile_t *)malloc(sizeof(_tiling_tile_t)*tiles_x*tiles_y);
+  if(tiles == NULL) goto error;
+  int num_tiles = 0;
   for(int tx=0; tx<tiles_x; tx++)
     for(int ty=0; ty<tiles_y; ty++)
     {
-      piece->pipe->tiling = 1;
-
       /* the output dimensions of the good part of this specific tile */
       size_t wd = (tx + 1) * tile_wd > roi_out->width  ? roi_out->width - tx * tile_wd : tile_wd;
       size_t ht = (ty + 1) * tile_ht > roi_out->height ? roi_out->height- ty * tile_ht : tile_ht;
@@ -1030,70 +1126,30 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
       //_print_roi(&iroi_full, "tile iroi_full final");
       //_print_roi(&oroi_full, "tile oroi_full final");
 
-      /* offsets of tile into ivoid and ovoid */
-      size_t ioffs = (iroi_full.y - roi_in->y)*ipitch + (iroi_full.x - roi_in->x)*in_bpp;
-      size_t ooffs = (oroi_good.y - roi_out->y)*opitch + (oroi_good.x - roi_out->x)*out_bpp;
-
-      dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] tile (%d, %d) with %d x %d at origin [%d, %d]\n", tx, ty, iroi_full.width, iroi_full.height, iroi_full.x, iroi_full.y);
-
-
-      /* prepare input tile buffer */
-      input = dt_alloc_align(64, iroi_full.width*iroi_full.height*in_bpp);
-      if(input == NULL)
-      {
-        dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc input buffer for module '%s'\n", self->op);
-        goto error;
-      }
-      output = dt_alloc_align(64, oroi_full.width*oroi_full.height*out_bpp);
-      if(output == NULL)
-      {
-        dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc output buffer for module '%s'\n", self->op);
-        goto error;
-      }
-
-#ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(input,ivoid,ioffs,iroi_full) schedule(static)
-#endif
-      for(int j=0; j<iroi_full.height; j++)
-        memcpy((char *)input+j*iroi_full.width*in_bpp, (char *)ivoid+ioffs+j*ipitch, iroi_full.width*in_bpp);
+      _tiling_tile_t *tile = tiles + num_tiles++;
+      tile->iroi = iroi_full;
+      tile->oroi = oroi_full;
 
-      /* take original processed_maximum as starting point */
-      for(int k=0; k<3; k++)
-        piece->pipe->processed_maximum[k] = processed_maximum_saved[k];
-
-      /* call process() of module */
-      self->process(self, piece, input, output, &iroi_full, &oroi_full);
-
-      /* aggregate resulting processed_maximum */
-      /* TODO: check if there really can be differences between tiles and take
-               appropriate action (calculate minimum, maximum, average, ...?) */
-      for(int k=0; k<3; k++)
-      {
-        if(tx+ty > 0 && fabs(processed_maximum_new[k] - piece->pipe->processed_maximum[k]) > 1.0e-6f)
-          dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] processed_maximum[%d] differs between tiles in module '%s'\n", k, self->op);
-        processed_maximum_new[k] = piece->pipe->processed_maximum[k];
-      }
-
-      /* copy "good" part of tile to output buffer */
-      const int origin_x = oroi_good.x - oroi_full.x;
-      const int origin_y = oroi_good.y - oroi_full.y;
-#ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(ovoid,ooffs,output,oroi_good,oroi_full) schedule(static)
-#endif
-      for(int j=0; j<oroi_good.height; j++)
-        memcpy((char *)ovoid+ooffs+j*opitch, (char *)output+((j+origin_y)*oroi_full.width+origin_x)*out_bpp, oroi_good.width*out_bpp);
-
-      dt_free_align(input);
-      dt_free_align(output);
-      input = output = NULL;
+      /* offsets of tile into ivoid and ovoid */
+      tile->ioffs = (size_t)(iroi_full.y - roi_in->y)*ipitch + (size_t)(iroi_full.x - roi_in->x)*in_bpp;
+      tile->ooffs = (size_t)(oroi_good.y - roi_out->y)*opitch + (size_t)(oroi_good.x - roi_out->x)*out_bpp;
+
+      /* "good" part of tile which goes to the output buffer */
+      tile->origin_x = oroi_good.x - oroi_full.x;
+      tile->origin_y = oroi_good.y - oroi_full.y;
+      tile->good_wd = oroi_good.width;
+      tile->good_ht = oroi_good.height;
     }
 
-  /* copy back final processed_maximum */
-  for(int k=0; k<3; k++)
-    piece->pipe->processed_maximum[k] = processed_maximum_new[k];
+  /* memory per tile is estimated from the planned tile dimensions */
+  const int in_flight = _tiling_in_flight(max_parallel, num_tiles, available, factor, tiling.overhead, width, height, max_bpp);
+  if(in_flight > 1)
+    dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] processing %d tiles at a time\n", in_flight);
+
+  if(_tiling_process_tiles(self, piece, ivoid, ovoid, ipitch, opitch, in_bpp, out_bpp, tiles, num_tiles, in_flight, "default_process_tiling_roi"))
+    goto error;
 
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
+  free(tiles);
   piece->pipe->tiling = 0;
   return;
 
@@ -1102,8 +1158,7 @@ error:
   // fall through
 
 fallback:
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
+  free(tiles);
   piece->pipe->tiling = 0;
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] fall back to standard processing for module '%s'\n", self->op);
   self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
@@ -98,6 +98,41 @@ void RawDecoder::decodeUncompressed(TiffIFD *rawIFD, BitOrder order) {
   }
 }
 
+/* Rows of uncompressed data without line padding don't depend on each other, so big */
+/* images are split into bands, each unpacked by its own thread and bit pump. */
+class RawDecoderUnpackThread
+{
+  public:
+    RawDecoderUnpackThread() {error = 0;};
+    const uchar8* input;    // first byte of row start_y
+    uint32 size;            // bytes available from input on
+    uint32 start_y;
+    uint32 end_y;
+    const char* error;
+    pthread_t threadid;
+    RawDecoder* parent;
+};
+
+void *RawDecoderUnpackThreadFunc(void *_this) {
+  RawDecoderUnpackThread* me = (RawDecoderUnpackThread*)_this;
+  try {
+    me->parent->unpackBand(me);
+  } catch (RawDecoderException &ex) {
+    me->error = _strdup(ex.what());
+  } catch (IOException &ex) {
+    me->error = _strdup(ex.what());
+  }
+  pthread_exit(NULL);
+  return 0;
+}
+
+void RawDecoder::unpackBand(RawDecoderUnpackThread *t) {
+  if (unpackFast12)
+    Decode12BitRaw(t->input, t->size, unpackW, t->start_y, t->end_y);
+  else
+    readUncompressedRows(t->input, t->size, unpackX, t->start_y, t->end_y, unpackW, unpackBpp, unpackSkipBits, unpackOrder);
+}
+
 void RawDecoder::readUncompressedRaw(ByteStream &input, iPoint2D& size, iPoint2D& offset, int inputPitch, int bitPerPixel, BitOrder order) {
   uchar8* data = mRaw->getData();
   uint32 outPitch = mRaw->pitch;
@@ -132,11 +167,82 @@ void RawDecoder::readUncompressedRaw(ByteStream &input, iPoint2D& size, iPoint2D
     return;
   }
 
+  const bool plain = BitOrder_Jpeg != order && BitOrder_Jpeg32 != order;
+  if (plain && bitPerPixel == 16 && getHostEndianness() == little)  {
+    BitBlt(&data[offset.x*sizeof(ushort16)*cpp+y*outPitch], outPitch,
+           input.getData(), inputPitch, w*mRaw->getBpp(), h - y);
+    return;
+  }
+
+  unpackFast12 = plain && bitPerPixel == 12 && (int)w == inputPitch * 8 / 12 && getHostEndianness() == little;
+  unpackX = unpackFast12 ? 0 : offset.x*cpp;
+  unpackW = unpackFast12 ? w : w*cpp;
+  unpackBpp = bitPerPixel;
+  unpackSkipBits = unpackFast12 ? 0 : skipBits;
+  unpackOrder = order;
+
+  // bands start at multiples of inputPitch, which is only where the serial pump would be if a row
+  // is exactly inputPitch bytes (the pumps count the line padding in bits). BitPumpMSB32 fetches
+  // whole 32 bit words, so its bands also have to start word aligned with the serial stream:
+  uint32 threads = getThreadCount();
+  const uint64 rowBits = (uint64)unpackW * unpackBpp + unpackSkipBits;
+  if (rowBits != (uint64)inputPitch * 8 || (BitOrder_Jpeg32 == order && inputPitch % 4 != 0) ||
+      (h - y) < 64 * threads)
+    threads = 1;
+
+  if (threads <= 1) {
+    RawDecoderUnpackThread t;
+    t.input = input.getData();
+    t.size = input.getRemainSize();
+    t.start_y = y;
+    t.end_y = h;
+    t.parent = this;
+    unpackBand(&t);
+    return;
+  }
+
+  RawDecoderUnpackThread *t = new RawDecoderUnpackThread[threads];
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+  uint32 y_per_thread = (h - y + threads - 1) / threads;
+  uint32 y_offset = y;
+  for (uint32 i = 0; i < threads; i++) {
+    t[i].start_y = y_offset;
+    t[i].end_y = MIN(y_offset + y_per_thread, h);
+    t[i].input = input.getData() + (t[i].start_y - y) * inputPitch;
+    t[i].size = input.getRemainSize() - (t[i].start_y - y) * inputPitch;
+    t[i].parent = this;
+    pthread_create(&t[i].threadid, &attr, RawDecoderUnpackThreadFunc, &t[i]);
+    y_offset = t[i].end_y;
+  }
+  void *status;
+  for (uint32 i = 0; i < threads; i++)
+    pthread_join(t[i].threadid, &status);
+  pthread_attr_destroy(&attr);
+
+  // same as the serial version: the first error ends the decode of this slice.
+  string error;
+  for (uint32 i = 0; i < threads; i++) {
+    if (t[i].error && error.empty())
+      error = t[i].error;
+    free((void*)t[i].error);
+  }
+  delete[] t;
+  if (!error.empty())
+    ThrowIOE("%s", error.c_str());
+}
+
+void RawDecoder::readUncompressedRows(const uchar8 *in, uint32 inSize, uint32 outX, uint32 y, uint32 h, uint32 w, int bitPerPixel, uint32 skipBits, BitOrder order) {
+  uchar8* data = mRaw->getData();
+  uint32 outPitch = mRaw->pitch;
+  ByteStream input(in, inSize);
+
   if (BitOrder_Jpeg == order) {
     BitPumpMSB bits(&input);
-    w *= cpp;
     for (; y < h; y++) {
-      ushort16* dest = (ushort16*) & data[offset.x*sizeof(ushort16)*cpp+y*outPitch];
+      ushort16* dest = (ushort16*) & data[outX*sizeof(ushort16)+y*outPitch];
       bits.checkPos();
       for (uint32 x = 0 ; x < w; x++) {
         uint32 b = bits.getBits(bitPerPixel);
@@ -146,9 +252,8 @@ void RawDecoder::readUncompressedRaw(ByteStream &input, iPoint2D& size, iPoint2D
     }
   } else if (BitOrder_Jpeg32 == order) {
       BitPumpMSB32 bits(&input);
-      w *= cpp;
       for (; y < h; y++) {
-        ushort16* dest = (ushort16*) & data[offset.x*sizeof(ushort16)*cpp+y*outPitch];
+        ushort16* dest = (ushort16*) & data[outX*sizeof(ushort16)+y*outPitch];
         bits.checkPos();
         for (uint32 x = 0 ; x < w; x++) {
           uint32 b = bits.getBits(bitPerPixel);
@@ -158,20 +263,9 @@ void RawDecoder::readUncompressedRaw(ByteStream &input, iPoint2D& size, iPoint2D
       }
 
   } else {
-
-    if (bitPerPixel == 16 && getHostEndianness() == little)  {
-      BitBlt(&data[offset.x*sizeof(ushort16)*cpp+y*outPitch], outPitch,
-             input.getData(), inputPitch, w*mRaw->getBpp(), h - y);
-      return;
-    }
-    if (bitPerPixel == 12 && (int)w == inputPitch * 8 / 12 && getHostEndianness() == little)  {
-      Decode12BitRaw(input, w, h);
-      return;
-    }
     BitPumpPlain bits(&input);
-    w *= cpp;
     for (; y < h; y++) {
-      ushort16* dest = (ushort16*) & data[offset.x*sizeof(ushort16)+y*outPitch];
+      ushort16* dest = (ushort16*) & data[outX*sizeof(ushort16)+y*outPitch];
       bits.checkPos();
       for (uint32 x = 0 ; x < w; x++) {
         uint32 b = bits.getBits(bitPerPixel);
@@ -182,17 +276,16 @@ void RawDecoder::readUncompressedRaw(ByteStream &input, iPoint2D& size, iPoint2D
   }
 }
 
-void RawDecoder::Decode12BitRaw(ByteStream &input, uint32 w, uint32 h) {
+void RawDecoder::Decode12BitRaw(const uchar8 *in, uint32 inSize, uint32 w, uint32 y, uint32 h) {
   uchar8* data = mRaw->getData();
   uint32 pitch = mRaw->pitch;
-  const uchar8 *in = input.getData();
-  if (input.getRemainSize() < ((w*12/8)*h)) {
-    if ((uint32)input.getRemainSize() > (w*12/8))
-      h = input.getRemainSize() / (w*12/8) - 1;
+  if (inSize < ((w*12/8)*(h - y))) {
+    if (inSize > (w*12/8))
+      h = y + inSize / (w*12/8) - 1;
     else
       ThrowIOE("readUncompressedRaw: Not enough data to decode a single line. Image file truncated.");
   }
-  for (uint32 y = 0; y < h; y++) {
+  for (; y < h; y++) {
     ushort16* dest = (ushort16*) & data[y*pitch];
     for (uint32 x = 0 ; x < w; x += 2) {
       uint32 g1 = *in++;
@@ -36,6 +36,7 @@
 namespace RawSpeed {
 
 class RawDecoder;
+class RawDecoderUnpackThread;
 
 /* Class with information delivered to RawDecoder::decodeThreaded() */
 class RawDecoderThread
@@ -83,6 +84,9 @@ public:
   /* The delivered class gives information on what part of the image should be decoded. */
   virtual void decodeThreaded(RawDecoderThread* t);
 
+  /* Called by the threads of readUncompressedRaw() to unpack one band of rows */
+  void unpackBand(RawDecoderUnpackThread* t);
+
   /* Allows access to the root IFD structure */
   /* If image isn't TIFF based NULL will be returned */
   virtual TiffIFD* getRootIFD() {return NULL;}
@@ -161,8 +165,17 @@ protected:
   /* order: Order of the bits - see Common.h for possibilities. */
   void readUncompressedRaw(ByteStream &input, iPoint2D& size, iPoint2D& offset, int inputPitch, int bitPerPixel, BitOrder order);
 
-  /* Faster version for unpacking 12 bit LSB data */
-  void Decode12BitRaw(ByteStream &input, uint32 w, uint32 h);
+  /* Unpacks rows y to h-1 of uncompressed data starting at in, used by readUncompressedRaw() */
+  void readUncompressedRows(const uchar8 *in, uint32 inSize, uint32 outX, uint32 y, uint32 h, uint32 w, int bitPerPixel, uint32 skipBits, BitOrder order);
+
+  /* Faster version for unpacking 12 bit LSB data, rows y to h-1 */
+  void Decode12BitRaw(const uchar8 *in, uint32 inSize, uint32 w, uint32 y, uint32 h);
+
+  /* Layout of the uncompressed data readUncompressedRaw() is currently unpacking */
+  uint32 unpackX, unpackW, unpackSkipBits;
+  int unpackBpp;
+  BitOrder unpackOrder;
+  bool unpackFast12;
 
   /* Generic decompressor for uncompressed images */
   /* order: Order of the bits - see Common.h for possibilities. */
@@ -29,6 +29,13 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 /*******************************************************************
  * Hash table implementation for permutohedral lattice             *
@@ -37,6 +44,10 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
  * The key for each point is its spatial location in the (d+1)-    *
  * dimensional space.                                              *
  *                                                                 *
+ * Lookups and inserts are safe to run concurrently, cells are     *
+ * claimed by compare and swap. Growing is not, the table only     *
+ * grows in reserve(), which is called in between.                 *
+ *                                                                 *
  *******************************************************************/
 template <int KD, int VD>
 class HashTablePermutohedral
@@ -45,23 +56,25 @@ public:
   /* Constructor
    *  kd_: the dimensionality of the position vectors on the hyperplane.
    *  vd_: the dimensionality of the value vectors
+   *  expected: number of vectors to make room for.
    */
-  HashTablePermutohedral()
+  HashTablePermutohedral(size_t expected = 0)
   {
     capacity = 1 << 15;
-    capacity_bits = 0x7fff;
+    while (capacity < 2*expected) capacity <<= 1;
+    capacity_bits = capacity - 1;
     filled = 0;
-    entries = new Entry[capacity];
+    entries = new int[capacity];
+    std::fill(entries, entries + capacity, -1);
     keys = new short[KD*capacity/2];
-    values = new float[VD*capacity/2];
-    memset(values, 0, sizeof(float)*VD*capacity/2);
+    values = allocValues(VD*capacity/2);
   }
 
   ~HashTablePermutohedral()
   {
     delete[] entries;
     delete[] keys;
-    delete[] values;
+    free(values);
   }
 
   // Returns the number of vectors stored.
@@ -82,6 +95,22 @@ public:
     return values;
   }
 
+  // Returns the number of vectors which can be added without growing.
+  size_t space()
+  {
+    return capacity/2 - filled;
+  }
+
+  /* Grows the table if n more vectors wouldn't fit. Not thread safe, offsets
+   * returned so far stay valid.
+   */
+  void reserve(size_t n)
+  {
+    size_t newCapacity = capacity;
+    while (filled + n > newCapacity/2) newCapacity <<= 1;
+    if (newCapacity > capacity) grow(newCapacity);
+  }
+
   /* Returns the index into the hash table for a given key.
    *     key: a pointer to the position vector.
    *       h: hash of the position vector.
@@ -90,41 +119,37 @@ public:
    */
   int lookupOffset(const short *key, size_t h, bool create = true)
   {
-
-    // Double hash table size if necessary
-    if (filled >= (capacity/2)-1)
-    {
-      grow();
-    }
-
     // Find the entry with the given key
     while (1)
     {
-      Entry e = entries[h];
+      int e = ((volatile int *)entries)[h];
       // check if the cell is empty
-      if (e.keyIdx == -1)
+      if (e == -1)
       {
         if (!create) return -1; // Return not found.
-        // need to create an entry. Store the given key.
+        // need to create an entry. claim the cell first, so only the winner takes a slot,
+        // then store the given key and publish its index in this cell.
+        if (!__sync_bool_compare_and_swap(entries + h, -1, -2))
+          continue; // another thread was faster, look at what it stores there
+        const int n = __sync_fetch_and_add(&filled, 1);
         for (int i = 0; i < KD; i++)
-          keys[filled*KD+i] = key[i];
-        e.keyIdx = filled*KD;
-        e.valueIdx = filled*VD;
-        entries[h] = e;
-        filled++;
-        return e.valueIdx;
+          keys[n*KD+i] = key[i];
+        __sync_synchronize();
+        ((volatile int *)entries)[h] = n;
+        return n*VD;
       }
+      // the key of this cell is still being stored, wait for it
+      if (e == -2) continue;
 
       // check if the cell has a matching key
       bool match = true;
       for (int i = 0; i < KD && match; i++)
-        match = keys[e.keyIdx+i] == key[i];
+        match = keys[e*KD+i] == key[i];
       if (match)
-        return e.valueIdx;
+        return e*VD;
 
       // increment the bucket with wraparound
-      h++;
-      if (h == capacity) h = 0;
+      h = (h+1) & capacity_bits;
     }
   }
 
@@ -134,12 +159,17 @@ public:
    */
   float *lookup(const short *k, bool create = true)
   {
-    size_t h = hash(k) & capacity_bits;
-    int offset = lookupOffset(k, h, create);
+    int offset = lookupOffset(k, hash(k) & capacity_bits, create);
     if (offset < 0) return NULL;
     else return values + offset;
   };
 
+  // Same as lookup(), but returns the offset into the values array.
+  int offset(const short *k, bool create = true)
+  {
+    return lookupOffset(k, hash(k) & capacity_bits, create);
+  }
+
   /* Hash function used in this implementation. A simple base conversion. */
   size_t hash(const short *key)
   {
@@ -152,19 +182,27 @@ public:
     return k;
   }
 
+  // zeroed, aligned for sse
+  static float *allocValues(size_t n)
+  {
+    void *p = NULL;
+    if (posix_memalign(&p, 16, sizeof(float)*n)) return NULL;
+    memset(p, 0, sizeof(float)*n);
+    return (float *)p;
+  }
+
 private:
   /* Grows the size of the hash table */
-  void grow()
+  void grow(size_t newCapacity)
   {
     size_t oldCapacity = capacity;
-    capacity *= 2;
-    capacity_bits = (capacity_bits << 1) | 1;
+    capacity = newCapacity;
+    capacity_bits = capacity - 1;
 
     // Migrate the value vectors.
-    float *newValues = new float[VD*capacity/2];
-    memset(newValues, 0, sizeof(float)*VD*capacity/2);
+    float *newValues = allocValues(VD*capacity/2);
     memcpy(newValues, values, sizeof(float)*VD*filled);
-    delete[] values;
+    free(values);
     values = newValues;
 
     // Migrate the key vectors.
@@ -173,36 +211,28 @@ private:
     delete[] keys;
     keys = newKeys;
 
-    Entry *newEntries = new Entry[capacity];
+    int *newEntries = new int[capacity];
+    std::fill(newEntries, newEntries + capacity, -1);
 
     // Migrate the table of indices.
     for (size_t i = 0; i < oldCapacity; i++)
     {
-      if (entries[i].keyIdx == -1) continue;
-      size_t h = hash(keys + entries[i].keyIdx) & capacity_bits;
-      while (newEntries[h].keyIdx != -1)
-      {
-        h++;
-        if (h == capacity) h = 0;
-      }
+      if (entries[i] == -1) continue;
+      size_t h = hash(keys + entries[i]*KD) & capacity_bits;
+      while (newEntries[h] != -1)
+        h = (h+1) & capacity_bits;
       newEntries[h] = entries[i];
     }
     delete[] entries;
     entries = newEntries;
   }
 
-  // Private struct for the hash table entries.
-  struct Entry
-  {
-    Entry() : keyIdx(-1), valueIdx(-1) {}
-    int keyIdx;
-    int valueIdx;
-  };
-
+  // the cells hold the index of the key and value vectors, -1 if empty, or -2 while being filled.
+  int *entries;
   short *keys;
   float *values;
-  Entry *entries;
-  size_t capacity, filled;
+  size_t capacity;
+  int filled;
   unsigned long capacity_bits;
 };
 
@@ -229,7 +259,7 @@ public:
     float *scaleFactorTmp = new float[D];
     int *canonicalTmp = new int[(D+1)*(D+1)];
 
-    replay = new ReplayEntry[nData*(D+1)];
+    replay = new ReplayEntry[(size_t)nData*(D+1)];
 
     // compute the coordinates of the canonical simplex, in which
     // the difference between a contained point and the zero
@@ -265,7 +295,12 @@ public:
     }
     scaleFactor = scaleFactorTmp;
 
-    hashTables = new HashTablePermutohedral<D,VD>[nThreads];
+    // one table shared by all threads, with room for the first batch of points:
+    hashTable = new HashTablePermutohedral<D,VD>(std::min((size_t)nData, minBatch())*(D+1));
+
+    pending = new Pending[nThreads*PENDING_STRIDE];
+    memset(pending, 0, sizeof(Pending)*nThreads*PENDING_STRIDE);
+    for (int i = 0; i < nThreads*PENDING_STRIDE; i++) pending[i].offset = -1;
   }
 
 
@@ -274,12 +309,55 @@ public:
     delete[] scaleFactor;
     delete[] replay;
     delete[] canonical;
-    delete[] hashTables;
+    delete hashTable;
+    delete[] pending;
   }
 
+  /* Splats all points, using all threads. points(index, position, value) fills in
+   * the position and value vectors of point index:
+   *
+   *   struct points_t
+   *   {
+   *     void operator()(const size_t index, float *position, float *value) const;
+   *   };
+   *
+   * This is done in batches, with the table grown in between so the next batch fits
+   * even if every point created d+1 new vertices. Each thread splats a consecutive
+   * range of points, so only a few vertices are shared between threads.
+   */
+  template <typename Points>
+  void splat(const Points &points)
+  {
+    for (size_t begin = 0; begin < (size_t)nData; )
+    {
+      const size_t batch = std::min((size_t)nData - begin, std::max(hashTable->space()/(D+1), minBatch()));
+      hashTable->reserve(batch*(D+1));
+#ifdef _OPENMP
+      #pragma omp parallel num_threads(nThreads)
+#endif
+      {
+#ifdef _OPENMP
+        const int thread = omp_get_thread_num(), threads = omp_get_num_threads();
+#else
+        const int thread = 0, threads = 1;
+#endif
+        const size_t end = begin + batch*(thread+1)/threads;
+        float position[D], value[VD];
+        for (size_t i = begin + batch*thread/threads; i < end; i++)
+        {
+          points(i, position, value);
+          splat(position, value, i, thread);
+        }
+        flush(thread);
+      }
+      begin += batch;
+    }
+  }
 
-  /* Performs splatting with given position and value vectors */
-  void splat(float *position, float *value, int replay_index, int thread_index=0)
+  /* Performs splatting with given position and value vectors. The table has to have room
+   * for d+1 new vertices, and flush() has to be called when the thread is done.
+   */
+  void splat(const float *position, const float *value, size_t replay_index, int thread_index)
   {
     float elevated[D+1];
     int greedy[D+1];
@@ -362,73 +440,71 @@ public:
     barycentric[0] += 1.0f + barycentric[D+1];
 
     // Splat the value into each vertex of the simplex, with barycentric weights.
-    for (int remainder = 0; remainder <= D; remainder++)
+    Pending *p = pending + thread_index*PENDING_STRIDE;
+    for (int remainder = 0; remainder <= D; remainder++, p++)
     {
       // Compute the location of the lattice point explicitly (all but the last coordinate - it's redundant because they sum to zero)
       for (int i = 0; i < D; i++)
         key[i] = greedy[i] + canonical[remainder*(D+1) + rank[i]];
 
-      // Retrieve pointer to the value at this vertex.
-      float * val = hashTables[thread_index].lookup(key, true);
+      // consecutive points mostly hit the same vertices. only go to the table when it changes.
+      bool same = p->offset >= 0;
+      for (int i = 0; i < D && same; i++)
+        same = p->key[i] == key[i];
+      if (!same)
+      {
+        flush(p);
+        for (int i = 0; i < D; i++)
+          p->key[i] = key[i];
+        p->offset = hashTable->offset(key, true);
+      }
 
       // Accumulate values with barycentric weight.
       for (int i = 0; i < VD; i++)
-        val[i] += barycentric[remainder]*value[i];
+        p->value[i] += barycentric[remainder]*value[i];
 
       // Record this interaction to use later when slicing
-      replay[replay_index*(D+1)+remainder].table = thread_index;
-      replay[replay_index*(D+1)+remainder].offset = val - hashTables[thread_index].getValues();
+      replay[replay_index*(D+1)+remainder].offset = p->offset;
       replay[replay_index*(D+1)+remainder].weight = barycentric[remainder];
     }
   }
 
-  /* Merge the multiple threads' hash tables into the totals. */
-  void merge_splat_threads(void)
+  /* Adds what the thread accumulated to the table. */
+  void flush(int thread_index)
   {
-    if (nThreads <= 1)
-      return;
-
-    /* Merge the multiple hash tables into one, creating an offset remap table. */
-    int *offset_remap[nThreads];
-    for (int i = 1; i < nThreads; i++)
+    Pending *p = pending + thread_index*PENDING_STRIDE;
+    for (int remainder = 0; remainder <= D; remainder++, p++)
     {
-      const short *oldKeys = hashTables[i].getKeys();
-      const float *oldVals = hashTables[i].getValues();
-      const int filled = hashTables[i].size();
-      offset_remap[i] = new int[filled];
-      for (int j = 0; j < filled; j++)
-      {
-        float *val = hashTables[0].lookup(oldKeys+j*D, true);
-        const float *oldVal = oldVals + j*VD;
-        for (int k = 0; k < VD; k++)
-          val[k] += oldVal[k];
-        offset_remap[i][j] = val - hashTables[0].getValues();
-      }
+      flush(p);
+      p->offset = -1;
     }
-
-    /* Rewrite the offsets in the replay structure from the above generated table. */
-    for (int i = 0; i < nData*(D+1); i++)
-      if (replay[i].table > 0)
-        replay[i].offset = offset_remap[replay[i].table][replay[i].offset/VD];
-
-    for (int i = 1; i < nThreads; i++)
-      delete[] offset_remap[i];
   }
 
   /* Performs slicing out of position vectors. Note that the barycentric weights and the simplex
    * containing each position vector were calculated and stored in the splatting step.
    * We may reuse this to accelerate the algorithm. (See pg. 6 in paper.)
    */
-  void slice(float *col, int replay_index)
+  void slice(float *col, size_t replay_index)
   {
-    float *base = hashTables[0].getValues();
+    const float *base = hashTable->getValues();
+    const ReplayEntry *r = replay + replay_index*(D+1);
+#ifdef __SSE__
+    if (VD == 4)
+    {
+      // the value vectors are aligned
+      __m128 sum = _mm_setzero_ps();
+      for (int i = 0; i <= D; i++)
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(r[i].weight), _mm_load_ps(base + r[i].offset)));
+      _mm_storeu_ps(col, sum);
+      return;
+    }
+#endif
     for (int j = 0; j < VD; j++) col[j] = 0;
     for (int i = 0; i <= D; i++)
     {
-      ReplayEntry r = replay[replay_index*(D+1)+i];
       for (int j = 0; j < VD; j++)
       {
-        col[j] += r.weight*base[r.offset + j];
+        col[j] += r[i].weight*base[r[i].offset + j];
       }
     }
   }
@@ -437,8 +513,10 @@ public:
   void blur()
   {
     // Prepare arrays
-    float *newValue = new float[VD*hashTables[0].size()];
-    float *oldValue = hashTables[0].getValues();
+    const int size = hashTable->size();
+    const short *keys = hashTable->getKeys();
+    float *newValue = HashTablePermutohedral<D,VD>::allocValues(VD*size);
+    float *oldValue = hashTable->getValues();
     float *hashTableBase = oldValue;
 
     float zero[VD];
@@ -448,12 +526,12 @@ public:
     for (int j = 0; j <= D; j++)
     {
 #ifdef _OPENMP
-      #pragma omp parallel for shared(j, oldValue, newValue, hashTableBase, zero)
+      #pragma omp parallel for schedule(static) num_threads(nThreads) shared(j, keys, oldValue, newValue, zero)
 #endif
       // For each vertex in the lattice,
-      for (int i = 0; i < hashTables[0].size(); i++)   // blur point i in dimension j
+      for (int i = 0; i < size; i++)   // blur point i in dimension j
       {
-        const short *key    = hashTables[0].getKeys() + i*(D); // keys to current vertex
+        const short *key    = keys + i*(D); // keys to current vertex
         short neighbor1[D+1];
         short neighbor2[D+1];
         for (int k = 0; k < D; k++)
@@ -464,18 +542,14 @@ public:
         neighbor1[j] = key[j] - D;
         neighbor2[j] = key[j] + D; // keys to the neighbors along the given axis.
 
-        float *oldVal = oldValue + i*VD;
+        const float *oldVal = oldValue + i*VD;
         float *newVal = newValue + i*VD;
 
-        float *vm1, *vp1;
-
-        vm1 = hashTables[0].lookup(neighbor1, false); // look up first neighbor
-        if (vm1) vm1 = vm1 - hashTableBase + oldValue;
-        else vm1 = zero;
-
-        vp1 = hashTables[0].lookup(neighbor2, false); // look up second neighbor
-        if (vp1) vp1 = vp1 - hashTableBase + oldValue;
-        else vp1 = zero;
+        // the table is only read here, so this runs concurrently
+        const int o1 = hashTable->offset(neighbor1, false); // look up first neighbor
+        const int o2 = hashTable->offset(neighbor2, false); // look up second neighbor
+        const float *vm1 = o1 < 0 ? zero : oldValue + o1;
+        const float *vp1 = o2 < 0 ? zero : oldValue + o2;
 
         // Mix values of the three vertices
         for (int k = 0; k < VD; k++)
@@ -490,17 +564,51 @@ public:
     // depending where we ended up, we may have to copy data
     if (oldValue != hashTableBase)
     {
-      memcpy(hashTableBase, oldValue, hashTables[0].size()*VD*sizeof(float));
-      delete[] oldValue;
+      memcpy(hashTableBase, oldValue, size*VD*sizeof(float));
+      free(oldValue);
     }
     else
     {
-      delete[] newValue;
+      free(newValue);
     }
   }
 
 private:
 
+  // points per batch in splat(), at least
+  size_t minBatch() const
+  {
+    return (size_t)4096*nThreads;
+  }
+
+  // accumulated for one vertex, not added to the table yet
+  struct Pending
+  {
+    int offset;
+    short key[D];
+    float value[VD];
+  };
+  // per thread, one for each remainder, and padding against false sharing
+  enum { PENDING_STRIDE = D + 1 + (64 + sizeof(Pending) - 1)/sizeof(Pending) };
+
+  void flush(Pending *p)
+  {
+    if (p->offset < 0) return;
+    float *val = hashTable->getValues() + p->offset;
+    for (int k = 0; k < VD; k++)
+    {
+      // lock free float add, other threads might flush into the same vertex
+      union { float f; int i; } o, n;
+      do
+      {
+        o.f = ((volatile float *)val)[k];
+        n.f = o.f + p->value[k];
+      }
+      while (!__sync_bool_compare_and_swap((int *)(val + k), o.i, n.i));
+      p->value[k] = 0.0f;
+    }
+  }
+
   int nData;
   int nThreads;
   const float *scaleFactor;
@@ -509,12 +617,12 @@ private:
   // slicing is done by replaying splatting (ie storing the sparse matrix)
   struct ReplayEntry
   {
-    int table;
     int offset;
     float weight;
   } *replay;
 
-  HashTablePermutohedral<D,VD> *hashTables;
+  HashTablePermutohedral<D,VD> *hashTable;
+  Pending *pending;
 };
 
 #endif
@@ -96,6 +96,9 @@ typedef struct dt_iop_atrous_global_data_t
 {
   int kernel_decompose;
   int kernel_synthesize;
+  // eaw_decompose() for this cpu:
+  void (*decompose)(float *const out, const float *const in, float *const detail, const int scale,
+                    const float sharpen, const int32_t width, const int32_t height);
 }
 dt_iop_atrous_global_data_t;
 
@@ -122,7 +125,7 @@ groups ()
 int
 flags ()
 {
-  return IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING;
+  return IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_ALLOW_PARALLEL_TILES;
 }
 
 void init_key_accels(dt_iop_module_so_t *self)
@@ -137,212 +140,7 @@ void connect_key_accels(dt_iop_module_t *self)
 }
 
 
-#define ALIGNED(a) __attribute__((aligned(a)))
-#define VEC4(a) {(a), (a), (a), (a)}
-
-static const __m128 fone ALIGNED(16) = VEC4(0x3f800000u);
-static const __m128 femo ALIGNED(16) = VEC4(0x00adf880u);
-static const __m128 ooo1 ALIGNED(16) = {0.f, 0.f, 0.f, 1.f};
-
-/* SSE intrinsics version of dt_fast_expf defined in darktable.h */
-static __m128  inline
-dt_fast_expf_sse(const __m128 x)
-{
-  __m128  f = _mm_add_ps(fone, _mm_mul_ps(x, femo)); // f(n) = i1 + x(n)*(i2-i1)
-  __m128i i = _mm_cvtps_epi32(f);                    // i(n) = int(f(n))
-  __m128i mask = _mm_srai_epi32(i, 31);              // mask(n) = 0xffffffff if i(n) < 0
-  i = _mm_andnot_si128(mask, i);                     // i(n) = 0 if i(n) < 0
-  return _mm_castsi128_ps(i);                        // return *(float*)&i
-}
-
-/* Computes the vector
- * (wl, wc, wc, 1)
- *
- * where:
- * wl = exp(-sharpen*SQR(c1[0] - c2[0]))
- *    = exp(-s*d1) (as noted in code comments below)
- * wc = exp(-sharpen*(SQR(c1[1] - c2[1]) + SQR(c1[2] - c2[2]))
- *    = exp(-s*(d2+d3)) (as noted in code comments below)
- */
-static __m128  inline
-weight_sse(const __m128 *c1, const __m128 *c2, const float sharpen)
-{
-  const __m128 vsharpen = _mm_set1_ps(-sharpen);  // (-s, -s, -s, -s)
-  __m128 diff = _mm_sub_ps(*c1, *c2);
-  __m128 square = _mm_mul_ps(diff, diff);         // (?, d3, d2, d1)
-  __m128 square2 = _mm_shuffle_ps(square, square, _MM_SHUFFLE(3, 1, 2, 0)); // (?, d2, d3, d1)
-  __m128 added = _mm_add_ps(square, square2);     // (?, d2+d3, d2+d3, 2*d1)
-  added = _mm_sub_ss(added, square);              // (?, d2+d3, d2+d3, d1)
-  __m128 sharpened = _mm_mul_ps(added, vsharpen); // (?, -s*(d2+d3), -s*(d2+d3), -s*d1)
-  __m128 exp = dt_fast_expf_sse(sharpened);       // (?, wc, wc, wl)
-  exp = _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(exp), 4)); // (wc, wc, wl, 0)
-  exp = _mm_castsi128_ps(_mm_srli_si128(_mm_castps_si128(exp), 4)); // (0, wc, wc, wl)
-  exp = _mm_or_ps(exp, ooo1); // (1, wc, wc, wl)
-  return exp;
-}
-
-#define SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj) \
-  do { \
-    const __m128 f = _mm_set1_ps(filter[(ii)]*filter[(jj)]); \
-    const __m128 wp = weight_sse(px, px2, sharpen); \
-    const __m128 w = _mm_mul_ps(f, wp); \
-    const __m128 pd = _mm_mul_ps(w, *px2); \
-    sum = _mm_add_ps(sum, pd); \
-    wgt = _mm_add_ps(wgt, w); \
-  } while (0)
-
-#define SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj) \
-  do { \
-    const int iii = (ii)-2; \
-    const int jjj = (jj)-2; \
-    int x = i + mult*iii; \
-    int y = j + mult*jjj; \
-    \
-    if(x < 0)       x = 0; \
-    if(x >= width)  x = width  - 1; \
-    if(y < 0)       y = 0; \
-    if(y >= height) y = height - 1; \
-    \
-    px2 = ((__m128 *)in) + x + y*width; \
-    \
-    SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj); \
-  } while (0)
-
-#define ROW_PROLOGUE \
-  const __m128 *px = ((__m128 *)in) + j*width; \
-  const __m128 *px2; \
-  float *pdetail = detail + 4*j*width; \
-  float *pcoarse = out + 4*j*width;
-
-#define SUM_PIXEL_PROLOGUE \
-  __m128 sum = _mm_setzero_ps(); \
-  __m128 wgt = _mm_setzero_ps();
-
-#define SUM_PIXEL_EPILOGUE \
-  sum = _mm_mul_ps(sum, _mm_rcp_ps(wgt)); \
-  \
-  _mm_stream_ps(pdetail, _mm_sub_ps(*px, sum)); \
-  _mm_stream_ps(pcoarse, sum); \
-  px++; \
-  pdetail+=4; \
-  pcoarse+=4;
-
-static void
-eaw_decompose (float *const out, const float *const in, float *const detail, const int scale,
-               const float sharpen, const int32_t width, const int32_t height)
-{
-  const int mult = 1<<scale;
-  static const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
-
-  /* The first "2*mult" lines use the macro with tests because the 5x5 kernel
-   * requires nearest pixel interpolation for at least a pixel in the sum */
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
-#endif
-  for (int j=0; j<2*mult; j++)
-  {
-    ROW_PROLOGUE
-
-    for(int i=0; i<width; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-  }
-
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
-#endif
-  for(int j=2*mult; j<height-2*mult; j++)
-  {
-    ROW_PROLOGUE
-
-    /* The first "2*mult" pixels use the macro with tests because the 5x5 kernel
-     * requires nearest pixel interpolation for at least a pixel in the sum */
-    for (int i=0; i<2*mult; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-
-    /* For pixels [2*mult, width-2*mult], we can safely use macro w/o tests
-     * to avoid unneeded branching in the inner loops */
-    for(int i=2*mult; i<width-2*mult; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      px2 = ((__m128*)in) + i-2*mult + (j-2*mult)*width;
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj);
-          px2 += mult;
-        }
-        px2 += (width-5)*mult;
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-
-    /* Last two pixels in the row require a slow variant... blablabla */
-    for (int i=width-2*mult; i<width; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-  }
-
-  /* The last "2*mult" lines use the macro with tests because the 5x5 kernel
-   * requires nearest pixel interpolation for at least a pixel in the sum */
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
-#endif
-  for (int j=height-2*mult; j<height; j++)
-  {
-    ROW_PROLOGUE
-
-    for(int i=0; i<width; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-  }
-
-  _mm_sfence();
-}
-
-#undef SUM_PIXEL_CONTRIBUTION_COMMON
-#undef SUM_PIXEL_CONTRIBUTION_WITH_TEST
-#undef ROW_PROLOGUE
-#undef SUM_PIXEL_PROLOGUE
-#undef SUM_PIXEL_EPILOGUE
+#include "iop/atrous_eaw.c"
 
 static void
 eaw_synthesize (float *const out, const float *const in, const float *const detail,
@@ -439,6 +237,7 @@ void
 process (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *i, void *o, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
   dt_iop_atrous_data_t *d = (dt_iop_atrous_data_t *)piece->data;
+  dt_iop_atrous_global_data_t *gd = (dt_iop_atrous_global_data_t *)self->data;
   float thrs [MAX_NUM_SCALES][4];
   float boost[MAX_NUM_SCALES][4];
   float sharp[MAX_NUM_SCALES];
@@ -482,7 +281,7 @@ process (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, voi
 
   for(int scale=0; scale<max_scale; scale++)
   {
-    eaw_decompose (buf2, buf1, detail[scale], scale, sharp[scale], width, height);
+    gd->decompose (buf2, buf1, detail[scale], scale, sharp[scale], width, height);
     if(scale == 0) buf1 = (float *)o;  // now switch to (float *)o for buffer ping-pong between buf1 and buf2
     float *buf3 = buf2;
     buf2 = buf1;
@@ -697,6 +496,10 @@ void init_global(dt_iop_module_so_t *module)
   module->data = gd;
   gd->kernel_decompose  = dt_opencl_create_kernel(program, "eaw_decompose");
   gd->kernel_synthesize = dt_opencl_create_kernel(program, "eaw_synthesize");
+  gd->decompose = eaw_decompose;
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+  if(dt_cpu_has(DT_CPU_AVX2 | DT_CPU_FMA)) gd->decompose = eaw_decompose_avx2;
+#endif
 }
 
 void cleanup(dt_iop_module_t *module)
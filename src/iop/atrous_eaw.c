@@ -0,0 +1,337 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2009--2011 johannes hanika.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// edge avoiding wavelet decomposition of the equalizer, included by atrous.c (and by the unit
+// test in src/tests): the sse2 version, and one for avx2 and fma picked at runtime.
+
+#include "common/cpu.h"
+
+#include <xmmintrin.h>
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+#include <immintrin.h>
+#endif
+
+#define ALIGNED(a) __attribute__((aligned(a)))
+#define VEC4(a) {(a), (a), (a), (a)}
+
+static const __m128 fone ALIGNED(16) = VEC4(0x3f800000u);
+static const __m128 femo ALIGNED(16) = VEC4(0x00adf880u);
+static const __m128 ooo1 ALIGNED(16) = {0.f, 0.f, 0.f, 1.f};
+
+/* SSE intrinsics version of dt_fast_expf defined in darktable.h */
+static __m128  inline
+dt_fast_expf_sse(const __m128 x)
+{
+  __m128  f = _mm_add_ps(fone, _mm_mul_ps(x, femo)); // f(n) = i1 + x(n)*(i2-i1)
+  __m128i i = _mm_cvtps_epi32(f);                    // i(n) = int(f(n))
+  __m128i mask = _mm_srai_epi32(i, 31);              // mask(n) = 0xffffffff if i(n) < 0
+  i = _mm_andnot_si128(mask, i);                     // i(n) = 0 if i(n) < 0
+  return _mm_castsi128_ps(i);                        // return *(float*)&i
+}
+
+/* Computes the vector
+ * (wl, wc, wc, 1)
+ *
+ * where:
+ * wl = exp(-sharpen*SQR(c1[0] - c2[0]))
+ *    = exp(-s*d1) (as noted in code comments below)
+ * wc = exp(-sharpen*(SQR(c1[1] - c2[1]) + SQR(c1[2] - c2[2]))
+ *    = exp(-s*(d2+d3)) (as noted in code comments below)
+ */
+static __m128  inline
+weight_sse(const __m128 *c1, const __m128 *c2, const float sharpen)
+{
+  const __m128 vsharpen = _mm_set1_ps(-sharpen);  // (-s, -s, -s, -s)
+  __m128 diff = _mm_sub_ps(*c1, *c2);
+  __m128 square = _mm_mul_ps(diff, diff);         // (?, d3, d2, d1)
+  __m128 square2 = _mm_shuffle_ps(square, square, _MM_SHUFFLE(3, 1, 2, 0)); // (?, d2, d3, d1)
+  __m128 added = _mm_add_ps(square, square2);     // (?, d2+d3, d2+d3, 2*d1)
+  added = _mm_sub_ss(added, square);              // (?, d2+d3, d2+d3, d1)
+  __m128 sharpened = _mm_mul_ps(added, vsharpen); // (?, -s*(d2+d3), -s*(d2+d3), -s*d1)
+  __m128 exp = dt_fast_expf_sse(sharpened);       // (?, wc, wc, wl)
+  exp = _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(exp), 4)); // (wc, wc, wl, 0)
+  exp = _mm_castsi128_ps(_mm_srli_si128(_mm_castps_si128(exp), 4)); // (0, wc, wc, wl)
+  exp = _mm_or_ps(exp, ooo1); // (1, wc, wc, wl)
+  return exp;
+}
+
+#define SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj) \
+  do { \
+    const __m128 f = _mm_set1_ps(filter[(ii)]*filter[(jj)]); \
+    const __m128 wp = weight_sse(px, px2, sharpen); \
+    const __m128 w = _mm_mul_ps(f, wp); \
+    const __m128 pd = _mm_mul_ps(w, *px2); \
+    sum = _mm_add_ps(sum, pd); \
+    wgt = _mm_add_ps(wgt, w); \
+  } while (0)
+
+#define SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj) \
+  do { \
+    const int iii = (ii)-2; \
+    const int jjj = (jj)-2; \
+    int x = i + mult*iii; \
+    int y = j + mult*jjj; \
+    \
+    if(x < 0)       x = 0; \
+    if(x >= width)  x = width  - 1; \
+    if(y < 0)       y = 0; \
+    if(y >= height) y = height - 1; \
+    \
+    px2 = ((__m128 *)in) + x + y*width; \
+    \
+    SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj); \
+  } while (0)
+
+#define ROW_PROLOGUE \
+  const __m128 *px = ((__m128 *)in) + j*width; \
+  const __m128 *px2; \
+  float *pdetail = detail + 4*j*width; \
+  float *pcoarse = out + 4*j*width;
+
+#define SUM_PIXEL_PROLOGUE \
+  __m128 sum = _mm_setzero_ps(); \
+  __m128 wgt = _mm_setzero_ps();
+
+#define SUM_PIXEL_EPILOGUE \
+  sum = _mm_mul_ps(sum, _mm_rcp_ps(wgt)); \
+  \
+  _mm_stream_ps(pdetail, _mm_sub_ps(*px, sum)); \
+  _mm_stream_ps(pcoarse, sum); \
+  px++; \
+  pdetail+=4; \
+  pcoarse+=4;
+
+static void
+eaw_decompose (float *const out, const float *const in, float *const detail, const int scale,
+               const float sharpen, const int32_t width, const int32_t height)
+{
+  const int mult = 1<<scale;
+  static const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+
+  /* The first "2*mult" lines use the macro with tests because the 5x5 kernel
+   * requires nearest pixel interpolation for at least a pixel in the sum */
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static)
+#endif
+  for (int j=0; j<2*mult; j++)
+  {
+    ROW_PROLOGUE
+
+    for(int i=0; i<width; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int j=2*mult; j<height-2*mult; j++)
+  {
+    ROW_PROLOGUE
+
+    /* The first "2*mult" pixels use the macro with tests because the 5x5 kernel
+     * requires nearest pixel interpolation for at least a pixel in the sum */
+    for (int i=0; i<2*mult; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+
+    /* For pixels [2*mult, width-2*mult], we can safely use macro w/o tests
+     * to avoid unneeded branching in the inner loops */
+    for(int i=2*mult; i<width-2*mult; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      px2 = ((__m128*)in) + i-2*mult + (j-2*mult)*width;
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj);
+          px2 += mult;
+        }
+        px2 += (width-5)*mult;
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+
+    /* Last two pixels in the row require a slow variant... blablabla */
+    for (int i=width-2*mult; i<width; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+  }
+
+  /* The last "2*mult" lines use the macro with tests because the 5x5 kernel
+   * requires nearest pixel interpolation for at least a pixel in the sum */
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static)
+#endif
+  for (int j=height-2*mult; j<height; j++)
+  {
+    ROW_PROLOGUE
+
+    for(int i=0; i<width; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+  }
+
+  _mm_sfence();
+}
+
+
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+/* weight_sse() for two pixels at once, bit for bit the same. */
+DT_CPU_TARGET_AVX2 static inline __m256
+weight_avx2(const __m256 c1, const __m256 c2, const __m256 vsharpen)
+{
+  const __m256 diff = _mm256_sub_ps(c1, c2);
+  const __m256 square = _mm256_mul_ps(diff, diff);                              // (?, d3, d2, d1)
+  const __m256 square2 = _mm256_permute_ps(square, _MM_SHUFFLE(3, 1, 2, 0));    // (?, d2, d3, d1)
+  const __m256 added = _mm256_blend_ps(_mm256_add_ps(square, square2), square, 0x11); // (?, d2+d3, d2+d3, d1)
+  const __m256 sharpened = _mm256_mul_ps(added, vsharpen);
+  const __m256 f = _mm256_add_ps(_mm256_set1_ps(0x3f800000u), _mm256_mul_ps(sharpened, _mm256_set1_ps(0x00adf880u)));
+  __m256i i = _mm256_cvtps_epi32(f);
+  i = _mm256_andnot_si256(_mm256_srai_epi32(i, 31), i);                        // (?, wc, wc, wl)
+  return _mm256_blend_ps(_mm256_castsi256_ps(i), _mm256_set1_ps(1.0f), 0x88);   // (1, wc, wc, wl)
+}
+
+/* eaw_decompose() doing two neighbouring pixels per step in the interior: their taps are
+ * neighbours as well, so one unaligned load fetches both. the sums use fma, which rounds a
+ * little differently from the sse2 version. borders are done as there. */
+DT_CPU_TARGET_AVX2 static void
+eaw_decompose_avx2 (float *const out, const float *const in, float *const detail, const int scale,
+                    const float sharpen, const int32_t width, const int32_t height)
+{
+  const int mult = 1<<scale;
+  static const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static)
+#endif
+  for (int j=0; j<height; j++)
+  {
+    ROW_PROLOGUE
+
+    const int interior = j >= 2*mult && j < height-2*mult;
+    int i = 0;
+    for (; i<width; i++)
+    {
+      if(interior && i == 2*mult) break;
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+    if(!interior) continue;
+
+    const __m256 vsharpen = _mm256_set1_ps(-sharpen);
+    for(; i+1<width-2*mult; i+=2)
+    {
+      __m256 sum = _mm256_setzero_ps();
+      __m256 wgt = _mm256_setzero_ps();
+      const __m256 c = _mm256_loadu_ps((const float *)px);
+      const float *p2 = in + 4*(i-2*mult + (size_t)(j-2*mult)*width);
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          const __m256 v = _mm256_loadu_ps(p2);
+          const __m256 w = _mm256_mul_ps(_mm256_set1_ps(filter[ii]*filter[jj]), weight_avx2(c, v, vsharpen));
+          sum = _mm256_fmadd_ps(w, v, sum);
+          wgt = _mm256_add_ps(wgt, w);
+          p2 += 4*mult;
+        }
+        p2 += 4*(width-5)*mult;
+      }
+      sum = _mm256_mul_ps(sum, _mm256_rcp_ps(wgt));
+      const __m256 d = _mm256_sub_ps(c, sum);
+      _mm_stream_ps(pdetail,   _mm256_castps256_ps128(d));
+      _mm_stream_ps(pdetail+4, _mm256_extractf128_ps(d, 1));
+      _mm_stream_ps(pcoarse,   _mm256_castps256_ps128(sum));
+      _mm_stream_ps(pcoarse+4, _mm256_extractf128_ps(sum, 1));
+      px += 2;
+      pdetail += 8;
+      pcoarse += 8;
+    }
+    // odd one out, and the right border:
+    for(; i<width; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+  }
+
+  _mm_sfence();
+}
+#endif
+
+#undef SUM_PIXEL_CONTRIBUTION_COMMON
+#undef SUM_PIXEL_CONTRIBUTION_WITH_TEST
+#undef ROW_PROLOGUE
+#undef SUM_PIXEL_PROLOGUE
+#undef SUM_PIXEL_EPILOGUE
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -36,6 +36,30 @@ extern "C"
 #include "gui/gtk.h"
 }
 #include "iop/Permutohedral.h"
+
+// position (x, y, r, g, b) and value (r, g, b, 1) of a pixel, for splatting
+struct dt_iop_bilateral_points_t
+{
+  const float *in;
+  int width, ch;
+  const float *sigma;
+
+  void operator()(const size_t index, float *pos, float *val) const
+  {
+    const int j = index / width, i = index - (size_t)j * width;
+    const float *pixel = in + index * ch;
+    pos[0] = i * sigma[0];
+    pos[1] = j * sigma[1];
+    pos[2] = pixel[0] * sigma[2];
+    pos[3] = pixel[1] * sigma[3];
+    pos[4] = pixel[2] * sigma[4];
+    val[0] = pixel[0];
+    val[1] = pixel[1];
+    val[2] = pixel[2];
+    val[3] = 1.0f;
+  }
+};
+
 extern "C"
 {
 #include <gtk/gtk.h>
@@ -194,24 +218,8 @@ extern "C"
       PermutohedralLattice<5,4> lattice(roi_in->width*roi_in->height, omp_get_max_threads());
 
       // splat into the lattice
-#ifdef _OPENMP
-      #pragma omp parallel for
-#endif
-      for(int j=0; j<roi_in->height; j++)
-      {
-        const float *in = (const float*)ivoid + j*roi_in->width*ch;
-        const int thread = omp_get_thread_num();
-        int index = j * roi_in->width;
-        for(int i=0; i<roi_in->width; i++, index++)
-        {
-          float pos[5] = {i*sigma[0], j*sigma[1], in[0]*sigma[2], in[1]*sigma[3], in[2]*sigma[4]};
-          float val[4] = {in[0], in[1], in[2], 1.0};
-          lattice.splat(pos, val, index, thread);
-          in += ch;
-        }
-      }
-
-      lattice.merge_splat_threads();
+      const dt_iop_bilateral_points_t points = { (const float *)ivoid, roi_in->width, ch, sigma };
+      lattice.splat(points);
 
       // blur the lattice
       lattice.blur();
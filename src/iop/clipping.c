@@ -27,6 +27,7 @@
 #include "control/conf.h"
 #include "common/debug.h"
 #include "common/interpolation.h"
+#include "common/warp.h"
 #include "common/opencl.h"
 #include "bauhaus/bauhaus.h"
 #include "gui/accelerators.h"
@@ -746,6 +747,57 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
   roi_in->height = CLAMP(roi_in->height, 1, scheight - roi_in->y);
 }
 
+// inverse mapping of process() for dt_warp_process(), from output pixels at roi_out scale
+// to input pixels at roi_in scale.
+typedef struct dt_iop_clipping_warp_t
+{
+  const dt_iop_clipping_data_t *d;
+  float scale_in, scale_out;
+  float k_space[4];
+  float kxa, kya, ma, mb, md, me, mg, mh;
+}
+dt_iop_clipping_warp_t;
+
+static void
+_clipping_warp_backtransform(const void *data, float *points, const int count)
+{
+  const dt_iop_clipping_warp_t *w = (const dt_iop_clipping_warp_t *)data;
+  const dt_iop_clipping_data_t *d = w->d;
+  for(int k=0; k<2*count; k+=2)
+  {
+    float pi[2], po[2];
+
+    pi[0] = points[k]   - w->scale_out*d->enlarge_x + w->scale_out*d->cix;
+    pi[1] = points[k+1] - w->scale_out*d->enlarge_y + w->scale_out*d->ciy;
+
+    // transform this point using matrix m
+    if(d->flip)
+    {
+      pi[1] -= d->tx*w->scale_out;
+      pi[0] -= d->ty*w->scale_out;
+    }
+    else
+    {
+      pi[0] -= d->tx*w->scale_out;
+      pi[1] -= d->ty*w->scale_out;
+    }
+    pi[0] /= w->scale_out;
+    pi[1] /= w->scale_out;
+    backtransform(pi, po, d->m, d->k_h, d->k_v);
+    points[k]   = (po[0] + d->tx)*w->scale_in;
+    points[k+1] = (po[1] + d->ty)*w->scale_in;
+  }
+}
+
+static void
+_clipping_warp_keystone(const void *data, float *points, const int count)
+{
+  const dt_iop_clipping_warp_t *w = (const dt_iop_clipping_warp_t *)data;
+  float k_space[4] = { w->k_space[0], w->k_space[1], w->k_space[2], w->k_space[3] };
+  for(int k=0; k<2*count; k+=2)
+    keystone_backtransform(points+k,k_space,w->ma,w->mb,w->md,w->me,w->mg,w->mh,w->kxa,w->kya);
+}
+
 // 3rd (final) pass: you get this input region (may be different from what was requested above),
 // do your best to fill the output region!
 void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
@@ -753,7 +805,6 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   dt_iop_clipping_data_t *d = (dt_iop_clipping_data_t *)piece->data;
 
   const int ch = piece->colors;
-  const int ch_width = ch*roi_in->width;
 
   assert(ch == 4);
 
@@ -778,54 +829,27 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   else
   {
     const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
+    dt_iop_clipping_warp_t w;
+    w.d = d;
+    w.scale_in = roi_in->scale;
+    w.scale_out = roi_out->scale;
     const float rx = piece->buf_in.width*roi_in->scale;
     const float ry = piece->buf_in.height*roi_in->scale;
-    float k_space[4] = {d->k_space[0]*rx,d->k_space[1]*ry,d->k_space[2]*rx,d->k_space[3]*ry};
-    const float kxa = d->kxa*rx, kxb = d->kxb*rx, kxc = d->kxc*rx, kxd = d->kxd*rx;
-    const float kya = d->kya*ry, kyb = d->kyb*ry, kyc = d->kyc*ry, kyd = d->kyd*ry;
-    float ma,mb,md,me,mg,mh;
-    keystone_get_matrix(k_space,kxa,kxb,kxc,kxd,kya,kyb,kyc,kyd,&ma,&mb,&md,&me,&mg,&mh);
-
-#ifdef _OPENMP
-    #pragma omp parallel for schedule(static) default(none) shared(d,ivoid,ovoid,roi_in,roi_out,interpolation,k_space,ma,mb,md,me,mg,mh)
-#endif
-    // (slow) point-by-point transformation.
-    // TODO: optimize with scanlines and linear steps between?
-    for(int j=0; j<roi_out->height; j++)
-    {
-      float *out = ((float *)ovoid)+ch*j*roi_out->width;
-      for(int i=0; i<roi_out->width; i++,out+=ch)
-      {
-        float pi[2], po[2];
-
-        pi[0] = roi_out->x - roi_out->scale*d->enlarge_x + roi_out->scale*d->cix + i;
-        pi[1] = roi_out->y - roi_out->scale*d->enlarge_y + roi_out->scale*d->ciy + j;
-
-        // transform this point using matrix m
-        if(d->flip)
-        {
-          pi[1] -= d->tx*roi_out->scale;
-          pi[0] -= d->ty*roi_out->scale;
-        }
-        else
-        {
-          pi[0] -= d->tx*roi_out->scale;
-          pi[1] -= d->ty*roi_out->scale;
-        }
-        pi[0] /= roi_out->scale;
-        pi[1] /= roi_out->scale;
-        backtransform(pi, po, d->m, d->k_h, d->k_v);
-        po[0] *= roi_in->scale;
-        po[1] *= roi_in->scale;
-        po[0] += d->tx*roi_in->scale;
-        po[1] += d->ty*roi_in->scale;
-        if (d->k_apply==1) keystone_backtransform(po,k_space,ma,mb,md,me,mg,mh,kxa,kya);
-        po[0] -= roi_in->x;
-        po[1] -= roi_in->y;
-
-        dt_interpolation_compute_pixel4c(interpolation, (float *)ivoid, out, po[0], po[1], roi_in->width, roi_in->height, ch_width);
-      }
-    }
+    w.k_space[0] = d->k_space[0]*rx;
+    w.k_space[1] = d->k_space[1]*ry;
+    w.k_space[2] = d->k_space[2]*rx;
+    w.k_space[3] = d->k_space[3]*ry;
+    w.kxa = d->kxa*rx;
+    w.kya = d->kya*ry;
+    keystone_get_matrix(w.k_space,w.kxa,d->kxb*rx,d->kxc*rx,d->kxd*rx,w.kya,d->kyb*ry,d->kyc*ry,d->kyd*ry,
+                        &w.ma,&w.mb,&w.md,&w.me,&w.mg,&w.mh);
+
+    // rotation and perspective, then keystone, in one resampling pass:
+    dt_warp_t warp;
+    dt_warp_init(&warp);
+    dt_warp_append(&warp, _clipping_warp_backtransform, &w);
+    if (d->k_apply==1) dt_warp_append(&warp, _clipping_warp_keystone, &w);
+    dt_warp_process(&warp, interpolation, (const float *)ivoid, roi_in, (float *)ovoid, roi_out);
   }
 }
 
@@ -22,6 +22,7 @@
 #include "iop/colorin.h"
 #include "develop/develop.h"
 #include "control/control.h"
+#include "control/conf.h"
 #include "gui/gtk.h"
 #include "bauhaus/bauhaus.h"
 #include "common/colorspaces.h"
@@ -229,6 +230,22 @@ dt_XYZ_to_Lab_SSE(const __m128 XYZ)
   return _mm_mul_ps(coef,_mm_sub_ps(_mm_shuffle_ps(f,f,_MM_SHUFFLE(3,1,0,1)),_mm_shuffle_ps(f,f,_MM_SHUFFLE(3,2,1,3))));
 }
 
+// gamut mapping of deeply saturated blues for profiles going through lcms, see the matrix path below.
+static inline void
+_map_blues_lcms(float *cam)
+{
+  const float YY = cam[0]+cam[1]+cam[2];
+  const float zz = cam[2]/YY;
+  const float bound_z = 0.5f, bound_Y = 0.5f;
+  const float amount = 0.11f;
+  if (zz > bound_z)
+  {
+    const float t = (zz - bound_z)/(1.0f-bound_z) * fminf(1.0, YY/bound_Y);
+    cam[1] += t*amount;
+    cam[2] -= t*amount;
+  }
+}
+
 void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, void *o, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
   const dt_iop_colorin_data_t *const d = (dt_iop_colorin_data_t *)piece->data;
@@ -296,6 +313,26 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
     }
     _mm_sfence();
   }
+  else if(d->clut)
+  {
+    // lcms transform sampled into a 3d lut, which all threads can use at the same time
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for(int k=0; k<roi_out->height; k++)
+    {
+      const float *buf_in = in + (size_t)ch*roi_out->width*k;
+      float *buf_out = out + (size_t)ch*roi_out->width*k;
+      for(int l=0; l<roi_out->width; l++)
+      {
+        float cam[3] = { buf_in[ch*l+0], buf_in[ch*l+1], buf_in[ch*l+2] };
+        _map_blues_lcms(cam);
+        for(int c=0; c<3; c++) buf_out[ch*l+c] = cam[c];
+      }
+      // pixels outside [0,1] are left to lcms, with this thread's copy of the transform
+      dt_color_lut_apply(d->clut, d->xform[dt_get_thread_num()], buf_out, buf_out, roi_out->width, ch);
+    }
+  }
   else
   {
     // use general lcms2 fallback
@@ -318,17 +355,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
         cam[ci+0] = in[m+ii+0];
         cam[ci+1] = in[m+ii+1];
         cam[ci+2] = in[m+ii+2];
-
-        const float YY = cam[ci+0]+cam[ci+1]+cam[ci+2];
-        const float zz = cam[ci+2]/YY;
-        const float bound_z = 0.5f, bound_Y = 0.5f;
-        const float amount = 0.11f;
-        if (zz > bound_z)
-        {
-          const float t = (zz - bound_z)/(1.0f-bound_z) * fminf(1.0, YY/bound_Y);
-          cam[ci+1] += t*amount;
-          cam[ci+2] -= t*amount;
-        }
+        _map_blues_lcms(cam+ci);
       }
       // convert to (L,a/L,b/L) to be able to change L without changing saturation.
       // lcms is not thread safe, so work on one copy for each thread :(
@@ -360,6 +387,8 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
       cmsDeleteTransform(d->xform[t]);
       d->xform[t] = NULL;
     }
+  dt_color_lut_free(d->clut);
+  d->clut = NULL;
   d->cmatrix[0] = -666.0f;
   d->lut[0][0] = -1.0f;
   d->lut[1][0] = -1.0f;
@@ -483,6 +512,11 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     }
   }
 
+  // sample the lcms transform once, the lut is a lot faster and thread safe. the transforms
+  // of all threads are kept for the pixels outside of the lut's domain.
+  if(d->xform[0] && dt_conf_get_bool("color_transform_lut"))
+    d->clut = dt_color_lut_new(d->xform[0], DT_COLOR_LUT_RGB, DT_COLOR_LUT_SIZE);
+
   // now try to initialize unbounded mode:
   // we do a extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -511,6 +545,7 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   d->input = NULL;
   d->xform = (cmsHTRANSFORM *)malloc(sizeof(cmsHTRANSFORM)*dt_get_num_threads());
   for(int t=0; t<dt_get_num_threads(); t++) d->xform[t] = NULL;
+  d->clut = NULL;
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -522,6 +557,7 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
   dt_colorspaces_cleanup_profile(d->Lab);
   for(int t=0; t<dt_get_num_threads(); t++) if(d->xform[t]) cmsDeleteTransform(d->xform[t]);
   free(d->xform);
+  dt_color_lut_free(d->clut);
   free(piece->data);
 }
 
@@ -428,6 +428,29 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
       }
     }
   }
+  else if(d->clut)
+  {
+    // lcms transform sampled into a 3d lut
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for(int k=0; k<roi_out->height; k++)
+    {
+      const float *in = (float*)ivoid + (size_t)ch*roi_out->width*k;
+      float *out = (float*)ovoid + (size_t)ch*roi_out->width*k;
+      // pixels outside the sampled Lab range are left to lcms
+      dt_color_lut_apply(d->clut, d->xform, in, out, roi_out->width, ch);
+      if(gamutcheck) for(int l=0; l<roi_out->width; l++, out+=ch)
+        {
+          if(out[0] < 0.0f || out[1] < 0.0f || out[2] < 0.0f)
+          {
+            out[0] = 0.0f;
+            out[1] = 1.0f;
+            out[2] = 1.0f;
+          }
+        }
+    }
+  }
   else
   {
     float *in  = (float*)ivoid;
@@ -546,6 +569,8 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     cmsDeleteTransform(d->xform);
     d->xform = 0;
   }
+  dt_color_lut_free(d->clut);
+  d->clut = NULL;
   d->cmatrix[0] = NAN;
   d->lut[0][0] = -1.0f;
   d->lut[1][0] = -1.0f;
@@ -631,6 +656,10 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     }
   }
 
+  // sample the transform once, this also covers high quality export and softproofing
+  if(d->xform && dt_conf_get_bool("color_transform_lut"))
+    d->clut = dt_color_lut_new(d->xform, DT_COLOR_LUT_LAB, DT_COLOR_LUT_SIZE);
+
   // now try to initialize unbounded mode:
   // we do extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -663,6 +692,7 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   d->softproof_enabled = 0;
   d->softproof = d->output = NULL;
   d->xform = 0;
+  d->clut = NULL;
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -677,6 +707,7 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
     cmsDeleteTransform(d->xform);
     d->xform = 0;
   }
+  dt_color_lut_free(d->clut);
 
   free(piece->data);
 }
@@ -81,6 +81,12 @@ typedef struct dt_iop_denoiseprofile_global_data_t
   int kernel_denoiseprofile_synthesize;
   int kernel_denoiseprofile_reduce_first;
   int kernel_denoiseprofile_reduce_second;
+  // eaw_decompose() for this cpu:
+  void (*decompose)(float *const out, const float *const in, float *const detail, const int scale,
+                    const float inv_sigma2, const int32_t width, const int32_t height);
+  // nlmeans_slide() for this cpu:
+  void (*slide)(float *s, const float *inp, const float *inps, const float *inm, const float *inms,
+                const int n, const float norm2[4]);
 }
 dt_iop_denoiseprofile_global_data_t;
 
@@ -138,7 +144,7 @@ groups ()
 int
 flags ()
 {
-  return IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING;
+  return IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_ALLOW_PARALLEL_TILES;
 }
 
 typedef union floatint_t
@@ -289,184 +295,8 @@ backtransform(
 // begin wavelet code:
 // =====================================================================================
 
-static __m128  inline
-weight_sse(const __m128 *c1, const __m128 *c2, const float inv_sigma2)
-{
-  // return _mm_set1_ps(1.0f);
-#if 1
-  // 3d distance based on color
-  __m128 diff = _mm_sub_ps(*c1, *c2);
-  __m128 sqr  = _mm_mul_ps(diff, diff);
-  float *fsqr = (float *)&sqr;
-  const float dot = (fsqr[0] + fsqr[1] + fsqr[2])*inv_sigma2;
-  const float var = 0.02f; // FIXME: this should ideally depend on the image before noise stabilizing transforms!
-  const float off2 = 9.0f;// (3 sigma)^2
-  return _mm_set1_ps(fast_mexp2f(MAX(0, dot*var - off2)));
-#endif
-}
-
-#define SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj) \
-  do { \
-    const __m128 f = _mm_set1_ps(filter[(ii)]*filter[(jj)]); \
-    const __m128 wp = weight_sse(px, px2, inv_sigma2); \
-    const __m128 w = _mm_mul_ps(f, wp); \
-    const __m128 pd = _mm_mul_ps(w, *px2); \
-    sum = _mm_add_ps(sum, pd); \
-    wgt = _mm_add_ps(wgt, w); \
-  } while (0)
-
-#define SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj) \
-  do { \
-    const int iii = (ii)-2; \
-    const int jjj = (jj)-2; \
-    int x = i + mult*iii; \
-    int y = j + mult*jjj; \
-    \
-    if(x < 0)       x = 0; \
-    if(x >= width)  x = width  - 1; \
-    if(y < 0)       y = 0; \
-    if(y >= height) y = height - 1; \
-    \
-    px2 = ((__m128 *)in) + x + y*width; \
-    \
-    SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj); \
-  } while (0)
-
-#define ROW_PROLOGUE \
-  const __m128 *px = ((__m128 *)in) + j*width; \
-  const __m128 *px2; \
-  float *pdetail = detail + 4*j*width; \
-  float *pcoarse = out + 4*j*width;
-
-#define SUM_PIXEL_PROLOGUE \
-  __m128 sum = _mm_setzero_ps(); \
-  __m128 wgt = _mm_setzero_ps();
-
-#define SUM_PIXEL_EPILOGUE \
-  sum = _mm_div_ps(sum, wgt); \
-  \
-  _mm_stream_ps(pdetail, _mm_sub_ps(*px, sum)); \
-  _mm_stream_ps(pcoarse, sum); \
-  px++; \
-  pdetail+=4; \
-  pcoarse+=4;
-
-static void
-eaw_decompose (float *const out, const float *const in, float *const detail, const int scale,
-               const float inv_sigma2, const int32_t width, const int32_t height)
-{
-  const int mult = 1<<scale;
-  static const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
-
-  /* The first "2*mult" lines use the macro with tests because the 5x5 kernel
-   * requires nearest pixel interpolation for at least a pixel in the sum */
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
-#endif
-  for (int j=0; j<2*mult; j++)
-  {
-    ROW_PROLOGUE
-
-    for(int i=0; i<width; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-  }
-
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
-#endif
-  for(int j=2*mult; j<height-2*mult; j++)
-  {
-    ROW_PROLOGUE
-
-    /* The first "2*mult" pixels use the macro with tests because the 5x5 kernel
-     * requires nearest pixel interpolation for at least a pixel in the sum */
-    for (int i=0; i<2*mult; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-
-    /* For pixels [2*mult, width-2*mult], we can safely use macro w/o tests
-     * to avoid unneeded branching in the inner loops */
-    for(int i=2*mult; i<width-2*mult; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      px2 = ((__m128*)in) + i-2*mult + (j-2*mult)*width;
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj);
-          px2 += mult;
-        }
-        px2 += (width-5)*mult;
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-
-    /* Last two pixels in the row require a slow variant... blablabla */
-    for (int i=width-2*mult; i<width; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-  }
-
-  /* The last "2*mult" lines use the macro with tests because the 5x5 kernel
-   * requires nearest pixel interpolation for at least a pixel in the sum */
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
-#endif
-  for (int j=height-2*mult; j<height; j++)
-  {
-    ROW_PROLOGUE
-
-    for(int i=0; i<width; i++)
-    {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
-      }
-      SUM_PIXEL_EPILOGUE
-    }
-  }
-
-  _mm_sfence();
-}
-
-#undef SUM_PIXEL_CONTRIBUTION_COMMON
-#undef SUM_PIXEL_CONTRIBUTION_WITH_TEST
-#undef ROW_PROLOGUE
-#undef SUM_PIXEL_PROLOGUE
-#undef SUM_PIXEL_EPILOGUE
+#include "iop/denoiseprofile_eaw.c"
+#include "iop/nlmeans_dist.c"
 
 static void
 eaw_synthesize (float *const out, const float *const in, const float *const detail,
@@ -514,6 +344,7 @@ void process_wavelets(
   // this is called for preview and full pipe separately, each with its own pixelpipe piece.
   // get our data struct:
   dt_iop_denoiseprofile_params_t *d = (dt_iop_denoiseprofile_params_t *)piece->data;
+  dt_iop_denoiseprofile_global_data_t *gd = (dt_iop_denoiseprofile_global_data_t *)self->data;
 
   const int max_max_scale = 5; // hard limit
   int max_scale = 0;
@@ -582,7 +413,7 @@ void process_wavelets(
     const float sigma = 1.0f;
     const float varf = sqrtf(2.0f + 2.0f * 4.0f*4.0f + 6.0f*6.0f)/16.0f; // about 0.5
     const float sigma_band = powf(varf, scale) *sigma;
-    eaw_decompose (buf2, buf1, buf[scale], scale, 1.0f/(sigma_band*sigma_band), width, height);
+    gd->decompose (buf2, buf1, buf[scale], scale, 1.0f/(sigma_band*sigma_band), width, height);
     // DEBUG: clean out temporary memory:
     // memset(buf1, 0, sizeof(float)*4*width*height);
 # if 0 // DEBUG: print wavelet scales:
@@ -678,6 +509,7 @@ void process_nlmeans(
   // this is called for preview and full pipe separately, each with its own pixelpipe piece.
   // get our data struct:
   dt_iop_denoiseprofile_params_t *d = (dt_iop_denoiseprofile_params_t *)piece->data;
+  dt_iop_denoiseprofile_global_data_t *gd = (dt_iop_denoiseprofile_global_data_t *)self->data;
 
   // TODO: fixed K to use adaptive size trading variance and bias!
   // adjust to zoom size:
@@ -686,6 +518,8 @@ void process_nlmeans(
   const int K = ceilf(7 * scale);
 
   // P == 0 : this will degenerate to a (fast) bilateral filter.
+  // the channels are already scaled by precondition():
+  const float norm2[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
 
   float *Sa = dt_alloc_align(64, sizeof(float)*roi_out->width*dt_get_num_threads());
   // we want to sum up weights in col[3], so need to init to 0:
@@ -724,7 +558,7 @@ void process_nlmeans(
       // don't construct summed area tables but use sliding window! (applies to cpu version res < 1k only, or else we will add up errors)
       // do this in parallel with a little threading overhead. could parallelize the outer loops with a bit more memory
 #ifdef _OPENMP
-      #  pragma omp parallel for schedule(static) default(none) firstprivate(inited_slide) shared(kj, ki, roi_out, roi_in, in, ovoid, Sa)
+      #  pragma omp parallel for schedule(static) default(none) firstprivate(inited_slide) shared(kj, ki, roi_out, roi_in, in, ovoid, Sa, gd)
 #endif
       for(int j=0; j<roi_out->height; j++)
       {
@@ -785,73 +619,14 @@ void process_nlmeans(
         if(inited_slide && j+P+1+MAX(0,kj) < roi_out->height)
         {
           // sliding window in j direction:
-          int i = MAX(0, -ki);
-          float *s = S + i;
-          const float *inp  = in + 4*i + 4* roi_in->width *(j+P+1);
-          const float *inps = in + 4*i + 4*(roi_in->width *(j+P+1+kj) + ki);
-          const float *inm  = in + 4*i + 4* roi_in->width *(j-P);
-          const float *inms = in + 4*i + 4*(roi_in->width *(j-P+kj) + ki);
+          const int i = MAX(0, -ki);
           const int last = roi_out->width + MIN(0, -ki);
-          for(; ((intptr_t)s & 0xf) != 0 && i<last; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
-          {
-            float stmp = s[0];
-            for(int k=0; k<3; k++)
-              stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
-                       -  (inm[k] - inms[k])*(inm[k] - inms[k]));
-            s[0] = stmp;
-          }
-          /* Process most of the line 4 pixels at a time */
-          for(; i<last-4; i+=4, inp+=16, inps+=16, inm+=16, inms+=16, s+=4)
-          {
-            __m128 sv = _mm_load_ps(s);
-            const __m128 inp1 = _mm_load_ps(inp)    - _mm_load_ps(inps);
-            const __m128 inp2 = _mm_load_ps(inp+4)  - _mm_load_ps(inps+4);
-            const __m128 inp3 = _mm_load_ps(inp+8)  - _mm_load_ps(inps+8);
-            const __m128 inp4 = _mm_load_ps(inp+12) - _mm_load_ps(inps+12);
-
-            const __m128 inp12lo = _mm_unpacklo_ps(inp1,inp2);
-            const __m128 inp34lo = _mm_unpacklo_ps(inp3,inp4);
-            const __m128 inp12hi = _mm_unpackhi_ps(inp1,inp2);
-            const __m128 inp34hi = _mm_unpackhi_ps(inp3,inp4);
-
-            const __m128 inpv0 = _mm_movelh_ps(inp12lo,inp34lo);
-            sv += inpv0*inpv0;
-
-            const __m128 inpv1 = _mm_movehl_ps(inp34lo,inp12lo);
-            sv += inpv1*inpv1;
-
-            const __m128 inpv2 = _mm_movelh_ps(inp12hi,inp34hi);
-            sv += inpv2*inpv2;
-
-            const __m128 inm1 = _mm_load_ps(inm)    - _mm_load_ps(inms);
-            const __m128 inm2 = _mm_load_ps(inm+4)  - _mm_load_ps(inms+4);
-            const __m128 inm3 = _mm_load_ps(inm+8)  - _mm_load_ps(inms+8);
-            const __m128 inm4 = _mm_load_ps(inm+12) - _mm_load_ps(inms+12);
-
-            const __m128 inm12lo = _mm_unpacklo_ps(inm1,inm2);
-            const __m128 inm34lo = _mm_unpacklo_ps(inm3,inm4);
-            const __m128 inm12hi = _mm_unpackhi_ps(inm1,inm2);
-            const __m128 inm34hi = _mm_unpackhi_ps(inm3,inm4);
-
-            const __m128 inmv0 = _mm_movelh_ps(inm12lo,inm34lo);
-            sv -= inmv0*inmv0;
-
-            const __m128 inmv1 = _mm_movehl_ps(inm34lo,inm12lo);
-            sv -= inmv1*inmv1;
-
-            const __m128 inmv2 = _mm_movelh_ps(inm12hi,inm34hi);
-            sv -= inmv2*inmv2;
-
-            _mm_store_ps(s, sv);
-          }
-          for(; i<last; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
-          {
-            float stmp = s[0];
-            for(int k=0; k<3; k++)
-              stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
-                       -  (inm[k] - inms[k])*(inm[k] - inms[k]));
-            s[0] = stmp;
-          }
+          gd->slide(S + i,
+                    in + 4*i + 4* roi_in->width *(j+P+1),
+                    in + 4*i + 4*(roi_in->width *(j+P+1+kj) + ki),
+                    in + 4*i + 4* roi_in->width *(j-P),
+                    in + 4*i + 4*(roi_in->width *(j-P+kj) + ki),
+                    last - i, norm2);
         }
         else inited_slide = 0;
       }
@@ -1544,6 +1319,14 @@ void init_global(dt_iop_module_so_t *module)
   gd->kernel_denoiseprofile_synthesize    = dt_opencl_create_kernel(program, "denoiseprofile_synthesize");
   gd->kernel_denoiseprofile_reduce_first  = dt_opencl_create_kernel(program, "denoiseprofile_reduce_first");
   gd->kernel_denoiseprofile_reduce_second = dt_opencl_create_kernel(program, "denoiseprofile_reduce_second");
+  gd->decompose = eaw_decompose;
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+  if(dt_cpu_has(DT_CPU_AVX2 | DT_CPU_FMA)) gd->decompose = eaw_decompose_avx2;
+#endif
+  gd->slide = nlmeans_slide;
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+  if(dt_cpu_has(DT_CPU_AVX2)) gd->slide = nlmeans_slide_avx2;
+#endif
 }
 
 void cleanup_global(dt_iop_module_so_t *module)
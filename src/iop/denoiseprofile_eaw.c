@@ -0,0 +1,314 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2011--2013 johannes hanika.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// edge avoiding wavelet decomposition of the denoiser, included by denoiseprofile.c (and by the
+// unit test in src/tests): the sse2 version, and one for avx2 and fma picked at runtime.
+// needs fast_mexp2f() from the module.
+
+#include "common/cpu.h"
+
+#include <xmmintrin.h>
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+#include <immintrin.h>
+#endif
+
+static __m128  inline
+weight_sse(const __m128 *c1, const __m128 *c2, const float inv_sigma2)
+{
+  // return _mm_set1_ps(1.0f);
+#if 1
+  // 3d distance based on color
+  __m128 diff = _mm_sub_ps(*c1, *c2);
+  __m128 sqr  = _mm_mul_ps(diff, diff);
+  float *fsqr = (float *)&sqr;
+  const float dot = (fsqr[0] + fsqr[1] + fsqr[2])*inv_sigma2;
+  const float var = 0.02f; // FIXME: this should ideally depend on the image before noise stabilizing transforms!
+  const float off2 = 9.0f;// (3 sigma)^2
+  return _mm_set1_ps(fast_mexp2f(MAX(0, dot*var - off2)));
+#endif
+}
+
+#define SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj) \
+  do { \
+    const __m128 f = _mm_set1_ps(filter[(ii)]*filter[(jj)]); \
+    const __m128 wp = weight_sse(px, px2, inv_sigma2); \
+    const __m128 w = _mm_mul_ps(f, wp); \
+    const __m128 pd = _mm_mul_ps(w, *px2); \
+    sum = _mm_add_ps(sum, pd); \
+    wgt = _mm_add_ps(wgt, w); \
+  } while (0)
+
+#define SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj) \
+  do { \
+    const int iii = (ii)-2; \
+    const int jjj = (jj)-2; \
+    int x = i + mult*iii; \
+    int y = j + mult*jjj; \
+    \
+    if(x < 0)       x = 0; \
+    if(x >= width)  x = width  - 1; \
+    if(y < 0)       y = 0; \
+    if(y >= height) y = height - 1; \
+    \
+    px2 = ((__m128 *)in) + x + y*width; \
+    \
+    SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj); \
+  } while (0)
+
+#define ROW_PROLOGUE \
+  const __m128 *px = ((__m128 *)in) + j*width; \
+  const __m128 *px2; \
+  float *pdetail = detail + 4*j*width; \
+  float *pcoarse = out + 4*j*width;
+
+#define SUM_PIXEL_PROLOGUE \
+  __m128 sum = _mm_setzero_ps(); \
+  __m128 wgt = _mm_setzero_ps();
+
+#define SUM_PIXEL_EPILOGUE \
+  sum = _mm_div_ps(sum, wgt); \
+  \
+  _mm_stream_ps(pdetail, _mm_sub_ps(*px, sum)); \
+  _mm_stream_ps(pcoarse, sum); \
+  px++; \
+  pdetail+=4; \
+  pcoarse+=4;
+
+static void
+eaw_decompose (float *const out, const float *const in, float *const detail, const int scale,
+               const float inv_sigma2, const int32_t width, const int32_t height)
+{
+  const int mult = 1<<scale;
+  static const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+
+  /* The first "2*mult" lines use the macro with tests because the 5x5 kernel
+   * requires nearest pixel interpolation for at least a pixel in the sum */
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static)
+#endif
+  for (int j=0; j<2*mult; j++)
+  {
+    ROW_PROLOGUE
+
+    for(int i=0; i<width; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int j=2*mult; j<height-2*mult; j++)
+  {
+    ROW_PROLOGUE
+
+    /* The first "2*mult" pixels use the macro with tests because the 5x5 kernel
+     * requires nearest pixel interpolation for at least a pixel in the sum */
+    for (int i=0; i<2*mult; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+
+    /* For pixels [2*mult, width-2*mult], we can safely use macro w/o tests
+     * to avoid unneeded branching in the inner loops */
+    for(int i=2*mult; i<width-2*mult; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      px2 = ((__m128*)in) + i-2*mult + (j-2*mult)*width;
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj);
+          px2 += mult;
+        }
+        px2 += (width-5)*mult;
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+
+    /* Last two pixels in the row require a slow variant... blablabla */
+    for (int i=width-2*mult; i<width; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+  }
+
+  /* The last "2*mult" lines use the macro with tests because the 5x5 kernel
+   * requires nearest pixel interpolation for at least a pixel in the sum */
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static)
+#endif
+  for (int j=height-2*mult; j<height; j++)
+  {
+    ROW_PROLOGUE
+
+    for(int i=0; i<width; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+  }
+
+  _mm_sfence();
+}
+
+
+
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+/* weight_sse() for two pixels at once, each half broadcast over its four channels. */
+DT_CPU_TARGET_AVX2 static inline __m256
+weight_avx2(const __m256 c1, const __m256 c2, const __m256 inv_sigma2)
+{
+  const __m256 diff = _mm256_sub_ps(c1, c2);
+  const __m256 sqr = _mm256_mul_ps(diff, diff);
+  const __m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_permute_ps(sqr, _MM_SHUFFLE(0, 0, 0, 0)),
+                                                 _mm256_permute_ps(sqr, _MM_SHUFFLE(1, 1, 1, 1))),
+                                   _mm256_permute_ps(sqr, _MM_SHUFFLE(2, 2, 2, 2)));
+  const __m256 dot = _mm256_mul_ps(sum, inv_sigma2);
+  // fast_mexp2f(MAX(0, dot*var - off2)), see there:
+  const __m256 x = _mm256_max_ps(_mm256_setzero_ps(),
+                                 _mm256_sub_ps(_mm256_mul_ps(dot, _mm256_set1_ps(0.02f)), _mm256_set1_ps(9.0f)));
+  const __m256 k0 = _mm256_add_ps(_mm256_set1_ps((float)0x3f800000u),
+                                  _mm256_mul_ps(x, _mm256_set1_ps((float)0x3f000000u - (float)0x3f800000u)));
+  const __m256 mask = _mm256_cmp_ps(k0, _mm256_set1_ps((float)0x800000u), _CMP_GE_OQ);
+  return _mm256_and_ps(mask, _mm256_castsi256_ps(_mm256_cvttps_epi32(k0)));
+}
+
+/* eaw_decompose() doing two neighbouring pixels per step in the interior, like the one of the
+ * equalizer. the sums use fma, so results differ from the sse2 version in the last bits. */
+DT_CPU_TARGET_AVX2 static void
+eaw_decompose_avx2 (float *const out, const float *const in, float *const detail, const int scale,
+                    const float inv_sigma2, const int32_t width, const int32_t height)
+{
+  const int mult = 1<<scale;
+  static const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static)
+#endif
+  for (int j=0; j<height; j++)
+  {
+    ROW_PROLOGUE
+
+    const int interior = j >= 2*mult && j < height-2*mult;
+    int i = 0;
+    for (; i<width; i++)
+    {
+      if(interior && i == 2*mult) break;
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+    if(!interior) continue;
+
+    const __m256 vinv_sigma2 = _mm256_set1_ps(inv_sigma2);
+    for(; i+1<width-2*mult; i+=2)
+    {
+      __m256 sum = _mm256_setzero_ps();
+      __m256 wgt = _mm256_setzero_ps();
+      const __m256 c = _mm256_loadu_ps((const float *)px);
+      const float *p2 = in + 4*(i-2*mult + (size_t)(j-2*mult)*width);
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          const __m256 v = _mm256_loadu_ps(p2);
+          const __m256 w = _mm256_mul_ps(_mm256_set1_ps(filter[ii]*filter[jj]), weight_avx2(c, v, vinv_sigma2));
+          sum = _mm256_fmadd_ps(w, v, sum);
+          wgt = _mm256_add_ps(wgt, w);
+          p2 += 4*mult;
+        }
+        p2 += 4*(width-5)*mult;
+      }
+      sum = _mm256_div_ps(sum, wgt);
+      const __m256 d = _mm256_sub_ps(c, sum);
+      _mm_stream_ps(pdetail,   _mm256_castps256_ps128(d));
+      _mm_stream_ps(pdetail+4, _mm256_extractf128_ps(d, 1));
+      _mm_stream_ps(pcoarse,   _mm256_castps256_ps128(sum));
+      _mm_stream_ps(pcoarse+4, _mm256_extractf128_ps(sum, 1));
+      px += 2;
+      pdetail += 8;
+      pcoarse += 8;
+    }
+    // odd one out, and the right border:
+    for(; i<width; i++)
+    {
+      SUM_PIXEL_PROLOGUE
+      for (int jj=0; jj<5; jj++)
+      {
+        for (int ii=0; ii<5; ii++)
+        {
+          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
+        }
+      }
+      SUM_PIXEL_EPILOGUE
+    }
+  }
+
+  _mm_sfence();
+}
+#endif
+
+#undef SUM_PIXEL_CONTRIBUTION_COMMON
+#undef SUM_PIXEL_CONTRIBUTION_WITH_TEST
+#undef ROW_PROLOGUE
+#undef SUM_PIXEL_PROLOGUE
+#undef SUM_PIXEL_EPILOGUE
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -30,6 +30,7 @@
 #include "develop/tiling.h"
 #include "common/opencl.h"
 #include "common/interpolation.h"
+#include "common/warp.h"
 #include "control/control.h"
 #include "dtgtk/button.h"
 #include "dtgtk/resetlabel.h"
@@ -163,6 +164,192 @@ _lens_sanitize(const char *orig_lens)
 }
 
 
+// the geometric corrections are sampled from a displacement map: on a grid over the region
+// being processed at the current scale it stores where lensfun takes red, green and blue from,
+// the positions in between are interpolated bilinearly. the error goes with step^2/image size,
+// 8 pixels at 6000x4000 and 2 for small previews keep it at about 1/500 of a pixel.
+#define DT_IOP_LENS_MAP_STEP 8
+
+static inline int
+_lens_modifies_geometry(const int modflags)
+{
+  return modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE);
+}
+
+static void
+_lens_free_setup(dt_iop_lensfun_data_t *d)
+{
+  if(d->modifier) lf_modifier_destroy(d->modifier);
+  dt_free_align(d->map);
+  d->modifier = NULL;
+  d->modflags = 0;
+  d->map = NULL;
+  d->map_x = d->map_y = 0;
+  d->map_width = d->map_height = d->map_step = 0;
+  d->map_orig_w = d->map_orig_h = 0.0f;
+}
+
+// set up the modifier for the given image size and the map for the nodes around roi_out, unless
+// they are still there from the last run. d->lens is our own copy, so other pipes don't have to wait for this.
+static void
+_lens_setup(dt_iop_lensfun_data_t *d, const float orig_w, const float orig_h, const dt_iop_roi_t *roi_out)
+{
+  if(!d->modifier || d->map_orig_w != orig_w || d->map_orig_h != orig_h)
+  {
+    _lens_free_setup(d);
+    d->modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+    d->modflags = lf_modifier_initialize(
+                    d->modifier, d->lens, LF_PF_F32,
+                    d->focal, d->aperture,
+                    d->distance, d->scale,
+                    d->target_geom, d->modify_flags, d->inverse);
+    d->map_orig_w = orig_w;
+    d->map_orig_h = orig_h;
+  }
+
+  if(!_lens_modifies_geometry(d->modflags)) return;
+
+  const float diagonal = sqrtf(orig_w*orig_w + orig_h*orig_h);
+  const int step = CLAMPS((int)sqrtf(diagonal/112.0f), 2, DT_IOP_LENS_MAP_STEP);
+  // one node beyond the last pixel, so every pixel of roi_out has four nodes around it:
+  const int x0 = (int)floorf(roi_out->x/(float)step), y0 = (int)floorf(roi_out->y/(float)step);
+  const int x1 = (int)floorf((roi_out->x + roi_out->width - 1)/(float)step) + 1;
+  const int y1 = (int)floorf((roi_out->y + roi_out->height - 1)/(float)step) + 1;
+  if(d->map && x0 >= d->map_x && y0 >= d->map_y
+     && x1 < d->map_x + d->map_width && y1 < d->map_y + d->map_height) return;
+
+  dt_free_align(d->map);
+  d->map = NULL;
+  const int mw = x1 - x0 + 1, mh = y1 - y0 + 1;
+  float *map = (float *)dt_alloc_align(16, sizeof(float)*8*mw*mh);
+  if(!map) return;
+  lfModifier *modifier = d->modifier;
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(map, modifier) schedule(static)
+#endif
+  for(int j = 0; j < mh; j++)
+  {
+    for(int i = 0; i < mw; i++)
+    {
+      float *node = map + 8*((size_t)mw*j + i);
+      lf_modifier_apply_subpixel_geometry_distortion(modifier, (x0+i)*step, (y0+j)*step, 1, 1, node);
+      node[6] = node[7] = 0.0f;
+    }
+  }
+  d->map = map;
+  d->map_x = x0;
+  d->map_y = y0;
+  d->map_width = mw;
+  d->map_height = mh;
+  d->map_step = step;
+}
+
+// where red, green and blue of the pixel at (x, y) come from, bilinear between the nodes.
+// lensfun is asked directly outside of the map.
+static inline void
+_lens_map_lookup(const dt_iop_lensfun_data_t *d, const float x, const float y, float *pi)
+{
+  const float inv_step = 1.0f/d->map_step;
+  const float fx = x * inv_step - d->map_x, fy = y * inv_step - d->map_y;
+  const int i = (int)floorf(fx), j = (int)floorf(fy);
+  if(i < 0 || j < 0 || i > d->map_width-2 || j > d->map_height-2)
+  {
+    lf_modifier_apply_subpixel_geometry_distortion(d->modifier, x, y, 1, 1, pi);
+    return;
+  }
+  const __m128 wx = _mm_set1_ps(fx - i), wy = _mm_set1_ps(fy - j);
+  const float *m0 = d->map + 8*((size_t)d->map_width*j + i);
+  const float *m1 = m0 + 8*d->map_width;
+  __m128 v[2];
+  for(int h = 0; h < 2; h++)
+  {
+    const __m128 a = _mm_load_ps(m0 + 4*h), b = _mm_load_ps(m0 + 8 + 4*h);
+    const __m128 c = _mm_load_ps(m1 + 4*h), e = _mm_load_ps(m1 + 8 + 4*h);
+    const __m128 top = _mm_add_ps(a, _mm_mul_ps(wx, _mm_sub_ps(b, a)));
+    const __m128 bot = _mm_add_ps(c, _mm_mul_ps(wx, _mm_sub_ps(e, c)));
+    v[h] = _mm_add_ps(top, _mm_mul_ps(wy, _mm_sub_ps(bot, top)));
+  }
+  _mm_storeu_ps(pi, v[0]);
+  _mm_storel_pi((__m64 *)(pi + 4), v[1]);
+}
+
+// the same for the pixels x..x+width-1 in row y, in the layout
+// lf_modifier_apply_subpixel_geometry_distortion() uses: 6 floats per pixel.
+static void
+_lens_map_row(const dt_iop_lensfun_data_t *d, const int x, const int y, const int width, float *pi)
+{
+  if(!d->map)
+  {
+    lf_modifier_apply_subpixel_geometry_distortion(d->modifier, x, y, width, 1, pi);
+    return;
+  }
+  for(int k = 0; k < width; k++) _lens_map_lookup(d, x + k, y, pi + 6*k);
+}
+
+// per channel mapping for dt_warp_process().
+static void
+_lens_map_points(const void *data, const float *points, const int count, float *rgb)
+{
+  const dt_iop_lensfun_data_t *d = (const dt_iop_lensfun_data_t *)data;
+  for(int k = 0; k < count; k++)
+  {
+    if(d->map)
+      _lens_map_lookup(d, points[2*k], points[2*k+1], rgb + 6*k);
+    else
+      lf_modifier_apply_subpixel_geometry_distortion(d->modifier, points[2*k], points[2*k+1], 1, 1, rgb + 6*k);
+  }
+}
+
+// resample in (roi_in) to out (roi_out) along the displacement map.
+static void
+_lens_distort(dt_iop_lensfun_data_t *d, const float *in, float *out, const dt_iop_roi_t *roi_in,
+              const dt_iop_roi_t *roi_out, const int ch, const int mask_display)
+{
+  const int ch_width = ch*roi_in->width;
+  const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
+
+  if(ch == 4)
+  {
+    dt_warp_t warp;
+    dt_warp_init(&warp);
+    dt_warp_set_rgb(&warp, _lens_map_points, d);
+    dt_warp_process(&warp, interpolation, in, roi_in, out, roi_out);
+    return;
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel default(none) shared(d, in, out, roi_in, roi_out, interpolation)
+#endif
+  {
+    // acquire temp memory for distorted pixel coords
+    float *const pi = (float *)dt_alloc_align(16, sizeof(float)*2*3*roi_out->width);
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for (int y = 0; y < roi_out->height; y++)
+    {
+      _lens_map_row(d, roi_out->x, roi_out->y+y, roi_out->width, pi);
+      // reverse transform the global coords from lf to our buffer
+      float *buf = out + (size_t)y*roi_out->width*ch;
+      const float *p = pi;
+      for (int x = 0; x < roi_out->width; x++, buf+=ch, p+=6)
+      {
+        const float px[3] = { p[0] - roi_in->x, p[2] - roi_in->x, p[4] - roi_in->x };
+        const float py[3] = { p[1] - roi_in->y, p[3] - roi_in->y, p[5] - roi_in->y };
+        for(int c=0; c<3; c++)
+          buf[c] = dt_interpolation_compute_sample(interpolation, in+c, px[c], py[c], roi_in->width, roi_in->height, ch, ch_width);
+
+        if(mask_display)
+        {
+          // take green channel distortion also for alpha channel
+          buf[3] = dt_interpolation_compute_sample(interpolation, in+3, px[1], py[1], roi_in->width, roi_in->height, ch, ch_width);
+        }
+      }
+    }
+    dt_free_align(pi);
+  }
+}
+
 void
 process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
@@ -172,7 +359,6 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
   float *in  = (float *)ivoid;
   float *out = (float *)ovoid;
   const int ch = piece->colors;
-  const int ch_width = ch*roi_in->width;
   const int mask_display = piece->pipe->mask_display;
 
   const unsigned int pixelformat = ch == 3 ? LF_CR_3 (RED, GREEN, BLUE) : LF_CR_4 (RED, GREEN, BLUE, UNKNOWN);
@@ -185,61 +371,16 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
 
   const float orig_w = roi_in->scale*piece->iwidth,
               orig_h = roi_in->scale*piece->iheight;
-  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  _lens_setup(d, orig_w, orig_h, roi_out);
+  lfModifier *modifier = d->modifier;
+  const int modflags = d->modflags;
 
   if(d->inverse)
   {
     // reverse direction (useful for renderings)
-    if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
-                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    if (_lens_modifies_geometry(modflags))
     {
-      // acquire temp memory for distorted pixel coords
-      const size_t req2 = roi_out->width*2*3*sizeof(float);
-      if(req2 > 0 && d->tmpbuf2_len < req2*dt_get_num_threads())
-      {
-        d->tmpbuf2_len = req2*dt_get_num_threads();
-        dt_free_align(d->tmpbuf2);
-        d->tmpbuf2 = (float *)dt_alloc_align(16, d->tmpbuf2_len);
-      }
-
-      const struct  dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
-
-#ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, in, d, ovoid, modifier, interpolation) schedule(static)
-#endif
-      for (int y = 0; y < roi_out->height; y++)
-      {
-        float *pi = (float *)(((char *)d->tmpbuf2) + req2*dt_get_thread_num());
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
-        // reverse transform the global coords from lf to our buffer
-        float *buf = ((float *)ovoid) + y*roi_out->width*ch;
-        for (int x = 0; x < roi_out->width; x++,buf+=ch,pi+=6)
-        {
-          for(int c=0; c<3; c++)
-          {
-            const float pi0 = pi[c*2] - roi_in->x;
-            const float pi1 = pi[c*2+1] - roi_in->y;
-            buf[c] = dt_interpolation_compute_sample(interpolation, in+c, pi0, pi1, roi_in->width, roi_in->height, ch, ch_width);
-          }
-
-          if(mask_display)
-          {
-            // take green channel distortion also for alpha channel
-            const float pi0 = pi[2] - roi_in->x;
-            const float pi1 = pi[3] - roi_in->y;
-            buf[3] = dt_interpolation_compute_sample(interpolation, in+3, pi0, pi1, roi_in->width, roi_in->height, ch, ch_width);
-          }
-        }
-      }
+      _lens_distort(d, in, out, roi_in, roi_out, ch, mask_display);
     }
     else
     {
@@ -293,49 +434,9 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
       }
     }
 
-    const size_t req2 = roi_out->width*2*3*sizeof(float);
-    if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
-                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    if (_lens_modifies_geometry(modflags))
     {
-      // acquire temp memory for distorted pixel coords
-      if(req2 > 0 && d->tmpbuf2_len < req2*dt_get_num_threads())
-      {
-        d->tmpbuf2_len = req2*dt_get_num_threads();
-        dt_free_align(d->tmpbuf2);
-        d->tmpbuf2 = (float *)dt_alloc_align(16, d->tmpbuf2_len);
-      }
-
-      const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
-
-#ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_in, roi_out, d, ovoid, modifier, interpolation) schedule(static)
-#endif
-      for (int y = 0; y < roi_out->height; y++)
-      {
-        float *pi = (float *)(((char *)d->tmpbuf2) + dt_get_thread_num()*req2);
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
-        // reverse transform the global coords from lf to our buffer
-        float *out = ((float *)ovoid) + y*roi_out->width*ch;
-        for (int x = 0; x < roi_out->width; x++,pi+=6)
-        {
-          for(int c=0; c<3; c++)
-          {
-            const float pi0 = pi[c*2] - roi_in->x;
-            const float pi1 = pi[c*2+1] - roi_in->y;
-            out[c] = dt_interpolation_compute_sample(interpolation, d->tmpbuf+c, pi0, pi1, roi_in->width, roi_in->height, ch, ch_width);
-          }
-
-          if(mask_display)
-          {
-            // take green channel distortion also for alpha channel
-            const float pi0 = pi[2] - roi_in->x;
-            const float pi1 = pi[3] - roi_in->y;
-            out[3] = dt_interpolation_compute_sample(interpolation, d->tmpbuf+3, pi0, pi1, roi_in->width, roi_in->height, ch, ch_width);
-          }
-          out += ch;
-        }
-      }
+      _lens_distort(d, d->tmpbuf, out, roi_in, roi_out, ch, mask_display);
     }
     else
     {
@@ -348,7 +449,6 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
         memcpy(out+ch*y*roi_out->width, input+ch*y*roi_out->width, ch*sizeof(float)*roi_out->width);
     }
   }
-  lf_modifier_destroy(modifier);
 
   if(g != NULL && self->dev->gui_attached && piece->pipe->type == DT_DEV_PIXELPIPE_PREVIEW)
   {
@@ -435,30 +535,22 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   if(dev_tmpbuf == NULL) goto error;
 
 
-  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-  modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  _lens_setup(d, orig_w, orig_h, roi_out);
+  modifier = d->modifier;
+  const int modflags = d->modflags;
 
   if(d->inverse)
   {
     // reverse direction (useful for renderings)
-    if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
-                   LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    if(_lens_modifies_geometry(modflags))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _lens_map_row(d, roi_out->x, roi_out->y+y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -557,17 +649,15 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
     }
 
 
-    if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
-                   LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    if(_lens_modifies_geometry(modflags))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _lens_map_row(d, roi_out->x, roi_out->y+y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -602,14 +692,12 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   dt_opencl_release_mem_object(dev_tmpbuf);
   dt_opencl_release_mem_object(dev_tmp);
   if (tmpbuf != NULL) dt_free_align(tmpbuf);
-  if (modifier != NULL) lf_modifier_destroy(modifier);
   return TRUE;
 
 error:
   if (dev_tmp != NULL) dt_opencl_release_mem_object(dev_tmp);
   if (dev_tmpbuf != NULL) dt_opencl_release_mem_object(dev_tmpbuf);
   if (tmpbuf != NULL) dt_free_align(tmpbuf);
-  if (modifier != NULL) lf_modifier_destroy(modifier);
   dt_print(DT_DEBUG_OPENCL, "[opencl_lens] couldn't enqueue kernel! %d\n", err);
   return FALSE;
 }
@@ -700,42 +788,28 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
 
   const float orig_w = roi_in->scale*piece->iwidth,
               orig_h = roi_in->scale*piece->iheight;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+  _lens_setup(d, orig_w, orig_h, roi_out);
 
   float xm = INFINITY, xM = - INFINITY, ym = INFINITY, yM = - INFINITY;
 
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-
-  if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
-                  LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+  if (_lens_modifies_geometry(d->modflags) && d->map)
   {
-    // acquire temp memory for distorted pixel coords
-    const size_t req2 = roi_in->width*2*3*sizeof(float);
-    if(req2 > 0 && d->tmpbuf2_len < req2)
+    // the interpolated positions stay within the nodes around roi_out, the map might cover more:
+    const int i0 = (int)floorf(roi_out->x/(float)d->map_step) - d->map_x;
+    const int j0 = (int)floorf(roi_out->y/(float)d->map_step) - d->map_y;
+    const int i1 = (int)floorf((roi_out->x+roi_out->width-1)/(float)d->map_step) + 1 - d->map_x;
+    const int j1 = (int)floorf((roi_out->y+roi_out->height-1)/(float)d->map_step) + 1 - d->map_y;
+    for (int j = j0; j <= j1; j++)
     {
-      d->tmpbuf2_len = req2;
-      dt_free_align(d->tmpbuf2);
-      d->tmpbuf2 = (float *)dt_alloc_align(16, d->tmpbuf2_len);
-    }
-    for (int y = 0; y < roi_out->height; y++)
-    {
-      lf_modifier_apply_subpixel_geometry_distortion (
-        modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, d->tmpbuf2);
-      const float *pi = d->tmpbuf2;
-      // reverse transform the global coords from lf to our buffer
-      for (int x = 0; x < roi_out->width; x++)
+      const float *pi = d->map + 8*((size_t)d->map_width*j + i0);
+      for (int i = i0; i <= i1; i++, pi+=8)
       {
         for(int c=0; c<3; c++)
         {
-          xm = fminf(xm, pi[0]);
-          xM = fmaxf(xM, pi[0]);
-          ym = fminf(ym, pi[1]);
-          yM = fmaxf(yM, pi[1]);
-          pi+=2;
+          xm = fminf(xm, pi[2*c]);
+          xM = fmaxf(xM, pi[2*c]);
+          ym = fminf(ym, pi[2*c+1]);
+          yM = fmaxf(yM, pi[2*c+1]);
         }
       }
     }
@@ -746,7 +820,13 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
     roi_in->width = fminf(orig_w-roi_in->x, xM - roi_in->x + interpolation->width);
     roi_in->height = fminf(orig_h-roi_in->y, yM - roi_in->y + interpolation->width);
   }
-  lf_modifier_destroy(modifier);
+  else if (_lens_modifies_geometry(d->modflags))
+  {
+    // no memory for the map, process() asks lensfun directly. play safe:
+    roi_in->x = roi_in->y = 0;
+    roi_in->width = orig_w;
+    roi_in->height = orig_h;
+  }
 }
 
 void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
@@ -763,6 +843,7 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
   const lfCamera *camera = NULL;
   const lfCamera **cam = NULL;
 
+  _lens_free_setup(d);
   lf_lens_destroy(d->lens);
   d->lens = lf_lens_new();
 
@@ -824,10 +905,11 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   piece->data = malloc(sizeof(dt_iop_lensfun_data_t));
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
 
-  d->tmpbuf2_len = 0;
-  d->tmpbuf2 = NULL;
   d->tmpbuf_len = 0;
   d->tmpbuf = NULL;
+  d->modifier = NULL;
+  d->map = NULL;
+  d->map_x = d->map_y = 0;
   d->lens = lf_lens_new();
   self->commit_params(self, self->default_params, pipe, piece);
 #endif
@@ -839,9 +921,9 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
 #error "lensfun needs to be ported to GEGL!"
 #else
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+  _lens_free_setup(d);
   lf_lens_destroy(d->lens);
   dt_free_align(d->tmpbuf);
-  dt_free_align(d->tmpbuf2);
   free(piece->data);
 #endif
 }
@@ -116,9 +116,7 @@ typedef struct dt_iop_lensfun_data_t
 {
   lfLens *lens;
   float *tmpbuf;
-  float *tmpbuf2;
   size_t tmpbuf_len;
-  size_t tmpbuf2_len;
   int modify_flags;
   int inverse;
   float scale;
@@ -127,6 +125,16 @@ typedef struct dt_iop_lensfun_data_t
   float aperture;
   float distance;
   lfLensType target_geom;
+  // lensfun setup for the image at map_orig_w x map_orig_h, kept until the parameters or the
+  // scale change, and the displacement map around the last roi_out, kept while it still covers
+  // the requested one. only used from the pipe's thread.
+  lfModifier *modifier;
+  int modflags;
+  float map_orig_w, map_orig_h;
+  float *map;                     // 8 floats per node: x and y of red, green, blue, padding
+  int map_x, map_y;               // grid position of the first node
+  int map_width, map_height;      // in nodes
+  int map_step;                   // pixels between nodes
 }
 dt_iop_lensfun_data_t;
 
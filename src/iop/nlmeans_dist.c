@@ -0,0 +1,138 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// patch distances of the non-local means on the cpu, included by nlmeans.c, denoiseprofile.c (and
+// by the unit test in src/tests): the sse2 version, and one for avx2 picked at runtime.
+
+#include "common/cpu.h"
+
+#include <stdint.h>
+#include <xmmintrin.h>
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+#include <immintrin.h>
+#endif
+
+/* moves the sliding window of patch distances s of n pixels one line down: adds the squared
+ * distances between the lines inp and inps, and subtracts those between inm and inms. pixels are
+ * four floats, the channels are weighted by norm2 and the fourth one is ignored. */
+static void
+nlmeans_slide(float *s, const float *inp, const float *inps, const float *inm, const float *inms,
+              const int n, const float norm2[4])
+{
+  int i = 0;
+  for(; ((intptr_t)s & 0xf) != 0 && i<n; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
+  {
+    float stmp = s[0];
+    for(int k=0; k<3; k++)
+      stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
+               -  (inm[k] - inms[k])*(inm[k] - inms[k])) * norm2[k];
+    s[0] = stmp;
+  }
+  /* Process most of the line 4 pixels at a time */
+  for(; i<n-4; i+=4, inp+=16, inps+=16, inm+=16, inms+=16, s+=4)
+  {
+    __m128 sv = _mm_load_ps(s);
+    const __m128 inp1 = _mm_load_ps(inp)    - _mm_load_ps(inps);
+    const __m128 inp2 = _mm_load_ps(inp+4)  - _mm_load_ps(inps+4);
+    const __m128 inp3 = _mm_load_ps(inp+8)  - _mm_load_ps(inps+8);
+    const __m128 inp4 = _mm_load_ps(inp+12) - _mm_load_ps(inps+12);
+
+    const __m128 inp12lo = _mm_unpacklo_ps(inp1,inp2);
+    const __m128 inp34lo = _mm_unpacklo_ps(inp3,inp4);
+    const __m128 inp12hi = _mm_unpackhi_ps(inp1,inp2);
+    const __m128 inp34hi = _mm_unpackhi_ps(inp3,inp4);
+
+    const __m128 inpv0 = _mm_movelh_ps(inp12lo,inp34lo);
+    sv += inpv0*inpv0 * _mm_set1_ps(norm2[0]);
+
+    const __m128 inpv1 = _mm_movehl_ps(inp34lo,inp12lo);
+    sv += inpv1*inpv1 * _mm_set1_ps(norm2[1]);
+
+    const __m128 inpv2 = _mm_movelh_ps(inp12hi,inp34hi);
+    sv += inpv2*inpv2 * _mm_set1_ps(norm2[2]);
+
+    const __m128 inm1 = _mm_load_ps(inm)    - _mm_load_ps(inms);
+    const __m128 inm2 = _mm_load_ps(inm+4)  - _mm_load_ps(inms+4);
+    const __m128 inm3 = _mm_load_ps(inm+8)  - _mm_load_ps(inms+8);
+    const __m128 inm4 = _mm_load_ps(inm+12) - _mm_load_ps(inms+12);
+
+    const __m128 inm12lo = _mm_unpacklo_ps(inm1,inm2);
+    const __m128 inm34lo = _mm_unpacklo_ps(inm3,inm4);
+    const __m128 inm12hi = _mm_unpackhi_ps(inm1,inm2);
+    const __m128 inm34hi = _mm_unpackhi_ps(inm3,inm4);
+
+    const __m128 inmv0 = _mm_movelh_ps(inm12lo,inm34lo);
+    sv -= inmv0*inmv0 * _mm_set1_ps(norm2[0]);
+
+    const __m128 inmv1 = _mm_movehl_ps(inm34lo,inm12lo);
+    sv -= inmv1*inmv1 * _mm_set1_ps(norm2[1]);
+
+    const __m128 inmv2 = _mm_movelh_ps(inm12hi,inm34hi);
+    sv -= inmv2*inmv2 * _mm_set1_ps(norm2[2]);
+
+    _mm_store_ps(s, sv);
+  }
+  for(; i<n; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
+  {
+    float stmp = s[0];
+    for(int k=0; k<3; k++)
+      stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
+               -  (inm[k] - inms[k])*(inm[k] - inms[k])) * norm2[k];
+    s[0] = stmp;
+  }
+}
+
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+/* weighted squared distances of 8 pixels of a and b. */
+DT_CPU_TARGET_AVX2 static inline __m256
+nlmeans_dist_avx2(const float *a, const float *b, const __m256 norm2, const __m256 mask)
+{
+  __m256 d[4];
+  for(int k=0; k<4; k++)
+  {
+    const __m256 diff = _mm256_and_ps(_mm256_sub_ps(_mm256_loadu_ps(a+8*k), _mm256_loadu_ps(b+8*k)), mask);
+    d[k] = _mm256_mul_ps(_mm256_mul_ps(diff, diff), norm2);
+  }
+  // sum up the channels of each pixel, which leaves them in the order 0 2 4 6 1 3 5 7:
+  const __m256 sum = _mm256_hadd_ps(_mm256_hadd_ps(d[0], d[1]), _mm256_hadd_ps(d[2], d[3]));
+  return _mm256_permutevar8x32_ps(sum, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+/* nlmeans_slide() doing 8 pixels per step. the channels are summed before they are added to s,
+ * so results differ from the sse2 version in the last bits. */
+DT_CPU_TARGET_AVX2 static void
+nlmeans_slide_avx2(float *s, const float *inp, const float *inps, const float *inm, const float *inms,
+                   const int n, const float norm2[4])
+{
+  const __m256 vnorm2 = _mm256_setr_ps(norm2[0], norm2[1], norm2[2], 0.0f, norm2[0], norm2[1], norm2[2], 0.0f);
+  // the fourth channel might hold anything, don't let it turn the sums into NaN:
+  const __m256 mask = _mm256_castsi256_ps(_mm256_setr_epi32(-1, -1, -1, 0, -1, -1, -1, 0));
+  int i = 0;
+  for(; i+8<=n; i+=8, inp+=32, inps+=32, inm+=32, inms+=32, s+=8)
+  {
+    const __m256 sv = _mm256_add_ps(_mm256_loadu_ps(s), nlmeans_dist_avx2(inp, inps, vnorm2, mask));
+    _mm256_storeu_ps(s, _mm256_sub_ps(sv, nlmeans_dist_avx2(inm, inms, vnorm2, mask)));
+  }
+  // the rest of the line:
+  nlmeans_slide(s, inp, inps, inm, inms, n-i, norm2);
+}
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
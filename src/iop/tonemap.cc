@@ -52,6 +52,28 @@ extern "C"
 
 #include "iop/Permutohedral.h"
 
+// position (x, y, log(L)) and value (log(L), 1) of a pixel, for splatting
+struct dt_iop_tonemapping_points_t
+{
+  const float *in;
+  int width, ch;
+  float inv_sigma_s, inv_sigma_r;
+
+  void operator()(const size_t index, float *pos, float *val) const
+  {
+    const int j = index / width, i = index - (size_t)j * width;
+    const float *pixel = in + index * ch;
+    float L = 0.2126*pixel[0]+ 0.7152*pixel[1] + 0.0722*pixel[2];
+    if(L<=0.0) L=1e-6;
+    L = logf(L);
+    pos[0] = i*inv_sigma_s;
+    pos[1] = j*inv_sigma_s;
+    pos[2] = L*inv_sigma_r;
+    val[0] = L;
+    val[1] = 1.0;
+  }
+};
+
 extern "C"
 {
   DT_MODULE(1)
@@ -133,26 +155,8 @@ extern "C"
 
     // Build I=log(L)
     // and splat into the lattice
-#ifdef _OPENMP
-    #pragma omp parallel for shared(lattice)
-#endif
-    for(int j=0; j<height; j++)
-    {
-      int index = j*width;
-      const int thread = omp_get_thread_num();
-      const float *in = (const float*)ivoid + j*width*ch;
-      for(int i=0; i<width; i++, index++, in+=ch)
-      {
-        float L = 0.2126*in[0]+ 0.7152*in[1] + 0.0722*in[2];
-        if(L<=0.0) L=1e-6;
-        L = logf(L);
-        float pos[3] = {i*inv_sigma_s, j*inv_sigma_s, L*inv_sigma_r};
-        float val[2] = {L,  1.0};
-        lattice.splat(pos, val, index, thread);
-      }
-    }
-
-    lattice.merge_splat_threads();
+    const dt_iop_tonemapping_points_t points = { (const float *)ivoid, width, ch, inv_sigma_s, inv_sigma_r };
+    lattice.splat(points);
 
     // blur the lattice
     lattice.blur();
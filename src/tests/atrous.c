@@ -0,0 +1,113 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the wavelet decomposition of the equalizer: the avx2 variant has
+// to agree with the sse2 one up to rounding, on all scales.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "common/cpu.c"
+#include "iop/atrous_eaw.c"
+
+static double
+get_time()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec + 1e-6*time.tv_usec;
+}
+
+// noisy Lab-like image with hard edges, so the edge weights do something.
+static void
+fill_image(float *buf, const int wd, const int ht)
+{
+  srand(42);
+  for(int j=0; j<ht; j++)
+    for(int i=0; i<wd; i++)
+    {
+      const float edge = (((i>>5)^(j>>5))&1) ? 1.0f : 0.3f;
+      buf[4*(wd*j+i)+0] = edge * (0.2f + 0.6f*j/ht) + 0.05f*rand()/(float)RAND_MAX;
+      buf[4*(wd*j+i)+1] = 0.2f*(i/(float)wd - 0.5f) + 0.05f*rand()/(float)RAND_MAX;
+      buf[4*(wd*j+i)+2] = 0.2f*(edge - 0.5f) + 0.05f*rand()/(float)RAND_MAX;
+      buf[4*(wd*j+i)+3] = 0.0f;
+    }
+}
+
+int main(int argc, char *arg[])
+{
+  const int wd = argc > 1 ? atol(arg[1]) : 3000;
+  const int ht = argc > 2 ? atol(arg[2]) : 2000;
+  const int runs = argc > 3 ? atol(arg[3]) : 3;
+  const float sharpen = 0.0009f*100.0f;
+  const size_t size = (size_t)4*wd*ht;
+
+  float *in = NULL, *out = NULL, *detail = NULL, *out_ref = NULL, *detail_ref = NULL;
+  assert(!posix_memalign((void **)&in, 64, sizeof(float)*size));
+  assert(!posix_memalign((void **)&out, 64, sizeof(float)*size));
+  assert(!posix_memalign((void **)&detail, 64, sizeof(float)*size));
+  assert(!posix_memalign((void **)&out_ref, 64, sizeof(float)*size));
+  assert(!posix_memalign((void **)&detail_ref, 64, sizeof(float)*size));
+  fill_image(in, wd, ht);
+
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+  if(!dt_cpu_has(DT_CPU_AVX2 | DT_CPU_FMA))
+#endif
+  {
+    fprintf(stderr, "atrous: avx2 and fma not available, nothing to compare\n");
+    exit(0);
+  }
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+  for(int scale=0; scale<5; scale++)
+  {
+    double t_sse = get_time();
+    for(int r=0; r<runs; r++) eaw_decompose(out_ref, in, detail_ref, scale, sharpen, wd, ht);
+    t_sse = (get_time() - t_sse)/runs;
+    double t_avx = get_time();
+    for(int r=0; r<runs; r++) eaw_decompose_avx2(out, in, detail, scale, sharpen, wd, ht);
+    t_avx = (get_time() - t_avx)/runs;
+
+    double err_max = 0.0;
+    for(size_t k=0; k<size; k++)
+    {
+      if((k&3) == 3) continue;
+      err_max = fmax(err_max, fabs(out[k] - out_ref[k]));
+      err_max = fmax(err_max, fabs(detail[k] - detail_ref[k]));
+    }
+    fprintf(stderr, "atrous decompose %dx%d scale %d: sse2 %6.1f ms, avx2 %6.1f ms (%.2fx), max difference %g\n",
+            wd, ht, scale, 1e3*t_sse, 1e3*t_avx, t_sse/t_avx, err_max);
+    // the weights are the same, only fma and the order of the sums differ. with -ffast-math that
+    // can move the summed weight by an ulp, which _mm_rcp_ps() turns into up to 2^-11 relative:
+    assert(err_max < 1e-3);
+  }
+#endif
+
+  free(in);
+  free(out);
+  free(detail);
+  free(out_ref);
+  free(detail_ref);
+  exit(0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,130 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and scaling benchmark for the raw chromatic aberration correction: the output has
+// to be the same bits for any number of threads. also reports how far red and blue are from
+// the scene without ca, before and after, on a synthetic image with lateral ca.
+#include <stdint.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <omp.h>
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define CLAMPS(A, L, H) ((A) > (L) ? ((A) < (H) ? (A) : (H)) : (L))
+
+static int
+FC(const int row, const int col, const unsigned int filters)
+{
+  return filters >> (((row << 1 & 14) + (col & 1)) << 1) & 3;
+}
+
+#include "iop/CA_correct_RT.c"
+
+static double
+get_time()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec + 1e-6*time.tv_usec;
+}
+
+// soft edged blobs, the same for all channels up to a gain:
+static float
+scene(const float x, const float y, const int c)
+{
+  const float gain[3] = { 0.7f, 0.9f, 0.5f };
+  const float v = sinf(x*(6.2831853f/97.0f)) * sinf(y*(6.2831853f/83.0f));
+  return gain[c] * (0.05f + 0.9f/(1.0f + expf(-12.0f*v)));
+}
+
+// mosaiced image, red magnified and blue shrunk around the center by `amount` pixels at the corners.
+static void
+fill_image(float *buf, const int wd, const int ht, const uint32_t filters, const float amount)
+{
+  const float cx = 0.5f*wd, cy = 0.5f*ht, r2 = cx*cx + cy*cy;
+  for(int j=0; j<ht; j++)
+    for(int i=0; i<wd; i++)
+    {
+      const int c = FC(j, i, filters);
+      const float scale = c == 0 ? 1.0f + amount/sqrtf(r2) : c == 2 ? 1.0f - amount/sqrtf(r2) : 1.0f;
+      buf[wd*j+i] = scene(cx + (i-cx)*scale, cy + (j-cy)*scale, c);
+    }
+}
+
+// mean distance of red and blue to the scene without ca, away from the borders.
+static double
+ca_error(const float *buf, const int wd, const int ht, const uint32_t filters)
+{
+  double err = 0.0;
+  size_t cnt = 0;
+  for(int j=32; j<ht-32; j++)
+    for(int i=32; i<wd-32; i++)
+    {
+      const int c = FC(j, i, filters);
+      if(c == 1) continue;
+      err += fabs(buf[wd*j+i] - scene(i, j, c));
+      cnt++;
+    }
+  return err/cnt;
+}
+
+int main(int argc, char *arg[])
+{
+  const int wd = argc > 1 ? atol(arg[1]) : 4096;
+  const int ht = argc > 2 ? atol(arg[2]) : 2736;
+  const int runs = argc > 3 ? atol(arg[3]) : 3;
+  const int max_threads = MAX(omp_get_max_threads(), 4);
+  const uint32_t filters = 0x94949494; // rggb
+
+  float *in  = (float *)malloc(sizeof(float)*wd*ht);
+  float *ref = (float *)malloc(sizeof(float)*wd*ht);
+  float *out = (float *)malloc(sizeof(float)*wd*ht);
+  fill_image(in, wd, ht, filters, 2.5f);
+
+  omp_set_num_threads(1);
+  double t1 = get_time();
+  for(int r=0; r<runs; r++) CA_correct(in, ref, wd, ht, filters);
+  t1 = (get_time() - t1)/runs;
+  fprintf(stderr, "cacorrect %dx%d:  1 thread  %7.1f ms\n", wd, ht, 1e3*t1);
+
+  for(int threads=2; threads<=max_threads; threads*=2)
+  {
+    omp_set_num_threads(threads);
+    double t = get_time();
+    for(int r=0; r<runs; r++) CA_correct(in, out, wd, ht, filters);
+    t = (get_time() - t)/runs;
+    fprintf(stderr, "cacorrect %dx%d: %2d threads %7.1f ms (%.2fx)\n", wd, ht, threads, 1e3*t, t1/t);
+    size_t mismatch = 0;
+    for(size_t k=0; k<(size_t)wd*ht; k++) mismatch += memcmp(out+k, ref+k, sizeof(float)) != 0;
+    fprintf(stderr, "cacorrect pixels differing from 1 thread: %zu\n", mismatch);
+    assert(mismatch == 0);
+  }
+
+  const double err_in = ca_error(in, wd, ht, filters), err_out = ca_error(ref, wd, ht, filters);
+  fprintf(stderr, "cacorrect mean red/blue error: input %f, corrected %f\n", err_in, err_out);
+
+  free(in);
+  free(ref);
+  free(out);
+  exit(0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,180 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// accuracy and speed of the 3d lut colorin and colorout use instead of lcms transforms:
+// linear rgb -> Lab as in colorin, and Lab -> gamma encoded sRGB as in colorout.
+#include "common/color_lut.c"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sys/time.h>
+
+static double
+get_time()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec + 1e-6*time.tv_usec;
+}
+
+static cmsHPROFILE
+create_linear_srgb()
+{
+  cmsCIExyY D65;
+  cmsCIExyYTRIPLE primaries = { {0.6400, 0.3300, 1.0}, {0.3000, 0.6000, 1.0}, {0.1500, 0.0600, 1.0} };
+  cmsWhitePointFromTemp(&D65, 6504);
+  cmsToneCurve *gamma = cmsBuildGamma(NULL, 1.0);
+  cmsToneCurve *curves[3] = { gamma, gamma, gamma };
+  cmsHPROFILE profile = cmsCreateRGBProfile(&D65, &primaries, curves);
+  cmsFreeToneCurve(gamma);
+  return profile;
+}
+
+int main(int argc, char *arg[])
+{
+  const int size = argc > 1 ? atol(arg[1]) : DT_COLOR_LUT_SIZE;
+  const int num = argc > 2 ? atol(arg[2]) : 1000000;
+  cmsHPROFILE Lab = cmsCreateLab4Profile(NULL);
+  cmsHPROFILE linear = create_linear_srgb();
+  cmsHPROFILE srgb = cmsCreate_sRGBProfile();
+  cmsHTRANSFORM to_lab = cmsCreateTransform(linear, TYPE_RGB_FLT, Lab, TYPE_Lab_FLT, INTENT_PERCEPTUAL, 0);
+  cmsHTRANSFORM to_rgb = cmsCreateTransform(Lab, TYPE_Lab_FLT, srgb, TYPE_RGB_FLT, INTENT_PERCEPTUAL, 0);
+
+  double start = get_time();
+  dt_color_lut_t *lut_lab = dt_color_lut_new(to_lab, DT_COLOR_LUT_RGB, size);
+  dt_color_lut_t *lut_rgb = dt_color_lut_new(to_rgb, DT_COLOR_LUT_LAB, size);
+  assert(lut_lab && lut_rgb);
+  fprintf(stderr, "sampling two %d^3 luts: %.2f ms\n", size, 1e3*(get_time() - start));
+
+  // random linear rgb, denser in the shadows like real images. the Lab values are in gamut for sRGB.
+  float *rgb = (float *)malloc(sizeof(float)*4*num);
+  float *lab_ref = (float *)malloc(sizeof(float)*4*num);
+  float *lab = (float *)malloc(sizeof(float)*4*num);
+  float *out_ref = (float *)malloc(sizeof(float)*4*num);
+  float *out = (float *)malloc(sizeof(float)*4*num);
+  srand(42);
+  for(int k=0; k<4*num; k++)
+    rgb[k] = powf(rand()/(float)RAND_MAX, 2.2f);
+
+  // lcms with 4 channel pixels, as the modules use it:
+  start = get_time();
+  float tmp[3*1024], res[3*1024];
+  for(int k=0; k<num; k+=1024)
+  {
+    const int n = num - k < 1024 ? num - k : 1024;
+    for(int i=0; i<n; i++) for(int c=0; c<3; c++) tmp[3*i+c] = rgb[4*(k+i)+c];
+    cmsDoTransform(to_lab, tmp, res, n);
+    for(int i=0; i<n; i++) for(int c=0; c<3; c++) lab_ref[4*(k+i)+c] = res[3*i+c];
+  }
+  const double t_lcms_in = get_time() - start;
+  start = get_time();
+  for(int k=0; k<num; k+=1024)
+  {
+    const int n = num - k < 1024 ? num - k : 1024;
+    for(int i=0; i<n; i++) for(int c=0; c<3; c++) tmp[3*i+c] = lab_ref[4*(k+i)+c];
+    cmsDoTransform(to_rgb, tmp, res, n);
+    for(int i=0; i<n; i++) for(int c=0; c<3; c++) out_ref[4*(k+i)+c] = res[3*i+c];
+  }
+  const double t_lcms_out = get_time() - start;
+
+  start = get_time();
+  dt_color_lut_apply(lut_lab, to_lab, rgb, lab, num, 4);
+  const double t_lut_in = get_time() - start;
+  start = get_time();
+  dt_color_lut_apply(lut_rgb, to_rgb, lab_ref, out, num, 4);
+  const double t_lut_out = get_time() - start;
+
+  fprintf(stderr, "rgb -> Lab: lcms %.2f ms, lut %.2f ms (%.1fx)\n", 1e3*t_lcms_in, 1e3*t_lut_in, t_lcms_in/t_lut_in);
+  fprintf(stderr, "Lab -> rgb: lcms %.2f ms, lut %.2f ms (%.1fx)\n", 1e3*t_lcms_out, 1e3*t_lut_out, t_lcms_out/t_lut_out);
+
+  double dE_sum = 0.0, dE_max = 0.0, err_sum = 0.0, err_max = 0.0;
+  for(int k=0; k<num; k++)
+  {
+    double dE = 0.0;
+    for(int c=0; c<3; c++)
+    {
+      const double d = lab[4*k+c] - lab_ref[4*k+c];
+      dE += d*d;
+      const double e = fabs(out[4*k+c] - out_ref[4*k+c]);
+      err_sum += e;
+      err_max = e > err_max ? e : err_max;
+    }
+    dE = sqrt(dE);
+    dE_sum += dE;
+    dE_max = dE > dE_max ? dE : dE_max;
+  }
+  fprintf(stderr, "rgb -> Lab: dE76 mean %f max %f\n", dE_sum/num, dE_max);
+  fprintf(stderr, "Lab -> rgb: abs error mean %f max %f\n", err_sum/(3.0*num), err_max);
+  assert(dE_sum/num < 0.05);
+  assert(dE_max < 1.0);
+  assert(err_sum/(3.0*num) < 1.0/255.0);
+
+  // pixels outside the domain of the luts (rgb above 1, a and b beyond 128) have to come out
+  // exactly as lcms converts them.
+  const int n_out = 1000;
+  float in_rgb[4*1000], in_lab[4*1000], lcms_rgb[3*1000], lcms_lab[3*1000], res_rgb[3*1000], res_lab[3*1000];
+  for(int k=0; k<n_out; k++)
+  {
+    for(int c=0; c<3; c++) lcms_rgb[3*k+c] = in_rgb[4*k+c] = 2.0f*rand()/(float)RAND_MAX;
+    lcms_lab[3*k+0] = in_lab[4*k+0] = 100.0f*rand()/(float)RAND_MAX;
+    lcms_lab[3*k+1] = in_lab[4*k+1] = 360.0f*rand()/(float)RAND_MAX - 180.0f;
+    lcms_lab[3*k+2] = in_lab[4*k+2] = 360.0f*rand()/(float)RAND_MAX - 180.0f;
+  }
+  cmsDoTransform(to_lab, lcms_rgb, res_lab, n_out);
+  cmsDoTransform(to_rgb, lcms_lab, res_rgb, n_out);
+  // in place, as colorin uses it:
+  dt_color_lut_apply(lut_lab, to_lab, in_rgb, in_rgb, n_out, 4);
+  dt_color_lut_apply(lut_rgb, to_rgb, in_lab, in_lab, n_out, 4);
+  int outside_rgb = 0, outside_lab = 0, mismatch = 0;
+  for(int k=0; k<n_out; k++)
+  {
+    const float *rgb_k = lcms_rgb + 3*k, *lab_k = lcms_lab + 3*k;
+    if(rgb_k[0] > 1.0f || rgb_k[1] > 1.0f || rgb_k[2] > 1.0f)
+    {
+      outside_rgb++;
+      for(int c=0; c<3; c++) mismatch += in_rgb[4*k+c] != res_lab[3*k+c];
+    }
+    if(fabsf(lab_k[1]) > 128.0f || fabsf(lab_k[2]) > 128.0f)
+    {
+      outside_lab++;
+      for(int c=0; c<3; c++) mismatch += in_lab[4*k+c] != res_rgb[3*k+c];
+    }
+  }
+  fprintf(stderr, "outside the luts: %d rgb and %d Lab pixels, %d values differing from lcms\n", outside_rgb, outside_lab, mismatch);
+  assert(outside_rgb > 0 && outside_lab > 0);
+  assert(mismatch == 0);
+
+  dt_color_lut_free(lut_lab);
+  dt_color_lut_free(lut_rgb);
+  cmsDeleteTransform(to_lab);
+  cmsDeleteTransform(to_rgb);
+  cmsCloseProfile(Lab);
+  cmsCloseProfile(linear);
+  cmsCloseProfile(srgb);
+  free(rgb);
+  free(lab_ref);
+  free(lab);
+  free(out_ref);
+  free(out);
+  exit(0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,136 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the 4x4 block float codec: the sse2 version has to produce
+// exactly the bits of the reference, and the round trip has to stay close to the input.
+#include "common/image_compression.c"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sys/time.h>
+
+static double
+get_time()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec + 1e-6*time.tv_usec;
+}
+
+// smooth hdr gradients with some noise and a few hard edges, similar to a small preview.
+static void
+fill_image(float *buf, const int wd, const int ht)
+{
+  srand(42);
+  for(int j=0; j<ht; j++)
+    for(int i=0; i<wd; i++)
+    {
+      const float x = i/(float)wd, y = j/(float)ht;
+      const float exposure = powf(2.0f, 8.0f*x - 4.0f) * ((((i>>5)^(j>>5))&1) ? 1.0f : 0.3f);
+      for(int c=0; c<3; c++)
+      {
+        const float noise = 1.0f + 0.02f*(rand()/(float)RAND_MAX - 0.5f);
+        buf[3*(wd*j+i)+c] = exposure * (0.2f + 0.6f*(c == 0 ? y : c == 1 ? 1.0f-y : x)) * noise;
+      }
+    }
+}
+
+// runs both codecs on a wd x ht image. sizes which are not a multiple of 4 exercise the partial
+// blocks at the border, the decoders must not write past the last pixel then.
+static void
+test_codec(const int wd, const int ht, const int runs)
+{
+  const size_t blocks = (size_t)((wd+3)/4)*((ht+3)/4);
+  const int guard = 16;
+
+  float   *in      = (float *)malloc(sizeof(float)*3*wd*ht);
+  float   *out_ref = (float *)malloc(sizeof(float)*(3*wd*ht + guard));
+  float   *out     = (float *)malloc(sizeof(float)*(3*wd*ht + guard));
+  uint8_t *c_ref   = (uint8_t *)malloc(16*blocks);
+  uint8_t *c       = (uint8_t *)malloc(16*blocks);
+  fill_image(in, wd, ht);
+  for(int k=0; k<guard; k++) out_ref[3*wd*ht+k] = out[3*wd*ht+k] = -1.0f;
+
+  double t_ref = 0.0, t = 0.0;
+  for(int r=0; r<runs; r++)
+  {
+    double start = get_time();
+    dt_image_compress_reference(in, c_ref, wd, ht);
+    t_ref += get_time() - start;
+    start = get_time();
+    dt_image_compress(in, c, wd, ht);
+    t += get_time() - start;
+  }
+  fprintf(stderr, "compress   %dx%d: reference %.2f ms, sse2 %.2f ms (%.1fx)\n", wd, ht, 1e3*t_ref/runs, 1e3*t/runs, t_ref/t);
+  size_t mismatch = 0;
+  for(size_t k=0; k<16*blocks; k++) mismatch += c[k] != c_ref[k];
+  fprintf(stderr, "compress   bytes differing from reference: %zu\n", mismatch);
+  assert(mismatch == 0);
+
+  t_ref = t = 0.0;
+  for(int r=0; r<runs; r++)
+  {
+    double start = get_time();
+    dt_image_uncompress_reference(c_ref, out_ref, wd, ht);
+    t_ref += get_time() - start;
+    start = get_time();
+    dt_image_uncompress(c_ref, out, wd, ht);
+    t += get_time() - start;
+  }
+  fprintf(stderr, "uncompress %dx%d: reference %.2f ms, sse2 %.2f ms (%.1fx)\n", wd, ht, 1e3*t_ref/runs, 1e3*t/runs, t_ref/t);
+  mismatch = 0;
+  for(size_t k=0; k<3*(size_t)wd*ht; k++) mismatch += memcmp(out+k, out_ref+k, sizeof(float)) != 0;
+  fprintf(stderr, "uncompress floats differing from reference: %zu\n", mismatch);
+  assert(mismatch == 0);
+  for(int k=0; k<guard; k++) assert(out_ref[3*wd*ht+k] == -1.0f && out[3*wd*ht+k] == -1.0f);
+
+  // round trip error, relative to the luminance of the input pixel:
+  double err_sum = 0.0, err_max = 0.0;
+  for(size_t k=0; k<(size_t)wd*ht; k++)
+  {
+    const float Lin  = (in[3*k]  + 2*in[3*k+1]  + in[3*k+2]) *.25f;
+    const float Lout = (out[3*k] + 2*out[3*k+1] + out[3*k+2])*.25f;
+    const double err = fabs(Lout - Lin)/Lin;
+    err_sum += err;
+    err_max = err > err_max ? err : err_max;
+  }
+  fprintf(stderr, "round trip relative luma error: mean %f max %f\n", err_sum/(wd*ht), err_max);
+  assert(err_sum/(wd*ht) < 0.05);
+
+  free(in);
+  free(out_ref);
+  free(out);
+  free(c_ref);
+  free(c);
+}
+
+int main(int argc, char *arg[])
+{
+  const int wd = argc > 1 ? atol(arg[1]) : 2048;
+  const int ht = argc > 2 ? atol(arg[2]) : 1536;
+  const int runs = argc > 3 ? atol(arg[3]) : 10;
+  test_codec(wd, ht, runs);
+  // partial blocks at the right and bottom border:
+  test_codec(1021, 767, 1);
+  exit(0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
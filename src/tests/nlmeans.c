@@ -0,0 +1,154 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the patch distances of nlmeans and denoiseprofile: the avx2 variant
+// has to agree with the sse2 one up to rounding, after sliding the window over a whole image.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "common/cpu.c"
+#include "iop/nlmeans_dist.c"
+
+static double
+get_time()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec + 1e-6*time.tv_usec;
+}
+
+// noisy Lab image with hard edges. the fourth channel holds garbage, it must not be used.
+static void
+fill_image(float *buf, const int wd, const int ht)
+{
+  srand(42);
+  for(int j=0; j<ht; j++)
+    for(int i=0; i<wd; i++)
+    {
+      const float edge = (((i>>5)^(j>>5))&1) ? 1.0f : 0.3f;
+      buf[4*(wd*j+i)+0] = 100.0f*edge * (0.2f + 0.6f*j/ht) + 5.0f*rand()/(float)RAND_MAX;
+      buf[4*(wd*j+i)+1] = 40.0f*(i/(float)wd - 0.5f) + 5.0f*rand()/(float)RAND_MAX;
+      buf[4*(wd*j+i)+2] = 40.0f*(edge - 0.5f) + 5.0f*rand()/(float)RAND_MAX;
+      buf[4*(wd*j+i)+3] = (i & 7) ? 1e30f : NAN;
+    }
+}
+
+typedef void (*slide_t)(float *s, const float *inp, const float *inps, const float *inm, const float *inms,
+                        const int n, const float norm2[4]);
+
+// slides the window of patch size 2P+1 for the shift (ki, kj) down the image, as the modules do it.
+// if keep is set, the distances of every line are kept in S, else only the last one.
+static void
+slide_image(slide_t slide, float *S, const float *in, const int wd, const int ht, const int P,
+            const int ki, const int kj, const float norm2[4], const int keep)
+{
+  const int i = ki < 0 ? -ki : 0;
+  const int last = wd + (ki > 0 ? -ki : 0);
+  float *s = S;
+  memset(s, 0, sizeof(float)*wd);
+  for(int jj=-P; jj<=P; jj++)
+    for(int ii=i; ii<last; ii++)
+      for(int k=0; k<3; k++)
+      {
+        const float d = in[4*(wd*(P+jj) + ii) + k] - in[4*(wd*(P+jj+kj) + ii+ki) + k];
+        s[ii] += d*d*norm2[k];
+      }
+  for(int j=P; j+P+1+kj<ht; j++)
+  {
+    if(keep)
+    {
+      memcpy(s + wd, s, sizeof(float)*wd);
+      s += wd;
+    }
+    slide(s + i,
+          in + 4*i + 4* wd *(j+P+1),
+          in + 4*i + 4*(wd *(j+P+1+kj) + ki),
+          in + 4*i + 4* wd *(j-P),
+          in + 4*i + 4*(wd *(j-P+kj) + ki),
+          last - i, norm2);
+  }
+}
+
+int main(int argc, char *arg[])
+{
+  const int wd = argc > 1 ? atol(arg[1]) : 3000;
+  const int ht = argc > 2 ? atol(arg[2]) : 2000;
+  const int P = argc > 3 ? atol(arg[3]) : 2;
+  // nlmeans weighs the channels, denoiseprofile doesn't:
+  const float norm2[2][4] = { { 1.0f/(120.0f*120.0f), 1.0f/(512.0f*512.0f), 1.0f/(512.0f*512.0f), 1.0f },
+                              { 1.0f, 1.0f, 1.0f, 1.0f } };
+
+  float *in = NULL, *S = NULL, *S_ref = NULL;
+  assert(!posix_memalign((void **)&in, 64, sizeof(float)*4*wd*ht));
+  assert(!posix_memalign((void **)&S, 64, sizeof(float)*wd*ht));
+  assert(!posix_memalign((void **)&S_ref, 64, sizeof(float)*wd*ht));
+  fill_image(in, wd, ht);
+
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+  if(!dt_cpu_has(DT_CPU_AVX2))
+#endif
+  {
+    fprintf(stderr, "nlmeans: avx2 not available, nothing to compare\n");
+    exit(0);
+  }
+#ifdef DT_CPU_HAVE_AVX2_TARGET
+  // a few shift vectors, with odd offsets so the lines start unaligned:
+  const int shift[4][2] = { { 0, 1 }, { 3, 2 }, { -5, 4 }, { 7, 0 } };
+  for(int n=0; n<2; n++)
+    for(int k=0; k<4; k++)
+    {
+      const int ki = shift[k][0], kj = shift[k][1];
+      slide_image(nlmeans_slide, S_ref, in, wd, ht, P, ki, kj, norm2[n], 1);
+      slide_image(nlmeans_slide_avx2, S, in, wd, ht, P, ki, kj, norm2[n], 1);
+      // timings with one line of distances, as in the modules:
+      double t_sse = get_time();
+      slide_image(nlmeans_slide, S_ref + (size_t)wd*(ht-1), in, wd, ht, P, ki, kj, norm2[n], 0);
+      t_sse = get_time() - t_sse;
+      double t_avx = get_time();
+      slide_image(nlmeans_slide_avx2, S + (size_t)wd*(ht-1), in, wd, ht, P, ki, kj, norm2[n], 0);
+      t_avx = get_time() - t_avx;
+
+      // relative to the size of the distances, as they are only ever used through exp(-S):
+      double err_max = 0.0, s_max = 0.0;
+      for(size_t l=0; l<(size_t)wd*(ht-2*P-1-kj); l++)
+      {
+        assert(!isnan(S[l]) && !isnan(S_ref[l]));
+        err_max = fmax(err_max, fabs(S[l] - S_ref[l]));
+        s_max = fmax(s_max, fabs(S_ref[l]));
+      }
+      fprintf(stderr, "%s slide %dx%d P %d shift %2d %d: sse2 %6.1f ms, avx2 %6.1f ms (%.2fx), max difference %g of %g\n",
+              n ? "denoiseprofile" : "nlmeans       ", wd, ht, P, ki, kj, 1e3*t_sse, 1e3*t_avx, t_sse/t_avx, err_max, s_max);
+      // only the order of the sums differs, the sliding window accumulates that over all lines:
+      assert(err_max < 1e-4*s_max);
+    }
+#endif
+
+  free(in);
+  free(S);
+  free(S_ref);
+  exit(0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,162 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the permutohedral lattice, set up like the bilateral filter:
+// the result must not depend on the number of threads (the table grows between batches
+// and all threads share it), and a flat image has to come out unchanged. concurrent inserts
+// of the same keys must not leave unused slots behind.
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <omp.h>
+
+#include "iop/Permutohedral.h"
+
+static double
+get_time()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec + 1e-6*time.tv_usec;
+}
+
+struct points_t
+{
+  const float *in;
+  int width;
+  const float *sigma;
+
+  void operator()(const size_t index, float *pos, float *val) const
+  {
+    const int j = index / width, i = index - (size_t)j * width;
+    const float *pixel = in + 4*index;
+    pos[0] = i * sigma[0];
+    pos[1] = j * sigma[1];
+    for(int c=0; c<3; c++)
+    {
+      pos[2+c] = pixel[c] * sigma[2+c];
+      val[c] = pixel[c];
+    }
+    val[3] = 1.0f;
+  }
+};
+
+// noisy gradients with hard edges, so there are plenty of lattice vertices.
+static void
+fill_image(float *buf, const int wd, const int ht)
+{
+  srand(42);
+  for(int j=0; j<ht; j++)
+    for(int i=0; i<wd; i++)
+    {
+      const float x = i/(float)wd, y = j/(float)ht;
+      const float edge = (((i>>6)^(j>>6))&1) ? 1.0f : 0.4f;
+      for(int c=0; c<3; c++)
+        buf[4*(wd*j+i)+c] = edge * (0.2f + 0.6f*(c == 0 ? y : c == 1 ? 1.0f-y : x)) + 0.1f*(rand()/(float)RAND_MAX - 0.5f);
+      buf[4*(wd*j+i)+3] = 0.0f;
+    }
+}
+
+static double
+bilateral(const float *in, float *out, const int wd, const int ht, const float *sigma, const int threads)
+{
+  const double start = get_time();
+  PermutohedralLattice<5,4> lattice(wd*ht, threads);
+  const points_t points = { in, wd, sigma };
+  lattice.splat(points);
+  lattice.blur();
+#pragma omp parallel for num_threads(threads)
+  for(int k=0; k<wd*ht; k++)
+  {
+    float val[4];
+    lattice.slice(val, k);
+    for(int c=0; c<3; c++) out[4*k+c] = val[c]/val[3];
+  }
+  return get_time() - start;
+}
+
+// all threads insert the same keys at once: each one has to end up in exactly one slot.
+static void
+concurrent_inserts(const int threads)
+{
+  const int n = 1 << 16;
+  HashTablePermutohedral<2,1> table(n);
+  table.reserve(n);
+#pragma omp parallel for num_threads(threads) schedule(static, 1)
+  for(int t=0; t<threads; t++)
+    for(int k=0; k<n; k++)
+    {
+      const int i = (k + t*7919) % n;
+      const short key[2] = { (short)(i & 255), (short)(i >> 8) };
+      table.offset(key, true);
+    }
+  fprintf(stderr, "hash table: %d keys inserted by %d threads, %d stored\n", n, threads, table.size());
+  assert(table.size() == n);
+  for(int i=0; i<n; i++)
+  {
+    const short key[2] = { (short)(i & 255), (short)(i >> 8) };
+    const int o = table.offset(key, false);
+    assert(o >= 0 && o < n);
+    assert(table.getKeys()[2*o] == key[0] && table.getKeys()[2*o+1] == key[1]);
+  }
+}
+
+int main(int argc, char *arg[])
+{
+  const int wd = argc > 1 ? atol(arg[1]) : 1536;
+  const int ht = argc > 2 ? atol(arg[2]) : 1024;
+  const int threads = argc > 3 ? atol(arg[3]) : (omp_get_max_threads() > 4 ? omp_get_max_threads() : 4);
+  const float sigma[5] = { 1.0f/15.0f, 1.0f/15.0f, 1.0f/0.05f, 1.0f/0.05f, 1.0f/0.05f };
+
+  float *in  = (float *)malloc(sizeof(float)*4*wd*ht);
+  float *out = (float *)malloc(sizeof(float)*4*wd*ht);
+  float *ref = (float *)malloc(sizeof(float)*4*wd*ht);
+  fill_image(in, wd, ht);
+
+  concurrent_inserts(threads);
+
+  const double t1 = bilateral(in, ref, wd, ht, sigma, 1);
+  const double tn = bilateral(in, out, wd, ht, sigma, threads);
+  fprintf(stderr, "bilateral %dx%d: 1 thread %.1f ms, %d threads %.1f ms (%.1fx)\n", wd, ht, 1e3*t1, threads, 1e3*tn, t1/tn);
+
+  // only the order of the float additions differs:
+  double err_max = 0.0;
+  for(size_t k=0; k<(size_t)wd*ht; k++)
+    for(int c=0; c<3; c++) err_max = fmax(err_max, fabs(out[4*k+c] - ref[4*k+c]));
+  fprintf(stderr, "bilateral max difference between 1 and %d threads: %g\n", threads, err_max);
+  assert(err_max < 1e-4);
+
+  for(size_t k=0; k<4*(size_t)wd*ht; k++) in[k] = 0.3f;
+  bilateral(in, out, wd, ht, sigma, threads);
+  err_max = 0.0;
+  for(size_t k=0; k<(size_t)wd*ht; k++)
+    for(int c=0; c<3; c++) err_max = fmax(err_max, fabs(out[4*k+c] - 0.3f));
+  fprintf(stderr, "bilateral max error on a flat image: %g\n", err_max);
+  assert(err_max < 1e-5);
+
+  free(in);
+  free(out);
+  free(ref);
+  exit(0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -23,6 +23,7 @@
 #include "control/control.h"
 #include "control/conf.h"
 #include "common/image_cache.h"
+#include "common/mipmap_cache.h"
 #include "common/darktable.h"
 #include "common/collection.h"
 #include "common/colorlabels.h"
@@ -91,6 +92,8 @@ typedef struct dt_library_t
   int full_preview;
   int32_t full_preview_id;
   gboolean offset_changed;
+  // viewport of the file manager the thumbnail loader is working for:
+  int32_t loader_offset, loader_images_in_row;
   GdkColor star_color;
   int images_in_row;
 
@@ -353,6 +356,7 @@ void init(dt_view_t *self)
   lib->selection_origin_idx = -1;
   lib->first_visible_zoomable = -1;
   lib->first_visible_filemanager = -1;
+  lib->loader_offset = lib->loader_images_in_row = -1;
   lib->button = 0;
   lib->modifiers = 0;
   lib->center = lib->pan = lib->track = 0;
@@ -507,6 +511,14 @@ expose_filemanager (dt_view_t *self, cairo_t *cr, int32_t width, int32_t height,
 
   int32_t offset = lib->offset = MIN(lib->first_visible_filemanager, ((lib->collection_count + iir - 1) / iir - 1) * iir);
 
+  /* scrolled or zoomed: thumbnails still queued for the old viewport are of no use any more */
+  if(offset != lib->loader_offset || iir != lib->loader_images_in_row)
+  {
+    dt_mipmap_loader_viewport_changed(&darktable.mipmap_cache->loader);
+    lib->loader_offset = offset;
+    lib->loader_images_in_row = iir;
+  }
+
   int32_t drawing_offset = 0;
   if(offset < 0)
   {
@@ -762,7 +774,6 @@ after_drawing:
     DT_DEBUG_SQLITE3_BIND_INT(lib->statements.main_query, 1, offset + max_rows*iir);
     DT_DEBUG_SQLITE3_BIND_INT(lib->statements.main_query, 2, prefetchrows*iir);
 
-    // prefetch jobs in inverse order: supersede previous jobs: most important last
     while(sqlite3_step(lib->statements.main_query) == SQLITE_ROW && imgids_num < prefetchrows*iir)
       imgids[imgids_num++] = sqlite3_column_int(lib->statements.main_query, 0);
 
@@ -770,17 +781,9 @@ after_drawing:
     dt_mipmap_size_t mip = dt_mipmap_cache_get_matching_size(
                              darktable.mipmap_cache,
                              imgwd*wd, imgwd*(iir==1?height:ht));
-    while(imgids_num > 0)
-    {
-      imgids_num --;
-      dt_mipmap_buffer_t buf;
-      dt_mipmap_cache_read_get(
-        darktable.mipmap_cache,
-        &buf,
-        imgids[imgids_num],
-        mip,
-        DT_MIPMAP_PREFETCH);
-    }
+    // visible thumbnails are requested with priority 0 while drawing, the next rows follow by distance:
+    for(int k=0; k<imgids_num; k++)
+      dt_mipmap_loader_request(&darktable.mipmap_cache->loader, imgids[k], mip, 1 + k/iir);
   }
 
   if(query_ids)